@@ -37,6 +37,8 @@
 #include <GSMConfig.h>
 #include <GSMLogicalChannel.h>
 #include <ControlCommon.h>
+#include <MediaEngine.h>
+#include <SIPInterface.h>
 #include <TRXManager.h>
 #include <PowerManager.h>
 
@@ -121,19 +123,29 @@ const char * Parser::help(const string& cmd) const
 	It returns 0 on success.
 */
 
-/** Get/set the logging level. */
+/** Get/set the logging level, by default, by module or by object. */
 int logLevel(int argc, char** argv, ostream& os, istream& is)
 {
 	if (argc==1) {
-		os << gGetLogLevelName() << endl;
+		gPrintLogLevels(os);
 		return SUCCESS;
 	}
-	if (argc!=2) return BAD_NUM_ARGS;
-	if (gSetLogLevel(argv[1])) {
+	if (argc==2) {
+		if (!gSetLogLevel(argv[1])) return BAD_VALUE;
 		gConfig.set("LogLevel",argv[1]);
 		return SUCCESS;
 	}
-	return BAD_VALUE;
+	if (argc!=3) return BAD_NUM_ARGS;
+	// Anything that isn't a module is an object, named as OBJLOG prints it.
+	if (!gLogModuleName(argv[1])) {
+		if (!gSetObjectLogLevel(argv[1],argv[2])) return BAD_VALUE;
+		gConfig.set(string("LogLevel.")+argv[1],argv[2]);
+		return SUCCESS;
+	}
+	if (!gSetLogLevel(argv[1],argv[2])) return BAD_VALUE;
+	// Store the key as gSetLogLevels looks it up, whatever case was typed.
+	gConfig.set(string("LogLevel.")+gLogModuleName(argv[1]),argv[2]);
+	return SUCCESS;
 }
 
 /** Set the logging file. */
@@ -221,12 +233,8 @@ int printTMSIs(int argc, char** argv, ostream& os, istream& is)
 	}
 	if (argc!=1) return BAD_NUM_ARGS;
 	os << " IMSI             TMSI" << endl;
-	Control::TMSIMap::const_iterator tp = gTMSITable.begin();
-	while (tp != gTMSITable.end()) {
-		os << tp->second << " 0x" << std::hex << tp->first << std::dec << endl;
-		++tp;
-	}
-	os << endl << gTMSITable.size() << " TMSIs in table";
+	size_t count = gTMSITable.dump(os);
+	os << endl << count << " TMSIs in table";
 	return SUCCESS;
 }
 
@@ -236,17 +244,7 @@ int findIMSI(int argc, char** argv, ostream& os, istream& is)
 		os << "usage: findimsi <imsiprefix>\n";
 		return BAD_VALUE;
 	}
-	Control::TMSIMap::const_iterator tp = gTMSITable.begin();
-	char buf[50]; // max size in decimal digits plus 1 plus RandomPositive
-	while (tp != gTMSITable.end()) {
-		std::string target;
-		sprintf(buf, "%d", tp->first);
-		std::string imsi = buf;
-		target.assign(imsi, 0, strlen(argv[1]));
-		if (target == argv[1])
-			os << tp->second << " 0x" << std::hex << tp->first << std::dec << endl;
-		++tp;
-	}
+	gTMSITable.dump(os,argv[1]);
 	return SUCCESS;
 }
 
@@ -275,12 +273,12 @@ int sendSMS(int argc, char** argv, ostream& os, istream& is)
 	char *IMSI = argv[1];
 	char *srcAddr = argv[2];
 
-	Control::TransactionEntry transaction(
+	Control::TransactionRef transaction(new Control::TransactionEntry(
 		GSM::L3MobileIdentity(IMSI),
 		GSM::L3CMServiceType::MobileTerminatedShortMessage,
 		GSM::L3CallingPartyBCDNumber(srcAddr),
-		txtBuf);
-	transaction.Q931State(Control::TransactionEntry::Paging);
+		txtBuf));
+	transaction->Q931State(Control::TransactionEntry::Paging);
 	Control::initiateMTTransaction(transaction,GSM::SDCCHType,30000);
 	os << "message submitted for delivery" << endl;
 	return SUCCESS;
@@ -395,15 +393,8 @@ int assignmentType(int argc, char** argv, ostream& os, istream& is)
 int printTransactions(int argc, char** argv, ostream& os, istream& is)
 {
 	if (argc!=1) return BAD_NUM_ARGS;
-	Control::TransactionMap::const_iterator trans = gTransactionTable.begin();
-	int count = 0;
-	gTransactionTable.clearDeadEntries();
-	while (trans != gTransactionTable.end()) {
-		os << trans->second << endl;
-		++trans;
-		count++;
-	}
-	os << endl << count << " transactions in table" << endl;
+	gTransactionTable.dump(os);
+	os << endl << gTransactionTable.size() << " transactions in table" << endl;
 	return SUCCESS;
 }
 
@@ -479,13 +470,18 @@ int configRegistration(int argc, char** argv, ostream& os, istream& is)
 	}
 
 	// By defuault, make SIP registration period 1.5x the GSM registration period.
-	unsigned SIPRegPeriod = newT3212*90;
+	// With the registration cache, make it 4x, so that most periodic updates
+	// are answered from the cache, and refresh on the last update before expiry.
+	bool cached = gConfig.defines("SIP.RegistrationCache.RefreshWindow")
+		&& gConfig.getNum("SIP.RegistrationCache.RefreshWindow")!=0;
+	unsigned SIPRegPeriod = cached ? newT3212*240 : newT3212*90;
 	if (argc==3) {
 		SIPRegPeriod = 60*strtol(argv[2],NULL,10);
 	}
 
 	// Set the values in the table and on the GSM beacon.
 	gConfig.set("SIP.RegistrationPeriod",SIPRegPeriod);
+	if (cached) gConfig.set("SIP.RegistrationCache.RefreshWindow",60*(newT3212+6));
 	gConfig.set("GSM.T3212",newT3212);
 	gBTS.regenerateBeacon();
 	// Done.
@@ -555,11 +551,11 @@ int testcall(int argc, char **argv, ostream& os, istream& is)
 		os << IMSI << " is not a valid IMSI" << endl;
 		return BAD_VALUE;
 	}
-	Control::TransactionEntry transaction(
+	Control::TransactionRef transaction(new Control::TransactionEntry(
 		GSM::L3MobileIdentity(IMSI),
 		GSM::L3CMServiceType::TestCall,
-		GSM::L3CallingPartyBCDNumber("0"));
-	transaction.Q931State(Control::TransactionEntry::Paging);
+		GSM::L3CallingPartyBCDNumber("0")));
+	transaction->Q931State(Control::TransactionEntry::Paging);
 	Control::initiateMTTransaction(transaction,GSM::TCHFType,1000*atoi(argv[2]));
 	return SUCCESS;
 }
@@ -569,13 +565,12 @@ int endcall(int argc, char **argv, ostream& os, istream& is)
 {
 	if (argc!=2) return BAD_NUM_ARGS;
 	unsigned transID = atoi(argv[1]);
-	Control::TransactionEntry target;
-	if (!gTransactionTable.find(transID,target)) {
+	Control::TransactionRef target = gTransactionTable.find(transID);
+	if (!target) {
 		os << transID << " not found in table";
 		return BAD_VALUE;
 	}
-	target.Q931State(Control::TransactionEntry::ReleaseRequest);
-	gTransactionTable.update(target);
+	target->Q931State(Control::TransactionEntry::ReleaseRequest);
 	return SUCCESS;
 }
 
@@ -637,6 +632,8 @@ int chans(int argc, char **argv, ostream& os, istream& is)
 		++sChanItr;
 	}
 
+	os << "TCH/F active " << gBTS.TCHActive() << " free " << gBTS.TCHAvailable() << " of " << gBTS.TCHTotal() << endl;
+	os << "SDCCH active " << gBTS.SDCCHActive() << " free " << gBTS.SDCCHAvailable() << " of " << gBTS.SDCCHTotal() << endl;
 
 	return SUCCESS;
 }
@@ -673,6 +670,35 @@ int power(int argc, char **argv, ostream& os, istream& is)
 }
 
 
+/** Print the L2/L3 frame and L3 message pool counters. */
+int frames(int argc, char** argv, ostream& os, istream& is)
+{
+	if (argc!=1) return BAD_NUM_ARGS;
+	GSM::reportFramePools(os);
+	GSM::reportL3MessagePools(os);
+	return SUCCESS;
+}
+
+
+/** Print the SIP interface traffic counters and rates. */
+int sipStats(int argc, char** argv, ostream& os, istream& is)
+{
+	if (argc!=1) return BAD_NUM_ARGS;
+	gSIPInterface.dumpStats(os);
+	return SUCCESS;
+}
+
+
+/** Print the RTP statistics of each call. */
+int media(int argc, char** argv, ostream& os, istream& is)
+{
+	if (argc!=1) return BAD_NUM_ARGS;
+	gMediaEngine.dump(os);
+	os << endl << gMediaEngine.size() << " media sessions" << endl;
+	return SUCCESS;
+}
+
+
 
 
 //@} // CLI commands
@@ -682,7 +708,7 @@ int power(int argc, char **argv, ostream& os, istream& is)
 Parser::Parser()
 {
 	// The constructor adds the commands.
-	addCommand("loglevel", logLevel, "[level] -- get/set the logging level, one of {ERROR, ALARM, WARN, NOICE, INFO, DEBUG, DEEPDEBUG}.");
+	addCommand("loglevel", logLevel, "[[module|object] level] -- get/set the logging level, one of {ERROR, ALARM, WARNING, NOTICE, INFO, DEBUG, DEEPDEBUG}, for all modules, for one of {Transceiver, L1, L2, L3, Control, SIP, HLR, smqueue, Common}, or for the OBJLOG of the objects with a name, such as a channel \"SDCCH.2\" or a transaction \"T1234\".  A module or object level of \"default\" follows the level for all modules again.");
 	addCommand("setlogfile", setLogFile, "<path> -- set the logging file to <path>.");
 	addCommand("uptime", showUptime, "-- show BTS uptime and BTS frame number.");
 	addCommand("help", getHelp, "[command] -- list available commands or gets help on a specific command.");
@@ -708,6 +734,9 @@ Parser::Parser()
 	addCommand("rolllac", rolllac, "[LAC] -- increment the LAC or set a net value");
 	addCommand("chans", chans, "-- report PHY status for active channels");
 	addCommand("power", power, "[minAtten maxAtten] -- report current attentuation or set min/max bounds");
+	addCommand("frames", frames, "-- report allocations from the L2/L3 frame and L3 message pools");
+	addCommand("sip", sipStats, "-- report SIP messages received, dispatched and sent, and their rates since the last report");
+	addCommand("media", media, "-- report RTP jitter, concealed and late frames, and jitter buffer depth/target for each call");
 
 	// TODO -- Commands to add: FER, CI.
 }
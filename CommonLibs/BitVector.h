@@ -239,6 +239,7 @@ class BitVector : public Vector<char> {
 		:Vector<char>(wData,wStart,wEnd)
 	{ }
 	BitVector(size_t len=0):Vector<char>(len) {}
+	BitVector(char* wStart, size_t span):Vector<char>(wStart,span) {}
 	BitVector(const Vector<char>& source):Vector<char>(source) {}
 	BitVector(Vector<char>& source):Vector<char>(source) {}
 	BitVector(const Vector<char>& source1, const Vector<char> source2):Vector<char>(source1,source2) {}
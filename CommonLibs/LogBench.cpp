@@ -0,0 +1,156 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+/*
+	Cost of LOG to the calling thread, in ns per call.
+
+	Each thread logs a typical message in a tight loop, at INFO and DEBUG
+	with the logging level at INFO, then at DEBUG with the level at DEBUG.
+	OBJLOG at DEBUG is timed with DEBUG set for another object and then
+	for the logging object.
+	The log goes to /dev/null unless another file is given.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "Logger.h"
+#include "Threads.h"
+
+
+static unsigned long gCalls = 1000000;
+
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+
+static void* logInfo(void*)
+{
+	for (unsigned long i=0; i<gCalls; i++) {
+		LOG(INFO) << "burst " << i << " TN " << (i&7) << " RSSI " << -62.5F;
+	}
+	return NULL;
+}
+
+
+static void* logDebug(void*)
+{
+	for (unsigned long i=0; i<gCalls; i++) {
+		LOG(DEBUG) << "burst " << i << " TN " << (i&7) << " RSSI " << -62.5F;
+	}
+	return NULL;
+}
+
+
+/** A logging object, for OBJLOG. */
+class Burst {
+
+	public:
+
+	void* log()
+	{
+		for (unsigned long i=0; i<gCalls; i++) {
+			OBJLOG(DEBUG) << "burst " << i << " TN " << (i&7) << " RSSI " << -62.5F;
+		}
+		return NULL;
+	}
+};
+
+static Burst gBurst;
+static Burst gOtherBurst;
+
+static void* logObject(void*)
+{
+	return gBurst.log();
+}
+
+
+/** Run the loop on the given number of threads and report ns per call. */
+static void run(const char* name, void *(*loop)(void*), unsigned numThreads)
+{
+	unsigned long dropped = gGetLogDropped();
+	Thread *threads = new Thread[numThreads];
+	double start = now();
+	for (unsigned i=0; i<numThreads; i++) threads[i].start(loop,NULL);
+	for (unsigned i=0; i<numThreads; i++) threads[i].join();
+	double calls = now();
+	gLogFlush();
+	double written = now();
+	delete[] threads;
+	printf("%-28s %8.1f ns/call, flush %6.1f ms, dropped %lu\n",
+		name, 1e9*(calls-start)/gCalls,
+		1e3*(written-calls), gGetLogDropped()-dropped);
+}
+
+
+int main(int argc, char *argv[])
+{
+	unsigned numThreads = 1;
+	const char *path = "/dev/null";
+	bool synchronous = false;
+
+	int opt;
+	while ((opt=getopt(argc,argv,"n:t:o:sh"))!=-1) {
+		switch (opt) {
+			case 'n': gCalls = strtoul(optarg,NULL,10); break;
+			case 't': numThreads = atoi(optarg); break;
+			case 'o': path = optarg; break;
+			case 's': synchronous = true; break;
+			default:
+				fprintf(stderr,"usage: %s [-n calls per thread] [-t threads] [-o log file] [-s(ynchronous)]\n",argv[0]);
+				exit(1);
+		}
+	}
+	if (numThreads==0 || gCalls==0) exit(1);
+
+	if (!gSetLogFile(path)) exit(1);
+	gSetLogSynchronous(synchronous);
+	printf("%u thread(s), %lu calls each, %s writes\n",
+		numThreads, gCalls, synchronous ? "synchronous" : "background");
+
+	gSetLogLevel("INFO");
+	run("INFO at level INFO",logInfo,numThreads);
+	run("DEBUG at level INFO",logDebug,numThreads);
+	gSetLogObjectName(&gBurst,"burst");
+	gSetLogObjectName(&gOtherBurst,"other");
+	gSetObjectLogLevel("other","DEBUG");
+	run("OBJLOG DEBUG, other object",logObject,numThreads);
+	gSetObjectLogLevel("burst","DEBUG");
+	run("OBJLOG DEBUG, this object",logObject,numThreads);
+	gSetObjectLogLevel("burst","default");
+	gSetObjectLogLevel("other","default");
+	gSetLogLevel("DEBUG");
+	run("DEBUG at level DEBUG",logDebug,numThreads);
+}
+
+// vim: ts=4 sw=4
@@ -35,6 +35,11 @@ void printAlarms()
     std::copy( alarms.begin(), alarms.end(), output );
 }
 
+class ObjectLogTest {
+	public:
+	void test() { OBJLOG(DEBUG) << " testing the object filter."; }
+};
+
 int main(int argc, char *argv[])
 {
 	gSetLogLevel("INFO");
@@ -44,6 +49,24 @@ int main(int argc, char *argv[])
 	LOG(INFO) << " testing the logger.";
 	LOG(DEBUG) << " testing the logger.";
 	LOG(DEEPDEBUG) << " testing the logger.";
+	gLogFlush();
+    std::cout << "\n\n\n";
+    std::cout << "testing module levels - you should see DEBUG for Common only\n";
+	gSetLogLevel("Common","DEBUG");
+	LOG(DEBUG) << " testing the Common module.";
+	gSetLogLevel("Common","default");
+	LOG(DEBUG) << " testing the logger after the Common module is back to default.";
+    std::cout << "testing object levels - you should see DEBUG for one object only\n";
+	ObjectLogTest first, second;
+	gSetLogObjectName(&first,"first");
+	gSetObjectLogLevel("first","DEBUG");
+	first.test();
+	second.test();
+	gSetObjectLogLevel("first","default");
+	first.test();
+	gClearLogObjectName(&first);
+	gPrintLogLevels(std::cout);
+	gLogFlush();
     std::cout << "\n\n\n";
     std::cout << "testing Alarms - you should run apps/showalarms.py to check udp\n";
 	LOG(ALARM) << " testing the logger alarm.";
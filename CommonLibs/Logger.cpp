@@ -23,8 +23,13 @@
 */
 
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <cstdio>
 #include <fstream>
+#include <map>
 
 #include "Configuration.h"
 #include "Sockets.h"
@@ -39,8 +44,12 @@ using namespace std;
 static const char* levelNames[] =
 	{ "FORCE", "ERROR", "ALARM", "WARNING", "NOTICE", "INFO", "DEBUG", "DEEPDEBUG" };
 
-/** The global logging lock. */
-static Mutex gLogLock;
+/**
+	The global logging lock.
+	It serializes the writers of the log sink, not the threads that log.
+	A plain static mutex, so that it is usable before static constructors run.
+*/
+static pthread_mutex_t gLogLock = PTHREAD_MUTEX_INITIALIZER;
 
 /**@ The global alarms table. */
 //@{
@@ -55,10 +64,85 @@ std::string     gAlarmTargetIP = DEFAULT_ALARM_TARGET_IP;
 //@}
 
 
-/** The current global logging level. */
+/** Names of the modules, as used in LOG_MODULE. */
+static const char* moduleNames[] =
+	{ "Common", "Transceiver", "L1", "L2", "L3", "Control", "SIP", "HLR", "smqueue" };
+
+
+/**@name Logging levels. */
+//@{
+/** The default logging level. */
 static Log::Level gLoggingLevel = Log::LOG_WARN;
 
+/** The levels that modules have been given, used if gModuleLevelSet[] is true. */
+static Log::Level gModuleLevels[Log::NUM_MODULES];
+static bool gModuleLevelSet[Log::NUM_MODULES];
+
+/** Maximum number of object names with their own OBJLOG level. */
+static const unsigned gMaxLogFilters = 8;
+
+/** Room for an object name with its own OBJLOG level, with the terminator. */
+static const unsigned gMaxLogFilterName = 32;
+
+/** The object filters, by name; an empty name is an unused entry. */
+static char gLogFilterNames[gMaxLogFilters][gMaxLogFilterName];
+static Log::Level gLogFilterLevels[gMaxLogFilters];
 
+/** Maximum number of live objects that the filters can match. */
+static const unsigned gMaxLogObjects = 32;
+
+/** The objects the filters match, for gLogObject; a NULL object ends the list. */
+static const void* volatile gLogObjects[gMaxLogObjects];
+static volatile Log::Level gLogObjectLevels[gMaxLogObjects];
+
+/** Guards the changes, not the LOG macros. */
+static pthread_mutex_t gLogLevelsLock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef map<const void*,string> LogObjectNameMap;
+
+/**
+	The names of the objects, made on first use so that objects can be
+	named before static constructors run.  It is changed with both
+	gLogLevelsLock and gLogNamesLock held, so either one is enough to read it.
+*/
+static LogObjectNameMap *gLogObjectNames = NULL;
+
+/** Taken after gLogLevelsLock, or alone by OBJLOG to look up a name. */
+static pthread_rwlock_t gLogNamesLock = PTHREAD_RWLOCK_INITIALIZER;
+
+volatile Log::Level gLogLevels[Log::NUM_MODULES] = {
+	Log::LOG_WARN, Log::LOG_WARN, Log::LOG_WARN, Log::LOG_WARN, Log::LOG_WARN,
+	Log::LOG_WARN, Log::LOG_WARN, Log::LOG_WARN, Log::LOG_WARN };
+volatile Log::Level gLogObjectCeilings[Log::NUM_MODULES] = {
+	Log::LOG_WARN, Log::LOG_WARN, Log::LOG_WARN, Log::LOG_WARN, Log::LOG_WARN,
+	Log::LOG_WARN, Log::LOG_WARN, Log::LOG_WARN, Log::LOG_WARN };
+//@}
+
+
+/** Recompute the tables used by the LOG macros.  Call with gLogLevelsLock held. */
+static void updateLogLevels()
+{
+	Log::Level objectLevel = Log::LOG_FORCE;
+	for (unsigned i=0; i<gMaxLogObjects; i++) {
+		if (gLogObjects[i] && gLogObjectLevels[i]>objectLevel) objectLevel = gLogObjectLevels[i];
+	}
+	for (int m=0; m<Log::NUM_MODULES; m++) {
+		Log::Level level = gModuleLevelSet[m] ? gModuleLevels[m] : gLoggingLevel;
+		gLogLevels[m] = level;
+		gLogObjectCeilings[m] = (objectLevel>level) ? objectLevel : level;
+	}
+}
+
+
+/** Return the level with this name, or -1. */
+static int findLogLevel(const char* name)
+{
+	for (int i=0; i<8; i++) {
+		if (strcmp(name,levelNames[i])==0) return i;
+	}
+	LOG(ERROR) << '\"' << name << '\"' << " is not a valid logging level.";
+	return -1;
+}
 
 
 Log::Level gGetLogLevel()
@@ -73,30 +157,255 @@ const char* gGetLogLevelName()
 
 void gSetLogLevel(Log::Level level)
 {
+	pthread_mutex_lock(&gLogLevelsLock);
 	gLoggingLevel = level;
+	updateLogLevels();
+	pthread_mutex_unlock(&gLogLevelsLock);
 }
 
 bool gSetLogLevel(const char* name)
 {
-	for (int i=0; i<8; i++) {
-		if (strcmp(name,levelNames[i])==0) {
-			gLoggingLevel = (Log::Level)i;
-			return true;
+	int level = findLogLevel(name);
+	if (level<0) return false;
+	gSetLogLevel((Log::Level)level);
+	return true;
+}
+
+
+static int findModule(const char* module)
+{
+	int m = 0;
+	while (m<Log::NUM_MODULES && strcasecmp(module,moduleNames[m])!=0) m++;
+	return m;
+}
+
+
+const char* gLogModuleName(const char* module)
+{
+	int m = findModule(module);
+	return (m<Log::NUM_MODULES) ? moduleNames[m] : NULL;
+}
+
+
+bool gSetLogLevel(const char* module, const char* levelName)
+{
+	int m = findModule(module);
+	if (m==Log::NUM_MODULES) {
+		LOG(ERROR) << '\"' << module << '\"' << " is not a logging module.";
+		return false;
+	}
+	bool set = (strcmp(levelName,"default")!=0);
+	int level = 0;
+	if (set) {
+		level = findLogLevel(levelName);
+		if (level<0) return false;
+	}
+	pthread_mutex_lock(&gLogLevelsLock);
+	gModuleLevelSet[m] = set;
+	gModuleLevels[m] = (Log::Level)level;
+	updateLogLevels();
+	pthread_mutex_unlock(&gLogLevelsLock);
+	return true;
+}
+
+
+/** Return the filter for this object name, or -1.  Call with gLogLevelsLock held. */
+static int findLogFilter(const char* name)
+{
+	for (unsigned i=0; i<gMaxLogFilters; i++) {
+		if (strcmp(name,gLogFilterNames[i])==0) return i;
+	}
+	return -1;
+}
+
+
+/** Return true if gLogObject can match this object.  Call with gLogLevelsLock held. */
+static bool isLogObject(const void* object)
+{
+	for (unsigned i=0; i<gMaxLogObjects && gLogObjects[i]; i++) {
+		if (gLogObjects[i]==object) return true;
+	}
+	return false;
+}
+
+
+/**
+	Rebuild the list of objects that the filters match, and the tables
+	used by the LOG macros.  Call with gLogLevelsLock held.
+	@return false if there were more objects than room for them.
+*/
+static bool updateLogObjects()
+{
+	unsigned n = 0;
+	bool retVal = true;
+	if (gLogObjectNames) {
+		LogObjectNameMap::const_iterator p = gLogObjectNames->begin();
+		for (; p!=gLogObjectNames->end(); ++p) {
+			int f = findLogFilter(p->second.c_str());
+			if (f<0) continue;
+			if (n==gMaxLogObjects) {
+				retVal = false;
+				break;
+			}
+			// Take the entry out of use while its level changes.
+			gLogObjects[n] = NULL;
+			__sync_synchronize();
+			gLogObjectLevels[n] = gLogFilterLevels[f];
+			__sync_synchronize();
+			gLogObjects[n] = p->first;
+			n++;
 		}
 	}
-	LOG(ERROR) << '\"' << name << '\"' << " is not a valid logging level.";
+	for (unsigned i=n; i<gMaxLogObjects; i++) gLogObjects[i] = NULL;
+	updateLogLevels();
+	return retVal;
+}
+
+
+bool gSetObjectLogLevel(const char* name, const char* levelName)
+{
+	assert(name);
+	if (!name[0] || strlen(name)>=gMaxLogFilterName) {
+		LOG(ERROR) << '\"' << name << '\"' << " is not a valid logging object name.";
+		return false;
+	}
+	bool set = (strcmp(levelName,"default")!=0);
+	int level = 0;
+	if (set) {
+		level = findLogLevel(levelName);
+		if (level<0) return false;
+	}
+	bool full = false;
+	bool overflow = false;
+	pthread_mutex_lock(&gLogLevelsLock);
+	int f = findLogFilter(name);
+	if (set && f<0) {
+		f = findLogFilter("");
+		if (f>=0) strcpy(gLogFilterNames[f],name);
+		else full = true;
+	}
+	if (f>=0) {
+		if (set) gLogFilterLevels[f] = (Log::Level)level;
+		else gLogFilterNames[f][0] = '\0';
+		overflow = !updateLogObjects();
+	}
+	pthread_mutex_unlock(&gLogLevelsLock);
+	if (full) {
+		LOG(ERROR) << "too many objects with their own logging level";
+		return false;
+	}
+	if (overflow) {
+		LOG(WARN) << "too many live objects match the object logging levels, some are not filtered";
+	}
+	return true;
+}
+
+
+void gSetLogObjectName(const void* object, const string& name)
+{
+	assert(object);
+	bool overflow = false;
+	pthread_mutex_lock(&gLogLevelsLock);
+	pthread_rwlock_wrlock(&gLogNamesLock);
+	if (!gLogObjectNames) gLogObjectNames = new LogObjectNameMap;
+	(*gLogObjectNames)[object] = name;
+	pthread_rwlock_unlock(&gLogNamesLock);
+	if (findLogFilter(name.c_str())>=0 || isLogObject(object)) overflow = !updateLogObjects();
+	pthread_mutex_unlock(&gLogLevelsLock);
+	if (overflow) {
+		LOG(WARN) << "too many live objects match the object logging levels, some are not filtered";
+	}
+}
+
+
+void gClearLogObjectName(const void* object)
+{
+	pthread_mutex_lock(&gLogLevelsLock);
+	if (gLogObjectNames) {
+		pthread_rwlock_wrlock(&gLogNamesLock);
+		gLogObjectNames->erase(object);
+		pthread_rwlock_unlock(&gLogNamesLock);
+	}
+	// The memory may be reused by an object that the filter should not match.
+	if (isLogObject(object)) updateLogObjects();
+	pthread_mutex_unlock(&gLogLevelsLock);
+}
+
+
+string gLogObjectName(const void* object)
+{
+	pthread_rwlock_rdlock(&gLogNamesLock);
+	if (gLogObjectNames) {
+		LogObjectNameMap::const_iterator p = gLogObjectNames->find(object);
+		if (p!=gLogObjectNames->end()) {
+			string name = p->second;
+			pthread_rwlock_unlock(&gLogNamesLock);
+			return name;
+		}
+	}
+	pthread_rwlock_unlock(&gLogNamesLock);
+	ostringstream os;
+	os << "obj:" << object;
+	return os.str();
+}
+
+
+bool gLogObject(Log::Level level, Log::Module module, const void* object)
+{
+	if (level <= gLogLevels[module]) return true;
+	for (unsigned i=0; i<gMaxLogObjects; i++) {
+		const void* match = gLogObjects[i];
+		if (!match) return false;
+		if (match==object) return level <= gLogObjectLevels[i];
+	}
 	return false;
 }
 
 
+void gSetLogLevels(const ConfigurationTable& config)
+{
+	if (config.defines("LogLevel")) gSetLogLevel(config.getStr("LogLevel"));
+	// The rest of the LogLevel.* keys name a module or an object.
+	static const string prefix("LogLevel.");
+	StringMap::const_iterator p = config.begin();
+	for (; p!=config.end(); ++p) {
+		if (p->first.compare(0,prefix.size(),prefix)!=0) continue;
+		const char* name = p->first.c_str() + prefix.size();
+		if (findModule(name)<Log::NUM_MODULES) gSetLogLevel(name,p->second.c_str());
+		else gSetObjectLogLevel(name,p->second.c_str());
+	}
+}
+
+
+void gPrintLogLevels(std::ostream& os)
+{
+	pthread_mutex_lock(&gLogLevelsLock);
+	os << "default " << levelNames[gLoggingLevel] << endl;
+	for (int m=0; m<Log::NUM_MODULES; m++) {
+		os << moduleNames[m] << ' ' << levelNames[gLogLevels[m]];
+		if (!gModuleLevelSet[m]) os << " (default)";
+		os << endl;
+	}
+	for (unsigned i=0; i<gMaxLogFilters; i++) {
+		if (!gLogFilterNames[i][0]) continue;
+		os << gLogFilterNames[i] << ' ' << levelNames[gLogFilterLevels[i]] << endl;
+	}
+	pthread_mutex_unlock(&gLogLevelsLock);
+}
+
+
 /** The current global log sink. */
 static FILE *gLoggingFile = stdout;
 
+static void logDrain();
+
 void gSetLogFile(FILE *wFile)
 {
-	gLogLock.lock();
+	pthread_mutex_lock(&gLogLock);
+	// Whatever is already logged goes to the old sink.
+	logDrain();
 	gLoggingFile = wFile;
-	gLogLock.unlock();
+	pthread_mutex_unlock(&gLogLock);
 }
 
 
@@ -104,18 +413,14 @@ bool gSetLogFile(const char *name)
 {
 	assert(name);
 	LOG(FORCE) << "setting log path to " << name;
-	bool retVal = true;
-	gLogLock.lock();
 	FILE* newLoggingFile = fopen(name,"a+");
 	if (!newLoggingFile) {
 		LOG(ERROR) << "cannot open \"" << name << "\" for logging.";
-		retVal = false;
-	} else {
-		gLoggingFile = newLoggingFile;
+		return false;
 	}
-	gLogLock.unlock();
+	gSetLogFile(newLoggingFile);
 	LOG(FORCE) << "new log path " << name;
-	return retVal;
+	return true;
 }
 
 void gSetAlarmTargetPort(unsigned int port)
@@ -169,25 +474,363 @@ void gAddAlarm(const string& s)
 }
 
 
+
+
+/**@name The per-thread rings and the background writer. */
+//@{
+
+/** Ring size per thread, in bytes; a power of two. */
+static const uint32_t LogRingBytes = 65536;
+
+/** Longest message text; longer messages are truncated. */
+static const unsigned LogTextBytes = 1024;
+
+/** Period of the background writer, in microseconds. */
+static const unsigned LogWriterPeriod = 5000;
+
+/** Flag in LogRecord::length for filler up to the end of the ring. */
+static const uint32_t LogWrapFlag = 0x80000000;
+
+
+/** A record in a ring, followed by the message text. */
+struct LogRecord {
+	uint32_t length;		///< bytes taken in the ring, with header and padding
+	uint16_t level;
+	uint16_t textLength;
+	unsigned line;
+	const char *file;
+	const char *function;
+	struct timeval time;
+	pthread_t thread;
+};
+
+
+/** A streambuf over a fixed buffer that silently truncates. */
+class LogStreamBuf : public std::streambuf {
+
+	private:
+
+	char mBuffer[LogTextBytes];
+
+	public:
+
+	LogStreamBuf() { reset(); }
+
+	void reset() { setp(mBuffer,mBuffer+sizeof(mBuffer)); }
+
+	const char* data() const { return pbase(); }
+
+	unsigned size() const { return pptr()-pbase(); }
+};
+
+
+/**
+	The logging state of one thread.
+	Only the owning thread writes mHead; only the writer writes mTail.
+*/
+struct LogThread {
+
+	LogStreamBuf mBuffer;
+	std::ostream mStream;
+	bool mBusy;				///< mStream belongs to a Log in progress
+
+	uint64_t mRing[LogRingBytes/sizeof(uint64_t)];
+	volatile uint32_t mHead;	///< total bytes appended
+	volatile uint32_t mTail;	///< total bytes consumed
+	uint32_t mDrainHead;		///< mHead as of the start of the writer's pass
+
+	volatile unsigned long mDropped;	///< records dropped for lack of room
+	unsigned long mReportedDropped;		///< drops already reported in the log
+	volatile bool mExited;		///< the thread is gone; free the ring once it is empty
+
+	LogThread *mNext;
+
+	LogThread()
+		:mStream(&mBuffer),mBusy(false),
+		mHead(0),mTail(0),mDrainHead(0),
+		mDropped(0),mReportedDropped(0),mExited(false),
+		mNext(NULL)
+	{ }
+
+	char* at(uint32_t count) { return (char*)mRing + (count & (LogRingBytes-1)); }
+
+	/** Append a record; return false if there is no room. */
+	bool append(LogRecord& header, const char* text, unsigned textLength);
+};
+
+
+/** All of the rings, newest first; the list is guarded by gLogThreadsLock. */
+static LogThread *gLogThreads = NULL;
+static pthread_mutex_t gLogThreadsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Drops from rings that have been freed. */
+static unsigned long gLogFreedDropped = 0;
+
+/** The calling thread's state; also held in gLogThreadKey so that we see the thread exit. */
+static __thread LogThread *gThisLogThread = NULL;
+static pthread_key_t gLogThreadKey;
+static pthread_once_t gLogStartOnce = PTHREAD_ONCE_INIT;
+
+static volatile bool gLogSynchronous = false;
+
+
+bool LogThread::append(LogRecord& header, const char* text, unsigned textLength)
+{
+	if (textLength > LogTextBytes) textLength = LogTextBytes;
+	uint32_t need = (sizeof(LogRecord) + textLength + 7) & ~7U;
+	uint32_t head = mHead;
+	uint32_t tail = mTail;
+	// Do not touch the space before the writer is done reading it.
+	__sync_synchronize();
+	uint32_t contiguous = LogRingBytes - (head & (LogRingBytes-1));
+	uint32_t filler = (need > contiguous) ? contiguous : 0;
+	if (need + filler > LogRingBytes - (head - tail)) return false;
+	if (filler) {
+		((LogRecord*)at(head))->length = filler | LogWrapFlag;
+		head += filler;
+	}
+	header.length = need;
+	header.textLength = textLength;
+	memcpy(at(head),&header,sizeof(LogRecord));
+	memcpy(at(head)+sizeof(LogRecord),text,textLength);
+	// Publish the record only after it is complete.
+	__sync_synchronize();
+	mHead = head + need;
+	return true;
+}
+
+
+/** Return the next record up to mDrainHead, or NULL. */
+static LogRecord* logPeek(LogThread *thread)
+{
+	while (thread->mTail != thread->mDrainHead) {
+		LogRecord *record = (LogRecord*)thread->at(thread->mTail);
+		if (!(record->length & LogWrapFlag)) return record;
+		thread->mTail += record->length & ~LogWrapFlag;
+	}
+	return NULL;
+}
+
+
+/** Format the fixed part of a log line, as the synchronous logger did. */
+static int logHeader(char *buffer, size_t size, const LogRecord& record)
+{
+	double seconds = record.time.tv_sec + 1e-6*record.time.tv_usec;
+	return snprintf(buffer,size,"%.4f %s %lu %s:%u:%s: ",
+		seconds, levelNames[record.level], (unsigned long)record.thread,
+		record.file, record.line, record.function);
+}
+
+
+/**
+	Write out all of the records in the rings, merged in time order.
+	The caller must hold gLogLock.
+*/
+static void logDrain()
+{
+	pthread_mutex_lock(&gLogThreadsLock);
+	LogThread *threads = gLogThreads;
+	pthread_mutex_unlock(&gLogThreadsLock);
+
+	// Bound the pass to what is there now, so a busy thread cannot hold us here.
+	for (LogThread *t = threads; t; t = t->mNext) t->mDrainHead = t->mHead;
+	__sync_synchronize();
+
+	FILE *file = gLoggingFile;
+	char header[512];
+	while (true) {
+		LogThread *oldest = NULL;
+		LogRecord *oldestRecord = NULL;
+		for (LogThread *t = threads; t; t = t->mNext) {
+			LogRecord *record = logPeek(t);
+			if (!record) continue;
+			if (oldestRecord && !timercmp(&record->time,&oldestRecord->time,<)) continue;
+			oldest = t;
+			oldestRecord = record;
+		}
+		if (!oldest) break;
+		int len = logHeader(header,sizeof(header),*oldestRecord);
+		if (len > (int)sizeof(header)-1) len = sizeof(header)-1;
+		fwrite(header,1,len,file);
+		fwrite((char*)oldestRecord+sizeof(LogRecord),1,oldestRecord->textLength,file);
+		fputc('\n',file);
+		uint32_t length = oldestRecord->length;
+		// Done reading before the space goes back to the thread.
+		__sync_synchronize();
+		oldest->mTail += length;
+	}
+
+	unsigned long dropped = 0;
+	for (LogThread *t = threads; t; t = t->mNext) {
+		unsigned long total = t->mDropped;
+		dropped += total - t->mReportedDropped;
+		t->mReportedDropped = total;
+	}
+	if (dropped) {
+		Timeval now;
+		fprintf(file,"%.4f %s %lu log records dropped, ring full\n",
+			now.seconds(), levelNames[Log::LOG_WARN], dropped);
+	}
+	fflush(file);
+
+	// Free the rings of threads that have exited, now that they are empty.
+	pthread_mutex_lock(&gLogThreadsLock);
+	LogThread **link = &gLogThreads;
+	while (*link) {
+		LogThread *t = *link;
+		if (t->mExited && t->mTail==t->mHead) {
+			*link = t->mNext;
+			gLogFreedDropped += t->mDropped;
+			delete t;
+		} else {
+			link = &t->mNext;
+		}
+	}
+	pthread_mutex_unlock(&gLogThreadsLock);
+}
+
+
+void gLogFlush()
+{
+	pthread_mutex_lock(&gLogLock);
+	logDrain();
+	pthread_mutex_unlock(&gLogLock);
+}
+
+
+void gSetLogSynchronous(bool synchronous)
+{
+	gLogSynchronous = synchronous;
+	if (synchronous) gLogFlush();
+}
+
+
+unsigned long gGetLogDropped()
+{
+	pthread_mutex_lock(&gLogThreadsLock);
+	unsigned long dropped = gLogFreedDropped;
+	for (LogThread *t = gLogThreads; t; t = t->mNext) dropped += t->mDropped;
+	pthread_mutex_unlock(&gLogThreadsLock);
+	return dropped;
+}
+
+
+static void* logWriter(void*)
+{
+	while (true) {
+		// Real time, even in simulated time; the log is real output.
+		usleep(LogWriterPeriod);
+		gLogFlush();
+	}
+	return NULL;
+}
+
+
+static void logThreadExit(void *thread)
+{
+	((LogThread*)thread)->mExited = true;
+}
+
+
+static void logStart()
+{
+	assert(!pthread_key_create(&gLogThreadKey,logThreadExit));
+	atexit(gLogFlush);
+	// Never destroyed, like the process's other service threads.
+	Thread *writer = new Thread(65536);
+	writer->start(logWriter,NULL);
+}
+
+
+/** Return the calling thread's logging state, creating it on first use. */
+static LogThread* logThread()
+{
+	if (gThisLogThread) return gThisLogThread;
+	pthread_once(&gLogStartOnce,logStart);
+	LogThread *thread = new LogThread;
+	pthread_setspecific(gLogThreadKey,thread);
+	pthread_mutex_lock(&gLogThreadsLock);
+	thread->mNext = gLogThreads;
+	gLogThreads = thread;
+	pthread_mutex_unlock(&gLogThreadsLock);
+	gThisLogThread = thread;
+	return thread;
+}
+
+//@}
+
+
+
 Log::~Log()
 {
-	gLogLock.lock();
+	if (!mStream) return;
+
+	LogRecord record;
+	record.level = mReportLevel;
+	record.line = mLine;
+	record.file = mFile;
+	record.function = mFunction;
+	record.time = mTime;
+	record.thread = pthread_self();
+
+	std::string privateText;
+	const char *text;
+	unsigned textLength;
+	if (mPrivate) {
+		privateText = mPrivate->str();
+		text = privateText.data();
+		textLength = privateText.size();
+	} else {
+		text = mThread->mBuffer.data();
+		textLength = mThread->mBuffer.size();
+	}
+
 	// XXX always handle alarms, even if the logging level is too low
-	if (mReportLevel == LOG_ALARM) gAddAlarm(mStream.str().c_str());
-	if (mReportLevel>gLoggingLevel) return;
-	mStream << std::endl;
-	fprintf(gLoggingFile, "%s", mStream.str().c_str());
-	fflush(gLoggingFile);
-	gLogLock.unlock();
+	if (mReportLevel == LOG_ALARM) {
+		char header[512];
+		logHeader(header,sizeof(header),record);
+		gAddAlarm(std::string(header) + std::string(text,textLength));
+	}
+
+	// The LOG macros have already checked the level.
+	bool urgent = gLogSynchronous || (mReportLevel <= LOG_ALARM);
+	LogThread *thread = logThread();
+	if (!thread->append(record,text,textLength)) {
+		if (urgent) {
+			// Make room rather than lose an error.
+			gLogFlush();
+			thread->append(record,text,textLength);
+		} else {
+			thread->mDropped++;
+		}
+	}
+	if (urgent) gLogFlush();
+
+	if (mThread) mThread->mBusy = false;
+	delete mPrivate;
 }
 
 
-ostringstream& Log::get()
+std::ostream& Log::get()
 {
-	Timeval now;
-	mStream.precision(4);
-	mStream << now << ' ' << mReportLevel <<  ' ';
-	return mStream;
+	gGetTime(&mTime);
+	LogThread *thread = logThread();
+	if (!thread->mBusy) {
+		thread->mBusy = true;
+		thread->mBuffer.reset();
+		thread->mStream.clear();
+		mThread = thread;
+		mStream = &thread->mStream;
+	} else {
+		// A LOG while formatting another LOG on this thread.
+		mPrivate = new std::ostringstream;
+		mStream = mPrivate;
+	}
+	// The same formatting as a new stream that a Timeval was written to.
+	mStream->flags(std::ios::dec | std::ios::skipws | std::ios::fixed);
+	mStream->precision(4);
+	mStream->fill(' ');
+	return *mStream;
 }
 
 
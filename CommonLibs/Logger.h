@@ -29,24 +29,53 @@
 #include <sstream>
 #include <list>
 #include <string>
+#include <sys/time.h>
 #include "Threads.h"
 
 
 
-#define _LOG(level) Log(Log::LOG_##level).get() << pthread_self() << ' ' << __FILE__ << ':' << __LINE__  << ':' << __FUNCTION__ << ": "
+/**
+	The module that a source file logs for, one of the Log::Module names
+	without the prefix.  Define it at the top of the file, before any
+	include, e.g. "#define LOG_MODULE L2".
+*/
+#ifndef LOG_MODULE
+#define LOG_MODULE Common
+#endif
+#define _LOG_MODULE_ID(module) Log::MODULE_##module
+#define LOG_MODULE_ID(module) _LOG_MODULE_ID(module)
+
+#define _LOG(level) Log(Log::LOG_##level,__FILE__,__LINE__,__FUNCTION__).get()
 #define LOG(wLevel) \
-	if (Log::LOG_##wLevel > gGetLogLevel()) ; \
+	if (Log::LOG_##wLevel > gLogLevels[LOG_MODULE_ID(LOG_MODULE)]) ; \
 	else _LOG(wLevel)
+/*
+	gLogObjectCeilings[] is the module level unless an object filter is
+	more verbose, so only a report that is going to be logged, or one that
+	a filter might pass, gets past the first test.
+	Reports carry the object's name, see gSetLogObjectName.
+*/
 #define OBJLOG(wLevel) \
-	if (Log::LOG_##wLevel > gGetLogLevel()) ; \
-	else _LOG(wLevel) << "obj:" << this << ' '
+	if (Log::LOG_##wLevel > gLogObjectCeilings[LOG_MODULE_ID(LOG_MODULE)]) ; \
+	else if (!gLogObject(Log::LOG_##wLevel,LOG_MODULE_ID(LOG_MODULE),this)) ; \
+	else _LOG(wLevel) << gLogObjectName(this) << ' '
 
 
 
 
+struct LogThread;
+
+
 /**
 	A thread-safe logger, directable to any file or stream.
 	Derived from Dr. Dobb's Sept. 2007 issue.
+
+	The calling thread only formats the message text, into a stream it
+	reuses, and appends it with the raw time, thread, file, line and
+	function to a ring buffer of its own, without taking any lock.
+	A background thread merges the rings, formats the record headers and
+	writes them out.  If a ring is full the record is dropped and counted.
+	FORCE, ERROR and ALARM records are written out before LOG returns.
 */
 class Log {
 
@@ -64,37 +93,96 @@ class Log {
 		LOG_DEEPDEBUG
 	};
 
+	/** Modules with their own logging levels; see LOG_MODULE. */
+	enum Module {
+		MODULE_Common,
+		MODULE_Transceiver,
+		MODULE_L1,
+		MODULE_L2,
+		MODULE_L3,
+		MODULE_Control,
+		MODULE_SIP,
+		MODULE_HLR,
+		MODULE_smqueue,
+		NUM_MODULES
+	};
+
 	protected:
 
-	std::ostringstream mStream;	///< This is where we write the long.
+	std::ostream *mStream;		///< This is where we write the log.
+	std::ostringstream *mPrivate;	///< Our own stream, if the thread's stream is in use.
+	LogThread *mThread;			///< The thread's stream and ring.
 	Level mReportLevel;			///< Level of current repot.
+	const char *mFile;			///< Source file of the report.
+	unsigned mLine;				///< Source line of the report.
+	const char *mFunction;		///< Function that made the report.
+	struct timeval mTime;		///< Time of the report.
 
 	static FILE *sFile;
 
 	public:
 
-	Log(Level wReportLevel = LOG_WARN)
-		:mReportLevel(wReportLevel)
+	Log(Level wReportLevel = LOG_WARN, const char* wFile = "",
+			unsigned wLine = 0, const char* wFunction = "")
+		:mStream(NULL),mPrivate(NULL),mThread(NULL),
+		mReportLevel(wReportLevel),
+		mFile(wFile),mLine(wLine),mFunction(wFunction)
 	{ }
 
 	~Log();
 
-	std::ostringstream& get();
+	std::ostream& get();
 };
 
-std::ostringstream& operator<<(std::ostringstream& os, Log::Level);
+std::ostream& operator<<(std::ostream& os, Log::Level);
 
 
 
 std::list<std::string> gGetLoggerAlarms();		///< Get a copy of the recent alarm list.
 
 
+class ConfigurationTable;
+
+/**@name Logging levels, by module, for the LOG macros. */
+//@{
+extern volatile Log::Level gLogLevels[Log::NUM_MODULES];
+extern volatile Log::Level gLogObjectCeilings[Log::NUM_MODULES];
+/** Return true if an OBJLOG report from this object should be logged. */
+bool gLogObject(Log::Level, Log::Module, const void* object);
+//@}
+
 /**@ Global logging level control. */
 //@{
+/** Set the default level, which applies to the modules without a level of their own. */
 void gSetLogLevel(Log::Level);
 bool gSetLogLevel(const char*);
 Log::Level gGetLogLevel();
 const char* gGetLogLevelName();
+/** Set a module's level, or "default" to follow the default level again. */
+bool gSetLogLevel(const char* module, const char* level);
+/** Return the name of a module as it appears in LogLevel.<module>, matched without case, or NULL. */
+const char* gLogModuleName(const char* module);
+/** Log OBJLOG reports from the objects with this name down to a level, or "default" to remove the filter. */
+bool gSetObjectLogLevel(const char* name, const char* level);
+/** Set the default, module and object levels from LogLevel and LogLevel.<module or object name>. */
+void gSetLogLevels(const ConfigurationTable&);
+/** Print the default, module and object levels. */
+void gPrintLogLevels(std::ostream&);
+//@}
+
+/**@name Names of the objects that use OBJLOG, by which they are filtered. */
+//@{
+/**
+	Name an object, e.g. a channel "SDCCH.2" or a transaction "T1234".
+	A name should not depend on where the object happens to be in memory,
+	so that a filter from the configuration finds it again after a restart.
+	Several objects, such as a channel and its layers, can share a name.
+*/
+void gSetLogObjectName(const void* object, const std::string& name);
+/** Forget the name of an object, before it is destroyed. */
+void gClearLogObjectName(const void* object);
+/** Return the name of an object, or "obj:<address>" if it has none. */
+std::string gLogObjectName(const void* object);
 //@}
 
 /**@name Global logging file control. */
@@ -109,6 +197,16 @@ void gSetAlarmTargetPort(unsigned int);
 void gSetAlarmTargetIP(const char*);
 //@}
 
+/**@name Background log writer control. */
+//@{
+/** Write out everything logged so far before returning. */
+void gLogFlush();
+/** Write out every record before LOG returns, as a synchronous logger would. */
+void gSetLogSynchronous(bool);
+/** Total records dropped because a thread's ring was full. */
+unsigned long gGetLogDropped();
+//@}
+
 
 #endif
 
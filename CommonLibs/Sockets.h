@@ -120,6 +120,9 @@ public:
 	/** Close the socket. */
 	void close();
 
+	/** Return the underlying file descriptor, for select(). */
+	int fd() const { return mSocketFD; }
+
 };
 
 
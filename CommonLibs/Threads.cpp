@@ -90,6 +90,23 @@ Mutex::~Mutex()
 /** Block for the signal up to the cancellation timeout. */
 void Signal::wait(Mutex& wMutex, unsigned timeout) const
 {
+	// In simulated time the timeout is virtual and pthread_cond_timedwait
+	// only knows the real clock, so wait a short real interval and rely on
+	// the caller to loop until its virtual deadline passes.
+	if (gSimulatedTime()) {
+		if (timeout>1) timeout = 1;
+		struct timeval now;
+		gettimeofday(&now,NULL);
+		struct timespec waitTime;
+		waitTime.tv_sec = now.tv_sec;
+		waitTime.tv_nsec = 1000L*now.tv_usec + 1000000L*timeout;
+		if (waitTime.tv_nsec>=1000000000L) {
+			waitTime.tv_nsec -= 1000000000L;
+			waitTime.tv_sec += 1;
+		}
+		pthread_cond_timedwait(&mSignal,&wMutex.mMutex,&waitTime);
+		return;
+	}
 	Timeval then(timeout);
 	struct timespec waitTime = then.timespec();
 	pthread_cond_timedwait(&mSignal,&wMutex.mMutex,&waitTime);
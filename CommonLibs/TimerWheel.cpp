@@ -0,0 +1,144 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "TimerWheel.h"
+
+
+TimerWheelEntry::~TimerWheelEntry()
+{
+	if (mWheel) mWheel->remove(*this);
+}
+
+
+
+TimerWheel::TimerWheel(unsigned wTickMs, unsigned wNumSlots)
+	:mTickMs(wTickMs),mNumSlots(1),mDue(NULL),mNow(0),mSize(0)
+{
+	assert(mTickMs>0);
+	while (mNumSlots<wNumSlots) mNumSlots <<= 1;
+	mSlots = new TimerWheelEntry*[mNumSlots];
+	for (unsigned i=0; i<mNumSlots; i++) mSlots[i] = NULL;
+	mStart.now();
+}
+
+
+TimerWheel::~TimerWheel()
+{
+	for (unsigned i=0; i<mNumSlots; i++) {
+		while (mSlots[i]) remove(*mSlots[i]);
+	}
+	while (mDue) remove(*mDue);
+	delete[] mSlots;
+}
+
+
+void TimerWheel::add(TimerWheelEntry& entry, unsigned ms)
+{
+	if (entry.mWheel) entry.mWheel->remove(entry);
+	// Round up, so that the entry never expires early,
+	// and never land in a slot that advance() has already passed.
+	unsigned long long expiry = currentTick() + (ms + mTickMs - 1) / mTickMs + 1;
+	if (expiry <= mNow) expiry = mNow + 1;
+	entry.mExpiry = expiry;
+	link(mSlots[expiry & (mNumSlots-1)],entry);
+}
+
+
+void TimerWheel::link(TimerWheelEntry*& head, TimerWheelEntry& entry)
+{
+	entry.mNext = head;
+	if (entry.mNext) entry.mNext->mPrevLink = &entry.mNext;
+	entry.mPrevLink = &head;
+	head = &entry;
+	entry.mWheel = this;
+	mSize++;
+}
+
+
+void TimerWheel::remove(TimerWheelEntry& entry)
+{
+	if (entry.mWheel!=this) return;
+	*entry.mPrevLink = entry.mNext;
+	if (entry.mNext) entry.mNext->mPrevLink = entry.mPrevLink;
+	entry.mNext = NULL;
+	entry.mPrevLink = NULL;
+	entry.mWheel = NULL;
+	mSize--;
+}
+
+
+unsigned TimerWheel::advance()
+{
+	unsigned long long now = currentTick();
+	if (now <= mNow) return 0;
+	// Each slot needs one visit, however long it has been.
+	unsigned long long first = mNow + 1;
+	if (now - mNow > mNumSlots) first = now - mNumSlots + 1;
+	mNow = now;
+
+	// Move the due entries to mDue first, since expired() may add or remove entries.
+	for (unsigned long long tick = first; tick <= now; tick++) {
+		TimerWheelEntry *entry = mSlots[tick & (mNumSlots-1)];
+		while (entry) {
+			TimerWheelEntry *next = entry->mNext;
+			if (entry->mExpiry <= now) {
+				remove(*entry);
+				link(mDue,*entry);
+			}
+			entry = next;
+		}
+	}
+
+	unsigned count = 0;
+	while (mDue) {
+		TimerWheelEntry *entry = mDue;
+		remove(*entry);
+		entry->expired();
+		count++;
+	}
+	return count;
+}
+
+
+unsigned TimerWheel::timeout(unsigned maxWait) const
+{
+	if (mSize==0) return maxWait;
+	unsigned long long now = currentTick();
+	if (now > mNow) {
+		// Slots may be due already.
+		for (unsigned long long tick = mNow+1; tick <= now && tick <= mNow+mNumSlots; tick++) {
+			if (mSlots[tick & (mNumSlots-1)]) return 0;
+		}
+	}
+	for (unsigned i=1; i<=mNumSlots; i++) {
+		if (!mSlots[(now+i) & (mNumSlots-1)]) continue;
+		unsigned wait = i * mTickMs;
+		return (wait < maxWait) ? wait : maxWait;
+	}
+	return maxWait;
+}
+
+
+// vim: ts=4 sw=4
@@ -0,0 +1,140 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <assert.h>
+#include "Timeval.h"
+
+
+class TimerWheel;
+
+
+/**
+	An entry in a TimerWheel.
+	Embed one in each object to be timed and override expired().
+	An entry is in at most one wheel at a time.
+*/
+class TimerWheelEntry {
+
+	private:
+
+	friend class TimerWheel;
+
+	TimerWheel *mWheel;					///< the wheel we are in, or NULL
+	TimerWheelEntry *mNext;				///< next entry in the slot
+	TimerWheelEntry **mPrevLink;		///< the pointer that points to us
+	unsigned long long mExpiry;			///< tick at which we expire
+
+	public:
+
+	TimerWheelEntry()
+		:mWheel(NULL),mNext(NULL),mPrevLink(NULL),mExpiry(0)
+	{ }
+
+	/** Remove the entry from its wheel, if any. */
+	virtual ~TimerWheelEntry();
+
+	/** Return true if the entry is waiting in a wheel. */
+	bool active() const { return mWheel!=NULL; }
+
+	/**
+		Called from TimerWheel::advance once the entry is due.
+		The entry is already removed and may be added again.
+	*/
+	virtual void expired() = 0;
+
+};
+
+
+/**
+	A hashed timing wheel, after Varghese and Lauck.
+	Each slot holds the entries whose expiration tick maps to it, so adding
+	and removing entries is O(1) and the cost of advancing the wheel depends
+	on the elapsed ticks, not on the number of entries.  Entries further out
+	than one turn of the wheel wait in their slot until their own turn.
+	Time is read with Timeval, so the wheel follows simulated time.
+	A wheel is not thread-safe; it belongs to the thread that advances it.
+*/
+class TimerWheel {
+
+	private:
+
+	unsigned mTickMs;				///< duration of a tick
+	unsigned mNumSlots;				///< a power of two
+	TimerWheelEntry **mSlots;		///< the slot lists
+	TimerWheelEntry *mDue;			///< entries being expired by advance()
+	Timeval mStart;					///< time of tick 0
+	unsigned long long mNow;		///< last tick processed
+	unsigned mSize;					///< number of entries
+
+	/** Put an entry at the head of a list. */
+	void link(TimerWheelEntry*& head, TimerWheelEntry& entry);
+
+	/** Ticks since mStart. */
+	unsigned long long currentTick() const { return mStart.elapsed() / mTickMs; }
+
+	public:
+
+	/**
+		Create an empty wheel.
+		@param wTickMs Resolution of the wheel in ms; entries never expire early.
+		@param wNumSlots Number of slots, rounded up to a power of two.
+	*/
+	TimerWheel(unsigned wTickMs=10, unsigned wNumSlots=256);
+
+	/** Entries still in the wheel are removed, not expired. */
+	~TimerWheel();
+
+	/** Add an entry to expire in a given number of ms, removing it from any wheel first. */
+	void add(TimerWheelEntry& entry, unsigned ms);
+
+	/** Remove an entry, if it is in this wheel. */
+	void remove(TimerWheelEntry& entry);
+
+	/** Number of entries in the wheel. */
+	unsigned size() const { return mSize; }
+
+	/**
+		Expire every entry that is due.
+		@return The number of entries expired.
+	*/
+	unsigned advance();
+
+	/**
+		Time until the next occupied slot, in ms, for sleeping between advances.
+		@param maxWait The value to return if the wheel is empty or the slot is further out.
+	*/
+	unsigned timeout(unsigned maxWait) const;
+
+	/** Resolution of the wheel in ms. */
+	unsigned tickMs() const { return mTickMs; }
+
+};
+
+
+#endif
+// vim: ts=4 sw=4
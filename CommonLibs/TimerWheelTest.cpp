@@ -0,0 +1,88 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "TimerWheel.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <iostream>
+
+using namespace std;
+
+
+/** A timer that checks that it is not early and can restart itself. */
+class TestTimer : public TimerWheelEntry {
+
+	public:
+
+	Timeval mDue;
+	unsigned mRestarts;
+	long mLate;
+
+	TestTimer():mRestarts(0),mLate(0) {}
+
+	void start(TimerWheel& wheel, unsigned ms)
+	{
+		mDue.future(ms);
+		wheel.add(*this,ms);
+	}
+
+	void expired()
+	{
+		long late = -mDue.remaining();
+		if (late<0) cout << "timer " << this << " expired " << -late << " ms early" << endl;
+		if (late>mLate) mLate = late;
+		mRestarts++;
+	}
+};
+
+
+int main(int argc, char *argv[])
+{
+	TimerWheel wheel(10,64);
+	const unsigned numTimers = 10000;
+	TestTimer *timers = new TestTimer[numTimers];
+	// Up to 2 s, which is 3 turns of the wheel.
+	for (unsigned i=0; i<numTimers; i++) timers[i].start(wheel,random()%2000);
+	// Cancel every tenth one.
+	for (unsigned i=0; i<numTimers; i+=10) wheel.remove(timers[i]);
+	cout << wheel.size() << " timers running" << endl;
+
+	unsigned expired = 0;
+	while (wheel.size()) {
+		usleep(1000*wheel.timeout(100));
+		expired += wheel.advance();
+	}
+
+	long late = 0;
+	unsigned cancelledFired = 0;
+	for (unsigned i=0; i<numTimers; i++) {
+		if (timers[i].mLate>late) late = timers[i].mLate;
+		if (i%10==0 && timers[i].mRestarts) cancelledFired++;
+	}
+	cout << expired << " expired, latest by " << late << " ms, "
+		<< cancelledFired << " cancelled timers fired" << endl;
+	delete[] timers;
+}
+
+// vim: ts=4 sw=4
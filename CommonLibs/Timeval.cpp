@@ -25,9 +25,93 @@
 
 
 #include "Timeval.h"
+#include <pthread.h>
+#include <unistd.h>
 
 using namespace std;
 
+
+/**@name Simulated time state. */
+//@{
+static bool sSimulatedTime = false;			///< set once, before threads start
+static struct timeval sSimulatedNow;		///< the virtual clock
+static pthread_mutex_t sSimulatedLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sSimulatedAdvance = PTHREAD_COND_INITIALIZER;	///< broadcast on every advance
+//@}
+
+
+static bool before(const struct timeval& a, const struct timeval& b)
+{
+	if (a.tv_sec != b.tv_sec) return a.tv_sec < b.tv_sec;
+	return a.tv_usec < b.tv_usec;
+}
+
+
+static void addMicroseconds(struct timeval& tv, unsigned long usec)
+{
+	tv.tv_sec += usec / 1000000;
+	tv.tv_usec += usec % 1000000;
+	if (tv.tv_usec >= 1000000) {
+		tv.tv_usec -= 1000000;
+		tv.tv_sec += 1;
+	}
+}
+
+
+void gEnableSimulatedTime()
+{
+	pthread_mutex_lock(&sSimulatedLock);
+	if (!sSimulatedTime) {
+		gettimeofday(&sSimulatedNow,NULL);
+		sSimulatedTime = true;
+	}
+	pthread_mutex_unlock(&sSimulatedLock);
+}
+
+
+bool gSimulatedTime()
+{
+	return sSimulatedTime;
+}
+
+
+void gAdvanceSimulatedTime(unsigned long usec)
+{
+	pthread_mutex_lock(&sSimulatedLock);
+	addMicroseconds(sSimulatedNow,usec);
+	pthread_cond_broadcast(&sSimulatedAdvance);
+	pthread_mutex_unlock(&sSimulatedLock);
+}
+
+
+void gGetTime(struct timeval *tv)
+{
+	if (!sSimulatedTime) {
+		gettimeofday(tv,NULL);
+		return;
+	}
+	pthread_mutex_lock(&sSimulatedLock);
+	*tv = sSimulatedNow;
+	pthread_mutex_unlock(&sSimulatedLock);
+}
+
+
+void gSleepMicroseconds(unsigned long usec)
+{
+	if (!sSimulatedTime) {
+		usleep(usec);
+		return;
+	}
+	pthread_mutex_lock(&sSimulatedLock);
+	struct timeval wakeup = sSimulatedNow;
+	addMicroseconds(wakeup,usec);
+	while (before(sSimulatedNow,wakeup)) {
+		pthread_cond_wait(&sSimulatedAdvance,&sSimulatedLock);
+	}
+	pthread_mutex_unlock(&sSimulatedLock);
+}
+
+
 void Timeval::future(unsigned offset)
 {
 	now();
@@ -70,8 +154,8 @@ double Timeval::seconds() const
 long Timeval::delta(const Timeval& other) const
 {
 	// 2^31 milliseconds is just over 4 years.
-	long deltaS = other.sec() - sec();
-	long deltaUs = other.usec() - usec();
+	long deltaS = (long)other.sec() - (long)sec();
+	long deltaUs = (long)other.usec() - (long)usec();
 	return 1000*deltaS + deltaUs/1000;
 }
 	
@@ -32,7 +32,34 @@
 
 
 
-inline void msleep(long v) { usleep((v+500)/1000); }
+/**@name Simulated time.
+	In simulated time, Timeval and the sleep functions below run on a
+	virtual clock that only moves when a driver advances it, so the system
+	runs as fast as the driver allows rather than at wall-clock rate.
+	The virtual clock starts at the wall-clock time it is enabled.
+	I/O polling and other waits on external peers should keep using usleep.
+*/
+//@{
+
+/** Switch the process to simulated time; call before starting threads. */
+void gEnableSimulatedTime();
+
+/** Return true if the process is running in simulated time. */
+bool gSimulatedTime();
+
+/** Advance the virtual clock and wake any sleepers that are due. */
+void gAdvanceSimulatedTime(unsigned long usec);
+
+/** Read the current time, virtual or real. */
+void gGetTime(struct timeval *tv);
+
+/** Sleep for a given number of microseconds, virtual or real. */
+void gSleepMicroseconds(unsigned long usec);
+
+//@}
+
+
+inline void msleep(long v) { gSleepMicroseconds((v+500)/1000); }
 
 
 /** A C++ wrapper for struct timeval. */
@@ -44,8 +71,8 @@ class Timeval {
 
 	public:
 
-	/** Set the value to gettimeofday. */
-	void now() { gettimeofday(&mTimeval,NULL); }
+	/** Set the value to gettimeofday, or to the virtual clock in simulated time. */
+	void now() { gGetTime(&mTimeval); }
 
 	/** Set the value to gettimeofday plus an offset. */
 	void future(unsigned ms);
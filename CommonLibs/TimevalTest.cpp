@@ -26,10 +26,21 @@
 
 
 #include "Timeval.h"
+#include "Threads.h"
 #include <iostream>
 
 using namespace std;
 
+
+void* sleeper(void*)
+{
+	Timeval start;
+	gSleepMicroseconds(2000000);
+	cout << "simulated sleeper woke after " << start.elapsed() << " ms" << endl;
+	return NULL;
+}
+
+
 int main(int argc, char *argv[])
 {
 
@@ -41,4 +52,16 @@ int main(int argc, char *argv[])
 		usleep(500000);
 	}
 	cout << "now: " << Timeval() << " then: " << then << " remaining: " << then.remaining() << endl;
+
+	// In simulated time, the sleeper wakes only when the clock is driven past its deadline.
+	gEnableSimulatedTime();
+	Thread thread;
+	thread.start(sleeper,NULL);
+	Timeval simStart;
+	for (int i=0; i<30; i++) {
+		usleep(1000);
+		gAdvanceSimulatedTime(100000);
+	}
+	cout << "simulated elapsed: " << simStart.elapsed() << " ms" << endl;
+	thread.join();
 }
@@ -34,9 +34,12 @@
 */
 
 
+#define LOG_MODULE Control
+
 #include <Globals.h>
 
 #include "ControlCommon.h"
+#include "MediaEngine.h"
 
 #include <GSMLogicalChannel.h>
 #include <GSML3RRMessages.h>
@@ -101,7 +104,6 @@ void forceGSMClearing(TransactionEntry& transaction, LogicalChannel *LCH, const
 	transaction.resetTimers();
 	transaction.Q931State(TransactionEntry::NullState);
 	LCH->send(RELEASE);
-	gTransactionTable.update(transaction);
 }
 
 
@@ -120,7 +122,6 @@ void forceSIPClearing(TransactionEntry& transaction)
 		transaction.SIP().MODResendBYE();
 	}
 	// FIXME -- We need to loop here and wait for the OK or timeout from the SIP side.
-	gTransactionTable.update(transaction);
 }
 
 
@@ -232,7 +233,6 @@ bool callManagementDispatchGSM(TransactionEntry& transaction, LogicalChannel* LC
 		LOG(INFO) << "GSM Connect Acknowledge " << transaction.subscriber();
 		transaction.resetTimers();
 		transaction.Q931State(TransactionEntry::Active);
-		gTransactionTable.update(transaction);
 		return false;
 	}
 
@@ -242,7 +242,6 @@ bool callManagementDispatchGSM(TransactionEntry& transaction, LogicalChannel* LC
 		LOG(INFO) << "GSM Connect " << transaction.subscriber();
 		transaction.resetTimers();
 		transaction.Q931State(TransactionEntry::Active);
-		gTransactionTable.update(transaction);
 		return false;
 	}
 
@@ -251,10 +250,9 @@ bool callManagementDispatchGSM(TransactionEntry& transaction, LogicalChannel* LC
 	// "Call Confirmed" is the GSM MTC counterpart to "Call Proceeding"
 	if (dynamic_cast<const L3CallConfirmed*>(message)) {
 		LOG(INFO) << "GSM Call Confirmed " << transaction.subscriber();
-		transaction.T303().reset();
-		transaction.T310().set();
+		transaction.resetTimer(TransactionEntry::T303);
+		transaction.setTimer(TransactionEntry::T310);
 		transaction.Q931State(TransactionEntry::MTCConfirmed);
-		gTransactionTable.update(transaction);
 		return false;
 	}
 
@@ -262,10 +260,9 @@ bool callManagementDispatchGSM(TransactionEntry& transaction, LogicalChannel* LC
 	// GSM 04.08 5.2.2.3.2
 	if (dynamic_cast<const L3Alerting*>(message)) {
 		LOG(INFO) << "GSM Alerting " << transaction.subscriber();
-		transaction.T310().reset();
-		transaction.T301().set();
+		transaction.resetTimer(TransactionEntry::T310);
+		transaction.setTimer(TransactionEntry::T301);
 		transaction.Q931State(TransactionEntry::CallReceived);
-		gTransactionTable.update(transaction);
 		return false;
 	}
 
@@ -280,10 +277,9 @@ bool callManagementDispatchGSM(TransactionEntry& transaction, LogicalChannel* LC
 		LOG(INFO) << "GSM Disconnect " << transaction.subscriber();
 		transaction.resetTimers();
 		LCH->send(L3Release(1-transaction.TIFlag(),transaction.TIValue()));
-		transaction.T308().set();
+		transaction.setTimer(TransactionEntry::T308);
 		transaction.Q931State(TransactionEntry::ReleaseRequest);
 		transaction.SIP().MODSendBYE();
-		gTransactionTable.update(transaction);
 		return false;
 	}
 
@@ -295,7 +291,6 @@ bool callManagementDispatchGSM(TransactionEntry& transaction, LogicalChannel* LC
 		LCH->send(L3ChannelRelease());
 		transaction.Q931State(TransactionEntry::NullState);
 		transaction.SIP().MTDSendOK();
-		gTransactionTable.update(transaction);
 		return true;
 	}
 
@@ -374,46 +369,6 @@ bool callManagementDispatchGSM(TransactionEntry& transaction, LogicalChannel* LC
 
 
 
-/**
-	Update vocoder data transfers in both directions.
-	@param transaction The transaction object for this call.
-	@param TCH The traffic channel for this call.
-	@return True if anything was transferred.
-*/
-bool updateCallTraffic(TransactionEntry &transaction, TCHFACCHLogicalChannel *TCH)
-{
-	bool activity = false;
-
-	SIPEngine& engine = transaction.SIP();
-
-
-	// Transfer in the downlink direction (RTP->GSM).
-	// Blocking call.  On average returns 1 time per 20 ms.
-	// Returns non-zero if anything really happened.
-	// Make the rxFrame buffer big enough for G.711.
-	unsigned char rxFrame[160];
-	if (engine.RxFrame(rxFrame)) {
-		activity = true;
-		TCH->sendTCH(rxFrame);
-	}
-
-	// Transfer in the uplink direction (GSM->RTP).
-	// Flush FIFO to limit latency.
-	while (TCH->queueSize()>2) delete[] TCH->recvTCH();
-	if (unsigned char *txFrame = TCH->recvTCH()) {
-		activity = true;
-		// Send on RTP.
-		engine.TxFrame(txFrame);
-		delete[] txFrame;
-	}
-
-	// Return a flag so the caller will know if anything transferred.
-	return activity;
-}
-
-
-
-
 /**
 	Check GSM signalling.
 	Can block for up to 52 GSM L1 frames (240 ms) because LCH::send is blocking.
@@ -472,7 +427,7 @@ bool updateSignalling(TransactionEntry &transaction, LogicalChannel *LCH, unsign
 		if (!transaction.clearing()) {
 			LOG(DEBUG) << "got BYE";
 			LCH->send(L3Disconnect(1-transaction.TIFlag(),transaction.TIValue()));
-			transaction.T305().set();
+			transaction.setTimer(TransactionEntry::T305);
 			transaction.Q931State(TransactionEntry::DisconnectIndication);
 			// Return false, because it the call is not yet cleared.
 			return false;
@@ -489,10 +444,13 @@ bool updateSignalling(TransactionEntry &transaction, LogicalChannel *LCH, unsign
 
 
 
+/** Time to wait for signalling on each pass through pollInCall, in ms. */
+static const unsigned InCallPollTimeout = 100;
+
 /**
-	Poll for activity while in a call.
-	Sleep if needed to prevent fast spinning.
-	Will block for up to 250 ms.
+	Poll for signalling while in a call.
+	The speech itself is moved by the MediaEngine.
+	Will block for about InCallPollTimeout ms.
 	@param transaction The call's TransactionEntry.
 	@param TCH The call's TCH+FACCH.
 	@return true If the call was cleared.
@@ -508,13 +466,8 @@ bool pollInCall(TransactionEntry &transaction, TCHFACCHLogicalChannel *TCH)
 	}
 	// Process pending SIP and GSM signalling.
 	// If this returns true, it means the call is fully cleared.
-	if (updateSignalling(transaction,TCH)) return true;
-	// Transfer vocoder data.
-	// If anything happened, then the call is still up.
-	if (updateCallTraffic(transaction,TCH)) return false;
-	// If nothing happened, sleep so we don't burn up the CPU cycles.
-	msleep(250);
-	return false;
+	// Blocking on the FACCH keeps this thread off the CPU.
+	return updateSignalling(transaction,TCH,InCallPollTimeout);
 }
 
 
@@ -548,9 +501,19 @@ bool waitInCall(TransactionEntry& transaction, TCHFACCHLogicalChannel *TCH, unsi
 void callManagementLoop(TransactionEntry &transaction, TCHFACCHLogicalChannel* TCH)
 {
 	LOG(INFO) << "MOC MTC connected, " << transaction.subscriber() << " entering callManagementLoop";
-	transaction.SIP().FlushRTP();
-	// poll everything until the call is cleared
+	// Hand the speech path to the media engine.
+	SIPEngine& engine = transaction.SIP();
+	MediaSession *media = gMediaEngine.add(TCH,engine.RTPPort(),engine.RTPRemoteIP(),engine.RTPRemotePort());
+	if (!media) {
+		LOG(ALARM) << "cannot open RTP port " << engine.RTPPort() << " for " << transaction.subscriber();
+		// Cause 0x2f, "resource unavailable, unspecified"
+		abortCall(transaction,TCH,L3Cause(0x2f));
+		clearTransactionHistory(transaction);
+		return;
+	}
+	// poll signalling until the call is cleared
 	while (!pollInCall(transaction,TCH)) { }
+	gMediaEngine.remove(media);
 	clearTransactionHistory(transaction);
 }
 
@@ -630,17 +593,18 @@ void Control::MOCStarter(const L3CMServiceRequest* req, LogicalChannel *LCH)
 
 	// Create a transaction table entry so the TCH controller knows what to do later.
 	// The transaction on the TCH is a continuation of this one and uses the same ID.
-	TransactionEntry transaction(mobileIdentity,
+	TransactionRef entry(new TransactionEntry(mobileIdentity,
 		req->serviceType(),
 		L3TI,
-		setup->calledPartyBCDNumber());
+		setup->calledPartyBCDNumber()));
+	TransactionEntry& transaction = *entry;
 	assert(transaction.TIFlag()==0);
 	transaction.SIP().User(IMSI);
 	transaction.Q931State(TransactionEntry::MOCInitiated);
 	LCH->transactionID(transaction.ID());
 	if (!veryEarly) TCH->transactionID(transaction.ID());
 	LOG(DEBUG) << "MOC: transaction: " << transaction;
-	gTransactionTable.add(transaction);
+	gTransactionTable.add(entry);
 
 	// At this point, we have enough information start the SIP call setup.
 	// We also have a SIP side and a transaction that will need to be
@@ -660,7 +624,6 @@ void Control::MOCStarter(const L3CMServiceRequest* req, LogicalChannel *LCH)
 
 	// The transaction is moving on to the MOCController.
 	// If we need a TCH assignment, we do it here.
-	gTransactionTable.update(transaction);
 	LOG(DEBUG) << "MOC: transaction: " << transaction;
 	if (veryEarly) {
 		// For very early assignment, we need a mode change.
@@ -705,7 +668,6 @@ void Control::MOCController(TransactionEntry& transaction, TCHFACCHLogicalChanne
 	LOG(DEBUG) << "MOC: Sending Call Proceeding";
 	TCH->send(L3CallProceeding(1,L3TI));
 	transaction.Q931State(TransactionEntry::MOCProceeding);
-	gTransactionTable.update(transaction);
 
 	// Look for RINGING or OK from the SIP side.
 	// There's a T310 running on the phone now.
@@ -747,7 +709,6 @@ void Control::MOCController(TransactionEntry& transaction, TCHFACCHLogicalChanne
 				break;
 		}
 	}
-	gTransactionTable.update(transaction);
 
 	// There's a question here of what entity is generating the "patterns"
 	// (ringing, busy signal, etc.) during call set-up.  For now, we're ignoring 
@@ -790,14 +751,12 @@ void Control::MOCController(TransactionEntry& transaction, TCHFACCHLogicalChanne
 				break;
 		}
 	} 
-	gTransactionTable.update(transaction);
 	
 	// Let the phone know the call is connected.
 	LOG(INFO) << "MOC: sending Connect to handset";
 	TCH->send(L3Connect(1,L3TI));
-	transaction.T313().set();
+	transaction.setTimer(TransactionEntry::T313);
 	transaction.Q931State(TransactionEntry::ConnectIndication);
-	gTransactionTable.update(transaction);
 
 	// The call is open.
 	transaction.SIP().MOCInitRTP();
@@ -810,7 +769,6 @@ void Control::MOCController(TransactionEntry& transaction, TCHFACCHLogicalChanne
 	}
 
 	// At this point, everything is ready to run the call.
-	gTransactionTable.update(transaction);
 	callManagementLoop(transaction,TCH);
 
 	// The radio link should have been cleared with the call.
@@ -850,9 +808,8 @@ void Control::MTCStarter(TransactionEntry& transaction, LogicalChannel *LCH)
 	// GSM 04.08 5.2.2.1
 	LOG(INFO) << "MTC: sending GSM Setup to call " << transaction.calling();
 	LCH->send(L3Setup(0,L3TI,L3CallingPartyBCDNumber(transaction.calling())));
-	transaction.T303().set();
+	transaction.setTimer(TransactionEntry::T303);
 	transaction.Q931State(TransactionEntry::CallPresent);
-	gTransactionTable.update(transaction);
 
 	// Wait for Call Confirmed message.
 	LOG(DEBUG) << "MTC: wait for GSM Call Confirmed";
@@ -880,8 +837,6 @@ void Control::MTCStarter(TransactionEntry& transaction, LogicalChannel *LCH)
 	}
 
 	// The transaction is moving to the MTCController.
-	// Once this update happens, don't change the transaction object again in this function.
-	gTransactionTable.update(transaction);
 	LOG(DEBUG) << "MTC: transaction: " << transaction;
 	if (veryEarly) {
 		// For very early assignment, we need a mode change.
@@ -932,7 +887,6 @@ void Control::MTCController(TransactionEntry& transaction, TCHFACCHLogicalChanne
 			return abortCall(transaction,TCH,L3Cause(0x7F));
 		}
 	}
-	gTransactionTable.update(transaction);
 
 	LOG(INFO) << "MTC:: allocating port and sending SIP OKAY";
 	unsigned RTPPorts = allocateRTPPorts();
@@ -958,7 +912,6 @@ void Control::MTCController(TransactionEntry& transaction, TCHFACCHLogicalChanne
 		}
 	}
 	transaction.SIP().MTCInitRTP();
-	gTransactionTable.update(transaction);
 
 	// Send Connect Ack to make it all official.
 	LOG(DEBUG) << "MTC send GSM Connect Acknowledge";
@@ -966,7 +919,6 @@ void Control::MTCController(TransactionEntry& transaction, TCHFACCHLogicalChanne
 
 	// At this point, everything is ready to run for the call.
 	// The radio link should have been cleared with the call.
-	gTransactionTable.update(transaction);
 	callManagementLoop(transaction,TCH);
 }
 
@@ -984,8 +936,8 @@ void Control::EmergencyCall(const L3CMServiceRequest* req, LogicalChannel *LCH)
 	// If we got a TMSI, find the IMSI.
 	L3MobileIdentity mobileIdentity = req->mobileIdentity();
 	if (mobileIdentity.type()==TMSIType) {
-		const char *IMSI = gTMSITable.find(mobileIdentity.TMSI());
-		if (IMSI) mobileIdentity = L3MobileIdentity(IMSI);
+		string IMSI;
+		if (gTMSITable.find(mobileIdentity.TMSI(),IMSI)) mobileIdentity = L3MobileIdentity(IMSI.c_str());
 	}
 
 	// Can't find the TMSI?  Ask for an IMSI.
@@ -1046,15 +998,16 @@ void Control::EmergencyCall(const L3CMServiceRequest* req, LogicalChannel *LCH)
 	LOG(DEBUG) << "E-MOC: SIP start engine";
 	// Create a transaction table entry so the TCH controller knows what to do later.
 	// The transaction on the TCH is a continuation of this one and uses the same ID
-	TransactionEntry transaction(mobileIdentity,
+	TransactionRef entry(new TransactionEntry(mobileIdentity,
 		req->serviceType(),
-		L3TI, L3CalledPartyBCDNumber(bcd_digits));
+		L3TI, L3CalledPartyBCDNumber(bcd_digits)));
+	TransactionEntry& transaction = *entry;
 	assert(transaction.TIFlag()==0);
 	if (mobileIdentity.type()!=TMSIType) transaction.SIP().User(mobileIdentity.digits());
 	transaction.Q931State(TransactionEntry::MOCInitiated);
 	TCH->transactionID(transaction.ID());
 	LOG(DEBUG) << "E-MOC: transaction: " << transaction;
-	gTransactionTable.add(transaction);
+	gTransactionTable.add(entry);
 
 	// Done with the setup message.
 	delete msg_setup;
@@ -1099,7 +1052,6 @@ void Control::TestCall(TransactionEntry& transaction, LogicalChannel *LCH)
 
 	// Mark the call as active.
 	transaction.Q931State(TransactionEntry::Active);
-	gTransactionTable.update(transaction);
 
 	// Create and open the control port.
 	UDPSocket controlSocket(gConfig.getNum("TestCall.Port"));
@@ -1172,10 +1124,10 @@ void Control::TestCall(TransactionEntry& transaction, LogicalChannel *LCH)
 
 
 
-void Control::initiateMTTransaction(TransactionEntry& transaction, GSM::ChannelType chanType, unsigned pageTime)
+void Control::initiateMTTransaction(const TransactionRef& transaction, GSM::ChannelType chanType, unsigned pageTime)
 {
 	gTransactionTable.add(transaction);
-	gBTS.pager().addID(transaction.subscriber(),chanType,transaction,pageTime);
+	gBTS.pager().addID(transaction->subscriber(),chanType,*transaction,pageTime);
 }
 
 
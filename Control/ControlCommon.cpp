@@ -25,6 +25,8 @@
 */
 
 
+#define LOG_MODULE Control
+
 #include "ControlCommon.h"
 
 #include <GSMLogicalChannel.h>
@@ -61,9 +63,11 @@ TransactionEntry::TransactionEntry()
 	mT304(T304ms), mT305(T305ms), mT308(T308ms),
 	mT310(T310ms), mT313(T313ms),
 	mT3113(gConfig.getNum("GSM.T3113")),
-	mTR1M(TR1Mms)
+	mTR1M(TR1Mms),
+	mRefs(1)
 {
 	mMessage[0]='\0';
+	nameForLog();
 }
 
 // Form for MT transactions.
@@ -80,10 +84,12 @@ TransactionEntry::TransactionEntry(const L3MobileIdentity& wSubscriber,
 	mT304(T304ms), mT305(T305ms), mT308(T308ms),
 	mT310(T310ms), mT313(T313ms),
 	mT3113(gConfig.getNum("GSM.T3113")),
-	mTR1M(TR1Mms)
+	mTR1M(TR1Mms),
+	mRefs(1)
 {
 	if (wMessage) strncpy(mMessage,wMessage,160);
 	else mMessage[0]='\0';
+	nameForLog();
 }
 
 // Form for MO transactions.
@@ -100,9 +106,11 @@ TransactionEntry::TransactionEntry(const L3MobileIdentity& wSubscriber,
 	mT304(T304ms), mT305(T305ms), mT308(T308ms),
 	mT310(T310ms), mT313(T313ms),
 	mT3113(gConfig.getNum("GSM.T3113")),
-	mTR1M(TR1Mms)
+	mTR1M(TR1Mms),
+	mRefs(1)
 {
 	mMessage[0]='\0';
+	nameForLog();
 }
 
 // Form for MT transactions.
@@ -118,58 +126,113 @@ TransactionEntry::TransactionEntry(const L3MobileIdentity& wSubscriber,
 	mT304(T304ms), mT305(T305ms), mT308(T308ms),
 	mT310(T310ms), mT313(T313ms),
 	mT3113(gConfig.getNum("GSM.T3113")),
-	mTR1M(TR1Mms)
+	mTR1M(TR1Mms),
+	mRefs(1)
 {
 	mMessage[0]='\0';
+	nameForLog();
 }
 
 
 
-bool TransactionEntry::timerExpired() const
+TransactionEntry::~TransactionEntry()
 {
-	// FIXME -- If we were smart, this would be a table.
-	if (mT301.expired()) {
-		OBJLOG(DEBUG) << "T301 expired";
-		return true;
-	}
-	if (mT302.expired()) {
-		OBJLOG(DEBUG) << "T302 expired";
-		return true;
-	}
-	if (mT303.expired()) {
-		OBJLOG(DEBUG) << "T303 expired";
-		return true;
-	}
-	if (mT304.expired()) {
-		OBJLOG(DEBUG) << "T304 expired";
-		return true;
-	}
-	if (mT305.expired()) {
-		OBJLOG(DEBUG) << "T305 expired";
-		return true;
-	}
-	if (mT308.expired()) {
-		OBJLOG(DEBUG) << "T308 expired";
-		return true;
-	}
-	if (mT310.expired()) {
-		OBJLOG(DEBUG) << "T310 expired";
-		return true;
-	}
-	if (mT313.expired()) {
-		OBJLOG(DEBUG) << "T313 expired";
-		return true;
+	gClearLogObjectName(this);
+}
+
+
+void TransactionEntry::nameForLog() const
+{
+	ostringstream name;
+	name << 'T' << mID;
+	gSetLogObjectName(this,name.str());
+}
+
+
+
+Z100Timer& TransactionEntry::timer(Q931Timer which)
+{
+	switch (which) {
+		case T301: return mT301;
+		case T302: return mT302;
+		case T303: return mT303;
+		case T304: return mT304;
+		case T305: return mT305;
+		case T308: return mT308;
+		case T310: return mT310;
+		case T313: return mT313;
+		case T3113: return mT3113;
+		case TR1M: return mTR1M;
 	}
-	if (mTR1M.expired()) {
-		OBJLOG(DEBUG) << " TR1M expired";
-		return true;
+	assert(0);
+	return mT301;
+}
+
+
+void TransactionEntry::setTimer(Q931Timer which)
+{
+	mLock.lock();
+	timer(which).set();
+	mLock.unlock();
+}
+
+
+void TransactionEntry::setTimer(Q931Timer which, long wLimit)
+{
+	mLock.lock();
+	timer(which).set(wLimit);
+	mLock.unlock();
+}
+
+
+void TransactionEntry::resetTimer(Q931Timer which)
+{
+	mLock.lock();
+	timer(which).reset();
+	mLock.unlock();
+}
+
+
+bool TransactionEntry::startPaging(unsigned wLife, bool onlyIfPaging)
+{
+	mLock.lock();
+	// A repeated INVITE must not drag a call that has already
+	// been answered back into paging.
+	bool retVal = !onlyIfPaging || mQ931State==Paging;
+	if (retVal) {
+		mStateTimer.now();
+		mQ931State = Paging;
+		mT3113.set(wLife);
 	}
-	return false;
+	mLock.unlock();
+	return retVal;
+}
+
+
+bool TransactionEntry::timerExpired() const
+{
+	// FIXME -- If we were smart, this would be a table.
+	const char *name = NULL;
+	mLock.lock();
+	if (mT301.expired()) name = "T301";
+	else if (mT302.expired()) name = "T302";
+	else if (mT303.expired()) name = "T303";
+	else if (mT304.expired()) name = "T304";
+	else if (mT305.expired()) name = "T305";
+	else if (mT308.expired()) name = "T308";
+	else if (mT310.expired()) name = "T310";
+	else if (mT313.expired()) name = "T313";
+	else if (mTR1M.expired()) name = "TR1M";
+	mLock.unlock();
+	if (!name) return false;
+	OBJLOG(DEBUG) << name << " expired";
+	return true;
 }
 
 
 void TransactionEntry::resetTimers()
 {
+	mLock.lock();
 	mT301.reset();
 	mT302.reset();
 	mT303.reset();
@@ -179,15 +242,17 @@ void TransactionEntry::resetTimers()
 	mT310.reset();
 	mT313.reset();
 	mTR1M.reset();
+	mLock.unlock();
 }
 
 
 
 bool TransactionEntry::dead() const
 {
-	if (mQ931State==NullState) return true;
-	if ((mQ931State==Paging) && mT3113.expired()) return true;
-	return false;
+	mLock.lock();
+	bool retVal = (mQ931State==NullState) || ((mQ931State==Paging) && mT3113.expired());
+	mLock.unlock();
+	return retVal;
 }
 
 
@@ -237,50 +302,81 @@ unsigned TransactionTable::newID()
 }
 
 
-void TransactionTable::add(const TransactionEntry& value)
+void TransactionTable::add(const TransactionRef& value)
 {
-	LOG(INFO) << "new transaction " << value;
+	LOG(INFO) << "new transaction " << *value;
+	TransactionEntry *entry = value.get();
 	mLock.lock();
-	mTable[value.ID()]=value;
+	TransactionMap::iterator itr = mTable.find(entry->ID());
+	if (itr!=mTable.end()) eraseLocked(itr);
+	mTable[entry->ID()] = entry->ref();
+	mByMobileID.insert(TransactionMobileIDMap::value_type(entry->subscriber(),entry));
+	entry->mIndexedCallID = entry->SIP().callID();
+	if (!entry->mIndexedCallID.empty()) mByCallID[entry->mIndexedCallID] = entry;
 	mLock.unlock();
 }
 
 
-void TransactionTable::update(const TransactionEntry& value)
+
+TransactionRef TransactionTable::find(unsigned key) const
 {
 	// ID==0 is a non-valid special case.
-	assert(value.ID());
+	assert(key);
+	TransactionRef retVal;
 	mLock.lock();
-	if (mTable.find(value.ID())==mTable.end()) {
-		mLock.unlock();
-		LOG(WARN) << "attempt to update non-existent transaction entry with key " << value.ID();
-		return;
-	}
-	mTable[value.ID()]=value;
+	TransactionMap::const_iterator itr = mTable.find(key);
+	if (itr!=mTable.end() && !itr->second->dead()) retVal = TransactionRef(itr->second->ref());
 	mLock.unlock();
+	return retVal;
 }
 
 
 
-
-bool TransactionTable::find(unsigned key, TransactionEntry& target)
+TransactionRef TransactionTable::find(const L3MobileIdentity& mobileID) const
 {
-	// ID==0 is a non-valid special case.
-	assert(key);
+	// Entries of one subscriber are in the order they were added.
+	TransactionRef retVal;
 	mLock.lock();
-	TransactionMap::iterator itr = mTable.find(key);
-	if (itr==mTable.end()) {
-		mLock.unlock();
-		return false;
-	}
-	if (itr->second.dead()) {
-		mTable.erase(itr);
-		mLock.unlock();
-		return false;
+	TransactionMobileIDMap::const_iterator itr = mByMobileID.lower_bound(mobileID);
+	TransactionMobileIDMap::const_iterator end = mByMobileID.upper_bound(mobileID);
+	for (; itr!=end; ++itr) {
+		if (itr->second->dead()) continue;
+		retVal = TransactionRef(itr->second->ref());
+		break;
 	}
 	mLock.unlock();
-	target = itr->second;
-	return true;
+	return retVal;
+}
+
+
+
+TransactionRef TransactionTable::findByCallID(const string& callID) const
+{
+	TransactionRef retVal;
+	mLock.lock();
+	TransactionCallIDMap::const_iterator itr = mByCallID.find(callID);
+	if (itr!=mByCallID.end() && !itr->second->dead()) retVal = TransactionRef(itr->second->ref());
+	mLock.unlock();
+	return retVal;
+}
+
+
+
+void TransactionTable::eraseLocked(TransactionMap::iterator itr)
+{
+	TransactionEntry *entry = itr->second;
+	TransactionMobileIDMap::iterator mp = mByMobileID.lower_bound(entry->subscriber());
+	while (mp!=mByMobileID.end() && mp->second!=entry) ++mp;
+	if (mp!=mByMobileID.end()) mByMobileID.erase(mp);
+	// Erase by the key the entry was indexed under; the SIP engine's call ID
+	// may have changed since, and a newer entry may have taken the key.
+	if (!entry->mIndexedCallID.empty()) {
+		TransactionCallIDMap::iterator cp = mByCallID.find(entry->mIndexedCallID);
+		if (cp!=mByCallID.end() && cp->second==entry) mByCallID.erase(cp);
+		entry->mIndexedCallID.clear();
+	}
+	mTable.erase(itr);
+	entry->release();
 }
 
 
@@ -290,7 +386,9 @@ bool TransactionTable::remove(unsigned key)
 	// ID==0 is a non-valid special case.
 	assert(key);
 	mLock.lock();
-	bool retVal = mTable.erase(key);
+	TransactionMap::iterator itr = mTable.find(key);
+	bool retVal = (itr!=mTable.end());
+	if (retVal) eraseLocked(itr);
 	mLock.unlock();
 	return retVal;
 }
@@ -302,12 +400,12 @@ void TransactionTable::clearDeadEntries()
 	mLock.lock();
 	TransactionMap::iterator itr = mTable.begin();
 	while (itr!=mTable.end()) {
-		if (!itr->second.dead()) ++itr;
+		if (!itr->second->dead()) ++itr;
 		else {
 			LOG(DEBUG) << "erasing " << itr->first;
 			TransactionMap::iterator old = itr;
 			itr++;
-			mTable.erase(old);
+			eraseLocked(old);
 		}
 	}
 	mLock.unlock();
@@ -315,35 +413,49 @@ void TransactionTable::clearDeadEntries()
 
 
 
-bool TransactionTable::find(const L3MobileIdentity& mobileID, TransactionEntry& target)
+void TransactionTable::reaperLoop()
+{
+	while (true) {
+		clearDeadEntries();
+		gSleepMicroseconds(ReapPeriod*1000UL);
+	}
+}
+
+
+
+void *TransactionTableReaperAdapter(TransactionTable *table)
+{
+	table->reaperLoop();
+	return NULL;
+}
+
+
+
+void TransactionTable::start()
 {
-	// Yes, it's linear time.
-	// Even in a 6-ARFCN system, it should rarely be more than a dozen entries.
+	mReaperThread.start((void*(*)(void*))TransactionTableReaperAdapter,this);
+}
 
-	// Since clearDeadEntries is also linear, do that here, too.
 
-	// Brtue force search.
-	bool foundIt = false;
+
+void TransactionTable::dump(ostream& os) const
+{
 	mLock.lock();
-	clearDeadEntries();
-	TransactionMap::const_iterator itr = mTable.begin();
-	while (itr!=mTable.end()) {
-		const TransactionEntry& transaction = itr->second;
-		if (transaction.subscriber()==mobileID) {
-			// No need to check dead(), since we just cleared the table.
-			foundIt = true;
-			target = transaction;
-			break;
-		}
-		++itr;
+	for (TransactionMap::const_iterator itr = mTable.begin(); itr!=mTable.end(); ++itr) {
+		if (itr->second->dead()) continue;
+		os << *(itr->second) << endl;
 	}
 	mLock.unlock();
-	return foundIt;
 }
 
-size_t TransactionTable::size()
+
+
+size_t TransactionTable::size() const
 {
-	return mTable.size();
+	mLock.lock();
+	size_t retVal = mTable.size();
+	mLock.unlock();
+	return retVal;
 }
 
 
@@ -359,9 +471,9 @@ void Control::clearTransactionHistory( TransactionEntry& transaction )
 void Control::clearTransactionHistory(unsigned transactionID)
 {
 	if (transactionID==0) return;
-	TransactionEntry transaction;
-	if (gTransactionTable.find(transactionID,transaction)) {
-		clearTransactionHistory(transaction);
+	TransactionRef transaction = gTransactionTable.find(transactionID);
+	if (transaction.get()) {
+		clearTransactionHistory(*transaction);
 	} else {
 		LOG(INFO) << "clearTransactionHistory didn't find " << transactionID << "(size = " << gTransactionTable.size() << ")";
 	}
@@ -370,39 +482,153 @@ void Control::clearTransactionHistory(unsigned transactionID)
 
 
 
+bool TMSITable::open(const char* path)
+{
+	// The journal is one record per line, oldest first:
+	// "<TMSI in hex> <IMSI>" for an assignment, "<TMSI in hex> -" for an erasure,
+	// "<TMSI in hex> +" for a use, which makes it the most recently used.
+	mLock.lock();
+	mPath = path;
+	unsigned loaded = 0;
+	FILE *fp = fopen(path,"r");
+	if (fp) {
+		unsigned TMSI;
+		char IMSI[20];
+		while (fscanf(fp,"%x %19s",&TMSI,IMSI)==2) {
+			loaded++;
+			TMSIMap::iterator itr = mMap.find(TMSI);
+			if (IMSI[0]=='+') {
+				if (itr!=mMap.end()) mAges.splice(mAges.end(),mAges,itr->second.mAge);
+				continue;
+			}
+			if (itr!=mMap.end()) eraseLocked(itr);
+			if (IMSI[0]=='-') continue;
+			IMSIMap::iterator ip = mIMSIs.find(IMSI);
+			if (ip!=mIMSIs.end()) eraseLocked(mMap.find(ip->second));
+			insertLocked(TMSI,IMSI);
+			// Don't reuse TMSIs from an earlier run, even if the clock went back.
+			if ((int)(TMSI+1-mCounter)>0) mCounter = TMSI+1;
+		}
+		fclose(fp);
+	}
+	while (mMap.size()>mMaxSize) eraseLocked(mMap.find(mAges.front()));
+	LOG(INFO) << "loaded " << mMap.size() << " TMSIs from " << loaded << " records in " << path;
+	// Start a fresh journal with just the live entries.
+	snapshotLocked();
+	bool retVal = (mJournal!=NULL);
+	mLock.unlock();
+	return retVal;
+}
+
+
+void TMSITable::insertLocked(unsigned TMSI, const string& IMSI)
+{
+	TMSIAgeList::iterator age = mAges.insert(mAges.end(),TMSI);
+	mMap.insert(TMSIMap::value_type(TMSI,TMSIEntry(IMSI,age)));
+	mIMSIs[IMSI] = TMSI;
+}
+
+
+void TMSITable::eraseLocked(TMSIMap::iterator itr)
+{
+	mIMSIs.erase(itr->second.mIMSI);
+	mAges.erase(itr->second.mAge);
+	mMap.erase(itr);
+}
+
+
+void TMSITable::touchLocked(const TMSIEntry& entry) const
+{
+	unsigned TMSI = *entry.mAge;
+	if (mAges.back()==TMSI) return;
+	mAges.splice(mAges.end(),mAges,entry.mAge);
+	journalLocked(TMSI,"+",false);
+}
+
+
+void TMSITable::journalLocked(unsigned TMSI, const char* IMSI, bool flush) const
+{
+	if (!mJournal) return;
+	fprintf(mJournal,"%x %s\n",TMSI,IMSI);
+	if (flush) fflush(mJournal);
+	// Rewrite when most of the journal is history.
+	if (++mJournalRecords > 2*mMap.size()+1000) snapshotLocked();
+}
+
+
+void TMSITable::snapshotLocked() const
+{
+	if (mPath.empty()) return;
+	if (mJournal) fclose(mJournal);
+	mJournal = NULL;
+	mJournalRecords = 0;
+	// Write the new journal beside the old one and swap them,
+	// so that a crash at any point leaves one or the other.
+	string tmp = mPath + ".new";
+	FILE *fp = fopen(tmp.c_str(),"w");
+	if (!fp) {
+		LOG(ALARM) << "cannot write TMSI journal " << tmp;
+		return;
+	}
+	// Oldest first, so that a reload keeps the aging order.
+	for (TMSIAgeList::const_iterator ap = mAges.begin(); ap!=mAges.end(); ++ap) {
+		fprintf(fp,"%x %s\n",*ap,mMap.find(*ap)->second.mIMSI.c_str());
+		mJournalRecords++;
+	}
+	if (fclose(fp)!=0 || rename(tmp.c_str(),mPath.c_str())!=0) {
+		LOG(ALARM) << "cannot write TMSI journal " << mPath;
+		return;
+	}
+	mJournal = fopen(mPath.c_str(),"a");
+	if (!mJournal) {
+		LOG(ALARM) << "cannot append to TMSI journal " << mPath;
+	}
+}
+
+
 unsigned TMSITable::assign(const char* IMSI)
 {
-	purge();
 	mLock.lock();
+	// An IMSI has one TMSI at a time.
+	IMSIMap::iterator ip = mIMSIs.find(IMSI);
+	if (ip!=mIMSIs.end()) {
+		journalLocked(ip->second,"-");
+		eraseLocked(mMap.find(ip->second));
+	}
+	// Age out the least recently used.
+	while (mMap.size()>=mMaxSize) {
+		journalLocked(mAges.front(),"-");
+		eraseLocked(mMap.find(mAges.front()));
+	}
 	unsigned TMSI = mCounter++;
-	mMap[TMSI] = IMSI;
+	insertLocked(TMSI,IMSI);
+	journalLocked(TMSI,IMSI);
 	mLock.unlock();
 	return TMSI;
 }
 
-const char* TMSITable::find(unsigned TMSI) const
+bool TMSITable::find(unsigned TMSI, string& IMSI) const
 {
+	bool retVal = false;
 	mLock.lock();
 	TMSIMap::const_iterator iter = mMap.find(TMSI);
+	if (iter!=mMap.end()) {
+		touchLocked(iter->second);
+		IMSI = iter->second.mIMSI;
+		retVal = true;
+	}
 	mLock.unlock();
-	if (iter==mMap.end()) return NULL;
-	return iter->second.c_str();
+	return retVal;
 }
 
 unsigned TMSITable::find(const char* IMSI) const
 {
-	// FIXME -- If we were smart, we'd organize the table for a log-time search.
 	unsigned TMSI = 0;
-	string IMSIc(IMSI);
 	mLock.lock();
-	// brute force search
-	TMSIMap::const_iterator itr = mMap.begin();
-	while (itr!=mMap.end()) {
-		if (itr->second == IMSIc) {
-			TMSI = itr->first;
-			break;
-		}
-		++itr;
+	IMSIMap::const_iterator ip = mIMSIs.find(IMSI);
+	if (ip!=mIMSIs.end()) {
+		TMSI = ip->second;
+		touchLocked(mMap.find(TMSI)->second);
 	}
 	mLock.unlock();
 	return TMSI;
@@ -415,19 +641,39 @@ void TMSITable::erase(unsigned TMSI)
 {
 	mLock.lock();
 	TMSIMap::iterator iter = mMap.find(TMSI);
-	if (iter!=mMap.end()) mMap.erase(iter);
+	if (iter!=mMap.end()) {
+		journalLocked(TMSI,"-");
+		eraseLocked(iter);
+	}
 	mLock.unlock();
 }
 
 
-void TMSITable::purge()
+void TMSITable::clear()
 {
 	mLock.lock();
-	// We rely on the fact the TMSIs are assigned in numeric order
-	// to erase the oldest first.
-	while ( (mMap.size()>mMaxSize) && (mClear!=mCounter) )
-		mMap.erase(mClear++);
+	mMap.clear();
+	mIMSIs.clear();
+	mAges.clear();
+	snapshotLocked();
+	mLock.unlock();
+}
+
+
+size_t TMSITable::dump(ostream& os, const char* prefix) const
+{
+	// The IMSI index is sorted, so a prefix is a contiguous range.
+	string start = prefix ? prefix : "";
+	size_t count = 0;
+	mLock.lock();
+	IMSIMap::const_iterator ip = mIMSIs.lower_bound(start);
+	for (; ip!=mIMSIs.end(); ++ip) {
+		if (ip->first.compare(0,start.size(),start)!=0) break;
+		os << ip->first << " 0x" << hex << ip->second << dec << endl;
+		count++;
+	}
 	mLock.unlock();
+	return count;
 }
 
 
@@ -516,11 +762,10 @@ unsigned  Control::resolveIMSI(bool sameLAI, L3MobileIdentity& mobID, LogicalCha
 	// Must be a TMSI.
 	// Look in the table to see if it's one we assigned.
 	unsigned TMSI = mobID.TMSI();
-	const char* IMSI = NULL;
-	if (sameLAI) IMSI = gTMSITable.find(TMSI);
-	if (IMSI) {
+	string IMSI;
+	if (sameLAI && gTMSITable.find(TMSI,IMSI)) {
 		// We assigned this TMSI and the TMSI/IMSI pair is already in the table.
-		mobID = L3MobileIdentity(IMSI);
+		mobID = L3MobileIdentity(IMSI.c_str());
 		LOG(DEBUG) << "resolving mobile ID (table): " << mobID;
 		return TMSI;
 	}
@@ -553,8 +798,8 @@ void  Control::resolveIMSI(L3MobileIdentity& mobileIdentity, LogicalChannel* LCH
 
 	// If we got a TMSI, find the IMSI.
 	if (mobileIdentity.type()==TMSIType) {
-		const char *IMSI = gTMSITable.find(mobileIdentity.TMSI());
-		if (IMSI) mobileIdentity = L3MobileIdentity(IMSI);
+		string IMSI;
+		if (gTMSITable.find(mobileIdentity.TMSI(),IMSI)) mobileIdentity = L3MobileIdentity(IMSI.c_str());
 	}
 
 	// Still no IMSI?  Ask for one.
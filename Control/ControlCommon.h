@@ -30,7 +30,11 @@
 
 #include <Logger.h>
 
+#include <stdio.h>
 #include <list>
+#include <map>
+#include <string>
+#include <vector>
 
 #include "Interthread.h"
 #include "Timeval.h"
@@ -65,6 +69,7 @@ class L3PagingResponse;
 namespace Control {
 
 class TransactionEntry;
+class TransactionRef;
 class TransactionTable;
 
 /**@name Call control time-out values (in ms) from ITU-T Q.931 Table 9-1 and GSM 04.08 Table 11.4. */
@@ -207,8 +212,8 @@ void MTSMSController(TransactionEntry& transaction,
 						GSM::LogicalChannel *LCH);
 //@}
 
-/** Create a new transaction entry and start paging. */
-void initiateMTTransaction(TransactionEntry& transaction,
+/** Add a new transaction entry to the table and start paging. */
+void initiateMTTransaction(const TransactionRef& transaction,
 		GSM::ChannelType chanType, unsigned pageTime);
 
 //@}
@@ -252,6 +257,7 @@ class PagingEntry {
 	private:
 
 	GSM::L3MobileIdentity mID;		///< The mobile ID.
+	unsigned mTMSI;					///< TMSI to page with, or 0 to page with mID.
 	GSM::ChannelType mType;			///< The needed channel type.
 	unsigned mTransactionID;		///< The associated transaction ID.
 	Timeval mExpiration;			///< The expiration time for this entry.
@@ -261,16 +267,24 @@ class PagingEntry {
 	/**
 		Create a new entry, with current timestamp.
 		@param wID The ID to be paged.
+		@param wTMSI A TMSI for the mobile, or 0 to page with wID.
 		@param wLife The number of milliseconds to keep paging.
 	*/
-	PagingEntry(const GSM::L3MobileIdentity& wID, GSM::ChannelType wType,
+	PagingEntry(const GSM::L3MobileIdentity& wID, unsigned wTMSI, GSM::ChannelType wType,
 			unsigned wTransactionID, unsigned wLife)
-		:mID(wID),mType(wType),mTransactionID(wTransactionID),mExpiration(wLife)
+		:mID(wID),mTMSI(wTMSI),mType(wType),mTransactionID(wTransactionID),mExpiration(wLife)
 	{}
 
 	/** Access the ID. */
 	const GSM::L3MobileIdentity& ID() const { return mID; }
 
+	/** Return the TMSI to page with, or 0 if none. */
+	unsigned TMSI() const { return mTMSI; }
+
+	/** Return the ID to put in a paging request. */
+	GSM::L3MobileIdentity pageID() const
+		{ return mTMSI ? GSM::L3MobileIdentity(mTMSI) : mID; }
+
 	/** Access the channel type needed. */
 	GSM::ChannelType type() const { return mType; }
 
@@ -291,26 +305,34 @@ typedef std::list<PagingEntry> PagingEntryList;
 	The pager is a global object that generates paging messages on the CCCH.
 	To page a mobile, add the mobile ID to the pager.
 	The entry will be deleted automatically when it expires.
-	All pager operations are linear time.
-	Not much point in optimizing since the main operation is inherently linear.
+
+	Each mobile listens only to the paging blocks of its paging group,
+	GSM 05.02 6.5.2, so there is a paging list for each group.  The CCCH
+	service loops ask for a paging message for each block they send, and
+	get one for the group of that block, packing up to four mobiles into
+	a paging request of type 1, 2 or 3.  Each list is served round-robin,
+	so every mobile in a group is paged once per pass through its list.
 */
 class Pager {
 
 	private:
 
-	PagingEntryList mPageIDs;				///< List of ID's to be paged.
-	Mutex mLock;							///< Lock for thread-safe access.
-	Signal mPageSignal;						///< signal to wake the paging loop
-	Thread mPagingThread;					///< Thread for the paging loop.
-	volatile bool mRunning;
+	std::vector<PagingEntryList> mGroups;		///< Lists of IDs to be paged, by paging group.
+	size_t mSize;								///< Total number of IDs in mGroups.
+	std::vector<const GSM::CCCHLogicalChannel*> mPCHs;	///< Paging channels in block order.
+	unsigned mMultiframes;						///< BS_PA_MFRMS, multiframes in the paging cycle.
+	mutable Mutex mLock;						///< Lock for thread-safe access.
 
 	public:
 
 	Pager()
-		:mRunning(false)
+		:mGroups(1),mSize(0),mMultiframes(1)
 	{}
 
-	/** Set the output FIFO and start the paging loop. */
+	/**
+		Set up the paging groups from the PCHs and the control channel description.
+		Do not call this until the paging channels are installed.
+	*/
 	void start();
 
 	/**
@@ -327,6 +349,18 @@ class Pager {
 		unsigned wLife=2*gConfig.getNum("SIP.Timer.A")
 	);
 
+	/**
+		Page a mobile ID again, for a repeated INVITE.
+		Unlike addID, this leaves alone a transaction that is no longer paging.
+		@return True if the mobile is being paged.
+	*/
+	bool repageID(
+		const GSM::L3MobileIdentity& addID,
+		GSM::ChannelType chanType,
+		TransactionEntry& transaction,
+		unsigned wLife=2*gConfig.getNum("SIP.Timer.A")
+	);
+
 	/**
 		Remove a mobile ID.
 		This is used to stop the paging when a phone responds.
@@ -334,19 +368,28 @@ class Pager {
 	*/
 	unsigned removeID(const GSM::L3MobileIdentity&);
 
-	private:
-
 	/**
-		Traverse the paging list, paging all IDs.
-		@return Number of IDs paged.
+		Return a paging message for the next block of a CCCH, or NULL.
+		@param CCCH The channel that will send the block.
+		@param when The time of the block.
+		@return A new UNIT_DATA frame, or NULL if the block is not a paging block or nobody in its group is paged.
 	*/
-	unsigned pageAll();
+	GSM::L3Frame* pagingFrame(const GSM::CCCHLogicalChannel* CCCH, const GSM::Time& when);
 
-	/** A loop that repeatedly calls pageAll. */
-	void serviceLoop();
+	/** Return the paging group of a mobile ID, GSM 05.02 6.5.2. */
+	unsigned pagingGroup(const GSM::L3MobileIdentity&) const;
 
-	/** C-style adapter. */
-	friend void *PagerServiceLoopAdapter(Pager*);
+	private:
+
+	/** Return the paging group of a mobile ID, with mLock held. */
+	unsigned pagingGroupLocked(const GSM::L3MobileIdentity&) const;
+
+	/** Put a mobile ID in the list of its paging group, or renew it there. */
+	void addEntry(const GSM::L3MobileIdentity& newID, GSM::ChannelType chanType,
+		unsigned transactionID, unsigned wLife);
+
+	/** Remove expired entries from a paging list. */
+	void expire(PagingEntryList& list);
 
 public:
 
@@ -358,9 +401,6 @@ public:
 };
 
 
-void *PagerServiceLoopAdapter(Pager*);
-
-
 //@}	// paging mech
 
 
@@ -373,7 +413,12 @@ void *PagerServiceLoopAdapter(Pager*);
 /**
 	A TransactionEntry object is used to maintain the state of a transaction
 	as it moves from channel to channel.
-	The object itself is not thread safe.
+	Entries live on the heap and are shared through TransactionRef handles,
+	so the table and the threads running a transaction all see one object.
+	The Q.931 state and the timers are read and changed by other threads too
+	(the reaper, the CLI, the SIP interface), so they are guarded by a
+	per-entry lock.  The rest of the entry is set up before it is added to
+	the table and after that belongs to the thread running the transaction.
 */
 class TransactionEntry {
 
@@ -396,8 +441,24 @@ class TransactionEntry {
 		SMSSubmitting,
 	};
 
+	/** Timers from GSM and Q.931 (network side) */
+	enum Q931Timer {
+		T301,
+		T302,
+		T303,
+		T304,
+		T305,		///< a "clearing timer"
+		T308,		///< a "clearing timer"
+		T310,
+		T313,
+		T3113,		///< the paging timer, NOT a Q.931 timer
+		TR1M,		///< SMS RP-ACK timer, see GSM 04.11 6.2.1.2
+	};
+
 	private:
 
+	mutable Mutex mLock;					///< guards the Q.931 state and timers
+
 	unsigned mID;						///< the internal transaction ID, assigned by a TransactionTable
 
 	GSM::L3MobileIdentity mSubscriber;		///< some kind of subscriber ID, preferably IMSI
@@ -415,8 +476,8 @@ class TransactionEntry {
 
 	/**@name Timers from GSM and Q.931 (network side) */
 	//@{
-	// If you add a timer, remember to add it to
-	// the constructor, timerExpired and resetTimers methods.
+	// If you add a timer, remember to add it to the Q931Timer enum,
+	// the constructor, timer, timerExpired and resetTimers methods.
 	GSM::Z100Timer mT301;
 	GSM::Z100Timer mT302;
 	GSM::Z100Timer mT303;
@@ -429,6 +490,20 @@ class TransactionEntry {
 	GSM::Z100Timer mTR1M;		///< SMS RP-ACK timer, see GSM 04.11 6.2.1.2
 	//@}
 
+	volatile int mRefs;			///< reference count, for entries on the heap
+
+	std::string mIndexedCallID;	///< the key of the entry in the table's call ID index, under the table lock
+
+	/** Entries are shared, not copied. */
+	TransactionEntry(const TransactionEntry&);
+	TransactionEntry& operator=(const TransactionEntry&);
+
+	/** Map a timer name to the timer; mLock must be held. */
+	GSM::Z100Timer& timer(Q931Timer which);
+
+	/** Name the entry for OBJLOG filters by its ID, "T<ID>". */
+	void nameForLog() const;
+
 	public:
 
 	TransactionEntry();
@@ -451,6 +526,8 @@ class TransactionEntry {
 		unsigned wTIValue,
 		const GSM::L3CallingPartyBCDNumber& wCalling);
 
+	~TransactionEntry();
+
 	/**@name Accessors. */
 	//@{
 	unsigned TIValue() const { return mTIValue; }
@@ -481,33 +558,53 @@ class TransactionEntry {
 
 	void Q931State(Q931CallState wState)
 	{
+		mLock.lock();
 		mStateTimer.now();
 		mQ931State=wState;
+		mLock.unlock();
 	}
 
-	Q931CallState Q931State() const { return mQ931State; }
+	Q931CallState Q931State() const
+	{
+		mLock.lock();
+		Q931CallState retVal = mQ931State;
+		mLock.unlock();
+		return retVal;
+	}
 
-	unsigned stateAge() const { return mStateTimer.elapsed(); }
+	unsigned stateAge() const
+	{
+		mLock.lock();
+		unsigned retVal = mStateTimer.elapsed();
+		mLock.unlock();
+		return retVal;
+	}
 
 	/**@name Timer access. */
-	// TODO -- If we were clever, this would be a table.
 	//@{
-	GSM::Z100Timer& T301() { return mT301; }
-	GSM::Z100Timer& T302() { return mT302; }
-	GSM::Z100Timer& T303() { return mT303; }
-	GSM::Z100Timer& T304() { return mT304; }
-	GSM::Z100Timer& T305() { return mT305; }
-	GSM::Z100Timer& T308() { return mT308; }
-	GSM::Z100Timer& T310() { return mT310; }
-	GSM::Z100Timer& T313() { return mT313; }
-	GSM::Z100Timer& T3113() { return mT3113; }
-	GSM::Z100Timer& TR1M() { return mTR1M; }
+	/** Start a timer with its default limit. */
+	void setTimer(Q931Timer which);
+	/** Start a timer with a given limit in ms. */
+	void setTimer(Q931Timer which, long wLimit);
+	/** Stop a timer. */
+	void resetTimer(Q931Timer which);
 	//@}
 	//@}
 
+	/**
+		Enter the Paging state and (re)start T3113.
+		@param wLife The paging duration in ms.
+		@param onlyIfPaging If true, leave a transaction alone that is no longer paging.
+		@return True if the transaction is now paging.
+	*/
+	bool startPaging(unsigned wLife, bool onlyIfPaging=false);
+
 	/** Return true if clearing is in progress. */
 	bool clearing() const
-		{ return (mQ931State==ReleaseRequest) || (mQ931State==DisconnectIndication); }
+	{
+		Q931CallState state = Q931State();
+		return (state==ReleaseRequest) || (state==DisconnectIndication);
+	}
 
 	/** Return true if any Q.931 timer is expired. */
 	bool timerExpired() const;
@@ -518,6 +615,12 @@ class TransactionEntry {
 	/** Retrns true if the transaction is "dead". */
 	bool dead() const;
 
+	/**@name Reference counting, for entries on the heap; see TransactionRef. */
+	//@{
+	TransactionEntry* ref() { __sync_add_and_fetch(&mRefs,1); return this; }
+	void release() { if (__sync_sub_and_fetch(&mRefs,1)==0) delete this; }
+	//@}
+
 	private:
 
 	friend class TransactionTable;
@@ -526,36 +629,93 @@ class TransactionEntry {
 };
 
 
+/**
+	A counted handle on a TransactionEntry on the heap.
+	The entry is deleted when the last handle goes away,
+	whether or not it is still in the table.
+*/
+class TransactionRef {
+
+	private:
+
+	TransactionEntry *mEntry;
+
+	public:
+
+	/** Take over the initial reference of a new entry, or NULL. */
+	explicit TransactionRef(TransactionEntry *wEntry=NULL)
+		:mEntry(wEntry)
+	{ }
+
+	TransactionRef(const TransactionRef& other)
+		:mEntry(other.mEntry)
+	{ if (mEntry) mEntry->ref(); }
+
+	~TransactionRef() { if (mEntry) mEntry->release(); }
+
+	TransactionRef& operator=(const TransactionRef& other)
+	{
+		if (other.mEntry) other.mEntry->ref();
+		if (mEntry) mEntry->release();
+		mEntry = other.mEntry;
+		return *this;
+	}
+
+	TransactionEntry* get() const { return mEntry; }
+	TransactionEntry& operator*() const { return *mEntry; }
+	TransactionEntry* operator->() const { return mEntry; }
+	bool operator!() const { return mEntry==NULL; }
+};
+
+
 std::ostream& operator<<(std::ostream& os, const TransactionEntry&);
 std::ostream& operator<<(std::ostream& os, TransactionEntry::Q931CallState);
 
 
 /** A map of transactions keyed by ID. */
-class TransactionMap : public std::map<unsigned,TransactionEntry> {};
+class TransactionMap : public std::map<unsigned,TransactionEntry*> {};
+
+/** An index of transactions by subscriber; a subscriber may have several. */
+class TransactionMobileIDMap : public std::multimap<GSM::L3MobileIdentity,TransactionEntry*> {};
+
+/** An index of transactions by SIP call ID. */
+class TransactionCallIDMap : public std::map<std::string,TransactionEntry*> {};
 
 /**
 	A table for tracking the states of active transactions.
-	Note that transaction table add and find operations
-	are pass-by-copy, not pass-by-reference.
+	Entries are indexed by ID, by subscriber and by SIP call ID,
+	and are handed out as shared TransactionRef handles, so a change made
+	through a handle is immediately visible to every other holder.
+	Dead entries are reaped by a service thread, not on the lookup path;
+	lookups just skip them.
 */
 class TransactionTable {
 
 	private:
 
-	// FIXME -- We need to support log-time lookup by transaction ID _or_ IMSI.
-	// Right now, it's log-time for transaction ID and linear time for IMSI.
-
 	TransactionMap mTable;
+	TransactionMobileIDMap mByMobileID;
+	TransactionCallIDMap mByCallID;
 	mutable Mutex mLock;
 	unsigned mIDCounter;
+	Thread mReaperThread;
+
+	/** Remove an entry from all indexes and drop the table's reference; lock must be held. */
+	void eraseLocked(TransactionMap::iterator itr);
 
 	public:
 
+	/** Time between dead-entry sweeps, in ms. */
+	static const unsigned ReapPeriod = 1000;
+
 	TransactionTable()
 		// This assumes the main application uses sdevrandom.
 		:mIDCounter(random())
 	{ }
 
+	/** Start the thread that reaps dead entries. */
+	void start();
+
 	/**
 		Return a new ID for use in the table.
 	*/
@@ -563,55 +723,58 @@ class TransactionTable {
 
 	/**
 		Insert a new entry into the table.
-		@param value The entry to copy into the table.
+		The entry is indexed by the SIP call ID it has at this point, if any,
+		and is not re-indexed later, so set up the SIP engine first:
+		SIPEngine::User allocates the call ID of an MO transaction and
+		takes the one of the INVITE or MESSAGE for an MT transaction.
+		@param value A handle on the entry; the table keeps its own reference.
 	*/
-	void add(const TransactionEntry& value);
+	void add(const TransactionRef& value);
 
 	/**
-		Update a transaction in the table.
-		Uses the ID previously assigned to the TransactionEntry by add().
-		@param value The new TransactionEntry to be copied in.
+		Find an entry by ID.
+		@param wID The transaction ID to search.
+		@return A handle on the entry, or a NULL handle if there is no live entry.
 	*/
-	void update(const TransactionEntry& value);
+	TransactionRef find(unsigned wID) const;
 
 	/**
-		Find an entry and make a copy.
-		(Removes entry if it was dead.)
-		@param wID The transaction ID to search.
-		@param target A place to put the copy.
-		@return True if successful.
+		Find an entry by its mobile ID.
+		@param mobileID The mobile at to search for.
+		@return A handle on the oldest live entry of the mobile, or a NULL handle.
+	*/
+	TransactionRef find(const GSM::L3MobileIdentity& mobileID) const;
+
+	/**
+		Find an entry by the call ID its SIP engine had when it was added.
+		Entries added with no SIP user, like test calls and E-MOCs from a TMSI,
+		are never found this way.
+		@param callID The SIP call ID.
+		@return A handle on the entry, or a NULL handle if there is no live entry.
 	*/
-	bool find(unsigned wID, TransactionEntry& target);
+	TransactionRef findByCallID(const std::string& callID) const;
 
 	/**
 		Remove an entry from the table.
+		Holders of handles keep the entry until they let go.
 		@param wID The transaction ID to search.
 		@return True if the ID was really in the table.
 	*/
 	bool remove(unsigned wID);
 
-	/**
-		Find an entry by its mobile ID.
-		Also clears dead entries during search.
-		@param mobileID The mobile at to search for.
-		@param target A TransactionEntry to accept the found record.
-		@return true is the mobile ID was foind.
-	*/
-	bool find(const GSM::L3MobileIdentity& mobileID, TransactionEntry& target);
-
 	/**
 		Remove "dead" entries from the table.
 		A "dead" entry is a transaction that is no longer active.
 	*/
 	void clearDeadEntries();
 
-	/**@Access to raw map. */
-	//@{
-	TransactionMap::const_iterator begin() { clearDeadEntries(); return mTable.begin(); }
-	TransactionMap::const_iterator end() const { return mTable.end(); }
-	//@}
+	/** Service loop of the reaper thread. */
+	void reaperLoop();
+
+	/** Print the live entries. */
+	void dump(std::ostream&) const;
 
-	size_t size();
+	size_t size() const;
 };
 
 //@} // Transaction Table
@@ -622,26 +785,66 @@ class TransactionTable {
 /**@ TMSI mechanisms */
 //@{
 
-typedef std::map<unsigned,std::string> TMSIMap;
+/** TMSIs in order of last use, least recently used first. */
+typedef std::list<unsigned> TMSIAgeList;
+
+/** A TMSI assignment and its place in the aging list. */
+class TMSIEntry {
 
+	public:
+
+	std::string mIMSI;
+	TMSIAgeList::iterator mAge;
+
+	TMSIEntry(const std::string& wIMSI, TMSIAgeList::iterator wAge)
+		:mIMSI(wIMSI),mAge(wAge)
+	{ }
+};
+
+typedef std::map<unsigned,TMSIEntry> TMSIMap;
+typedef std::map<std::string,unsigned> IMSIMap;
+
+
+/**
+	The TMSI/IMSI mapping, indexed in both directions.
+	When the table is full, the entry used least recently is dropped.
+	If a journal is opened, every change is appended to it and the table is
+	reloaded from it at startup, so handsets keep their TMSIs across restarts.
+	Uses are journaled too, so the aging order also survives a restart.
+	The journal is rewritten as a snapshot when it grows well past the table.
+*/
 class TMSITable {
 
 	private:
 
-	TMSIMap mMap;							///< IMSI/TMSI mapping
+	TMSIMap mMap;							///< TMSI to IMSI
+	IMSIMap mIMSIs;							///< IMSI to TMSI
+	mutable TMSIAgeList mAges;				///< TMSIs, least recently used first
 	unsigned mCounter;						///< a counter to generate new TMSIs
-	unsigned mClear;						///< next TMSI to be cleared from the table
 	mutable Mutex mLock;					///< concurrency control
 	static const unsigned mMaxSize = 50000;	///< maximum allowable table size
 
+	std::string mPath;						///< journal path, empty if none
+	mutable FILE *mJournal;					///< journal, open for appending
+	mutable unsigned mJournalRecords;		///< records in the journal
+
 
 	public:
 
 	TMSITable()
 		:mCounter(time(NULL)),
-		mClear(mCounter)
+		mJournal(NULL),mJournalRecords(0)
 	{}
 
+	~TMSITable() { if (mJournal) fclose(mJournal); }
+
+	/**
+		Load the table from a journal, if there is one, and log changes to it from now on.
+		@param path The journal file.
+		@return True if the journal is open for writing.
+	*/
+	bool open(const char* path);
+
 	/**
 		Create a new entry in the table.
 		@param IMSI	The IMSI to create an entry for.
@@ -653,13 +856,14 @@ class TMSITable {
 		Find an entry in the table.
 		This is a log-time operation.
 		@param TMSI The TMSI to find.
-		@return Pointer to c-string IMSI or NULL.
+		@param IMSI Set to a copy of the IMSI, taken under the lock.
+		@return True if the TMSI was found.
 	*/
-	const char* find(unsigned TMSI) const;
+	bool find(unsigned TMSI, std::string& IMSI) const;
 
 	/**
 		Find an entry in the table.
-		This is a linear-time operation.
+		This is a log-time operation.
 		@param IMSI The IMSI to find.
 		@return A TMSI value or zero on failure.
 	*/
@@ -672,7 +876,7 @@ class TMSITable {
 	void erase(unsigned TMSI);
 
 	/** Clear the table completely. */
-	void clear() { mMap.clear(); }
+	void clear();
 
 	size_t size() const {
 		mLock.lock();
@@ -681,14 +885,35 @@ class TMSITable {
 		return retVal;
 	}
 
-
-	TMSIMap::const_iterator begin() const { return mMap.begin(); }
-	TMSIMap::const_iterator end() const { return mMap.end(); }
+	/**
+		Print the entries, in IMSI order.
+		@param os The stream to print on.
+		@param prefix If not NULL, only print IMSIs that start with this.
+		@return The number of entries printed.
+	*/
+	size_t dump(std::ostream& os, const char* prefix=NULL) const;
 
 	private:
 
-	/** Erase entries, oldest first, to limit the table size. */
-	void purge();
+	/** Add an entry as the most recently used; lock must be held. */
+	void insertLocked(unsigned TMSI, const std::string& IMSI);
+
+	/** Remove an entry; lock must be held. */
+	void eraseLocked(TMSIMap::iterator itr);
+
+	/** Mark an entry as just used, in the table and the journal; lock must be held. */
+	void touchLocked(const TMSIEntry& entry) const;
+
+	/**
+		Append a record to the journal; lock must be held.
+		@param IMSI The assigned IMSI, or "-" for an erasure, or "+" for a use.
+		@param flush False to leave the record in the buffer, for uses,
+			which only cost a little of the aging order if lost in a crash.
+	*/
+	void journalLocked(unsigned TMSI, const char* IMSI, bool flush=true) const;
+
+	/** Rewrite the journal as a snapshot of the table, oldest first; lock must be held. */
+	void snapshotLocked() const;
 
 };
 
@@ -27,6 +27,8 @@
 
 
 
+#define LOG_MODULE Control
+
 #include "ControlCommon.h"
 #include <GSMLogicalChannel.h>
 #include <GSML3MMMessages.h>
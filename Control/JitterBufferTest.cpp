@@ -0,0 +1,237 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+	Check the RTP jitter buffer's reordering, loss concealment and
+	adaptive depth by playing made-up packet schedules through it,
+	one get() per 20 ms frame time.  It needs no radio or network.
+
+		JitterBufferTest
+*/
+
+
+#include "RTPJitterBuffer.h"
+
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+using namespace Control;
+
+
+static unsigned gFailures = 0;
+
+static void check(bool ok, const char *what)
+{
+	if (ok) return;
+	cout << "FAILED: " << what << endl;
+	gFailures++;
+}
+
+
+/** A frame that carries its sequence number where concealment leaves it alone. */
+static void makeFrame(unsigned char *frame, uint16_t seq)
+{
+	memset(frame,0xff,RTPGSMFrameBytes);
+	frame[0] = 0xd0;
+	frame[1] = seq>>8;
+	frame[2] = seq&0xff;
+}
+
+static uint16_t frameSeq(const unsigned char *frame)
+{
+	return (frame[1]<<8) | frame[2];
+}
+
+
+/** A packet of the stream and the frame time it arrives in. */
+struct Arrival {
+	unsigned n;				///< frame number in the stream, sets the timestamp
+	unsigned tick;			///< arrival, in frame times
+};
+
+static bool byTick(const Arrival& a, const Arrival& b) { return a.tick < b.tick; }
+
+
+/** Plays a packet schedule through a jitter buffer, one get() per frame time. */
+class Player {
+
+	private:
+
+	RTPJitterBuffer& mJitter;
+	vector<Arrival> mArrivals;
+	uint16_t mFirst;			///< sequence number of frame 0
+	unsigned mNext;				///< next arrival to deliver
+	unsigned mTick;				///< current frame time
+
+	public:
+
+	vector<uint16_t> played;	///< sequence numbers of the good frames played
+
+	Player(RTPJitterBuffer& wJitter, const vector<Arrival>& wArrivals, uint16_t wFirst)
+		:mJitter(wJitter),mArrivals(wArrivals),mFirst(wFirst),mNext(0),mTick(0)
+	{
+		stable_sort(mArrivals.begin(),mArrivals.end(),byTick);
+	}
+
+	/** Run up to, but not including, frame time tick. */
+	void runTo(unsigned tick)
+	{
+		unsigned char frame[RTPGSMFrameBytes];
+		for (; mTick<tick; mTick++) {
+			while (mNext<mArrivals.size() && mArrivals[mNext].tick==mTick) {
+				uint16_t seq = mFirst + mArrivals[mNext].n;
+				makeFrame(frame,seq);
+				mJitter.put(seq, mArrivals[mNext].n*RTPGSMFrameTicks, mTick*RTPGSMFrameTicks, frame);
+				mNext++;
+			}
+			unsigned before = mJitter.played();
+			if (mJitter.get(frame) && mJitter.played()>before) played.push_back(frameSeq(frame));
+		}
+	}
+};
+
+
+/** Packets swapped in flight come out in order, across a sequence wrap. */
+static void testReordering()
+{
+	const uint16_t first = 65530;
+	vector<Arrival> arrivals;
+	for (unsigned n=0; n<20; n++) {
+		Arrival a = { n, n };
+		// Frames 4/5 and 10/11 arrive the wrong way round.
+		if (n==4 || n==10) a.tick = n+1;
+		if (n==5 || n==11) a.tick = n-1;
+		arrivals.push_back(a);
+	}
+
+	RTPJitterBuffer jitter(2);
+	Player player(jitter,arrivals,first);
+	player.runTo(24);
+	const vector<uint16_t>& played = player.played;
+
+	check(played.size()==20, "reordering: every frame played");
+	bool inOrder = true;
+	for (unsigned i=0; i<played.size(); i++) {
+		if (played[i]!=(uint16_t)(first+i)) inOrder = false;
+	}
+	check(inOrder, "reordering: frames played in sequence order");
+	check(jitter.late()==0, "reordering: no frame late");
+	check(jitter.discarded()==0, "reordering: no frame discarded");
+	check(jitter.targetDepth()==2, "reordering: target depth stays at the minimum");
+}
+
+
+/** Lost frames are substituted, faded, and finally muted. */
+static void testLoss()
+{
+	const uint16_t first = 100;
+	vector<Arrival> arrivals;
+	for (unsigned n=0; n<20; n++) {
+		if (n==5 || n==6) continue;
+		Arrival a = { n, n };
+		arrivals.push_back(a);
+	}
+
+	RTPJitterBuffer jitter(2);
+	Player player(jitter,arrivals,first);
+	player.runTo(21);
+	const vector<uint16_t>& played = player.played;
+
+	vector<uint16_t> expected;
+	for (unsigned i=0; i<arrivals.size(); i++) expected.push_back(first+arrivals[i].n);
+	check(played==expected, "loss: every frame that arrived played, in order");
+	check(jitter.concealed()==2, "loss: one substitute per lost frame");
+
+	// Now the stream stops.  The first substitute repeats the last frame,
+	// the next ones are quieter, and after MuteFrames there is nothing.
+	unsigned char last[RTPGSMFrameBytes];
+	makeFrame(last,first+19);
+	unsigned char frame[RTPGSMFrameBytes];
+	unsigned substitutes = 0;
+	check(jitter.get(frame) && memcmp(frame,last,RTPGSMFrameBytes)==0,
+		"loss: first substitute repeats the last good frame");
+	substitutes++;
+	check(jitter.get(frame) && memcmp(frame,last,RTPGSMFrameBytes)!=0
+		&& memcmp(frame,last,5)==0,
+		"loss: second substitute has lower block amplitudes");
+	substitutes++;
+	while (substitutes<RTPJitterBuffer::MuteFrames+4 && jitter.get(frame)) substitutes++;
+	check(substitutes==RTPJitterBuffer::MuteFrames, "loss: muted after MuteFrames substitutes");
+	check(jitter.underruns()>=1, "loss: running dry counts as an underrun");
+}
+
+
+/** The target depth follows the arrival jitter up, and back down. */
+static void testAdaptiveDepth()
+{
+	const uint16_t first = 2000;
+	const unsigned steady = 40, jittery = 120, calm = 200;
+	// Steady, then every odd frame 40 ms late, then steady again.
+	vector<Arrival> arrivals;
+	for (unsigned n=0; n<steady+jittery+calm; n++) {
+		Arrival a = { n, n };
+		if (n>=steady && n<steady+jittery && n%2==1) a.tick = n+2;
+		arrivals.push_back(a);
+	}
+
+	RTPJitterBuffer jitter(1);
+	Player player(jitter,arrivals,first);
+
+	player.runTo(steady);
+	check(jitter.jitterMs()==0, "adaptive: no jitter on a steady stream");
+	check(jitter.targetDepth()==1, "adaptive: minimum depth on a steady stream");
+
+	player.runTo(steady+jittery/2);
+	check(jitter.jitterMs()>20, "adaptive: jitter measured");
+	check(jitter.targetDepth()>=3, "adaptive: target depth grows with the jitter");
+	check(jitter.targetDepth()<=RTPJitterBuffer::MaxDepth, "adaptive: target depth stays bounded");
+	unsigned late = jitter.late();
+
+	player.runTo(steady+jittery);
+	check(jitter.late()==late, "adaptive: no late frames once the depth has grown");
+
+	unsigned discarded = jitter.discarded();
+	player.runTo(steady+jittery+calm);
+	check(jitter.targetDepth()==1, "adaptive: target depth falls back when the jitter stops");
+	check(jitter.depth()<=2, "adaptive: buffer shrinks back to the target");
+	check(jitter.discarded()>discarded, "adaptive: buffer shrinks by dropping frames");
+}
+
+
+int main(int argc, char *argv[])
+{
+	testReordering();
+	testLoss();
+	testAdaptiveDepth();
+
+	if (gFailures) {
+		cout << gFailures << " checks failed" << endl;
+		return 1;
+	}
+	cout << "all checks passed" << endl;
+	return 0;
+}
@@ -0,0 +1,283 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#define LOG_MODULE Control
+
+#include "MediaEngine.h"
+
+#include <sys/epoll.h>
+#include <errno.h>
+#include <string.h>
+
+#include <GSMLogicalChannel.h>
+#include <Logger.h>
+
+
+using namespace std;
+using namespace GSM;
+using namespace Control;
+
+
+
+Control::MediaEngine gMediaEngine;
+
+
+
+MediaSession::MediaSession(TCHFACCHLogicalChannel *wTCH,
+		unsigned short localPort, const char *remoteIP, unsigned short remotePort)
+	:mTCH(wTCH),
+	mSocket(localPort,remoteIP,remotePort),
+	mHeard(false),mClosed(false),
+	mTxSeq(random()),mTxTimestamp(random()),mSSRC(random()),
+	mRxPackets(0),mTxPackets(0),mDropped(0)
+{
+	mSocket.nonblocking();
+	mStart.now();
+}
+
+
+bool MediaSession::receive()
+{
+	char buffer[MAX_UDP_LENGTH];
+	while (true) {
+		int length;
+		try {
+			length = mSocket.read(buffer);
+		}
+		catch (SocketError) {
+			return false;
+		}
+		if (length<0) return true;
+		mRxPackets++;
+		mHeard = true;
+		// RFC 3550 5.1.
+		const unsigned char *packet = (const unsigned char*)buffer;
+		if (length<12 || (packet[0]>>6)!=2 || (packet[1]&0x7f)!=RTPPayloadGSM) {
+			mDropped++;
+			continue;
+		}
+		unsigned header = 12 + 4*(packet[0]&0x0f);
+		if ((packet[0]&0x10) && length>=(int)header+4) {
+			header += 4 + 4*((packet[header+2]<<8) | packet[header+3]);
+		}
+		if (length < (int)(header+RTPGSMFrameBytes)) {
+			mDropped++;
+			continue;
+		}
+		uint16_t seq = (packet[2]<<8) | packet[3];
+		uint32_t timestamp = (packet[4]<<24) | (packet[5]<<16) | (packet[6]<<8) | packet[7];
+		uint32_t arrival = mStart.elapsed() * (RTPGSMFrameTicks/MediaEngine::FrameMs);
+		mJitter.put(seq,timestamp,arrival,packet+header);
+	}
+}
+
+
+void MediaSession::tick()
+{
+	// Downlink, RTP->GSM, one frame per frame time, real or substituted.
+	unsigned char frame[RTPGSMFrameBytes];
+	if (mJitter.get(frame)) mTCH->sendTCH(frame);
+
+	// Uplink, GSM->RTP, whatever the TCH has, but not too far behind.
+	while (mTCH->queueSize()>MediaEngine::MaxUplinkBacklog) delete[] mTCH->recvTCH();
+	while (unsigned char *txFrame = mTCH->recvTCH()) {
+		unsigned char packet[12+RTPGSMFrameBytes];
+		packet[0] = 0x80;
+		packet[1] = RTPPayloadGSM;
+		packet[2] = mTxSeq>>8;
+		packet[3] = mTxSeq;
+		packet[4] = mTxTimestamp>>24;
+		packet[5] = mTxTimestamp>>16;
+		packet[6] = mTxTimestamp>>8;
+		packet[7] = mTxTimestamp;
+		packet[8] = mSSRC>>24;
+		packet[9] = mSSRC>>16;
+		packet[10] = mSSRC>>8;
+		packet[11] = mSSRC;
+		memcpy(packet+12,txFrame,RTPGSMFrameBytes);
+		delete[] txFrame;
+		mTxSeq++;
+		mTxTimestamp += RTPGSMFrameTicks;
+		// Symmetric RTP: once the far end is heard from, answer where it sends from.
+		if (mHeard) mSocket.writeBack((const char*)packet,sizeof(packet));
+		else mSocket.write((const char*)packet,sizeof(packet));
+		mTxPackets++;
+	}
+}
+
+
+ostream& Control::operator<<(ostream& os, const MediaSession& session)
+{
+	const RTPJitterBuffer& jitter = session.jitter();
+	unsigned frames = jitter.played() + jitter.concealed();
+	os << "rx=" << session.rxPackets() << " tx=" << session.txPackets() << " bad=" << session.dropped();
+	os << " jitter=" << (unsigned)(jitter.jitterMs()+0.5F) << "ms";
+	os << " depth=" << jitter.depth() << "/" << jitter.targetDepth();
+	os << " played=" << jitter.played() << " concealed=" << jitter.concealed();
+	if (frames) os << " (" << (100*jitter.concealed()+frames/2)/frames << "%)";
+	os << " late=" << jitter.late() << " discarded=" << jitter.discarded();
+	os << " underruns=" << jitter.underruns();
+	return os;
+}
+
+
+
+
+MediaEngine::MediaEngine()
+	:mEpollFD(-1),mStarted(false)
+{ }
+
+
+void MediaEngine::start()
+{
+	mLock.lock();
+	if (!mStarted) {
+		mEpollFD = epoll_create(64);
+		assert(mEpollFD>=0);
+		mStarted = true;
+		// This thread runs for the life of the process.
+		Thread *thread = new Thread;
+		thread->start((void *(*)(void*))MediaEngineLoopAdapter,this);
+	}
+	mLock.unlock();
+}
+
+
+MediaSession* MediaEngine::add(TCHFACCHLogicalChannel *TCH,
+		unsigned short localPort, const char *remoteIP, unsigned short remotePort)
+{
+	start();
+	MediaSession *session;
+	try {
+		session = new MediaSession(TCH,localPort,remoteIP,remotePort);
+	}
+	catch (SocketError) {
+		LOG(ALARM) << "cannot open RTP port " << localPort;
+		return NULL;
+	}
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = session;
+	mLock.lock();
+	if (epoll_ctl(mEpollFD,EPOLL_CTL_ADD,session->mSocket.fd(),&event)!=0) {
+		mLock.unlock();
+		LOG(ALARM) << "cannot poll RTP port " << localPort << ": " << strerror(errno);
+		delete session;
+		return NULL;
+	}
+	mSessions.push_back(session);
+	mLock.unlock();
+	LOG(INFO) << "RTP " << localPort << " to " << remoteIP << ":" << remotePort << " on TCH " << TCH->ARFCN() << ":" << TCH->TN();
+	return session;
+}
+
+
+void MediaEngine::remove(MediaSession *session)
+{
+	if (!session) return;
+	mLock.lock();
+	LOG(INFO) << "RTP " << *session;
+	epoll_ctl(mEpollFD,EPOLL_CTL_DEL,session->mSocket.fd(),NULL);
+	mSessions.remove(session);
+	// The loop may hold an event for this session, so it does the delete.
+	session->mClosed = true;
+	mClosed.push_back(session);
+	mLock.unlock();
+}
+
+
+size_t MediaEngine::size() const
+{
+	mLock.lock();
+	size_t retVal = mSessions.size();
+	mLock.unlock();
+	return retVal;
+}
+
+
+void MediaEngine::dump(ostream& os) const
+{
+	mLock.lock();
+	list<MediaSession*>::const_iterator sp = mSessions.begin();
+	for (; sp!=mSessions.end(); ++sp) {
+		const TCHFACCHLogicalChannel *TCH = (*sp)->mTCH;
+		os << "TCH " << TCH->ARFCN() << ":" << TCH->TN() << " " << *(*sp) << endl;
+	}
+	mLock.unlock();
+}
+
+
+void MediaEngine::serviceLoop()
+{
+	static const int MaxEvents = 64;
+	struct epoll_event events[MaxEvents];
+	mClockStart.now();
+	mFrames = 0;
+	while (true) {
+		// Wait for packets until the next frame is due.
+		// The epoll wait is in real time, so poll each ms in simulated time.
+		long timeout = (long)(mFrames*FrameMs) - mClockStart.elapsed();
+		if (timeout<0) timeout = 0;
+		if (gSimulatedTime() && timeout>1) timeout = 1;
+		int numEvents = epoll_wait(mEpollFD,events,MaxEvents,timeout);
+		if (numEvents<0 && errno!=EINTR) {
+			LOG(ERROR) << "epoll_wait failed: " << strerror(errno);
+			numEvents = 0;
+		}
+		mLock.lock();
+		for (int i=0; i<numEvents; i++) {
+			MediaSession *session = (MediaSession*)events[i].data.ptr;
+			if (session->mClosed || session->receive()) continue;
+			// Stop polling a broken socket, but leave the session to its call,
+			// which removes it as usual; downlink frames are concealed until then.
+			LOG(ERROR) << "RTP socket failed, no longer reading it: " << *session;
+			epoll_ctl(mEpollFD,EPOLL_CTL_DEL,session->mSocket.fd(),NULL);
+		}
+		long elapsed = mClockStart.elapsed();
+		if (elapsed >= (long)(mFrames*FrameMs)) {
+			list<MediaSession*>::iterator sp = mSessions.begin();
+			for (; sp!=mSessions.end(); ++sp) (*sp)->tick();
+			// Keep the frame clock on absolute times, but don't try to catch up
+			// with a backlog of frames after a stall.
+			mFrames++;
+			if (elapsed > (long)(mFrames*FrameMs + 5*FrameMs)) mFrames = elapsed/FrameMs + 1;
+		}
+		while (!mClosed.empty()) {
+			delete mClosed.front();
+			mClosed.pop_front();
+		}
+		mLock.unlock();
+	}
+}
+
+
+void *Control::MediaEngineLoopAdapter(MediaEngine *engine)
+{
+	engine->serviceLoop();
+	return NULL;
+}
+
+
+// vim: ts=4 sw=4
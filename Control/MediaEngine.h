@@ -0,0 +1,171 @@
+/**@file Speech transfer between RTP and the traffic channels. */
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef MEDIAENGINE_H
+#define MEDIAENGINE_H
+
+#include <stdint.h>
+#include <list>
+#include <ostream>
+
+#include <Threads.h>
+#include <Timeval.h>
+#include <Sockets.h>
+
+#include "RTPJitterBuffer.h"
+
+
+namespace GSM {
+class TCHFACCHLogicalChannel;
+};
+
+
+namespace Control {
+
+
+/** The media state of one call. */
+class MediaSession {
+
+	private:
+
+	GSM::TCHFACCHLogicalChannel *mTCH;
+	UDPSocket mSocket;				///< the RTP socket
+	bool mHeard;					///< true once a packet came in; then reply to its source
+	bool mClosed;					///< set by MediaEngine::remove
+	RTPJitterBuffer mJitter;
+
+	uint16_t mTxSeq;
+	uint32_t mTxTimestamp;
+	uint32_t mSSRC;
+
+	unsigned mRxPackets;			///< RTP packets received
+	unsigned mTxPackets;			///< RTP packets sent
+	unsigned mDropped;				///< RTP packets dropped as malformed
+	Timeval mStart;					///< zero of the arrival clock
+
+	MediaSession(GSM::TCHFACCHLogicalChannel *wTCH,
+		unsigned short localPort, const char *remoteIP, unsigned short remotePort);
+
+	/**
+		Read every waiting RTP packet into the jitter buffer.
+		@return False if the socket failed.
+	*/
+	bool receive();
+
+	/** Move one frame time of speech in both directions. */
+	void tick();
+
+	friend class MediaEngine;
+
+	public:
+
+	unsigned rxPackets() const { return mRxPackets; }
+	unsigned txPackets() const { return mTxPackets; }
+	unsigned dropped() const { return mDropped; }
+	const RTPJitterBuffer& jitter() const { return mJitter; }
+};
+
+
+std::ostream& operator<<(std::ostream&, const MediaSession&);
+
+
+
+/**
+	The media path of every call in the process.
+
+	One thread waits with epoll on the RTP sockets of all calls, putting
+	arriving packets into each call's jitter buffer, and every 20 ms moves
+	one frame from each jitter buffer to its TCH and sends the TCH's uplink
+	frames as RTP.  So a call costs no thread of its own, and the controller
+	thread of a call only has to handle signalling.
+*/
+class MediaEngine {
+
+	private:
+
+	mutable Mutex mLock;
+	std::list<MediaSession*> mSessions;		///< active sessions
+	std::list<MediaSession*> mClosed;		///< removed, deleted by the loop
+	int mEpollFD;
+	bool mStarted;
+	Timeval mClockStart;					///< time of frame 0
+	unsigned long long mFrames;				///< frames done since mClockStart
+
+	public:
+
+	/** Duration of a speech frame, ms. */
+	static const unsigned FrameMs = 20;
+
+	/** Most uplink frames kept waiting on the TCH, to limit latency. */
+	static const unsigned MaxUplinkBacklog = 2;
+
+	MediaEngine();
+
+	/** Start the thread, if it is not running yet. */
+	void start();
+
+	/**
+		Start moving speech for a call.
+		@param TCH The traffic channel.
+		@param localPort The local RTP port.
+		@param remoteIP The remote RTP address.
+		@param remotePort The remote RTP port.
+		@return The new session, or NULL if the RTP socket cannot be opened.
+	*/
+	MediaSession* add(GSM::TCHFACCHLogicalChannel *TCH,
+		unsigned short localPort, const char *remoteIP, unsigned short remotePort);
+
+	/** Stop a session; the TCH is not touched again after this returns. */
+	void remove(MediaSession*);
+
+	/** Number of active sessions. */
+	size_t size() const;
+
+	/** Print the active sessions. */
+	void dump(std::ostream&) const;
+
+	protected:
+
+	/** Wait for packets and run the frame clock, forever. */
+	void serviceLoop();
+
+	friend void *MediaEngineLoopAdapter(MediaEngine*);
+};
+
+
+/** Thread entry point of MediaEngine. */
+void *MediaEngineLoopAdapter(MediaEngine*);
+
+
+};	// namespace Control
+
+
+/** The media engine of the process. */
+extern Control::MediaEngine gMediaEngine;
+
+
+#endif
+// vim: ts=4 sw=4
@@ -24,6 +24,8 @@
 */
 
 
+#define LOG_MODULE Control
+
 #include "Timeval.h"
 
 #include "ControlCommon.h"
@@ -41,6 +43,7 @@ using namespace std;
 #include "SIPUtility.h"
 #include "SIPMessage.h"
 #include "SIPEngine.h"
+#include "SIPRegistrationCache.h"
 using namespace SIP;
 
 
@@ -88,13 +91,14 @@ void Control::IMSIDetachController(const L3IMSIDetachIndication* idi, LogicalCha
 	try { 
 		// FIXME -- Resolve TMSIs to IMSIs.
 		if (idi->mobileIdentity().type()==IMSIType) {
+			gSIPRegistrations.remove(idi->mobileIdentity().digits());
 			SIPEngine engine;
 			engine.User(idi->mobileIdentity().digits());
 			engine.Unregister();
 		}
 	}
 	catch(SIPTimeout) {
-		LOG(ALARM) "SIP registration timed out.  Is Asterisk running?";
+		LOG(ALARM) << "SIP registration timed out.  Is Asterisk running?";
 	}
 	// No reponse required, so just close the channel.
 	DCCH->send(L3ChannelRelease());
@@ -146,21 +150,25 @@ void Control::LocationUpdatingController(const L3LocationUpdatingRequest* lur, S
 	unsigned assignedTMSI = resolveIMSI(sameLAI,mobID,SDCCH);
 	// IMSIAttach set to true if this is a new registration.
 	bool IMSIAttach = (assignedTMSI==0);
+	// A periodic update with a TMSI we know, from our own LAI, that is
+	// still registered with Asterisk, is accepted without a new REGISTER.
+	// The cache renews the registration in the background when it needs it.
+	bool cached = sameLAI && assignedTMSI && gSIPRegistrations.check(mobID.digits(),assignedTMSI);
 	// Try to register the IMSI with Asterisk.
 	// This will be set true if registration succeeded in the SIP world.
-	bool success = false;
-	try {
+	bool success = cached;
+	if (!cached) try {
 		SIPEngine engine;
 		engine.User(mobID.digits());
 		LOG(DEBUG) << "waiting for registration";
 		success = engine.Register(); 
 	}
 	catch(SIPTimeout) {
-		LOG(ALARM) "SIP registration timed out.  Is Asterisk running?";
+		LOG(ALARM) << "SIP registration timed out.  Is Asterisk running?";
 		// Reject with a "network failure" cause code, 0x11.
 		SDCCH->send(L3LocationUpdatingReject(0x11));
 		// HACK -- wait long enough for a response
-		sleep(4);
+		gSleepMicroseconds(4000000);
 		// Release the channel and return.
 		SDCCH->send(L3ChannelRelease());
 		return;
@@ -194,8 +202,13 @@ void Control::LocationUpdatingController(const L3LocationUpdatingRequest* lur, S
 	// Otherwise, we are here because of open registration.
 	// Either way, we're going to register a phone if we arrive here.
 
-	if (success) LOG(INFO) << "registration SUCCESS: " << mobID;
-	else LOG(INFO) << "registration ALLOWED: " << mobID;
+	if (cached) {
+		LOG(INFO) << "registration CACHED: " << mobID;
+	} else if (success) {
+		LOG(INFO) << "registration SUCCESS: " << mobID;
+	} else {
+		LOG(INFO) << "registration ALLOWED: " << mobID;
+	}
 
 
 	// Send the "short name".
@@ -205,7 +218,8 @@ void Control::LocationUpdatingController(const L3LocationUpdatingRequest* lur, S
 	if (assignedTMSI) {
 		SDCCH->send(L3LocationUpdatingAccept(gBTS.LAI()));
 	} else {
-		SDCCH->send(L3LocationUpdatingAccept(gBTS.LAI(),gTMSITable.assign(mobID.digits())));
+		assignedTMSI = gTMSITable.assign(mobID.digits());
+		SDCCH->send(L3LocationUpdatingAccept(gBTS.LAI(),assignedTMSI));
 		L3Frame* resp = SDCCH->recv(1000); // wait for the MM TMSI REALLOCATION COMPLETE message
 		if (!resp) {
 			LOG(INFO) << "LocationUpdatingController no response to TMSI assignment";
@@ -214,6 +228,7 @@ void Control::LocationUpdatingController(const L3LocationUpdatingRequest* lur, S
 		}
 		delete resp;
 	}
+	if (success && !cached) gSIPRegistrations.add(mobID.digits(),assignedTMSI);
 
 	// If this is an IMSI attach, send a welcome message.
 	if (IMSIAttach) {
@@ -229,7 +244,7 @@ void Control::LocationUpdatingController(const L3LocationUpdatingRequest* lur, S
 	GSM::RRLP::collectMSInfo(mobID, SDCCH, false/* no RRLP */);
 
 	// HACK -- wait long enough for a response
-	sleep(4);
+	gSleepMicroseconds(4000000);
 
 	// Release the channel and return.
 	SDCCH->send(L3ChannelRelease());
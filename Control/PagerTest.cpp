@@ -22,46 +22,180 @@
 
 
 /*
-	This test sets of a pager and sends paging messages
-	on a CCCH.
-	It does not require a radio.
+	Check how Pager::pagingFrame packs the mobiles of a paging group into
+	paging requests of type 1, 2 and 3, GSM 04.08 9.1.22-9.1.24, by
+	decoding the frames it makes for one CCCH.  It needs no radio.
+	It reads the example configuration from the source tree.
+
+		PagerTest
 */
 
+#define LOG_MODULE Control
+
 #include "ControlCommon.h"
-#include "GSML1FEC.h"
-#include "TRXManager.h"
 #include "GSMLogicalChannel.h"
+#include "GSML3RRMessages.h"
 #include "GSMConfig.h"
 #include "SIPInterface.h"
 
+#include <stdio.h>
+#include <iostream>
+
 
 using namespace std;
 using namespace GSM;
-using namespace SIP;
 using namespace Control;
 
 
+ConfigurationTable gConfig(CONFIG_FILE);
+SIP::SIPInterface gSIPInterface;
+GSMConfig gBTS;
 
-GSMConfig gBTS(0,0,GSM850,L3LocationAreaIdentity("666","333",666),1234,"test");
-SIPInterface gSIPInterface(SIP_UDP_PORT, "0.0.0.0", 5060);
 
-int main(int argc, char *argv[])
+static unsigned gFailures = 0;
+
+static void check(bool ok, const char *what)
 {
-	CCCHLogicalChannel CCCH(gCCCH_0Mapping);
-	TransceiverManager TRX(1,"localhost",5700);
+	if (ok) return;
+	cout << "FAILED: " << what << endl;
+	gFailures++;
+}
 
-	gBTS.addPCH(&CCCH);
-	CCCH.downstream(TRX.ARFCN(0));
+
+/**
+	A made-up IMSI.  They all end in 000, so they are all in
+	paging group 0 however many groups there are.
+*/
+static string IMSI(unsigned n)
+{
+	char digits[16];
+	sprintf(digits,"001010000%03u000",n);
+	return digits;
+}
+
+
+/** Page a mobile by IMSI; the pager pages with its TMSI if it has one. */
+static void page(Pager& pager, const string& IMSI)
+{
+	TransactionEntry transaction;
+	pager.addID(L3MobileIdentity(IMSI.c_str()),AnyDCCHType,transaction,60000);
+}
+
+
+/** The mobile IDs in a paging request, in order. */
+static vector<L3MobileIdentity> pagedIDs(const L3Frame& frame)
+{
+	// Skip indicator and PD, message type, then page mode and channels needed.
+	size_t rp = 24;
+	vector<L3MobileIdentity> IDs;
+	switch (frame.MTI()) {
+		case L3RRMessage::PagingRequestType1: {
+			L3MobileIdentity ID;
+			ID.parseLV(frame,rp);
+			IDs.push_back(ID);
+			if (ID.parseTLV(0x17,frame,rp)) IDs.push_back(ID);
+			break;
+		}
+		case L3RRMessage::PagingRequestType2: {
+			for (unsigned i=0; i<2; i++, rp+=32) IDs.push_back(L3MobileIdentity(frame.peekField(rp,32)));
+			L3MobileIdentity ID;
+			if (ID.parseTLV(0x17,frame,rp)) IDs.push_back(ID);
+			break;
+		}
+		case L3RRMessage::PagingRequestType3:
+			for (unsigned i=0; i<4; i++, rp+=32) IDs.push_back(L3MobileIdentity(frame.peekField(rp,32)));
+			break;
+	}
+	return IDs;
+}
+
+
+/**
+	Page the mobiles, the ones marked with a TMSI first given one,
+	take one frame, and check its type and the IDs in it.
+	@param spec One letter per mobile, in paging order: T for one with a TMSI, I for one without.
+	@param type The expected message type.
+	@param expected The indexes in spec of the mobiles expected in the frame, in order.
+*/
+static void checkPacking(const char* what, const CCCHLogicalChannel* CCCH,
+	const char* spec, unsigned type, const char* expected)
+{
+	static unsigned next = 0;
 	Pager pager;
+	pager.start();
+	vector<L3MobileIdentity> IDs;
+	for (const char* sp=spec; *sp; sp++) {
+		string thisIMSI = IMSI(next++);
+		if (*sp=='T') IDs.push_back(L3MobileIdentity(gTMSITable.assign(thisIMSI.c_str())));
+		else IDs.push_back(L3MobileIdentity(thisIMSI.c_str()));
+		page(pager,thisIMSI);
+	}
+
+	L3Frame* frame = pager.pagingFrame(CCCH,Time(0));
+	check(frame!=NULL, what);
+	if (!frame) return;
+	check(frame->MTI()==type, what);
+	vector<L3MobileIdentity> paged = pagedIDs(*frame);
+	bool same = (paged.size()==strlen(expected));
+	for (unsigned i=0; same && i<paged.size(); i++) {
+		same = (paged[i]==IDs[expected[i]-'0']);
+	}
+	check(same, what);
+	delete frame;
+}
+
 
-	TRX.start();
-	CCCH.open();
+/** A mobile paged in one block goes to the back of its group's line. */
+static void testRoundRobin(const CCCHLogicalChannel* CCCH)
+{
+	Pager pager;
 	pager.start();
+	vector<unsigned> TMSIs;
+	for (unsigned n=0; n<5; n++) {
+		string thisIMSI = IMSI(900+n);
+		TMSIs.push_back(gTMSITable.assign(thisIMSI.c_str()));
+		page(pager,thisIMSI);
+	}
+	L3Frame* first = pager.pagingFrame(CCCH,Time(0));
+	L3Frame* second = pager.pagingFrame(CCCH,Time(0));
+	check(first && second, "round robin: two frames");
+	if (!first || !second) return;
+	vector<L3MobileIdentity> paged = pagedIDs(*second);
+	check(second->MTI()==L3RRMessage::PagingRequestType3 && paged.size()==4,
+		"round robin: second frame is type 3");
+	check(paged.size()==4 && paged[0]==L3MobileIdentity(TMSIs[4]),
+		"round robin: the mobile left out of the first frame leads the second");
+	delete first;
+	delete second;
+}
+
+
+int main(int argc, char *argv[])
+{
+	gSetLogLevel("ERROR");
+	CCCHLogicalChannel CCCH(gCCCH_0Mapping);
+	gBTS.addPCH(&CCCH);
 
-	while (1) {
-		pager.addID(L3MobileIdentity(random()),GSM::AnyDCCHType);
-		pager.addID(L3MobileIdentity(random()),GSM::AnyDCCHType);
-		pager.addID(L3MobileIdentity("123456789012345"),GSM::AnyDCCHType);
-		sleep(random() % 2);
+	checkPacking("four TMSIs go in one type 3",
+		&CCCH, "TTTT", L3RRMessage::PagingRequestType3, "0123");
+	checkPacking("two TMSIs and an IMSI go in one type 2, the IMSI last",
+		&CCCH, "TIT", L3RRMessage::PagingRequestType2, "021");
+	checkPacking("the mobile at the front is paged, even if four TMSIs follow it",
+		&CCCH, "ITTTT", L3RRMessage::PagingRequestType2, "120");
+	checkPacking("three TMSIs go in one type 2",
+		&CCCH, "TTT", L3RRMessage::PagingRequestType2, "012");
+	checkPacking("one TMSI and an IMSI go in a type 1",
+		&CCCH, "TI", L3RRMessage::PagingRequestType1, "01");
+	checkPacking("two IMSIs go in a type 1",
+		&CCCH, "II", L3RRMessage::PagingRequestType1, "01");
+	checkPacking("a single mobile goes in a type 1",
+		&CCCH, "T", L3RRMessage::PagingRequestType1, "0");
+	testRoundRobin(&CCCH);
+
+	if (gFailures) {
+		cout << gFailures << " checks failed" << endl;
+		return 1;
 	}
+	cout << "all checks passed" << endl;
+	return 0;
 }
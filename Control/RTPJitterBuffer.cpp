@@ -0,0 +1,184 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#define LOG_MODULE Control
+
+#include "RTPJitterBuffer.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include <GSMTransfer.h>
+#include <Logger.h>
+
+
+using namespace GSM;
+using namespace Control;
+
+
+
+RTPJitterBuffer::RTPJitterBuffer(unsigned wMinDepth)
+	:mMinDepth(wMinDepth),
+	mHaveTransit(false),mTransit(0),mJitter(0),
+	mHaveLastGood(false),mLostRun(0),
+	mPlayed(0),mConcealed(0),mLate(0),mDiscarded(0),mUnderruns(0)
+{
+	assert(mMinDepth>0 && mMinDepth<=MaxDepth);
+	reset();
+}
+
+
+void RTPJitterBuffer::reset()
+{
+	for (unsigned i=0; i<Slots; i++) mFull[i]=false;
+	mCount = 0;
+	mPlaying = false;
+	mStarted = false;
+	mNextSeq = 0;
+}
+
+
+unsigned RTPJitterBuffer::targetDepth() const
+{
+	// One frame, plus three mean deviations of the arrival time.
+	unsigned depth = 1 + (3*(mJitter>>4) + RTPGSMFrameTicks-1) / RTPGSMFrameTicks;
+	if (depth<mMinDepth) return mMinDepth;
+	if (depth>MaxDepth) return MaxDepth;
+	return depth;
+}
+
+
+bool RTPJitterBuffer::put(uint16_t seq, uint32_t timestamp, uint32_t arrival, const unsigned char *frame)
+{
+	// Interarrival jitter, RFC 3550 A.8.
+	int32_t transit = (int32_t)(arrival - timestamp);
+	if (mHaveTransit) {
+		int32_t d = transit - mTransit;
+		if (d<0) d = -d;
+		// A step of a second or more is a new timestamp base, not jitter.
+		if (d < (int32_t)(50*RTPGSMFrameTicks)) {
+			mJitter = (uint32_t)((int32_t)mJitter + d - (int32_t)((mJitter+8)>>4));
+		}
+	}
+	mTransit = transit;
+	mHaveTransit = true;
+
+	// Until playout first starts, the earliest frame sets the playout point.
+	int16_t ahead = (int16_t)(seq - mNextSeq);
+	if (!mStarted && (mCount==0 || (ahead<0 && -ahead<(int)Slots))) {
+		mNextSeq = seq;
+		ahead = 0;
+	}
+	// Too late to play.
+	if (ahead<0) {
+		mLate++;
+		return false;
+	}
+	// So far ahead that the stream must have jumped; start over from here.
+	if (ahead>=(int)Slots) {
+		LOG(DEBUG) << "RTP sequence jump from " << mNextSeq << " to " << seq;
+		reset();
+		mNextSeq = seq;
+	}
+	unsigned slot = seq % Slots;
+	if (mFull[slot]) {
+		mDiscarded++;
+		return false;
+	}
+	memcpy(mFrames[slot],frame,RTPGSMFrameBytes);
+	mFull[slot] = true;
+	mCount++;
+	return true;
+}
+
+
+bool RTPJitterBuffer::get(unsigned char *frame)
+{
+	unsigned target = targetDepth();
+	if (!mPlaying) {
+		if (mCount==0 || mCount<target) return conceal(frame);
+		// Skip the gap left by an underrun, which was already concealed.
+		while (!mFull[mNextSeq % Slots]) mNextSeq++;
+		mPlaying = true;
+		mStarted = true;
+	}
+
+	// More than a frame over the target?  Drop the oldest to cut the delay.
+	if (mCount > target+1) {
+		unsigned slot = mNextSeq % Slots;
+		if (mFull[slot]) {
+			mFull[slot] = false;
+			mCount--;
+			mDiscarded++;
+		}
+		mNextSeq++;
+	}
+
+	unsigned slot = mNextSeq % Slots;
+	mNextSeq++;
+	if (!mFull[slot]) {
+		// Ran dry?  Then fill up to the target again before playing.
+		if (mCount==0) {
+			mPlaying = false;
+			mUnderruns++;
+		}
+		return conceal(frame);
+	}
+	memcpy(frame,mFrames[slot],RTPGSMFrameBytes);
+	mFull[slot] = false;
+	mCount--;
+	memcpy(mLastGood,frame,RTPGSMFrameBytes);
+	mHaveLastGood = true;
+	mLostRun = 0;
+	mPlayed++;
+	return true;
+}
+
+
+bool RTPJitterBuffer::conceal(unsigned char *frame)
+{
+	// After MuteFrames, send nothing, so the handset mutes on bad frames.
+	if (!mHaveLastGood || mLostRun>=MuteFrames) return false;
+	mLostRun++;
+	// GSM 06.11 5.1: repeat the last good frame for the first loss, and
+	// lower its level for each one after that.  The block amplitude xmaxc
+	// is logarithmic, 8 steps per 6 dB, so 4 steps is about 3 dB.
+	if (mLostRun>1) {
+		VocoderFrame substitute(mLastGood);
+		for (unsigned k=0; k<4; k++) {
+			// xmaxc of subframe k, RFC 3551 4.5.8.
+			size_t xmaxcIndex = 40 + 56*k + 11;
+			unsigned xmaxc = substitute.peekField(xmaxcIndex,6);
+			substitute.fillField(xmaxcIndex, xmaxc>4 ? xmaxc-4 : 0, 6);
+		}
+		substitute.pack(mLastGood);
+	}
+	memcpy(frame,mLastGood,RTPGSMFrameBytes);
+	mConcealed++;
+	return true;
+}
+
+
+// vim: ts=4 sw=4
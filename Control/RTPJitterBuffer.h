@@ -0,0 +1,149 @@
+/**@file Adaptive jitter buffer for RTP GSM speech. */
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef RTPJITTERBUFFER_H
+#define RTPJITTERBUFFER_H
+
+#include <stdint.h>
+
+
+namespace Control {
+
+
+/** RTP payload type of GSM 06.10 full rate speech, RFC 3551. */
+const unsigned RTPPayloadGSM = 3;
+
+/** Size of an RTP GSM 06.10 frame, RFC 3551 4.5.8. */
+const unsigned RTPGSMFrameBytes = 33;
+
+/** RTP timestamp units per speech frame, 8 kHz * 20 ms. */
+const unsigned RTPGSMFrameTicks = 160;
+
+
+
+/**
+	An adaptive jitter buffer for the GSM frames of one RTP stream.
+
+	Frames are keyed on sequence number.  The interarrival jitter is
+	measured from the RTP timestamps as in RFC 3550 6.4.1, and the target
+	depth follows it: playout (re)starts once the buffer holds the target
+	depth, and a buffer that runs more than a frame over the target drops
+	its oldest frame.  Missing frames are substituted and muted as in
+	GSM 06.11: the last good frame is repeated, with its block amplitudes
+	lowered on each further loss, until the speech is muted after 320 ms.
+*/
+class RTPJitterBuffer {
+
+	public:
+
+	static const unsigned Slots = 16;		///< a power of two, 320 ms of speech
+	static const unsigned MaxDepth = Slots/2;	///< largest target depth, frames
+	static const unsigned MuteFrames = 16;	///< consecutive substitutions before muting, GSM 06.11
+
+	private:
+
+	unsigned char mFrames[Slots][RTPGSMFrameBytes];
+	bool mFull[Slots];
+	unsigned mCount;			///< frames in the buffer
+	unsigned mMinDepth;			///< smallest target depth, frames
+	bool mPlaying;				///< true while playing, false while filling
+	bool mStarted;				///< true once playout first started
+	uint16_t mNextSeq;			///< sequence number of the next frame to play
+
+	/**@name Jitter estimate, RFC 3550 A.8. */
+	//@{
+	bool mHaveTransit;
+	int32_t mTransit;			///< arrival minus timestamp of the last packet, RTP ticks
+	uint32_t mJitter;			///< interarrival jitter, RTP ticks * 16
+	//@}
+
+	/**@name Concealment state. */
+	//@{
+	unsigned char mLastGood[RTPGSMFrameBytes];
+	bool mHaveLastGood;
+	unsigned mLostRun;			///< consecutive frames substituted
+	//@}
+
+	/**@name Statistics. */
+	//@{
+	unsigned mPlayed;			///< good frames played
+	unsigned mConcealed;		///< frames substituted or muted
+	unsigned mLate;				///< frames that arrived after their playout time
+	unsigned mDiscarded;		///< frames dropped as duplicates or to shrink the buffer
+	unsigned mUnderruns;		///< times playout ran dry and restarted
+	//@}
+
+	/** Make the substitute for a lost frame in mLastGood and copy it out. */
+	bool conceal(unsigned char *frame);
+
+	public:
+
+	/** @param wMinDepth Smallest target depth, in frames. */
+	RTPJitterBuffer(unsigned wMinDepth=1);
+
+	/** Empty the buffer, keeping the jitter estimate and statistics. */
+	void reset();
+
+	/**
+		Add a frame.
+		@param seq The RTP sequence number.
+		@param timestamp The RTP timestamp.
+		@param arrival The arrival time, in RTP ticks on any local clock.
+		@param frame RTPGSMFrameBytes of speech.
+		@return False if the frame was too late, or a duplicate.
+	*/
+	bool put(uint16_t seq, uint32_t timestamp, uint32_t arrival, const unsigned char *frame);
+
+	/**
+		Take the frame for the next 20 ms, substituting for a lost one.
+		@param frame A place for RTPGSMFrameBytes of speech.
+		@return False if there is nothing to play, not even a substitute.
+	*/
+	bool get(unsigned char *frame);
+
+	/** Frames in the buffer. */
+	unsigned depth() const { return mCount; }
+
+	/** The depth that playout aims for now, from the jitter estimate. */
+	unsigned targetDepth() const;
+
+	/** Interarrival jitter, in ms. */
+	float jitterMs() const { return mJitter / (16.0F * RTPGSMFrameTicks / 20.0F); }
+
+	unsigned played() const { return mPlayed; }
+	unsigned concealed() const { return mConcealed; }
+	unsigned late() const { return mLate; }
+	unsigned discarded() const { return mDiscarded; }
+	unsigned underruns() const { return mUnderruns; }
+};
+
+
+
+};	// namespace Control
+
+
+#endif
+// vim: ts=4 sw=4
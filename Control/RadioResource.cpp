@@ -27,6 +27,8 @@
 
 
 
+#define LOG_MODULE Control
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <list>
@@ -161,7 +163,7 @@ void Control::AccessGrantResponder(
 			const L3ImmediateAssignmentReject reject(L3RequestReference(RA,when),waitTime);
 			LOG(DEBUG) << "AccessGrantResponder: LUR rejection, sending " << reject;
 			if (AGCH->load()<gConfig.getNum("GSM.AGCHMaxQueue")) AGCH->send(reject);
-			else LOG(NOTICE) "AccessGrantResponder: AGCH congestion";
+			else LOG(NOTICE) << "AccessGrantResponder: AGCH congestion";
 			return;
 		}
 	}
@@ -190,7 +192,7 @@ void Control::AccessGrantResponder(
 		const L3ImmediateAssignmentReject reject(L3RequestReference(RA,when),waitTime);
 		LOG(DEBUG) << "rejection, sending " << reject;
 		if (AGCH->load()<gConfig.getNum("GSM.AGCHMaxQueue")) AGCH->send(reject);
-		else LOG(NOTICE) "AccessGrantResponder: AGCH congestion";
+		else LOG(NOTICE) << "AccessGrantResponder: AGCH congestion";
 		return;
 	}
 
@@ -227,8 +229,8 @@ void Control::PagingResponseHandler(const L3PagingResponse* resp, LogicalChannel
 	// If we got a TMSI, find the IMSI.
 	L3MobileIdentity mobileID = resp->mobileIdentity();
 	if (mobileID.type()==TMSIType) {
-		const char *IMSI = gTMSITable.find(mobileID.TMSI());
-		if (IMSI) mobileID = L3MobileIdentity(IMSI);
+		string IMSI;
+		if (gTMSITable.find(mobileID.TMSI(),IMSI)) mobileID = L3MobileIdentity(IMSI.c_str());
 		else {
 			// Don't try too hard to resolve.
 			// The handset is supposed to respond with the same ID type as in the request.
@@ -248,9 +250,9 @@ void Control::PagingResponseHandler(const L3PagingResponse* resp, LogicalChannel
 	// erased before this handler was called.  That's too bad.
 	// HACK -- We also flush stray transactions until we find what we 
 	// are looking for.
-	TransactionEntry transaction;
 	while (true) {
-		if (!gTransactionTable.find(mobileID,transaction)) {
+		TransactionRef transaction = gTransactionTable.find(mobileID);
+		if (!transaction) {
 			LOG(WARN) << "Paging Reponse with no transaction record for " << mobileID;
 			// Cause 0x41 means "call already cleared".
 			DCCH->send(L3ChannelRelease(0x41));
@@ -258,21 +260,21 @@ void Control::PagingResponseHandler(const L3PagingResponse* resp, LogicalChannel
 		}
 		// We are looking for a mobile-terminated transaction.
 		// The transaction controller will take it from here.
-		switch (transaction.service().type()) {
+		switch (transaction->service().type()) {
 			case L3CMServiceType::MobileTerminatedCall:
-				MTCStarter(transaction, DCCH);
+				MTCStarter(*transaction, DCCH);
 				return;
 			case L3CMServiceType::TestCall:
-				TestCall(transaction, DCCH);
+				TestCall(*transaction, DCCH);
 				return;
 			case L3CMServiceType::MobileTerminatedShortMessage:
-				MTSMSController(transaction, DCCH);
+				MTSMSController(*transaction, DCCH);
 				return;
 			default:
 				// Flush stray MOC entries.
 				// There should not be any, but...
-				LOG(WARN) << "flushing stray " << transaction.service().type() << " transaction entry";
-				gTransactionTable.remove(transaction.ID());
+				LOG(WARN) << "flushing stray " << transaction->service().type() << " transaction entry";
+				gTransactionTable.remove(transaction->ID());
 				continue;
 		}
 	}
@@ -293,24 +295,24 @@ void Control::AssignmentCompleteHandler(const L3AssignmentComplete *confirm, TCH
 	LOG(DEBUG) << *confirm;
 
 	// Check the transaction table to know what to do next.
-	TransactionEntry transaction;
-	if (!gTransactionTable.find(TCH->transactionID(),transaction)) {
+	TransactionRef transaction = gTransactionTable.find(TCH->transactionID());
+	if (!transaction) {
 		LOG(WARN) << "Assignment Complete with no transaction record";
 		throw UnexpectedMessage();
 	}
-	LOG(INFO) << "service="<<transaction.service().type();
+	LOG(INFO) << "service="<<transaction->service().type();
 
 	// These "controller" functions don't return until the call is cleared.
-	switch (transaction.service().type()) {
+	switch (transaction->service().type()) {
 		case L3CMServiceType::MobileOriginatedCall:
-			MOCController(transaction,TCH);
+			MOCController(*transaction,TCH);
 			break;
 		case L3CMServiceType::MobileTerminatedCall:
-			MTCController(transaction,TCH);
+			MTCController(*transaction,TCH);
 			break;
 		default:
-			LOG(WARN) << "unsupported service " << transaction.service();
-			throw UnsupportedMessage(transaction.ID());
+			LOG(WARN) << "unsupported service " << transaction->service();
+			throw UnsupportedMessage(transaction->ID());
 	}
 	// If we got here, the call is cleared.
 }
@@ -322,31 +324,101 @@ void Control::AssignmentCompleteHandler(const L3AssignmentComplete *confirm, TCH
 
 
 
+void Pager::start()
+{
+	// GSM 05.02 6.5.2.
+	// There is one CCCH timeslot, so CCCH_GROUP is always 0 and
+	// the paging groups are just the paging blocks of the paging cycle.
+	L3ControlChannelDescription CCD;
+	unsigned blocks = (CCD.CCCH_CONF()==1 ? 3 : 9) - CCD.BS_AG_BLKS_RES();
+	if (gBTS.numPCH()!=blocks) {
+		LOG(WARN) << gBTS.numPCH() << " PCHs for " << blocks << " paging blocks per multiframe";
+	}
+	mLock.lock();
+	mPCHs.clear();
+	for (unsigned i=0; i<gBTS.numPCH(); i++) mPCHs.push_back(gBTS.getPCH(i));
+	mMultiframes = CCD.BS_PA_MFRMS();
+	unsigned numGroups = mPCHs.size() * mMultiframes;
+	if (numGroups==0) numGroups = 1;
+	// Move anything already waiting into its new group.
+	PagingEntryList pending;
+	for (unsigned g=0; g<mGroups.size(); g++) pending.splice(pending.end(),mGroups[g]);
+	mGroups.assign(numGroups,PagingEntryList());
+	while (!pending.empty()) {
+		PagingEntryList& list = mGroups[pagingGroupLocked(pending.front().ID())];
+		list.splice(list.end(),pending,pending.begin());
+	}
+	LOG(INFO) << mPCHs.size() << " PCHs, " << mMultiframes << " multiframes, " << numGroups << " paging groups";
+	mLock.unlock();
+}
+
+
+
+unsigned Pager::pagingGroupLocked(const L3MobileIdentity& ID) const
+{
+	// GSM 05.02 6.5.2: PAGING_GROUP = (IMSI mod 1000) mod N.
+	string IMSI;
+	if (ID.type()==IMSIType) IMSI = ID.digits();
+	else if (ID.type()==TMSIType) gTMSITable.find(ID.TMSI(),IMSI);
+	if (IMSI.empty()) {
+		LOG(WARN) << "no IMSI for " << ID << ", using paging group 0";
+		return 0;
+	}
+	size_t len = IMSI.size();
+	unsigned lastDigits = atoi(IMSI.c_str() + (len>3 ? len-3 : 0));
+	return lastDigits % mGroups.size();
+}
+
+
+unsigned Pager::pagingGroup(const L3MobileIdentity& ID) const
+{
+	mLock.lock();
+	unsigned retVal = pagingGroupLocked(ID);
+	mLock.unlock();
+	return retVal;
+}
+
+
+
 void Pager::addID(const L3MobileIdentity& newID, ChannelType chanType,
 		TransactionEntry& transaction, unsigned wLife)
 {
-	transaction.Q931State(TransactionEntry::Paging);
-	transaction.T3113().set(wLife);
-	gTransactionTable.update(transaction);
-	// Add a mobile ID to the paging list for a given lifetime.
+	transaction.startPaging(wLife);
+	addEntry(newID,chanType,transaction.ID(),wLife);
+}
+
+
+bool Pager::repageID(const L3MobileIdentity& newID, ChannelType chanType,
+		TransactionEntry& transaction, unsigned wLife)
+{
+	if (!transaction.startPaging(wLife,true)) return false;
+	addEntry(newID,chanType,transaction.ID(),wLife);
+	return true;
+}
+
+
+void Pager::addEntry(const L3MobileIdentity& newID, ChannelType chanType,
+		unsigned transactionID, unsigned wLife)
+{
+	// Page with the TMSI if the mobile has one, GSM 04.08 3.3.2.1.
+	unsigned TMSI = 0;
+	if (newID.type()==IMSIType) TMSI = gTMSITable.find(newID.digits());
+	// Add a mobile ID to the paging list of its group for a given lifetime.
 	mLock.lock();
+	PagingEntryList& list = mGroups[pagingGroupLocked(newID)];
 	// If this ID is already in the list, just reset its timer.
-	// Uhg, another linear time search.
-	// This would be faster if the paging list were ordered by ID.
-	// But the list should usually be short, so it may not be worth the effort.
-	for (PagingEntryList::iterator lp = mPageIDs.begin(); lp != mPageIDs.end(); ++lp) {
+	for (PagingEntryList::iterator lp = list.begin(); lp != list.end(); ++lp) {
 		if (lp->ID()==newID) {
 			LOG(DEBUG) << newID << " already in table";
 			lp->renew(wLife);
-			mPageSignal.signal();
 			mLock.unlock();
 			return;
 		}
 	}
 	// If this ID is new, put it in the list.
-	mPageIDs.push_back(PagingEntry(newID,chanType,transaction.ID(),wLife));
+	list.push_back(PagingEntry(newID,TMSI,chanType,transactionID,wLife));
+	mSize++;
 	LOG(INFO) << newID << " added to table";
-	mPageSignal.signal();
 	mLock.unlock();
 }
 
@@ -357,10 +429,12 @@ unsigned Pager::removeID(const L3MobileIdentity& delID)
 	unsigned retVal = 0;
 	LOG(INFO) << delID;
 	mLock.lock();
-	for (PagingEntryList::iterator lp = mPageIDs.begin(); lp != mPageIDs.end(); ++lp) {
+	PagingEntryList& list = mGroups[pagingGroupLocked(delID)];
+	for (PagingEntryList::iterator lp = list.begin(); lp != list.end(); ++lp) {
 		if (lp->ID()==delID) {
 			retVal = lp->transactionID();
-			mPageIDs.erase(lp);
+			list.erase(lp);
+			mSize--;
 			break;
 		}
 	}
@@ -370,110 +444,131 @@ unsigned Pager::removeID(const L3MobileIdentity& delID)
 
 
 
-unsigned Pager::pageAll()
+void Pager::expire(PagingEntryList& list)
 {
-	// Traverse the full list and page all IDs.
-	// Remove expired IDs.
-	// Return the number of IDs paged.
-	// This is a linear time operation.
-
-	mLock.lock();
-
-	// Clear expired entries.
-	PagingEntryList::iterator lp = mPageIDs.begin();
-	while (lp != mPageIDs.end()) {
+	PagingEntryList::iterator lp = list.begin();
+	while (lp != list.end()) {
 		if (!lp->expired()) ++lp;
 		else {
 			// DO NOT remove the transaction entry here.
 			// It may be in use in an active call.
 			LOG(INFO) << "erasing " << lp->ID();
-			lp=mPageIDs.erase(lp);
+			lp = list.erase(lp);
+			mSize--;
 		}
 	}
+}
 
-	LOG(INFO) << "paging " << mPageIDs.size() << " mobile(s)";
-
-	// Page remaining entries, two at a time if possible.
-	// These PCH send operations are non-blocking.
-	lp = mPageIDs.begin();
-	while (lp != mPageIDs.end()) {
-		// FIXME -- This completely ignores the paging groups.
-		// HACK -- So we send every page twice.
-		// That will probably mean a different Pager for each subchannel.
-		// See GSM 04.08 10.5.2.11 and GSM 05.02 6.5.2.
-		const L3MobileIdentity& id1 = lp->ID();
-		ChannelType type1 = lp->type();
-		++lp;
-		if (lp==mPageIDs.end()) {
-			// Just one ID left?
-			LOG(DEBUG) << "paging " << id1;
-			gBTS.getPCH(0)->send(L3PagingRequestType1(id1,type1));
-			gBTS.getPCH(0)->send(L3PagingRequestType1(id1,type1));
-			break;
-		}
-		// Page by pairs when possible.
-		const L3MobileIdentity& id2 = lp->ID();
-		ChannelType type2 = lp->type();
-		++lp;
-		LOG(DEBUG) << "paging " << id1 << " and " << id2;
-		gBTS.getPCH(0)->send(L3PagingRequestType1(id1,type1,id2,type2));
-		gBTS.getPCH(0)->send(L3PagingRequestType1(id1,type1,id2,type2));
-	}
-	
-	mLock.unlock();
 
-	return mPageIDs.size();
-}
 
-size_t Pager::pagingEntryListSize()
+L3Frame* Pager::pagingFrame(const CCCHLogicalChannel* CCCH, const GSM::Time& when)
 {
-	return mPageIDs.size();
-}
+	mLock.lock();
 
-void Pager::start()
-{
-	if (mRunning) return;
-	mRunning=true;
-	mPagingThread.start((void* (*)(void*))PagerServiceLoopAdapter, (void*)this);
-}
+	// Find the paging group of this block, GSM 05.02 6.5.2.
+	unsigned block = 0;
+	while (block<mPCHs.size() && mPCHs[block]!=CCCH) block++;
+	if (block==mPCHs.size() || mSize==0) {
+		mLock.unlock();
+		return NULL;
+	}
+	unsigned group = ((when.FN()/51) % mMultiframes) * mPCHs.size() + block;
+	PagingEntryList& list = mGroups[group];
+	expire(list);
+	if (list.empty()) {
+		mLock.unlock();
+		return NULL;
+	}
 
+	// Look over the front of the list for TMSIs to pack.
+	// The front entry is always paged, so nobody waits more than one pass.
+	PagingEntryList::iterator TMSIs[4];
+	PagingEntryList::iterator others[2];
+	unsigned numTMSIs = 0;
+	unsigned numOthers = 0;
+	PagingEntryList::iterator lp = list.begin();
+	for (unsigned scanned=0; scanned<8 && lp!=list.end(); scanned++, ++lp) {
+		if (lp->TMSI()) {
+			if (numTMSIs<4) TMSIs[numTMSIs++] = lp;
+		} else {
+			if (numOthers<2) others[numOthers++] = lp;
+		}
+	}
+	bool frontIsTMSI = list.front().TMSI()!=0;
+
+	// Types 2 and 3 carry more mobiles, GSM 04.08 9.1.22-9.1.24.
+	PagingEntryList::iterator paged[4];
+	unsigned numPaged = 0;
+	L3Frame *frame = NULL;
+	if (frontIsTMSI && numTMSIs==4) {
+		unsigned IDs[4];
+		ChannelType types[4];
+		for (unsigned i=0; i<4; i++) {
+			paged[numPaged++] = TMSIs[i];
+			IDs[i] = TMSIs[i]->TMSI();
+			types[i] = TMSIs[i]->type();
+		}
+		const L3PagingRequestType3 request(IDs,types);
+		LOG(DEBUG) << "paging " << request;
+		frame = new L3Frame(request,UNIT_DATA);
+	} else if (numTMSIs>=2 && (numOthers>0 || numTMSIs>2)) {
+		PagingEntryList::iterator third = numOthers ? others[0] : TMSIs[2];
+		paged[numPaged++] = TMSIs[0];
+		paged[numPaged++] = TMSIs[1];
+		paged[numPaged++] = third;
+		const L3PagingRequestType2 request(
+			TMSIs[0]->TMSI(),TMSIs[0]->type(),
+			TMSIs[1]->TMSI(),TMSIs[1]->type(),
+			third->pageID(),third->type());
+		LOG(DEBUG) << "paging " << request;
+		frame = new L3Frame(request,UNIT_DATA);
+	} else {
+		PagingEntryList::iterator first = list.begin();
+		paged[numPaged++] = first;
+		PagingEntryList::iterator second = first;
+		++second;
+		if (second==list.end()) {
+			const L3PagingRequestType1 request(first->pageID(),first->type());
+			LOG(DEBUG) << "paging " << request;
+			frame = new L3Frame(request,UNIT_DATA);
+		} else {
+			paged[numPaged++] = second;
+			const L3PagingRequestType1 request(first->pageID(),first->type(),second->pageID(),second->type());
+			LOG(DEBUG) << "paging " << request;
+			frame = new L3Frame(request,UNIT_DATA);
+		}
+	}
 
+	// Whoever was paged goes to the back of the line.
+	for (unsigned i=0; i<numPaged; i++) list.splice(list.end(),list,paged[i]);
 
-void* Control::PagerServiceLoopAdapter(Pager *pager)
-{
-	pager->serviceLoop();
-	return NULL;
+	mLock.unlock();
+	return frame;
 }
 
-void Pager::serviceLoop()
-{
-	while (mRunning) {
-
-		LOG(DEBUG) << "Pager blocking for signal";
-		mLock.lock();
-		while (mPageIDs.size()==0) mPageSignal.wait(mLock);
-		mLock.unlock();
 
-		// page everything
-		pageAll();
 
-		// Wait for pending activity to clear the channel.
-		// This wait is what causes PCH to have lower priority than AGCH.
-		unsigned load = gBTS.getPCH()->load();
-		LOG(DEBUG) << "Pager waiting for " << load << " multiframes";
-		if (load) sleepFrames(51*load);
-	}
+size_t Pager::pagingEntryListSize()
+{
+	mLock.lock();
+	size_t retVal = mSize;
+	mLock.unlock();
+	return retVal;
 }
 
 
 
 void Pager::dump(ostream& os) const
 {
-	PagingEntryList::const_iterator lp = mPageIDs.begin();
-	while (lp != mPageIDs.end()) {
-		os << lp->ID() << " " << lp->type() << " " << lp->expired() << endl;
-		++lp;
+	mLock.lock();
+	for (unsigned g=0; g<mGroups.size(); g++) {
+		PagingEntryList::const_iterator lp = mGroups[g].begin();
+		while (lp != mGroups[g].end()) {
+			os << g << " " << lp->ID() << " " << lp->type() << " " << lp->expired() << endl;
+			++lp;
+		}
 	}
+	mLock.unlock();
 }
 
 
@@ -41,6 +41,8 @@
 */
 
 
+#define LOG_MODULE Control
+
 #include <stdio.h>
 #include <GSMLogicalChannel.h>
 #include <GSML3MMMessages.h>
@@ -188,14 +190,15 @@ bool sendToNumericAddress(const L3MobileIdentity &mobileID, const TLSubmit& subm
 	// Form the TLAddress into a CalledPartyNumber for the transaction.
 	L3CalledPartyBCDNumber calledParty(address.digits());
 	// Step 1 -- Create a transaction record.
-	TransactionEntry transaction(
+	TransactionRef entry(new TransactionEntry(
 		mobileID,
 		L3CMServiceType::ShortMessage,
 		0,		// doesn't matter
-		calledParty);
+		calledParty));
+	TransactionEntry& transaction = *entry;
 	transaction.SIP().User(mobileID.digits());
 	transaction.Q931State(TransactionEntry::SMSSubmitting);
-	gTransactionTable.add(transaction);
+	gTransactionTable.add(entry);
 	LOG(DEBUG) << "MOSMS: transaction: " << transaction;
 
 	// Step 2 -- Send the message to the server.
@@ -576,7 +579,6 @@ void Control::MTSMSController(TransactionEntry& transaction,
 
 	// Update transaction state.
 	transaction.Q931State(TransactionEntry::SMSDelivering);
-	gTransactionTable.update(transaction);
 
 	bool success = deliverSMSToMS(transaction.calling().digits(),transaction.message(),random()%7,LCH);
 
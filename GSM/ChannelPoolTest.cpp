@@ -0,0 +1,125 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+	Check the channel allocator's free lists and policies
+	with stand-in channels whose recyclable() we control.
+
+		ChannelPoolTest
+*/
+
+
+#include "GSMChannelPool.h"
+
+#include <iostream>
+
+using namespace std;
+using namespace GSM;
+
+
+/** A channel that is recyclable when the test says so. */
+class TestChannel {
+
+	private:
+
+	unsigned mTN;
+	bool mRecyclable;
+
+	public:
+
+	TestChannel(unsigned wTN=0)
+		:mTN(wTN),mRecyclable(true)
+	{ }
+
+	void open() { mRecyclable=false; }
+	void release() { mRecyclable=true; }
+	bool recyclable() const { return mRecyclable; }
+	unsigned ARFCN() const { return 51; }
+	unsigned TN() const { return mTN; }
+
+};
+
+
+static unsigned gFailures = 0;
+
+static void check(bool ok, const char *what)
+{
+	if (ok) return;
+	cout << "FAILED: " << what << endl;
+	gFailures++;
+}
+
+
+int main(int argc, char *argv[])
+{
+	// Two channels on each of TN 1-3.
+	TestChannel chans[6];
+	for (unsigned i=0; i<6; i++) chans[i] = TestChannel(1+i/2);
+
+	// LRU hands them out in order, then recycles the one freed first.
+	ChannelPool<TestChannel> lru;
+	for (unsigned i=0; i<6; i++) lru.add(&chans[i]);
+	check(lru.available()==6 && lru.active()==0,"initial counts");
+	for (unsigned i=0; i<6; i++) check(lru.allocate(LRUAllocation)==&chans[i],"LRU order");
+	check(lru.allocate(LRUAllocation)==NULL,"empty pool");
+	chans[4].release();
+	chans[2].release();
+	// An empty pool sweeps on allocation, whatever the counters say.
+	check(lru.allocate(LRUAllocation)!=NULL,"sweep on empty pool");
+	check(lru.allocate(LRUAllocation)!=NULL,"second recycled channel");
+	check(lru.allocate(LRUAllocation)==NULL,"empty again");
+	for (unsigned i=0; i<6; i++) chans[i].release();
+	lru.sweep();
+	check(lru.available()==6,"all recycled");
+
+	// Spread takes one channel from each timeslot before a second from any.
+	ChannelPool<TestChannel> spread;
+	for (unsigned i=0; i<6; i++) spread.add(&chans[i]);
+	unsigned seen[4] = {0,0,0,0};
+	for (unsigned i=0; i<3; i++) seen[spread.allocate(SpreadAllocation)->TN()]++;
+	check(seen[1]==1 && seen[2]==1 && seen[3]==1,"spread across timeslots");
+	for (unsigned i=0; i<6; i++) chans[i].release();
+
+	// Pack fills a timeslot before starting another.
+	ChannelPool<TestChannel> pack;
+	for (unsigned i=0; i<6; i++) pack.add(&chans[i]);
+	TestChannel *first = pack.allocate(PackAllocation);
+	TestChannel *second = pack.allocate(PackAllocation);
+	check(first->TN()==second->TN(),"pack into one timeslot");
+	check(pack.active()==2 && pack.available()==4,"pack counts");
+
+	// A channel that is already open when added starts out busy.
+	ChannelPool<TestChannel> open;
+	TestChannel busy(1);
+	busy.open();
+	open.add(&busy);
+	check(open.available()==0 && open.allocate(LRUAllocation)==NULL,"added busy");
+	busy.release();
+	check(open.allocate(LRUAllocation)==&busy,"added busy then released");
+
+	cout << (gFailures ? "FAIL" : "PASS") << endl;
+	return gFailures ? 1 : 0;
+}
+
+// vim: ts=4 sw=4
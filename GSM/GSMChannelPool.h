@@ -0,0 +1,250 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+
+#ifndef GSMCHANNELPOOL_H
+#define GSMCHANNELPOOL_H
+
+#include <vector>
+#include <deque>
+
+#include <Threads.h>
+#include <Timeval.h>
+
+
+namespace GSM {
+
+
+/** How a ChannelPool picks among its free channels. */
+enum ChannelAllocationPolicy {
+	LRUAllocation,		///< the channel that has been free the longest
+	SpreadAllocation,	///< the timeslot with the fewest busy channels, for less interference
+	PackAllocation		///< the timeslot with the most busy channels, so others can stay idle
+};
+
+
+/**
+	A pool of allocatable dedicated channels, with free lists by timeslot.
+
+	A channel only becomes busy by allocation, but it becomes free again
+	by its L1 timers running out, with no event to tell us.  So free
+	channels are kept in lists and busy ones are swept for recyclable()
+	now and then: on any allocation from an empty pool, and otherwise at
+	most every sweepInterval ms when the counters are read.  Allocation is
+	constant time in the number of channels and never misses a free one.
+
+	ChanType needs open(), recyclable(), ARFCN() and TN().
+*/
+template <class ChanType> class ChannelPool {
+
+	public:
+
+	/** Longest time, in ms, that the counters can lag a channel timer. */
+	static const long sweepInterval = 100;
+
+	private:
+
+	/** The channels on one timeslot of one ARFCN. */
+	struct Group {
+		unsigned ARFCN;
+		unsigned TN;
+		std::deque<unsigned> free;		///< indices into mChannels, longest free first
+		unsigned busy;					///< channels not in the free list
+	};
+
+	/** The allocation state of one channel. */
+	struct Entry {
+		ChanType *chan;
+		unsigned group;				///< index into mGroups
+		unsigned long freedAt;		///< mFreeCount when it went on the free list
+		int busyPos;				///< index in mBusy, -1 if free
+	};
+
+	mutable Mutex mLock;
+	std::vector<Entry> mChannels;
+	std::vector<Group> mGroups;
+	std::vector<unsigned> mBusy;	///< indices of channels not in any free list
+	unsigned mFree;					///< total length of the free lists
+	unsigned long mFreeCount;		///< channels ever put on a free list
+	Timeval mLastSweep;
+
+	public:
+
+	ChannelPool()
+		:mFree(0),mFreeCount(0)
+	{ }
+
+	/** Add a channel, which may already be open. */
+	void add(ChanType *chan)
+	{
+		mLock.lock();
+		unsigned ARFCN = chan->ARFCN();
+		unsigned TN = chan->TN();
+		unsigned g = 0;
+		while (g<mGroups.size() && !(mGroups[g].ARFCN==ARFCN && mGroups[g].TN==TN)) g++;
+		if (g==mGroups.size()) {
+			mGroups.push_back(Group());
+			mGroups[g].ARFCN = ARFCN;
+			mGroups[g].TN = TN;
+			mGroups[g].busy = 0;
+		}
+		Entry entry;
+		entry.chan = chan;
+		entry.group = g;
+		entry.freedAt = 0;
+		entry.busyPos = -1;
+		mChannels.push_back(entry);
+		unsigned index = mChannels.size()-1;
+		if (chan->recyclable()) putFree(index);
+		else putBusy(index);
+		mLock.unlock();
+	}
+
+	/**
+		Open and return a free channel.
+		@return The channel, or NULL if there is none.
+	*/
+	ChanType* allocate(ChannelAllocationPolicy policy)
+	{
+		mLock.lock();
+		if (mFree==0) sweepLocked();
+		int g = pickGroup(policy);
+		if (g<0) {
+			mLock.unlock();
+			return NULL;
+		}
+		Group& group = mGroups[g];
+		unsigned index = group.free.front();
+		group.free.pop_front();
+		mFree--;
+		putBusy(index);
+		ChanType *chan = mChannels[index].chan;
+		chan->open();
+		mLock.unlock();
+		return chan;
+	}
+
+	/** Move every recyclable busy channel to the free lists now. */
+	void sweep()
+	{
+		mLock.lock();
+		sweepLocked();
+		mLock.unlock();
+	}
+
+	/**@name Occupancy counters, at most sweepInterval ms behind the channel timers. */
+	//@{
+	unsigned total() const { return mChannels.size(); }
+
+	unsigned available()
+	{
+		mLock.lock();
+		if (mLastSweep.elapsed()>=sweepInterval) sweepLocked();
+		unsigned retVal = mFree;
+		mLock.unlock();
+		return retVal;
+	}
+
+	unsigned active() { return total() - available(); }
+	//@}
+
+	private:
+
+	void putFree(unsigned index)
+	{
+		Entry& entry = mChannels[index];
+		Group& group = mGroups[entry.group];
+		if (entry.busyPos>=0) {
+			// Swap the last busy channel into this one's place.
+			unsigned last = mBusy.back();
+			mBusy[entry.busyPos] = last;
+			mChannels[last].busyPos = entry.busyPos;
+			mBusy.pop_back();
+			entry.busyPos = -1;
+			group.busy--;
+		}
+		entry.freedAt = ++mFreeCount;
+		group.free.push_back(index);
+		mFree++;
+	}
+
+	void putBusy(unsigned index)
+	{
+		Entry& entry = mChannels[index];
+		entry.busyPos = mBusy.size();
+		mBusy.push_back(index);
+		mGroups[entry.group].busy++;
+	}
+
+	void sweepLocked()
+	{
+		mLastSweep.now();
+		unsigned i = 0;
+		while (i<mBusy.size()) {
+			unsigned index = mBusy[i];
+			// putFree moves another channel into position i.
+			if (mChannels[index].chan->recyclable()) putFree(index);
+			else i++;
+		}
+	}
+
+	/** Return the group to allocate from, or -1 if all are empty. */
+	int pickGroup(ChannelAllocationPolicy policy) const
+	{
+		int best = -1;
+		for (unsigned g=0; g<mGroups.size(); g++) {
+			const Group& group = mGroups[g];
+			if (group.free.empty()) continue;
+			if (best<0) {
+				best = g;
+				continue;
+			}
+			const Group& other = mGroups[best];
+			// Among equals, the longest free channel wins.
+			bool older = mChannels[group.free.front()].freedAt < mChannels[other.free.front()].freedAt;
+			switch (policy) {
+				case LRUAllocation:
+					if (older) best = g;
+					break;
+				case SpreadAllocation:
+					if (group.busy<other.busy || (group.busy==other.busy && older)) best = g;
+					break;
+				case PackAllocation:
+					if (group.busy>other.busy || (group.busy==other.busy && older)) best = g;
+					break;
+			}
+		}
+		return best;
+	}
+
+};
+
+
+};	// namespace GSM
+
+
+#endif
+
+// vim: ts=4 sw=4
@@ -350,7 +350,10 @@ long Z100Timer::remaining() const
 
 void Z100Timer::wait() const
 {
-	while (!expired()) msleep(remaining());
+	while (!expired()) {
+		long rem = remaining();
+		gSleepMicroseconds(rem>0 ? 1000*rem : 1000);
+	}
 }
 
 // vim: ts=4 sw=4
@@ -62,11 +62,11 @@ const unsigned gFrameMicroseconds = 4615;
 
 /** Sleep for a given number of GSM frame periods. */
 inline void sleepFrames(unsigned frames)
-	{ usleep(frames*gFrameMicroseconds); }
+	{ gSleepMicroseconds(frames*gFrameMicroseconds); }
 
 /** Sleep for 1 GSM frame period. */
 inline void sleepFrame()
-	{ usleep(gFrameMicroseconds); }
+	{ gSleepMicroseconds(gFrameMicroseconds); }
 
 
 
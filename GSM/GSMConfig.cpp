@@ -38,6 +38,7 @@ using namespace GSM;
 GSMConfig::GSMConfig()
 	:mBand((GSMBand)gConfig.getNum("GSM.Band")),
 	mSI5Frame(UNIT_DATA),mSI6Frame(UNIT_DATA),
+	mBeaconGeneration(0),
 	mT3122(gConfig.getNum("GSM.T3122Min")),
 	mStartTime(::time(NULL))
 {
@@ -113,7 +114,10 @@ void GSMConfig::regenerateBeacon()
 	// SI6
 	L3SystemInformationType6 SI6;
 	SI6.write(mSI6Frame);
-	LOG(DEBUG) "mSI6Frame " << mSI6Frame;
+	LOG(DEBUG) << "mSI6Frame " << mSI6Frame;
+
+	// Tell the L1 encoders to drop their cached SI encodings.
+	mBeaconGeneration++;
 
 }
 
@@ -144,109 +148,82 @@ CCCHLogicalChannel* GSMConfig::minimumLoad(CCCHList &chanList)
 
 
 
-template <class ChanType> ChanType* getChan(vector<ChanType*>& chanList)
+ChannelAllocationPolicy GSMConfig::channelAllocationPolicy() const
 {
-	const unsigned sz = chanList.size();
-	if (sz==0) return NULL;
-	// Start the search from a random point in the list.
-	//unsigned pos = random() % sz;
-	// HACK -- Try in-order allocation for debugging.
-	for (unsigned i=0; i<sz; i++) {
-		ChanType *chan = chanList[i];
-		//ChanType *chan = chanList[pos];
-		if (chan->recyclable()) return chan;
-		//pos = (pos+1) % sz;
+	if (!gConfig.defines("GSM.ChannelAllocation")) return LRUAllocation;
+	const char *policy = gConfig.getStr("GSM.ChannelAllocation");
+	if (strcasecmp(policy,"spread")==0) return SpreadAllocation;
+	if (strcasecmp(policy,"pack")==0) return PackAllocation;
+	if (strcasecmp(policy,"LRU")!=0) {
+		LOG(WARN) << "unknown GSM.ChannelAllocation " << policy << ", using LRU";
 	}
-	return NULL;
+	return LRUAllocation;
 }
 
 
 
+void GSMConfig::addSDCCH(SDCCHLogicalChannel *wSDCCH)
+{
+	mSDCCHPool.push_back(wSDCCH);
+	mSDCCHAllocator.add(wSDCCH);
+}
 
 
-SDCCHLogicalChannel *GSMConfig::getSDCCH()
+void GSMConfig::addTCH(TCHFACCHLogicalChannel *wTCH)
 {
-	mLock.lock();
-	SDCCHLogicalChannel *chan = getChan<SDCCHLogicalChannel>(mSDCCHPool);
-	if (chan) chan->open();
-	mLock.unlock();
-	return chan;
+	mTCHPool.push_back(wTCH);
+	mTCHAllocator.add(wTCH);
 }
 
 
-TCHFACCHLogicalChannel *GSMConfig::getTCH()
+
+SDCCHLogicalChannel *GSMConfig::getSDCCH()
 {
-	mLock.lock();
-	TCHFACCHLogicalChannel *chan = getChan<TCHFACCHLogicalChannel>(mTCHPool);
-	if (chan) chan->open();
-	mLock.unlock();
-	return chan;
+	return mSDCCHAllocator.allocate(channelAllocationPolicy());
 }
 
 
-
-template <class ChanType> size_t chanAvailable(const vector<ChanType*>& chanList)
+TCHFACCHLogicalChannel *GSMConfig::getTCH()
 {
-	size_t count = 0;
-	for (unsigned i=0; i<chanList.size(); i++) {
-		if (chanList[i]->recyclable()) count++;
-	}
-	return count;
+	return mTCHAllocator.allocate(channelAllocationPolicy());
 }
 
 
 
 size_t GSMConfig::SDCCHAvailable() const
 {
-	mLock.lock();
-	size_t retVal = chanAvailable<SDCCHLogicalChannel>(mSDCCHPool);
-	mLock.unlock();
-	return retVal;
+	return mSDCCHAllocator.available();
 }
 
 size_t GSMConfig::TCHAvailable() const
 {
-	mLock.lock();
-	size_t retVal = chanAvailable<TCHFACCHLogicalChannel>(mTCHPool);
-	mLock.unlock();
-	return retVal;
+	return mTCHAllocator.available();
 }
 
 
-size_t GSMConfig::totalLoad(const CCCHList& chanList) const
+unsigned GSMConfig::SDCCHActive() const
 {
-	size_t total = 0;
-	for (int i=0; i<chanList.size(); i++) {
-		total += chanList[i]->load();
-	}
-	return total;
+	return mSDCCHAllocator.active();
 }
 
-
-
-template <class ChanType> unsigned countActive(const vector<ChanType*>& chanList)
+unsigned GSMConfig::TCHActive() const
 {
-	unsigned active = 0;
-	const unsigned sz = chanList.size();
-	// Start the search from a random point in the list.
-	for (unsigned i=0; i<sz; i++) {
-		if (!chanList[i]->recyclable()) active++;
-	}
-	return active;
+	return mTCHAllocator.active();
 }
 
 
-unsigned GSMConfig::SDCCHActive() const
-{
-	return countActive(mSDCCHPool);
-}
 
-unsigned GSMConfig::TCHActive() const
+size_t GSMConfig::totalLoad(const CCCHList& chanList) const
 {
-	return countActive(mTCHPool);
+	size_t total = 0;
+	for (int i=0; i<chanList.size(); i++) {
+		total += chanList[i]->load();
+	}
+	return total;
 }
 
 
+
 unsigned GSMConfig::T3122() const
 {
 	mLock.lock();
@@ -35,6 +35,7 @@
 #include "GSML3RRElements.h"
 #include "GSML3CommonElements.h"
 #include "GSML3RRMessages.h"
+#include "GSMChannelPool.h"
 
 
 
@@ -74,6 +75,8 @@ class GSMConfig {
 	//@{
 	SDCCHList mSDCCHPool;
 	TCHList mTCHPool;
+	mutable ChannelPool<SDCCHLogicalChannel> mSDCCHAllocator;
+	mutable ChannelPool<TCHFACCHLogicalChannel> mTCHAllocator;
 	//@}
 
 	/**@name BSIC. */
@@ -100,6 +103,8 @@ class GSMConfig {
 	L3Frame mSI6Frame;
 	//@}
 
+	unsigned mBeaconGeneration;	///< incremented each time the SI frames change
+
 	int mT3122;
 
 	time_t mStartTime;
@@ -131,6 +136,9 @@ class GSMConfig {
 	const L3Frame& SI6Frame() const { return mSI6Frame; }
 	//@}
 
+	/** A count that changes whenever the SI frames are regenerated. */
+	unsigned beaconGeneration() const { return mBeaconGeneration; }
+
 	/** Get the current master clock value. */
 	Time time() const { return mClock.get(); }
 
@@ -178,6 +186,8 @@ class GSMConfig {
 	CCCHLogicalChannel* getAGCH() { return minimumLoad(mAGCHPool); }
 	/** Return a minimum-load PCH. */
 	CCCHLogicalChannel* getPCH() { return minimumLoad(mPCHPool); }
+	/** Return the number of PCHs, which are in paging block order. */
+	unsigned numPCH() const { return mPCHPool.size(); }
 	/** Return a specific PCH. */
 	CCCHLogicalChannel* getPCH(size_t index)
 	{
@@ -191,7 +201,7 @@ class GSMConfig {
 	/**@name Manage SDCCH Pool. */
 	//@{
 	/** The add method is not mutex protected and should only be used during initialization. */
-	void addSDCCH(SDCCHLogicalChannel *wSDCCH) { mSDCCHPool.push_back(wSDCCH); }
+	void addSDCCH(SDCCHLogicalChannel *wSDCCH);
 	/** Return a pointer to a usable channel. */
 	SDCCHLogicalChannel *getSDCCH();
 	/** Return true if an SDCCH is available, but do not allocate it. */
@@ -207,7 +217,7 @@ class GSMConfig {
 	/**@name Manage TCH pool. */
 	//@{
 	/** The add method is not mutex protected and should only be used during initialization. */
-	void addTCH(TCHFACCHLogicalChannel *wTCH) { mTCHPool.push_back(wTCH); }
+	void addTCH(TCHFACCHLogicalChannel *wTCH);
 	/** Return a pointer to a usable channel. */
 	TCHFACCHLogicalChannel *getTCH();
 	/** Return true if an TCH is available, but do not allocate it. */
@@ -220,6 +230,9 @@ class GSMConfig {
 	const TCHList& TCHPool() const { return mTCHPool; }
 	//@}
 
+	/** The allocation policy from GSM.ChannelAllocation: LRU, spread or pack. */
+	ChannelAllocationPolicy channelAllocationPolicy() const;
+
 	/**@name T3122 management */
 	//@{
 	unsigned T3122() const;
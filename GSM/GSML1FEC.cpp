@@ -26,6 +26,8 @@
 #define NDEBUG
 
 
+#define LOG_MODULE L1
+
 #include "GSML1FEC.h"
 #include "GSMCommon.h"
 #include "GSMSAPMux.h"
@@ -664,7 +666,7 @@ void XCCHL1Decoder::handleGoodFrame()
 	// stop T3101 and tell L2 we're alive down here.
 	if (mT3101.active()) {
 		mT3101.reset();
-		if (mUpstream!=NULL) mUpstream->writeLowSide(L2Frame(ESTABLISH));
+		if (mUpstream!=NULL) mUpstream->writeLowSide(new L2Frame(ESTABLISH));
 	}
 	mLock.unlock();
 
@@ -676,7 +678,7 @@ void XCCHL1Decoder::handleGoodFrame()
 		// Build an L2 frame and pass it up.
 		const BitVector L2Part(mD.tail(headerOffset()));
 		OBJLOG(DEEPDEBUG) <<"XCCHL1Decoder L2=" << L2Part;
-		mUpstream->writeLowSide(L2Frame(L2Part,DATA));
+		mUpstream->writeLowSide(new L2Frame(L2Part,DATA));
 	} else {
 		OBJLOG(NOTICE) << "XCCHL1Decoder with no uplink connected.";
 	}
@@ -698,6 +700,58 @@ void SACCHL1Decoder::handleGoodFrame()
 
 
 
+void XCCHBlockCache::capacity(unsigned wCapacity)
+{
+	assert(wCapacity<=maxEntries);
+	mCapacity = wCapacity;
+	mSize = 0;
+}
+
+
+bool XCCHBlockCache::find(const BitVector& d, BitVector *i)
+{
+	if (mCapacity==0) return false;
+	// Anything encoded before the last beacon change is stale.
+	unsigned generation = gBTS.beaconGeneration();
+	if (generation!=mGeneration) {
+		mGeneration = generation;
+		mSize = 0;
+	}
+	mUses++;
+	for (unsigned e=0; e<mSize; e++) {
+		Entry& entry = mEntries[e];
+		if (memcmp(entry.d,d.begin(),sizeof(entry.d))!=0) continue;
+		for (int B=0; B<4; B++) memcpy(i[B].begin(),entry.i[B],sizeof(entry.i[B]));
+		entry.lastUse = mUses;
+		mHits++;
+		return true;
+	}
+	return false;
+}
+
+
+void XCCHBlockCache::add(const BitVector& d, const BitVector *i)
+{
+	if (mCapacity==0) return;
+	// Take a free entry, or else the least recently used one.
+	unsigned e = mSize;
+	if (mSize<mCapacity) mSize++;
+	else {
+		e = 0;
+		for (unsigned k=1; k<mSize; k++) {
+			if (mEntries[k].lastUse < mEntries[e].lastUse) e = k;
+		}
+	}
+	Entry& entry = mEntries[e];
+	assert(d.size()==sizeof(entry.d));
+	memcpy(entry.d,d.begin(),sizeof(entry.d));
+	for (int B=0; B<4; B++) memcpy(entry.i[B],i[B].begin(),sizeof(entry.i[B]));
+	entry.lastUse = mUses;
+}
+
+
+
+
 XCCHL1Encoder::XCCHL1Encoder(
 		unsigned wTN,
 		const TDMAMapping& wMapping,
@@ -783,8 +837,12 @@ void XCCHL1Encoder::sendFrame(const L2Frame& frame)
 	OBJLOG(DEEPDEBUG) << "XCCHL1Encoder d[]=" << mD;
 	mD.LSB8MSB();
 	OBJLOG(DEEPDEBUG) << "XCCHL1Encoder d[]=" << mD;
-	encode();			// Encode u[] to c[], GSM 05.03 4.1.2 and 4.1.3.
-	interleave();		// Interleave c[] to i[][], GSM 05.03 4.1.4.
+	// Repeated blocks, like system information, reuse their last encoding.
+	if (!mBlockCache.find(mD,mI)) {
+		encode();			// Encode u[] to c[], GSM 05.03 4.1.2 and 4.1.3.
+		interleave();		// Interleave c[] to i[][], GSM 05.03 4.1.4.
+		mBlockCache.add(mD,mI);
+	}
 	transmit();			// Send the bursts to the radio, GSM 05.03 4.1.5.
 	// FIXME: is this FN OK, or do we need to back it up by 4?
 	gWriteGSMTAP(ARFCN(),mTN,mPrevWriteTime.FN(),frame);
@@ -942,7 +1000,7 @@ void FCCHL1Encoder::generate()
 		mDownstream->writeHighSide(mBurst);
 		rollForward();
 	}
-	sleep(1);
+	gSleepMicroseconds(1000000);
 }
 
 
@@ -1426,7 +1484,10 @@ SACCHL1Encoder::SACCHL1Encoder( unsigned wTN, const TDMAMapping& wMapping, SACCH
 	:XCCHL1Encoder(wTN,wMapping,(L1FEC*)wParent),
 	mSACCHParent(wParent),
 	mOrderedMSPower(40),mOrderedMSTiming(0)
-{ }
+{
+	// SI5 and SI6, with a few recent physical headers.
+	mBlockCache.capacity(4);
+}
 
 
 void SACCHL1Encoder::open()
@@ -140,6 +140,8 @@ class L1Encoder {
 	unsigned ARFCN() const;						///< this comes from mDownstream
 	TypeAndOffset typeAndOffset() const;	///< this comes from mMapping
 	//@}
+	/** Time of the next burst to be written, for the writer's thread. */
+	GSM::Time nextWriteTime() const { return mNextWriteTime; }
 	//@}
 
 	/** Close the channel after blocking for flush.  */
@@ -619,6 +621,59 @@ class SACCHL1Decoder : public XCCHL1Decoder {
 
 
 
+/**
+	A few recently sent xCCH blocks and their interleaved encodings.
+	The BCCH, SACCH and CCCH send the same handful of frames over and over,
+	so most of their blocks can skip the parity, convolutional coding and interleaving.
+	The key is d[] with any physical header, so a SACCH power or timing change
+	is just a miss.  All entries are dropped when the beacon is regenerated.
+*/
+class XCCHBlockCache {
+
+	public:
+
+	static const unsigned maxEntries = 4;
+
+	private:
+
+	struct Entry {
+		char d[184];			///< d[], as per GSM 05.03 2.2
+		char i[4][114];			///< i[][] encoded from d[]
+		unsigned lastUse;		///< for LRU replacement
+	};
+
+	Entry mEntries[maxEntries];
+	unsigned mCapacity;			///< entries to use, 0 to disable the cache
+	unsigned mSize;				///< entries in use
+	unsigned mGeneration;		///< beacon generation of the entries
+	unsigned mUses;				///< lookup count, the LRU clock
+	unsigned mHits;
+
+	public:
+
+	XCCHBlockCache()
+		:mCapacity(0),mSize(0),mGeneration(0),mUses(0),mHits(0)
+	{ }
+
+	/** Set the number of entries to use, up to maxEntries. */
+	void capacity(unsigned wCapacity);
+
+	/**
+		Look up a d[] and copy its encoding into i[].
+		@return true on a hit.
+	*/
+	bool find(const BitVector& d, BitVector *i);
+
+	/** Save the encoding of a d[] that missed. */
+	void add(const BitVector& d, const BitVector *i);
+
+	unsigned lookups() const { return mUses; }
+	unsigned hits() const { return mHits; }
+
+};
+
+
+
 /** L1 encoder used for many control channels -- mostly from GSM 05.03 4.1 */
 class XCCHL1Encoder : public L1Encoder {
 
@@ -634,6 +689,8 @@ class XCCHL1Encoder : public L1Encoder {
 	BitVector mP;				///< p[], as per GSM 05.03 2.2
 	//@}
 
+	XCCHBlockCache mBlockCache;	///< encodings of repeated blocks, disabled by default
+
 	public:
 
 	XCCHL1Encoder(
@@ -944,7 +1001,7 @@ class BCCHL1Encoder : public NDCCHL1Encoder {
 
 	BCCHL1Encoder(L1FEC *wParent)
 		:NDCCHL1Encoder(0,gBCCHMapping,wParent)
-	{}
+	{ mBlockCache.capacity(4); }		// SI1-SI4
 
 	private:
 
@@ -1007,7 +1064,7 @@ class CCCHL1Encoder : public XCCHL1Encoder {
 	CCCHL1Encoder(const TDMAMapping& wMapping,
 			L1FEC* wParent)
 		:XCCHL1Encoder(0,wMapping,wParent)
-	{}
+	{ mBlockCache.capacity(2); }		// the idle paging frame, mostly
 
 };
 
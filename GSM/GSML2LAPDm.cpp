@@ -30,9 +30,10 @@ implementation, although no code is copied directly.
 
 
 /*
-	As a general rule, the caller need not hold
-	mLock when sending U frames but should hold the 
-	lock when transmitting S or I frames.
+	The state machines run in the LAPDm engine thread.
+	Everything that touches the state of a link, including
+	the handlers and senders below, runs there; other threads
+	only put frames and requests on the link's queues.
 
 	This implementation is for use on the BTS side,
 	however, some MS functions are included for unit-
@@ -40,6 +41,8 @@ implementation, although no code is copied directly.
 	to be compelted.
 */
 
+#define LOG_MODULE L2
+
 #include "GSML2LAPDm.h"
 #include "GSMSAPMux.h"
 #include <Logger.h>
@@ -71,106 +74,401 @@ void CCCHL2::writeHighSide(const GSM::L3Frame& l3)
 	OBJLOG(DEEPDEBUG) <<"CCCHL2::writeHighSide " << l3;
 	assert(mDownstream);
 	assert(l3.primitive()==UNIT_DATA);
-	L2Header header(L2Length(l3.length()));
+	L2Header header(L2Length(l3.pseudoLength()));
 	mDownstream->writeHighSide(L2Frame(header,l3));
 }
 	
 
 
 
-L2LAPDm::L2LAPDm(unsigned wC, unsigned wSAPI)
-	:mRunning(false),
+LAPDmEngine GSM::gLAPDmEngine;
+
+
+
+void L2Future::done(bool ok)
+{
+	mLock.lock();
+	mOK = ok;
+	mDone = true;
+	mSignal.signal();
+	mLock.unlock();
+}
+
+
+bool L2Future::wait()
+{
+	mLock.lock();
+	while (!mDone) mSignal.wait(mLock);
+	bool ok = mOK;
+	mLock.unlock();
+	return ok;
+}
+
+
+
+
+LAPDmEngine::LAPDmEngine(unsigned wMaxWriters)
+	:mReadyHead(NULL),mReadyTail(NULL),
+	mTransmitHead(NULL),mTransmitTail(NULL),
+	mTimers(10),
+	mNumWriters(0),mMaxWriters(wMaxWriters),
+	mBusyWriters(0),mQueuedLinks(0),
+	mStarted(false),mStopping(false),mLoopRunning(false),
+	mLoopThread(NULL)
+{
+	assert(mMaxWriters>0);
+}
+
+
+void *GSM::LAPDmEngineLoopAdapter(LAPDmEngine *engine)
+{
+	engine->serviceLoop();
+	return NULL;
+}
+
+
+void *GSM::LAPDmEngineWriterAdapter(LAPDmEngine *engine)
+{
+	engine->writerLoop();
+	return NULL;
+}
+
+
+void LAPDmEngine::start()
+{
+	mLock.lock();
+	if (!mStarted) {
+		mStarted = true;
+		// This thread runs until stop(), normally for the life of the process.
+		mLoopThread = new Thread;
+		mLoopThread->start((void *(*)(void*))LAPDmEngineLoopAdapter,this);
+		startWriter();
+	}
+	mLock.unlock();
+}
+
+
+void LAPDmEngine::stop()
+{
+	mLock.lock();
+	if (!mStarted) {
+		mLock.unlock();
+		return;
+	}
+	mStopping = true;
+	mReadySignal.broadcast();
+	mTransmitSignal.broadcast();
+	mLock.unlock();
+
+	// No new writers start once mStopping is set, so the list is complete.
+	mLoopThread->join();
+	delete mLoopThread;
+	mLoopThread = NULL;
+	for (unsigned i=0; i<mWriterThreads.size(); i++) {
+		mWriterThreads[i]->join();
+		delete mWriterThreads[i];
+	}
+	mWriterThreads.clear();
+
+	mLock.lock();
+	mNumWriters = 0;
+	mBusyWriters = 0;
+	mStarted = false;
+	mStopping = false;
+	mLock.unlock();
+}
+
+
+void LAPDmEngine::startWriter()
+{
+	if (mStopping) return;
+	// Writers also run until stop().
+	Thread *thread = new Thread;
+	thread->start((void *(*)(void*))LAPDmEngineWriterAdapter,this);
+	mWriterThreads.push_back(thread);
+	mNumWriters++;
+	// Give it a tick to make progress before starting another.
+	mLastWrite.now();
+	LOG(INFO) << "LAPDm engine now has " << mNumWriters << " L1 writers";
+}
+
+
+void LAPDmEngine::checkWriters()
+{
+	if (mQueuedLinks==0) return;
+	if (mBusyWriters < mNumWriters) return;
+	if (mNumWriters >= mMaxWriters) return;
+	if (mLastWrite.elapsed() < (long)mTimers.tickMs()) return;
+	startWriter();
+}
+
+
+void LAPDmEngine::wrote()
+{
+	mLock.lock();
+	mLastWrite.now();
+	mLock.unlock();
+}
+
+
+unsigned LAPDmEngine::numThreads() const
+{
+	mLock.lock();
+	unsigned threads = mNumWriters + 1;
+	mLock.unlock();
+	return threads;
+}
+
+
+void LAPDmEngine::schedule(L2LAPDm* link)
+{
+	mLock.lock();
+	if (!link->mScheduled) {
+		link->mScheduled = true;
+		link->mNextReady = NULL;
+		if (mReadyTail) mReadyTail->mNextReady = link;
+		else mReadyHead = link;
+		mReadyTail = link;
+		mReadySignal.signal();
+	}
+	mLock.unlock();
+}
+
+
+void LAPDmEngine::transmit(L2LAPDm* link)
+{
+	// The link makes sure that it is on this list only once.
+	mLock.lock();
+	link->mNextTransmit = NULL;
+	if (mTransmitTail) mTransmitTail->mNextTransmit = link;
+	else mTransmitHead = link;
+	mTransmitTail = link;
+	mQueuedLinks++;
+	checkWriters();
+	mTransmitSignal.signal();
+	mLock.unlock();
+}
+
+
+void LAPDmEngine::serviceLoop()
+{
+	mLoopID = pthread_self();
+	mLoopRunning = true;
+	mLock.lock();
+	while (!mStopping) {
+		if (!mReadyHead) {
+			// Block until something is scheduled or the next timer is due.
+			// The signal wait is in real time, so poll each tick in simulated time.
+			// Also look at the writers each tick while links wait for them.
+			unsigned timeout = mTimers.timeout(3600000);
+			bool poll = gSimulatedTime() || (mQueuedLinks>0);
+			if (poll && timeout>mTimers.tickMs()) timeout = mTimers.tickMs();
+			if (timeout) mReadySignal.wait(mLock,timeout);
+		}
+		// Service the links that are ready now.
+		// Links scheduled along the way wait for the next pass, after the timers.
+		L2LAPDm *link = mReadyHead;
+		mReadyHead = NULL;
+		mReadyTail = NULL;
+		while (link) {
+			L2LAPDm *next = link->mNextReady;
+			link->mScheduled = false;
+			mLock.unlock();
+			link->service();
+			mLock.lock();
+			link = next;
+		}
+		checkWriters();
+		mLock.unlock();
+		mTimers.advance();
+		mLock.lock();
+	}
+	mLoopRunning = false;
+	mLock.unlock();
+}
+
+
+void LAPDmEngine::writerLoop()
+{
+	mLock.lock();
+	while (true) {
+		while (!mTransmitHead && !mStopping) mTransmitSignal.wait(mLock);
+		if (mStopping) break;
+		L2LAPDm *link = mTransmitHead;
+		mTransmitHead = link->mNextTransmit;
+		if (!mTransmitHead) mTransmitTail = NULL;
+		mQueuedLinks--;
+		mBusyWriters++;
+		mLock.unlock();
+		link->transmit();
+		mLock.lock();
+		mBusyWriters--;
+	}
+	mLock.unlock();
+}
+
+
+
+
+void L2LAPDm::T200Timer::expired()
+{
+	mLink->checkMaster();
+	mLink->T200Expiration();
+	mLink->serviceRequests();
+}
+
+
+
+L2LAPDm::L2LAPDm(unsigned wC, unsigned wSAPI, LAPDmEngine *wEngine)
+	:mEngine(wEngine),mOpened(false),
 	mC(wC),mR(1-wC),mSAPI(wSAPI),
 	mMaster(NULL),
-	mT200(T200ms),
-	mIdleFrame(DATA)
+	mTransmitting(false),mAckableWritten(0),
+	mScheduled(false),mNextReady(NULL),mNextTransmit(NULL),
+	mState(LinkReleased),
+	mRecvBuffer(NULL),mRecvBits(0),mSentFrame(NULL),
+	mT200(this),mT200Pending(false),mAckableQueued(0),
+	mMaxIPayloadBits(0),
+	mRequestStarted(false),mSendIndex(0),
+	mIdleFrame(new L2Frame(DATA))
 {
 	// sanity checks
 	assert(mC<2);
 	assert(mSAPI<4);
+	assert(mEngine);
+
+	mRequest.frame = NULL;
+	mRequest.owned = false;
+	mRequest.completion = NULL;
 
 	clearState();
 
 	// Set the idle frame as per GSM 04.06 5.4.2.3.
-	mIdleFrame.fillField(8*0,(mC<<1)|1,8);		// address
-	mIdleFrame.fillField(8*1,3,8);				// control
-	mIdleFrame.fillField(8*2,1,8);				// length
+	mIdleFrame->fillField(8*0,(mC<<1)|1,8);		// address
+	mIdleFrame->fillField(8*1,3,8);				// control
+	mIdleFrame->fillField(8*2,1,8);				// length
+}
+
+
+L2LAPDm::~L2LAPDm()
+{
+	// The L1 writers may still hold references to the shared frames.
+	if (mSentFrame) mSentFrame->release();
+	mIdleFrame->release();
+	delete mRecvBuffer;
 }
 
 
-void L2LAPDm::writeL1(const L2Frame& frame)
+void L2LAPDm::writeL1(L2Frame* frame, bool ackable)
 {
-	OBJLOG(DEEPDEBUG) <<"L2LAPDm::writeL1 " << frame;
+	OBJLOG(DEEPDEBUG) <<"L2LAPDm::writeL1 " << *frame;
 	//assert(mDownstream);
-	if (!mDownstream) return;
-	mL1Lock.lock();
-	mDownstream->writeHighSide(frame);
-	mL1Lock.unlock();
+	if (!mDownstream) {
+		frame->release();
+		if (ackable) startT200();
+		return;
+	}
+	// The L1 writers do the actual write, since it can block.
+	if (ackable) {
+		stopT200();
+		mT200Pending = true;
+		mAckableQueued++;
+	}
+	Transmission transmission;
+	transmission.frame = frame;
+	transmission.ackable = ackable;
+	mQueueLock.lock();
+	mL1Out.push_back(transmission);
+	bool idle = !mTransmitting;
+	mTransmitting = true;
+	mQueueLock.unlock();
+	if (idle) mEngine->transmit(this);
 }
 
 
-void L2LAPDm::writeL1NoAck(const L2Frame& frame)
+void L2LAPDm::writeL1NoAck(L2Frame* frame)
 {
-	// Caller need not hold mLock.
-	OBJLOG(DEEPDEBUG) <<"L2LAPDm::writeL1NoAck " << frame;
+	OBJLOG(DEEPDEBUG) <<"L2LAPDm::writeL1NoAck " << *frame;
 	writeL1(frame);
 }
 
 
-void L2LAPDm::writeL1Ack(const L2Frame& frame)
+void L2LAPDm::writeL1Ack(L2Frame* frame)
 {
-	// Caller should hold mLock.
 	// GSM 04.06 5.4.4.2
-	OBJLOG(DEEPDEBUG) <<"L2LAPDm::writeL1Ack " << frame;
-	frame.copyTo(mSentFrame);
-	mSentFrame.primitive(frame.primitive());
-	writeL1(frame);
-	mT200.set();
+	OBJLOG(DEEPDEBUG) <<"L2LAPDm::writeL1Ack " << *frame;
+	// Keep the frame itself for retransmission, rather than a copy.
+	if (mSentFrame) mSentFrame->release();
+	mSentFrame = frame->ref();
+	writeL1(frame,true);
 }
 
 
-
-void L2LAPDm::waitForAck()
+void L2LAPDm::transmit()
 {
-	// Block until any pending ack is received.
-	// Caller should hold mLock.
-	OBJLOG(DEBUG) <<"L2LAPDm::waitForAck state=" << mState << " VS=" << mVS << " VA=" << mVA;
+	// Called in an L1 writer.
 	while (true) {
-		if (mState==LinkReleased) break;
-		if ((mState==ContentionResolution) && (mVS==mVA)) break;
-		if ((mState==LinkEstablished) && (mVS==mVA)) break;
-		// HACK -- We should not need a timeout here.
-		mAckSignal.wait(mLock,N200()*T200ms);
-		OBJLOG(DEBUG) <<"L2LAPDm::waitForAck state=" << mState << " VS=" << mVS << " VA=" << mVA;
+		mQueueLock.lock();
+		if (mL1Out.empty()) {
+			mTransmitting = false;
+			mQueueLock.unlock();
+			return;
+		}
+		Transmission transmission = mL1Out.front();
+		mL1Out.pop_front();
+		mQueueLock.unlock();
+		mDownstream->writeHighSide(*transmission.frame);
+		mEngine->wrote();
+		transmission.frame->release();
+		if (transmission.ackable) {
+			// Let the engine start T200.
+			mQueueLock.lock();
+			mAckableWritten++;
+			mQueueLock.unlock();
+			mEngine->schedule(this);
+		}
 	}
 }
 
 
+void L2LAPDm::startT200()
+{
+	mT200Pending = false;
+	mEngine->timers().add(mT200,T200());
+}
+
+
+void L2LAPDm::stopT200()
+{
+	mT200Pending = false;
+	mEngine->timers().remove(mT200);
+}
+
+
 
 void L2LAPDm::releaseLink()
 {
 	OBJLOG(DEBUG) << "mState=" << mState;
-	// Caller should hold mLock.
 	mState = LinkReleased;
 	mEstablishmentInProgress = false;
-	mAckSignal.signal();
-	if (mSAPI==0) writeL1(RELEASE);
-	mL3Out.write(new L3Frame(RELEASE));
+	if (mSAPI==0) writeL1(new L2Frame(RELEASE));
+	writeL3(new L3Frame(RELEASE));
 }
 
 
 void L2LAPDm::clearCounters()
 {
 	OBJLOG(DEBUG) << "mState=" << mState;
-	// Caller should hold mLock.
 	// This is called upon establishment or re-establihment of ABM.
-	mT200.reset();
+	stopT200();
 	mVS = 0;
 	mVA = 0;
 	mVR = 0;
 	mRC = 0;
 	mIdleCount=0;
-	mRecvBuffer.clear();
+	delete mRecvBuffer;
+	mRecvBuffer = NULL;
+	mRecvBits = 0;
 	discardIQueue();
 }
 
@@ -178,7 +476,6 @@ void L2LAPDm::clearCounters()
 void L2LAPDm::clearState()
 {
 	OBJLOG(DEBUG) << "mState=" << mState;
-	// Caller should hold mLock.
 	// Reset the state machine.
 	clearCounters();
 	releaseLink();
@@ -192,14 +489,12 @@ void L2LAPDm::processAck(unsigned NR)
 	// Q.921 5.6.3.2, 5.8.2.
 	// Equivalent to vISDN datalink.c:lapd_ack_frames,
 	// but much simpler for LAPDm.
-	// Caller should hold mLock.
 	OBJLOG(DEBUG) << "NR=" << NR << " VA=" << mVA << " VS=" << mVS;
 	mVA=NR;
 	if (mVA==mVS) {
 		mRC=0;
-		mT200.reset();
+		stopT200();
 	}
-	mAckSignal.signal();
 }
 
 
@@ -222,25 +517,38 @@ void L2LAPDm::bufferIFrameData(const L2Frame& frame)
 	*/
 
 	OBJLOG(DEBUG) << frame;
-	if (!frame.M()) {
-		// The last or only frame.
-		if (mRecvBuffer.size()==0) {
-			// The only frame -- just send it up.
-			OBJLOG(DEBUG) << "single frame message";
-			mL3Out.write(new L3Frame(frame));
-			return;
-		}
-		// The last of several -- concat and send it up.
-		OBJLOG(DEBUG) << "last frame of message";
-		mL3Out.write(new L3Frame(mRecvBuffer,frame.L3Part()));
-		mRecvBuffer.clear();
+	if (!frame.M() && !mRecvBuffer) {
+		// The only frame -- just send it up.
+		OBJLOG(DEBUG) << "single frame message";
+		writeL3(new L3Frame(frame));
+		return;
+	}
+
+	// Segments are copied once, into a frame big enough for any message.
+	const BitVector payload = frame.L3Part();
+	if (!mRecvBuffer) mRecvBuffer = new L3Frame(DATA,L3Frame::maxBits);
+	if (mRecvBits+payload.size() > mRecvBuffer->size()) {
+		// Longer than GSM allows, but take it anyway.
+		L3Frame *bigger = new L3Frame(DATA,2*mRecvBuffer->size());
+		mRecvBuffer->copyToSegment(*bigger,0,mRecvBits);
+		delete mRecvBuffer;
+		mRecvBuffer = bigger;
+	}
+	payload.copyToSegment(*mRecvBuffer,mRecvBits);
+	mRecvBits += payload.size();
+
+	if (frame.M()) {
+		// One segment of many.
+		OBJLOG(DEBUG) <<"buffering recvBits=" << mRecvBits;
 		return;
 	}
 
-	// One segment of many -- concat.
-	// This is inefficient but simple.
-	mRecvBuffer = L3Frame(mRecvBuffer,frame.L3Part());
-	OBJLOG(DEBUG) <<"buffering recvBuffer=" << mRecvBuffer;
+	// The last of several -- send it up.
+	OBJLOG(DEBUG) << "last frame of message";
+	mRecvBuffer->truncate(mRecvBits);
+	writeL3(mRecvBuffer);
+	mRecvBuffer = NULL;
+	mRecvBits = 0;
 }
 
 
@@ -250,21 +558,19 @@ void L2LAPDm::unexpectedMessage()
 	// vISDN datalink.c:unexpeced_message
 	// For LAPD, vISDN just keeps trying.
 	// For LAPDm, just terminate the link.
-	// Caller should hold mLock.
 	abnormalRelease();
 }
 
 
 void L2LAPDm::abnormalRelease()
 {
-	// Caller should hold mLock.
 	OBJLOG(INFO) << "state=" << mState;
 	// GSM 04.06 5.6.4.
 	// We're cutting a corner here that we'll
 	// clean up when L3 is more stable.
-	mL3Out.write(new L3Frame(ERROR));
+	writeL3(new L3Frame(ERROR));
 	sendUFrameDM(true);
-	writeL1(ERROR);
+	writeL1(new L2Frame(ERROR));
 	clearState();
 }
 
@@ -272,14 +578,12 @@ void L2LAPDm::abnormalRelease()
 
 void L2LAPDm::retransmissionProcedure()
 {
-	// Caller should hold mLock.
 	// vISDN datalink.c:lapd_invoke_retransmission_procedure
 	// GSM 04.08 5.5.7, bullet point (a)
 	OBJLOG(DEBUG) << "VS=" << mVS << " VA=" << mVA << " RC=" << mRC;
 	mRC++;
-	writeL1(mSentFrame);
-	mT200.set();
-	mAckSignal.signal();
+	assert(mSentFrame);
+	writeL1(mSentFrame->ref(),true);
 }
 
 
@@ -288,35 +592,156 @@ void L2LAPDm::retransmissionProcedure()
 void L2LAPDm::open()
 {
 	OBJLOG(DEBUG);
-	mLock.lock();
-	if (!mRunning) {
+	if (!mOpened) {
 		// We can't call this from the constructor,
 		// since N201 may not be defined yet.
 		mMaxIPayloadBits = 8*N201(L2Control::IFormat);
-		mRunning = true;
-		mUpstreamThread.start((void *(*)(void*))LAPDmServiceLoopAdapter,this);
+		mOpened = true;
 	}
+	mEngine->start();
 	mL3Out.clear();
 	mL1In.clear();
-	clearCounters();
-	mState = LinkReleased;
-	mAckSignal.signal();
-	mLock.unlock();
-	if (mSAPI==0) sendIdle();
+	// The reset itself runs in the engine.
+	L2Future opened;
+	mQueueLock.lock();
+	mOpens.push_back(&opened);
+	mQueueLock.unlock();
+	mEngine->schedule(this);
+	opened.wait();
 }
 
 
-void *GSM::LAPDmServiceLoopAdapter(L2LAPDm *lapdm)
+
+void L2LAPDm::writeHighSide(const L3Frame& frame)
 {
-	lapdm->serviceLoop();
-	return NULL;
+	OBJLOG(DEBUG) << frame;
+	// The engine would wait on itself.
+	assert(!mEngine->inLoop());
+	L2Future written;
+	// The frame is not copied, since we block until L2 is done with it.
+	queueRequest(const_cast<L3Frame*>(&frame),false,&written);
+	// HACK -- Sleep before returning to prevent fast spinning
+	// in SACCH L3 during release.
+	if (!written.wait()) sleepFrames(51);
 }
 
 
+void L2LAPDm::post(const L3Frame& frame, L2Completion* completion)
+{
+	queueRequest(new L3Frame(frame),true,completion);
+}
+
 
-void L2LAPDm::writeHighSide(const L3Frame& frame)
+void L2LAPDm::post(L3Frame* frame, L2Completion* completion)
 {
-	OBJLOG(DEBUG) << frame;
+	queueRequest(frame,true,completion);
+}
+
+
+void L2LAPDm::queueRequest(L3Frame* frame, bool owned, L2Completion* completion)
+{
+	OBJLOG(DEBUG) << *frame;
+	mEngine->start();
+	Request request;
+	request.frame = frame;
+	request.owned = owned;
+	request.completion = completion;
+	mQueueLock.lock();
+	mL3In.push_back(request);
+	mQueueLock.unlock();
+	mEngine->schedule(this);
+}
+
+
+
+void L2LAPDm::writeLowSide(const L2Frame& frame)
+{
+	writeLowSide(new L2Frame(frame));
+}
+
+
+void L2LAPDm::writeLowSide(L2Frame* frame)
+{
+	OBJLOG(DEBUG) << *frame;
+	mL1In.write(frame);
+	mEngine->schedule(this);
+}
+
+
+
+void L2LAPDm::checkMaster()
+{
+	if (!mMaster) return;
+	if (mMaster->mState==LinkReleased) mState=LinkReleased;
+}
+
+
+void L2LAPDm::service()
+{
+	mQueueLock.lock();
+	unsigned written = mAckableWritten;
+	mAckableWritten = 0;
+	L2Completion *opened = NULL;
+	if (!mOpens.empty()) {
+		opened = mOpens.front();
+		mOpens.pop_front();
+	}
+	bool moreOpens = !mOpens.empty();
+	mQueueLock.unlock();
+
+	// Start T200 once the last ack-able frame is on its way.
+	if (written) {
+		assert(written<=mAckableQueued);
+		mAckableQueued -= written;
+		if (mT200Pending && mAckableQueued==0) startT200();
+	}
+
+	if (opened) {
+		OBJLOG(DEBUG) << "open, state=" << mState;
+		clearCounters();
+		mState = LinkReleased;
+		if (mSAPI==0) sendIdle();
+		opened->done(true);
+		if (moreOpens) mEngine->schedule(this);
+	}
+
+	while (true) {
+		L2Frame* frame = mL1In.readNoBlock();
+		if (!frame) break;
+		checkMaster();
+		OBJLOG(DEBUG) << "state=" << mState << " received " << *frame;
+		receiveFrame(*frame);
+		delete frame;
+	}
+
+	checkMaster();
+	serviceRequests();
+}
+
+
+void L2LAPDm::serviceRequests()
+{
+	while (true) {
+		if (!mRequest.frame) {
+			mQueueLock.lock();
+			if (mL3In.empty()) {
+				mQueueLock.unlock();
+				return;
+			}
+			mRequest = mL3In.front();
+			mL3In.pop_front();
+			mQueueLock.unlock();
+			mRequestStarted = false;
+			mSendIndex = 0;
+		}
+		if (!processRequest()) return;
+	}
+}
+
+
+bool L2LAPDm::processRequest()
+{
+	const L3Frame& frame = *mRequest.frame;
 	switch (frame.primitive()) {
 		case UNIT_DATA:
 			// Send the data in a single U-Frame.
@@ -324,9 +749,17 @@ void L2LAPDm::writeHighSide(const L3Frame& frame)
 			break;
 		case DATA:
 			// Send the data as a series of I-Frames.
-			mLock.lock();
-			sendMultiframeData(frame);
-			mLock.unlock();
+			if (!mRequestStarted) {
+				mRequestStarted = true;
+				if (mState==LinkReleased) {
+					OBJLOG(ERROR) << "attempt to send DATA on released LAPm channel";
+					abnormalRelease();
+					completeRequest(false);
+					return true;
+				}
+				mDiscardIQueue = false;
+			}
+			if (!sendMultiframeData()) return false;
 			break;
 		case ESTABLISH:
 			// GSM 04.06 5.4.1.2
@@ -335,98 +768,61 @@ void L2LAPDm::writeHighSide(const L3Frame& frame)
 			// See note in GSM 04.06 5.4.1.1.
 			assert(mSAPI!=0 || mC==0);
 			if (mState==LinkEstablished) break;
-			mLock.lock();
 			clearCounters();
 			mState=AwaitingEstablish;
-			mLock.unlock();
 			sendUFrameSABM();
 			break;
 		case RELEASE:
 			// GSM 04.06 5.4.4.2
 			// vISDN datalink.c:lapd_dl_release_request
-			if (mState==LinkReleased) break;
-			mLock.lock();
-			if (mState==LinkEstablished) waitForAck();
-			clearCounters();
-			mEstablishmentInProgress=false;
-			mState=AwaitingRelease;
-			mT200.set();	// HACK?
-			// Send DISC and wait for UA.
-			// Don't return until released.
-			sendUFrameDISC();
-			waitForAck();
-			mLock.unlock();
+			if (!mRequestStarted) {
+				if (mState==LinkReleased) break;
+				// Let the last I-frame be acked first.
+				if ((mState==LinkEstablished) && (mVS!=mVA)) return false;
+				mRequestStarted = true;
+				clearCounters();
+				mEstablishmentInProgress=false;
+				mState=AwaitingRelease;
+				// Send DISC and wait for UA.
+				sendUFrameDISC();
+			}
+			// Don't complete until released.
+			if (mState!=LinkReleased) return false;
 			break;
 		case ERROR:
 			// Forced release.
-			mLock.lock();
 			abnormalRelease();
-			mLock.unlock();
 			break;
 		case HARDRELEASE:
-			mLock.lock();
 			clearState();
-			mLock.unlock();
 			break;
 		default:
 			OBJLOG(ERROR) << "unhandled primitive in L3->L2 " << frame;
 			assert(0);
 	}
+	completeRequest(true);
+	return true;
 }
 
 
-
-
-
-void L2LAPDm::writeLowSide(const L2Frame& frame)
+void L2LAPDm::completeRequest(bool ok)
 {
-	OBJLOG(DEBUG) << frame;
-	mL1In.write(new L2Frame(frame));
+	L2Completion *completion = mRequest.completion;
+	if (mRequest.owned) delete mRequest.frame;
+	mRequest.frame = NULL;
+	mRequest.completion = NULL;
+	if (completion) completion->done(ok);
 }
 
 
 
-void L2LAPDm::serviceLoop()
-{
-	mLock.lock();
-	while (mRunning) {
-		// Block for up to T200 expiration, then check T200.
-		// Allow other threads to modify state while blocked.
-		// Add 2 ms to prevent race condition due to roundoff error.
-		unsigned timeout = mT200.remaining() + 2;
-		// If SAP0 is released, other SAPs need to release also.
-		if (mMaster) {
-			if (mMaster->mState==LinkReleased) mState=LinkReleased;
-		}
-		if (!mT200.active()) {
-			if (mState==LinkReleased) timeout=3600000;
-			else timeout = T200();
-		}
-		OBJLOG(DEBUG) << "read blocking up to " << timeout << " ms, state=" << mState;
-		mLock.unlock();
-		// FIXME -- If the link is released, there should be no timeout at all.
-		L2Frame* frame = mL1In.read(timeout);
-		mLock.lock();
-		if (frame!=NULL) {
-			OBJLOG(DEBUG) << "state=" << mState << " received " << *frame;
-			receiveFrame(*frame);
-			delete frame;
-		}
-		if (mT200.expired()) T200Expiration();
-	}
-	mLock.unlock();
-}
-	
-
-
 
 void L2LAPDm::T200Expiration()
 {
-	// Caller should hold mLock.
 	// vISDN datalink.c:timer_T200.
 	// GSM 04.06 5.4.1.3, 5.4.4.3, 5.5.7, 5.7.2.
 	OBJLOG(DEBUG) << "state=" << mState << " RC=" << mRC;
-	mT200.reset();
+	mT200Pending = false;
 	switch (mState) {
 		case AwaitingRelease:
 			releaseLink();
@@ -454,8 +850,6 @@ void L2LAPDm::receiveFrame(const GSM::L2Frame& frame)
 {
 	OBJLOG(DEBUG) << frame;
 
-	// Caller should hold mLock.
-
 	// Accept and process an incoming frame on the L1->L2 interface.
 	// See vISDN datalink.c:lapd_dlc_recv for another example.
 
@@ -510,7 +904,6 @@ void L2LAPDm::receiveUFrame(const L2Frame& frame)
 
 void L2LAPDm::receiveUFrameSABM(const L2Frame& frame)
 {
-	// Caller should hold mLock.
 	// Process the incoming SABM command.
 	// GSM 04.06 3.8.2, 5.4.1
 	// Q.921 5.5.1.2.
@@ -528,13 +921,13 @@ void L2LAPDm::receiveUFrameSABM(const L2Frame& frame)
 			clearCounters();
 			mEstablishmentInProgress = true;
 			// Tell L3 what happened.
-			mL3Out.write(new L3Frame(ESTABLISH));
+			writeL3(new L3Frame(ESTABLISH));
 			if (frame.L()) {
 				// Presence of an L3 payload indicates contention resolution.
 				// GSM 04.06 5.4.1.4.
 				mState=ContentionResolution;
 				mContentionCheck = frame.sum();
-				mL3Out.write(new L3Frame(frame.L3Part(),DATA));
+				writeL3(new L3Frame(frame.L3Part(),DATA));
 				// Echo back payload.
 				sendUFrameUA(frame);
 			} else {
@@ -590,7 +983,6 @@ void L2LAPDm::receiveUFrameSABM(const L2Frame& frame)
 
 void L2LAPDm::receiveUFrameDISC(const L2Frame& frame)
 {
-	// Caller should hold mLock.
 	OBJLOG(DEBUG) << "state=" << mState;
 	mEstablishmentInProgress = false;
 	switch (mState) {
@@ -623,7 +1015,6 @@ void L2LAPDm::receiveUFrameDISC(const L2Frame& frame)
 
 void L2LAPDm::receiveUFrameUA(const L2Frame& frame)
 {
-	// Caller should hold mLock.
 	// GSM 04.06 3.8.8
 	// vISDN datalink.c:lapd_socket_handle_uframe_ua
 
@@ -638,8 +1029,7 @@ void L2LAPDm::receiveUFrameUA(const L2Frame& frame)
 			// We sent SABM and the peer responded.
 			clearCounters();
 			mState = LinkEstablished;
-			mAckSignal.signal();
-			mL3Out.write(new L3Frame(ESTABLISH));
+			writeL3(new L3Frame(ESTABLISH));
 			break;
 		case AwaitingRelease:
 			// We sent DISC and the peer responded.
@@ -654,7 +1044,6 @@ void L2LAPDm::receiveUFrameUA(const L2Frame& frame)
 
 void L2LAPDm::receiveUFrameDM(const L2Frame& frame)
 {
-	// Caller should hold mLock.
 	OBJLOG(DEBUG) << "state=" << mState;
 	// GSM 04.06 5.4.5
 	if (mState==LinkReleased) return;
@@ -678,7 +1067,7 @@ void L2LAPDm::receiveUFrameUI(const L2Frame& frame)
 	// The zero-length frame is the idle frame.
 	if (frame.L()==0) return;
 	OBJLOG(DEBUG) << "state=" << mState;
-	mL3Out.write(new L3Frame(frame,UNIT_DATA));
+	writeL3(new L3Frame(frame,UNIT_DATA));
 }
 
 
@@ -688,7 +1077,6 @@ void L2LAPDm::receiveUFrameUI(const L2Frame& frame)
 
 void L2LAPDm::receiveSFrame(const L2Frame& frame)
 {
-	// Caller should hold mLock.
 	// See GSM 04.06 5.4.1.4.
 	mEstablishmentInProgress = false;
 	switch (frame.SFrameType()) {
@@ -701,7 +1089,6 @@ void L2LAPDm::receiveSFrame(const L2Frame& frame)
 
 void L2LAPDm::receiveSFrameRR(const L2Frame& frame)
 {
-	// Caller should hold mLock.
 	OBJLOG(DEBUG) << "state=" << mState;
 	// GSM 04.06 3.8.5.
 	// Q.921 3.6.6.
@@ -728,7 +1115,6 @@ void L2LAPDm::receiveSFrameRR(const L2Frame& frame)
 
 void L2LAPDm::receiveSFrameREJ(const L2Frame& frame)
 {
-	// Caller should hold mLock.
 	OBJLOG(DEBUG) << "state=" << mState;
 	// GSM 04.06 3.8.6, 5.5.4
 	// Q.921 3.7.6, 5.6.4.
@@ -764,7 +1150,6 @@ void L2LAPDm::receiveSFrameREJ(const L2Frame& frame)
 
 void L2LAPDm::receiveIFrame(const L2Frame& frame)
 {
-	// Caller should hold mLock.
 	// See GSM 04.06 5.4.1.4.
 	mEstablishmentInProgress = false;
 	OBJLOG(DEBUG) << "state=" << mState << " NS=" << frame.NS() << " NR=" << frame.NR();
@@ -800,28 +1185,26 @@ void L2LAPDm::receiveIFrame(const L2Frame& frame)
 void L2LAPDm::sendSFrameRR(bool FBit)
 {
 	// GSM 04.06 3.8.5.
-	// The caller should hold mLock.
 	OBJLOG(DEBUG) << "F=" << FBit << " VS=" << mVS << " VR=" << mVR;
 	L2Address address(mR,mSAPI);
 	L2Control control(L2Control::SFormat,FBit,0);
 	static const L2Length length;
 	L2Header header(address,control,length);
 	header.control().NR(mVR);
-	writeL1NoAck(L2Frame(header));
+	writeL1NoAck(new L2Frame(header));
 }
 
 
 void L2LAPDm::sendSFrameREJ(bool FBit)
 {
 	// GSM 04.06 3.8.6.
-	// The caller should hold mLock.
 	OBJLOG(DEBUG) << "F=" << FBit << " state=" << mState;
 	L2Address address(mR,mSAPI);
 	L2Control control(L2Control::SFormat,FBit,2);
 	static const L2Length length;
 	L2Header header(address,control,length);
 	header.control().NR(mVR);
-	writeL1NoAck(L2Frame(header));
+	writeL1NoAck(new L2Frame(header));
 }
 
 
@@ -829,25 +1212,23 @@ void L2LAPDm::sendSFrameREJ(bool FBit)
 
 void L2LAPDm::sendUFrameDM(bool FBit)
 {
-	// The caller need not hold mLock.
 	OBJLOG(DEBUG) << "F=" << FBit << " state=" << mState;
 	L2Address address(mR,mSAPI);
 	L2Control control(L2Control::UFormat,FBit,0x03);
 	static const L2Length length;
 	L2Header header(address,control,length);
-	writeL1NoAck(L2Frame(header));
+	writeL1NoAck(new L2Frame(header));
 }
 
 
 void L2LAPDm::sendUFrameUA(bool FBit)
 {
-	// The caller need not hold mLock.
 	OBJLOG(DEBUG) << "F=" << FBit << " state=" << mState;
 	L2Address address(mR,mSAPI);
 	L2Control control(L2Control::UFormat,FBit,0x0C);
 	static const L2Length length;
 	L2Header header(address,control,length);
-	writeL1NoAck(L2Frame(header));
+	writeL1NoAck(new L2Frame(header));
 }
 
 
@@ -856,13 +1237,12 @@ void L2LAPDm::sendUFrameUA(const L2Frame& frame)
 	// Send UA frame with a echoed payload.
 	// This is used in the contention resolution procedure.
 	// GSM 04.06 5.4.1.4.
-	// The caller need not hold mLock.
 	OBJLOG(DEBUG) << "state=" << mState << " " << frame;
 	L2Address address(mR,mSAPI);
 	L2Control control(L2Control::UFormat,frame.PF(),0x0C);
 	L2Length length(frame.L());
 	L2Header header(address,control,length);
-	writeL1NoAck(L2Frame(header,frame.L3Part()));
+	writeL1NoAck(new L2Frame(header,frame.L3Part()));
 }
 
 
@@ -871,95 +1251,80 @@ void L2LAPDm::sendUFrameUA(const L2Frame& frame)
 void L2LAPDm::sendUFrameSABM()
 {
 	// GMS 04.06 3.8.2, 5.4.1
-	// The caller need not hold mLock.
 	OBJLOG(DEBUG) << "state=" << mState;
 	L2Address address(mC,mSAPI);
 	L2Control control(L2Control::UFormat,1,0x07);
 	static const L2Length length;
 	L2Header header(address,control,length);
-	writeL1Ack(L2Frame(header));
+	writeL1Ack(new L2Frame(header));
 }
 
 
 void L2LAPDm::sendUFrameDISC()
 {
 	// GMS 04.06 3.8.3, 5.4.4.2
-	// The caller need not hold mLock.
 	OBJLOG(DEBUG) << "state=" << mState;
 	L2Address address(mC,mSAPI);
 	L2Control control(L2Control::UFormat,1,0x08);
 	static const L2Length length;
 	L2Header header(address,control,length);
-	writeL1Ack(L2Frame(header));
+	writeL1Ack(new L2Frame(header));
 }
 
 
 void L2LAPDm::sendUFrameUI(const L3Frame& l3)
 {
 	// GSM 04.06 3.8.4, 5.3.2, not supporting the short header format.
-	// The caller need not hold mLock.
 	OBJLOG(DEBUG) << "state=" << mState << " payload=" << l3;
 	L2Address address(mC,mSAPI);
 	L2Control control(L2Control::UFormat,1,0x00);
 	L2Length length(l3.length());
 	L2Header header(address,control,length);
-	writeL1NoAck(L2Frame(header,l3));
+	writeL1NoAck(new L2Frame(header,l3));
 }
 
 
 
 
-void L2LAPDm::sendMultiframeData(const L3Frame& l3)
+bool L2LAPDm::sendMultiframeData()
 {
 	// GSM 04.06 5.4.2
-	// Caller holds mLock.
+	const L3Frame& l3 = *mRequest.frame;
 	OBJLOG(DEBUG) << "state=" << mState << " payload=" << l3;
-	// HACK -- Sleep before returning to prevent fast spinning
-	// in SACCH L3 during release.
-	if (mState==LinkReleased) {
-		OBJLOG(ERROR) << "attempt to send DATA on released LAPm channel";
-		abnormalRelease();
-		sleepFrames(51);
-		return;
-	}
-	mDiscardIQueue = false;
-	size_t bitsRemaining = l3.size();
-	size_t sendIndex = 0;
-	OBJLOG(DEBUG) << "sendIndex=" << sendIndex<< " bitsRemaining=" << bitsRemaining;
-	while (bitsRemaining>0) {
+	while (mSendIndex < l3.size()) {
+		size_t bitsRemaining = l3.size() - mSendIndex;
 		size_t thisChunkSize = bitsRemaining;
 		bool MBit = false;
-		if (thisChunkSize==0) break;
 		if (thisChunkSize>mMaxIPayloadBits) {
 			thisChunkSize = mMaxIPayloadBits;
 			MBit = true;
 		}
-		// This is the point where we block and allow
-		// the upstream thread to modify the LAPDm state.
-		waitForAck();
+		// Wait for the ack of the previous I-frame, k=1.
+		// The engine calls back here as the state changes.
+		bool acked = ((mState==LinkEstablished) || (mState==ContentionResolution)) && (mVS==mVA);
+		if (!acked && (mState!=LinkReleased)) return false;
 		// Did we abort multiframe mode while waiting?
 		if (mDiscardIQueue) {
 			OBJLOG(DEBUG) <<"aborting (discard)";
-			break;
+			return true;
 		}
 		if ((mState!=LinkEstablished) && (mState!=ContentionResolution)) {
 			OBJLOG(DEBUG) << "aborting, state=" << mState;
-			break;
+			return true;
 		}
 		OBJLOG(DEBUG) << "state=" << mState
-				<< " sendIndex=" << sendIndex << " thisChunkSize=" << thisChunkSize
+				<< " sendIndex=" << mSendIndex << " thisChunkSize=" << thisChunkSize
 				<< " bitsRemaining=" << bitsRemaining << " MBit=" << MBit;
-		sendIFrame(l3.segment(sendIndex,thisChunkSize),MBit);
-		sendIndex += thisChunkSize;
-		bitsRemaining -= thisChunkSize;
+		sendIFrame(l3.segment(mSendIndex,thisChunkSize),MBit);
+		mSendIndex += thisChunkSize;
 	}
+	return true;
 }
 
 
 
 void L2LAPDm::sendIFrame(const BitVector& payload, bool MBit)
 {
-	// Caller should hold mLock.
 	// GSM 04.06 5.5.1
 	OBJLOG(DEBUG) << "M=" << MBit << " VS=" << mVS  << " payload=" << payload;
 	// Lots of sanity checking.
@@ -973,7 +1338,7 @@ void L2LAPDm::sendIFrame(const BitVector& payload, bool MBit)
 	L2Length length(payload.size()/8,MBit);
 	L2Header header(address,control,length);
 	mVS = (mVS+1)%8;
-	writeL1Ack(L2Frame(header,payload));
+	writeL1Ack(new L2Frame(header,payload));
 }
 
 
@@ -34,6 +34,11 @@ implementation, although no code is copied directly.
 #include "GSMCommon.h"
 #include "GSMTransfer.h"
 
+#include <deque>
+#include <vector>
+#include <Threads.h>
+#include <TimerWheel.h>
+
 
 namespace GSM {
 
@@ -103,6 +108,10 @@ class L2DL {
 	/** The L1->L2 interface */
 	virtual void writeLowSide(const GSM::L2Frame&) = 0;
 
+	/** The L1->L2 interface, taking ownership of the frame. */
+	virtual void writeLowSide(GSM::L2Frame* frame)
+		{ writeLowSide(*frame); delete frame; }
+
 	/** The L2->L3 interface. */
 	virtual L3Frame* readHighSide(unsigned timeout=3600000) = 0;
 
@@ -129,6 +138,8 @@ class CCCHL2 : public L2DL {
 
 	void open() {}
 
+	using L2DL::writeLowSide;
+
 	void writeLowSide(const GSM::L2Frame&) { assert(0); }
 
 	L3Frame* readHighSide(unsigned timeout=3600000) { assert(0); return NULL; }
@@ -142,6 +153,160 @@ class CCCHL2 : public L2DL {
 
 
 
+class L2LAPDm;
+
+
+/**
+	The completion of an L3->L2 request posted with L2LAPDm::post.
+	This is how an event-driven L3 learns that a request is done
+	without blocking a thread on it.
+*/
+class L2Completion {
+
+	public:
+
+	virtual ~L2Completion() {}
+
+	/**
+		Called once, from the LAPDm engine thread, when the request is done.
+		This must not block.
+		@param ok False if the request was refused because the link was released.
+	*/
+	virtual void done(bool ok) = 0;
+};
+
+
+/** An L2Completion that a thread can block on, a future. */
+class L2Future : public L2Completion {
+
+	private:
+
+	Mutex mLock;
+	Signal mSignal;
+	bool mDone;
+	bool mOK;
+
+	public:
+
+	L2Future():mDone(false),mOK(false) {}
+
+	void done(bool ok);
+
+	/** Block until the request is done and return its result. */
+	bool wait();
+};
+
+
+
+/**
+	The event loop shared by all of the LAPDm entities in the process.
+
+	One thread runs every LAPDm state machine.  Frames from L1 and
+	requests from L3 are queued on their link, which is then put on
+	the ready list; T200 is an entry in a timer wheel.  So the number
+	of threads does not depend on the number of channels.
+
+	Writes to L1 can block for up to a TDMA block, so they are done by
+	a pool of writer threads, never by the loop itself.  Each link's
+	frames are written in order by one writer at a time.  The pool
+	grows only when links wait while every writer has been stuck in L1
+	for a tick, up to a limit, so it follows the number of channels
+	blocked in L1 at once, not the number of links.
+*/
+class LAPDmEngine {
+
+	private:
+
+	mutable Mutex mLock;			///< guards the lists, the writer counts, mStarted and mStopping
+	Signal mReadySignal;			///< wakes the loop
+	Signal mTransmitSignal;			///< wakes the writers
+	L2LAPDm *mReadyHead;			///< links with events to handle
+	L2LAPDm *mReadyTail;
+	L2LAPDm *mTransmitHead;			///< links with frames to write to L1
+	L2LAPDm *mTransmitTail;
+
+	TimerWheel mTimers;				///< T200 of every link, used by the loop thread only
+
+	unsigned mNumWriters;			///< writer threads started
+	unsigned mMaxWriters;			///< limit on mNumWriters
+	unsigned mBusyWriters;			///< writers in L1
+	unsigned mQueuedLinks;			///< links on the transmit list
+	Timeval mLastWrite;				///< last time a writer got a frame through L1
+	bool mStarted;
+	bool mStopping;					///< tells the threads to return
+	volatile bool mLoopRunning;		///< mLoopID is valid
+	pthread_t mLoopID;
+	Thread *mLoopThread;
+	std::vector<Thread*> mWriterThreads;
+
+	public:
+
+	/**
+		Create an engine; it starts with its first link.
+		@param wMaxWriters The most L1 writer threads to run.
+	*/
+	LAPDmEngine(unsigned wMaxWriters=32);
+
+	/** Start the threads, if they are not running yet. */
+	void start();
+
+	/**
+		Stop and join the threads, for an orderly exit.
+		Links are left as they are; they must not be used again unless
+		the engine is started again.  A writer stuck in L1 holds this up.
+	*/
+	void stop();
+
+	/** Put a link on the ready list, from any thread. */
+	void schedule(L2LAPDm*);
+
+	/** Put a link on the list for the L1 writers, from any thread. */
+	void transmit(L2LAPDm*);
+
+	/** The timers, for the loop thread only. */
+	TimerWheel& timers() { return mTimers; }
+
+	/** Return true if called from the loop thread. */
+	bool inLoop() const { return mLoopRunning && pthread_equal(mLoopID,pthread_self()); }
+
+	/** Number of threads the engine uses now. */
+	unsigned numThreads() const;
+
+	protected:
+
+	/** Handle ready links and expired timers, until stopped. */
+	void serviceLoop();
+
+	/** Write frames from the links on the transmit list, until stopped. */
+	void writerLoop();
+
+	/** Start another writer; caller holds mLock. */
+	void startWriter();
+
+	/** Start another writer if the writers are stuck; caller holds mLock. */
+	void checkWriters();
+
+	/** Note that a writer got a frame through L1. */
+	void wrote();
+
+	friend void *LAPDmEngineLoopAdapter(LAPDmEngine*);
+	friend void *LAPDmEngineWriterAdapter(LAPDmEngine*);
+	friend class L2LAPDm;
+};
+
+
+/**@name Thread entry points of LAPDmEngine. */
+//@{
+void *LAPDmEngineLoopAdapter(LAPDmEngine*);
+void *LAPDmEngineWriterAdapter(LAPDmEngine*);
+//@}
+
+
+/** The LAPDm engine of the process. */
+extern LAPDmEngine gLAPDmEngine;
+
+
+
 /**
 	LAPDm transceiver, GSM 04.06, borrows from ITU-T Q.921 (LAPD) and ISO-13239 (HDLC).
 	Dedicated control channels need full-blown LAPDm.
@@ -163,6 +328,9 @@ class CCCHL2 : public L2DL {
 		- using the Bbis format for L3 messages that use the L2 pseudolength element
 		- just using independent L2s for each active SAP
 		- just using independent L2s on each dedicated channel, which works with k=1
+
+	The state machine runs in gLAPDmEngine and its state belongs to the
+	engine thread.  Other threads talk to it only through the queues.
 */
 class L2LAPDm : public L2DL {
 
@@ -183,8 +351,29 @@ class L2LAPDm : public L2DL {
 
 	protected:
 
-	Thread mUpstreamThread;		///< a thread for upstream traffic and T200 timeouts
-	bool mRunning;				///< true once the service loop starts
+	/** An L3 request waiting for the state machine. */
+	struct Request {
+		L3Frame *frame;
+		bool owned;				///< delete the frame when done
+		L2Completion *completion;
+	};
+
+	/** A frame waiting for an L1 writer. */
+	struct Transmission {
+		L2Frame *frame;
+		bool ackable;			///< start T200 once written
+	};
+
+	/** T200 as a timer-wheel entry. */
+	class T200Timer : public TimerWheelEntry {
+		L2LAPDm *mLink;
+		public:
+		T200Timer(L2LAPDm *wLink):mLink(wLink) {}
+		void expired();
+	};
+
+	LAPDmEngine *mEngine;		///< the engine that runs this link
+	bool mOpened;				///< true once the link has been opened
 	L3FrameFIFO mL3Out;			///< we connect L2->L3 through a FIFO
 	L2FrameFIFO mL1In;			///< we connect L1->L2 through a FIFO
 
@@ -195,37 +384,56 @@ class L2LAPDm : public L2DL {
 
 	L2LAPDm *mMaster;		///< This points to the SAP0 LAPDm on this channel.
 
+	/**@name Queues between the engine and the other threads, guarded by mQueueLock. */
+	//@{
+	mutable Mutex mQueueLock;
+	std::deque<Request> mL3In;			///< L3 requests not yet taken by the engine
+	std::deque<L2Completion*> mOpens;	///< pending open() calls
+	std::deque<Transmission> mL1Out;	///< frames for the L1 writers
+	bool mTransmitting;			///< a writer owns mL1Out
+	unsigned mAckableWritten;	///< ack-able frames written since the engine last looked
+	//@}
 
+	/**@name Engine list links, guarded by the engine's lock. */
+	//@{
+	bool mScheduled;			///< on the engine's ready list
+	L2LAPDm *mNextReady;
+	L2LAPDm *mNextTransmit;
+	//@}
 
-	/**@name Mutex-protected state shared by uplink and downlink threads. */
+	/**@name State of the state machine, used in the engine thread only. */
 	//@{
-	mutable Mutex mLock;
 	/**@name State variables from GSM 04.06 3.5.2 */
 	//@{
 	unsigned mVS;			///< GSM 3.5.2.2, Q.921 3.5.2.2, send counter, NS+1 of last sent I-frame
 	unsigned mVA;			///< GSM 3.5.2.3, Q.921 3.5.2.3, ack counter, NR+1 of last acked I-frame
 	unsigned mVR;			///< GSM 3.5.2.5, Q.921 3.5.2.5, recv counter, NR+1 of last recvd I-frame
 	LAPDState mState;		///< current protocol state
-	Signal mAckSignal;		///< signal used to wake a thread waiting for an ack
 	//@}
 	bool mEstablishmentInProgress;	///< flag described in GSM 04.06 5.4.1.4
 	/**@name Segmentation and retransmission. */
 	//@{
-	BitVector mRecvBuffer;	///< buffer to concatenate received I-frames, same role as sk_rcvbuf in vISDN
-	L2Frame mSentFrame;		///< previous ack-able kept for retransmission, same role as sk_write_queue in vISDN
+	L3Frame *mRecvBuffer;	///< buffer to concatenate received I-frames, same role as sk_rcvbuf in vISDN
+	size_t mRecvBits;		///< bits in mRecvBuffer so far
+	L2Frame *mSentFrame;	///< previous ack-able kept for retransmission, same role as sk_write_queue in vISDN, shared with L1
 	bool mDiscardIQueue;		///< a flag used to abort I-frame sending
 	unsigned mContentionCheck;	///< checksum used for contention resolution, GSM 04.06 5.4.1.4.
 	unsigned mRC;				///< retransmission counter, GSM 04.06 5.4.1-5.4.4
-	Z100Timer mT200;			///< retransmission timer, GSM 04.06 5.8.1
+	T200Timer mT200;			///< retransmission timer, GSM 04.06 5.8.1
+	bool mT200Pending;			///< T200 starts when the L1 writers are done with mAckableQueued
+	unsigned mAckableQueued;	///< ack-able frames still waiting for an L1 writer
 	size_t mMaxIPayloadBits;	///< N201*8 for the I-frame
 	//@}
+	/**@name The L3 request in progress. */
+	//@{
+	Request mRequest;			///< frame is NULL if there is none
+	bool mRequestStarted;		///< the request has changed the link state
+	size_t mSendIndex;			///< next bit of a DATA request to send
+	//@}
 	//@}
 
-	/** A handy idle frame. */
-	L2Frame mIdleFrame;
-
-	/** A lock to control multi-threaded access to L1->L2. */
-	Mutex mL1Lock;
+	/** A handy idle frame, shared with L1. */
+	L2Frame *mIdleFrame;
 
 	/** HACK -- A count of consecutive idle frames. Used to spot stuck channels. */
 	unsigned mIdleCount;
@@ -241,15 +449,19 @@ class L2LAPDm : public L2DL {
 			GSM 04.06 3.3.2.
 		@param wSAPI Service access point indicatior,
 			GSM 040.6 3.3.3.
+		@param wEngine The engine to run in.
 	*/
-	L2LAPDm(unsigned wC=1, unsigned wSAPI=0);
+	L2LAPDm(unsigned wC=1, unsigned wSAPI=0, LAPDmEngine *wEngine=&gLAPDmEngine);
 
-	virtual ~L2LAPDm() {}
+	virtual ~L2LAPDm();
 
 
 	/** Process an uplink L2 frame. */
 	void writeLowSide(const GSM::L2Frame&);
 
+	/** Process an uplink L2 frame, taking ownership of it. */
+	void writeLowSide(GSM::L2Frame* frame);
+
 	/**
 		Read the L3 output, with a timeout.
 		Caller is responsible for deleting returned object.
@@ -260,19 +472,27 @@ class L2LAPDm : public L2DL {
 	/**
 		Process a downlink L3 frame.
 		This is a blocking call and does not return until
-		all of the corresponding radio bursts have been
-		enqueued for transmission.
-		That can take up to 1/2 second.
+		all of the corresponding I-frames have been sent,
+		or, for RELEASE, until the link is released.
+		That can take several seconds.
+		It must not be called from the engine thread.
 	*/
 	void writeHighSide(const GSM::L3Frame&);
 
+	/**
+		Queue a downlink L3 frame without blocking.
+		@param frame The frame, handled as in writeHighSide.
+		@param completion If not NULL, told when the request is done.
+	*/
+	void post(const GSM::L3Frame& frame, L2Completion* completion=NULL);
+
+	/** Queue a downlink L3 frame without blocking, taking ownership of it. */
+	void post(GSM::L3Frame* frame, L2Completion* completion=NULL);
+
 
 	/** Prepare the channel for a new transaction. */
 	virtual void open();
 
-	/** Block until we receive any pending ack. */
-	void waitForAck();
-
 	/** Set the "master" SAP, SAP0; should be called no more than once. */
 	void master(L2LAPDm* wMaster)
 		{ assert(!mMaster); mMaster=wMaster; }
@@ -280,11 +500,27 @@ class L2LAPDm : public L2DL {
 
 	protected:
 
-	/** Send an L2Frame on the L2->L1 interface. */
-	void writeL1(const L2Frame&);
+	/**
+		Deliver a frame to L3.
+		The default puts it in the readHighSide FIFO;
+		an event-driven L3 can take it here instead, in the engine thread.
+	*/
+	virtual void writeL3(L3Frame* frame) { mL3Out.write(frame); }
+
+	/** Send an L2Frame on the L2->L1 interface, taking ownership of it. */
+	void writeL1(L2Frame*, bool ackable=false);
 
-	void writeL1Ack(const L2Frame&);			///< send an ack-able frame on L2->L1
-	void writeL1NoAck(const L2Frame&);			///< send a non-acked frame on L2->L1
+	void writeL1Ack(L2Frame*);			///< send an ack-able frame on L2->L1
+	void writeL1NoAck(L2Frame*);		///< send a non-acked frame on L2->L1
+
+	/** Queue an L3 request for the engine. */
+	void queueRequest(L3Frame* frame, bool owned, L2Completion* completion);
+
+	/**@name T200 control. */
+	//@{
+	void startT200();		///< start T200 now
+	void stopT200();		///< stop T200, or keep it from starting
+	//@}
 
 	/** Abort the link. */
 	void linkError();
@@ -355,7 +591,7 @@ class L2LAPDm : public L2DL {
 		lapd_send_uframe with arguments that specify the DISC frame.
 		In OpenBTS, you just call sendUFrameDISC.
 	*/
-	void sendMultiframeData(const L3Frame&);	///< send an L3 frame in one or more I-frames
+	bool sendMultiframeData();					///< send the next I-frame of the DATA request, true when done
 	void sendIFrame(const BitVector&, bool);	///< GSM 04.06 3.8.1, 5.5.1, with payload and "M" flag
 	void sendUFrameSABM();						///< GMS 04.06 3.8.2, 5.4.1
 	void sendUFrameDISC();						///< GSM 04.06 3.8.3, 5.4.4.2
@@ -386,7 +622,7 @@ class L2LAPDm : public L2DL {
 				as L1 will generate its own filler pattern that is more
 				appropriate in this condition.
 	*/
-	virtual void sendIdle() { writeL1(mIdleFrame); }
+	virtual void sendIdle() { writeL1(mIdleFrame->ref()); }
 
 	/**
 		Increment or clear the idle count based on the current frame.
@@ -394,20 +630,38 @@ class L2LAPDm : public L2DL {
 	*/
 	bool stuckChannel(const L2Frame&);
 
+	/**@name The engine side. */
+	//@{
+	/** Handle everything queued for this link; called by the engine loop. */
+	void service();
+
+	/** If SAP0 is released, other SAPs need to release also. */
+	void checkMaster();
+
 	/**
-		The upstream service loop handles incoming L2 frames and T200 timeouts.
+		Start or continue the L3 requests, in order, as far as the state allows.
+		Called after anything that can change the state.
 	*/
-	void serviceLoop();
+	void serviceRequests();
 
-	friend void *LAPDmServiceLoopAdapter(L2LAPDm*);
-};
+	/**
+		Start or continue the current request.
+		@return true if it is done.
+	*/
+	bool processRequest();
 
+	/** Finish the current request. */
+	void completeRequest(bool ok);
 
-std::ostream& operator<<(std::ostream&, L2LAPDm::LAPDState);
+	/** Write the queued frames to L1; called by an engine writer. */
+	void transmit();
+	//@}
+
+	friend class LAPDmEngine;
+};
 
 
-/** C-style adapter for LAPDm serice loop. */
-void *LAPDmServiceLoopAdapter(L2LAPDm*);
+std::ostream& operator<<(std::ostream&, L2LAPDm::LAPDState);
 
 
 
@@ -430,9 +684,10 @@ class SDCCHL2 : public L2LAPDm {
 		Construct the LAPDm part of the SDCCH.
 		@param wC "Command" bit, "1" for BTS, "0" for MS.
 		@param wSAPI Service access point indicatior.
+		@param wEngine The engine to run in.
 	*/
-	SDCCHL2(unsigned wC=1, unsigned wSAPI=0)
-		:L2LAPDm(wC,wSAPI)
+	SDCCHL2(unsigned wC=1, unsigned wSAPI=0, LAPDmEngine *wEngine=&gLAPDmEngine)
+		:L2LAPDm(wC,wSAPI,wEngine)
 	{ }
 
 };
@@ -471,9 +726,10 @@ class SACCHL2 : public L2LAPDm {
 		Construct the LAPDm part of the SACCH.
 		@param wC "Command" bit, "1" for BTS, "0" for MS.
 		@param wSAPI Service access point indicatior.
+		@param wEngine The engine to run in.
 	*/
-	SACCHL2(unsigned wC=1, unsigned wSAPI=0)
-		:L2LAPDm(wC,wSAPI)
+	SACCHL2(unsigned wC=1, unsigned wSAPI=0, LAPDmEngine *wEngine=&gLAPDmEngine)
+		:L2LAPDm(wC,wSAPI,wEngine)
 	{ }
 
 };
@@ -505,9 +761,10 @@ class FACCHL2 : public L2LAPDm {
 		Construct the LAPDm part of the FACCH.
 		@param wC "Command" bit, "1" for BTS, "0" for MS.
 		@param wSAPI Service access point indicatior.
+		@param wEngine The engine to run in.
 	*/
-	FACCHL2(unsigned wC=1, unsigned wSAPI=0)
-		:L2LAPDm(wC,wSAPI)
+	FACCHL2(unsigned wC=1, unsigned wSAPI=0, LAPDmEngine *wEngine=&gLAPDmEngine)
+		:L2LAPDm(wC,wSAPI,wEngine)
 	{ }
 
 };
@@ -28,6 +28,8 @@
 
 
 
+#define LOG_MODULE L3
+
 #include "GSML3CCElements.h"
 #include <Logger.h>
 
@@ -283,6 +285,21 @@ void L3ProgressIndicator::writeV(L3Frame& dest, size_t &wp) const
 }
 
 
+void L3ProgressIndicator::parseV(const L3Frame& src, size_t &rp, size_t expectedLength)
+{
+	if (expectedLength<2) L3_READ_ERROR;
+	size_t end = rp + 8*expectedLength;
+	// octet 3
+	rp += 4;
+	mLocation = (Location)src.readField(rp,4);
+	// octet 4
+	rp += 1;
+	mProgress = (Progress)src.readField(rp,7);
+	// Ignore anything else.
+	rp = end;
+}
+
+
 
 void L3ProgressIndicator::text(ostream& os) const
 {
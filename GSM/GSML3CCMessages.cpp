@@ -28,6 +28,8 @@
 
 
 
+#define LOG_MODULE L3
+
 #include <iostream>
 #include "GSML3CCMessages.h"
 #include <Logger.h>
@@ -87,28 +89,11 @@ ostream& GSM::operator<<(ostream& os, L3CCMessage::MessageType val)
 
 L3CCMessage * GSM::L3CCFactory(L3CCMessage::MessageType MTI)
 {
-	switch (MTI) {
-		case L3CCMessage::Connect: return new L3Connect();
-		case L3CCMessage::Alerting: return new L3Alerting();
-		case L3CCMessage::Setup: return new L3Setup();
-		case L3CCMessage::EmergencySetup: return new L3EmergencySetup();
-		case L3CCMessage::Disconnect: return new L3Disconnect();
-		case L3CCMessage::CallProceeding: return new L3CallProceeding();
-		case L3CCMessage::Release: return new L3Release();
-		case L3CCMessage::ReleaseComplete: return new L3ReleaseComplete();
-		case L3CCMessage::ConnectAcknowledge: return new L3ConnectAcknowledge();
-		case L3CCMessage::CCStatus: return new L3CCStatus();
-		case L3CCMessage::CallConfirmed: return new L3CallConfirmed();
-		case L3CCMessage::StartDTMF: return new L3StartDTMF();
-		case L3CCMessage::StartDTMFReject: return new L3StartDTMFReject();
-		case L3CCMessage::StopDTMF: return new L3StopDTMF();
-		case L3CCMessage::Hold: return new L3Hold();
-		case L3CCMessage::HoldReject: return new L3HoldReject();
-		default: {
-			LOG(NOTICE) << "no L3 CC factory support for message "<< MTI;
-			return NULL;
-		}
+	L3CCMessage *retVal = static_cast<L3CCMessage*>(L3Factory(L3CallControlPD,MTI));
+	if (!retVal) {
+		LOG(NOTICE) << "no L3 CC factory support for message "<< MTI;
 	}
+	return retVal;
 }
 
 
@@ -125,7 +110,14 @@ L3CCMessage * GSM::parseL3CC(const L3Frame& source)
 	if (retVal==NULL) return NULL;
 
 	retVal->TIValue(source.TIValue());
-	retVal->parse(source);
+	try {
+		retVal->parse(source);
+	}
+	catch (L3ReadError) {
+		// Don't leak the message on the way out.
+		delete retVal;
+		throw;
+	}
 	LOG(DEBUG) << "parseL3CC " << *retVal;
 	return retVal;
 }
@@ -29,6 +29,8 @@
 
 
 
+#define LOG_MODULE L3
+
 #include "GSML3CommonElements.h"
 
 
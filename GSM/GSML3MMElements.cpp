@@ -28,6 +28,8 @@
 
 
 
+#define LOG_MODULE L3
+
 #include <time.h>
 #include "GSML3MMElements.h"
 
@@ -70,6 +72,12 @@ void L3RejectCause::writeV( L3Frame& dest, size_t &wp ) const
 }
 
 
+void L3RejectCause::parseV(const L3Frame& src, size_t &rp)
+{
+	mRejectCause = src.readField(rp,8);
+}
+
+
 void L3RejectCause::text(ostream& os) const
 {	
 	os <<"0x"<< hex << mRejectCause << dec;	
@@ -29,6 +29,8 @@
 
 
 
+#define LOG_MODULE L3
+
 #include <iostream>
 
 #include "GSML3CommonElements.h"
@@ -80,18 +82,11 @@ ostream& GSM::operator<<(ostream& os, L3MMMessage::MessageType val)
 
 L3MMMessage* GSM::L3MMFactory(L3MMMessage::MessageType MTI)
 {
-	switch (MTI) {
-	  case L3MMMessage::LocationUpdatingRequest: return new L3LocationUpdatingRequest;
-	  case L3MMMessage::IMSIDetachIndication: return new L3IMSIDetachIndication;
-	  case L3MMMessage::CMServiceRequest: return new L3CMServiceRequest;
-	  // Since we don't support re-establishment, don't bother parsing this.
-	  //case L3MMMessage::CMReestablishmentRequest: return new L3CMReestablishmentRequest;
-	  case L3MMMessage::MMStatus: return new L3MMStatus;
-	  case L3MMMessage::IdentityResponse: return new L3IdentityResponse;
-	  default:
-	    LOG(WARN) << "no L3 MM factory support for message " << MTI;
-		return NULL;
+	L3MMMessage *retVal = static_cast<L3MMMessage*>(L3Factory(L3MobilityManagementPD,MTI));
+	if (!retVal) {
+		LOG(WARN) << "no L3 MM factory support for message " << MTI;
 	}
+	return retVal;
 }
 
 L3MMMessage * GSM::parseL3MM(const L3Frame& source)
@@ -102,7 +97,14 @@ L3MMMessage * GSM::parseL3MM(const L3Frame& source)
 	L3MMMessage *retVal = L3MMFactory(MTI);
 	if (retVal==NULL) return NULL;
 
-	retVal->parse(source);
+	try {
+		retVal->parse(source);
+	}
+	catch (L3ReadError) {
+		// Don't leak the message on the way out.
+		delete retVal;
+		throw;
+	}
 	return retVal;
 }
 
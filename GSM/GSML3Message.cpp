@@ -24,6 +24,8 @@
 
 
 
+#define LOG_MODULE L3
+
 #include "GSML3Message.h"
 #include "GSML3RRMessages.h"
 #include "GSML3MMMessages.h"
@@ -135,9 +137,161 @@ ostream& GSM::operator<<(ostream& os, const L3Message& msg)
 
 
 
+/**@name Free lists for L3Message, in steps of messageGrain bytes. */
+//@{
+static const size_t messageGrain = 64;
+static const unsigned numMessagePools = 16;
+
+static FramePool** newMessagePools()
+{
+	FramePool** pools = new FramePool*[numMessagePools];
+	for (unsigned i=0; i<numMessagePools; i++) {
+		char *name = new char[32];
+		sprintf(name,"L3 messages %u",(unsigned)(messageGrain*(i+1)));
+		pools[i] = new FramePool(name,messageGrain*(i+1),64);
+	}
+	return pools;
+}
+
+static FramePool** messagePools()
+{
+	// Never destroyed, like the frame pools.
+	static FramePool** pools = newMessagePools();
+	return pools;
+}
+//@}
+
+
+void* L3Message::operator new(size_t size)
+{
+	unsigned index = (size-1)/messageGrain;
+	if (index>=numMessagePools) return ::operator new(size);
+	return messagePools()[index]->allocate(messageGrain*(index+1));
+}
+
+
+void L3Message::operator delete(void* msg, size_t size)
+{
+	unsigned index = (size-1)/messageGrain;
+	if (index>=numMessagePools) ::operator delete(msg);
+	else messagePools()[index]->release(msg,messageGrain*(index+1));
+}
+
+
+void GSM::reportL3MessagePools(ostream& os)
+{
+	FramePool** pools = messagePools();
+	for (unsigned i=0; i<numMessagePools; i++) {
+		if (pools[i]->allocs()) pools[i]->report(os);
+	}
+}
+
+
+
+
+
+/**@name The uplink messages that we parse, GSM 04.08 9. */
+//@{
+
+/*
+	The table only picks the message class.  Each class still reads its
+	own IEs in parseBody and writes them in writeBody; there are no IE
+	layout tables.  Messages come from the free lists above, one at a time,
+	not from an arena per transaction, because Control deletes them singly.
+*/
+
+/** One row of the message table. */
+struct L3MessageType {
+	L3PD PD;
+	unsigned MTI;
+	L3Message* (*factory)();
+};
+
+template <class MESSAGE> static L3Message* makeL3Message() { return new MESSAGE; }
+
+static const L3MessageType L3MessageTypes[] = {
+	{ L3RadioResourcePD, L3RRMessage::ChannelRelease, makeL3Message<L3ChannelRelease> },
+	{ L3RadioResourcePD, L3RRMessage::AssignmentComplete, makeL3Message<L3AssignmentComplete> },
+	{ L3RadioResourcePD, L3RRMessage::AssignmentFailure, makeL3Message<L3AssignmentFailure> },
+	{ L3RadioResourcePD, L3RRMessage::RRStatus, makeL3Message<L3RRStatus> },
+	{ L3RadioResourcePD, L3RRMessage::PagingResponse, makeL3Message<L3PagingResponse> },
+	{ L3RadioResourcePD, L3RRMessage::ChannelModeModifyAcknowledge, makeL3Message<L3ChannelModeModifyAcknowledge> },
+	{ L3RadioResourcePD, L3RRMessage::MeasurementReport, makeL3Message<L3MeasurementReport> },
+	{ L3RadioResourcePD, L3RRMessage::ApplicationInformation, makeL3Message<L3ApplicationInformation> },
+	// Partial support just to get along with some phones.
+	{ L3RadioResourcePD, L3RRMessage::GPRSSuspensionRequest, makeL3Message<L3GPRSSuspensionRequest> },
+
+	{ L3MobilityManagementPD, L3MMMessage::LocationUpdatingRequest, makeL3Message<L3LocationUpdatingRequest> },
+	{ L3MobilityManagementPD, L3MMMessage::IMSIDetachIndication, makeL3Message<L3IMSIDetachIndication> },
+	{ L3MobilityManagementPD, L3MMMessage::CMServiceRequest, makeL3Message<L3CMServiceRequest> },
+	// Since we don't support re-establishment, don't bother parsing CMReestablishmentRequest.
+	{ L3MobilityManagementPD, L3MMMessage::MMStatus, makeL3Message<L3MMStatus> },
+	{ L3MobilityManagementPD, L3MMMessage::IdentityResponse, makeL3Message<L3IdentityResponse> },
+
+	{ L3CallControlPD, L3CCMessage::Connect, makeL3Message<L3Connect> },
+	{ L3CallControlPD, L3CCMessage::Alerting, makeL3Message<L3Alerting> },
+	{ L3CallControlPD, L3CCMessage::Setup, makeL3Message<L3Setup> },
+	{ L3CallControlPD, L3CCMessage::EmergencySetup, makeL3Message<L3EmergencySetup> },
+	{ L3CallControlPD, L3CCMessage::Disconnect, makeL3Message<L3Disconnect> },
+	{ L3CallControlPD, L3CCMessage::CallProceeding, makeL3Message<L3CallProceeding> },
+	{ L3CallControlPD, L3CCMessage::Release, makeL3Message<L3Release> },
+	{ L3CallControlPD, L3CCMessage::ReleaseComplete, makeL3Message<L3ReleaseComplete> },
+	{ L3CallControlPD, L3CCMessage::ConnectAcknowledge, makeL3Message<L3ConnectAcknowledge> },
+	{ L3CallControlPD, L3CCMessage::CCStatus, makeL3Message<L3CCStatus> },
+	{ L3CallControlPD, L3CCMessage::CallConfirmed, makeL3Message<L3CallConfirmed> },
+	{ L3CallControlPD, L3CCMessage::StartDTMF, makeL3Message<L3StartDTMF> },
+	{ L3CallControlPD, L3CCMessage::StartDTMFReject, makeL3Message<L3StartDTMFReject> },
+	{ L3CallControlPD, L3CCMessage::StopDTMF, makeL3Message<L3StopDTMF> },
+	{ L3CallControlPD, L3CCMessage::Hold, makeL3Message<L3Hold> },
+	{ L3CallControlPD, L3CCMessage::HoldReject, makeL3Message<L3HoldReject> },
+};
+
+/** The message table indexed by PD and MTI; uplink MTIs fit in 6 bits. */
+class L3MessageIndex {
+
+	private:
+
+	L3Message* (*mFactories[16][64])();
+
+	public:
+
+	L3MessageIndex()
+	{
+		memset(mFactories,0,sizeof(mFactories));
+		const unsigned numTypes = sizeof(L3MessageTypes)/sizeof(L3MessageTypes[0]);
+		for (unsigned i=0; i<numTypes; i++) {
+			const L3MessageType& type = L3MessageTypes[i];
+			assert(type.MTI<64);
+			assert(!mFactories[type.PD][type.MTI]);
+			mFactories[type.PD][type.MTI] = type.factory;
+		}
+	}
+
+	L3Message* make(L3PD PD, unsigned MTI) const
+	{
+		if (MTI>=64) return NULL;
+		L3Message* (*factory)() = mFactories[PD & 0x0f][MTI];
+		if (!factory) return NULL;
+		return factory();
+	}
+};
+
+//@}
+
+
+L3Message* GSM::L3Factory(L3PD PD, unsigned MTI)
+{
+	static const L3MessageIndex index;
+	return index.make(PD,MTI);
+}
+
+
+
+
 GSM::L3Message* GSM::parseL3(const GSM::L3Frame& source)
 {
-	if (source.size()==0) return NULL;
+	// A message is at least a PD and an MTI.
+	if (source.size()<16) return NULL;
 
 	LOG(DEBUG) << "GSM::parseL3 "<< source;
 	L3PD PD = source.PD();
@@ -159,7 +313,9 @@ GSM::L3Message* GSM::parseL3(const GSM::L3Frame& source)
 		return NULL;
 	}
 
-	if (retVal) LOG(INFO) << "L3 recv " << *retVal;
+	if (retVal) {
+		LOG(INFO) << "L3 recv " << *retVal;
+	}
 	return retVal;
 }
 
@@ -36,11 +36,7 @@ namespace GSM {
 /**@name L3 Processing Errors */
 //@{
 
-class L3ReadError : public GSMError {
-	public:
-	L3ReadError():GSMError() {}
-};
-#define L3_READ_ERROR {throw L3ReadError();}
+// L3ReadError is in GSMTransfer.h, since L3Frame throws it.
 
 class L3WriteError : public GSMError {
 	public:
@@ -71,6 +67,9 @@ class L3Message {
 	/** Return number of BITS needed to hold message and header.  */
 	size_t bitsNeeded() const { return 8*length(); }
 
+	/** Return the number of rest octets written at the end of the body, GSM 04.08 10.5.2.19. */
+	virtual size_t restOctetsLength() const { return 0; }
+
 	/**
 	  The parse() method reads and decodes L3 message bits.
 	  This method invokes parseBody, assuming that the L3 header
@@ -118,9 +117,19 @@ class L3Message {
 	/** Generate a human-readable representation of a message. */
 	virtual void text(std::ostream& os) const;
 
+	/**@name Allocation from free lists by size, since a message is made for every uplink frame. */
+	//@{
+	static void* operator new(size_t size);
+	static void operator delete(void* msg, size_t size);
+	//@}
+
 };
 
 
+/** Print the counters of the L3Message free lists. */
+void reportL3MessagePools(std::ostream& os);
+
+
 
 
 /**@name Utility functions for message parsers. */
@@ -147,6 +156,15 @@ size_t skipTV(unsigned IEI, size_t numBits, const L3Frame& source, size_t &readP
 
 
 
+/**
+	Make an empty message for parsing, from the table of uplink messages.
+	@param PD The protocol discriminator.
+	@param MTI The message type, with the N(SD) bit already masked for MM and CC.
+	@return A new message or NULL if the type is not supported.
+*/
+L3Message* L3Factory(L3PD PD, unsigned MTI);
+
+
 /**
 	Parse a complete L3 message into its object type.
 	Caller is responsible for deleting allocated memory.
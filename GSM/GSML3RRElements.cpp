@@ -26,6 +26,8 @@
 
 */
 
+#define LOG_MODULE L3
+
 #include <iterator> // for L3APDUData::text
 
 #include "GSML3RRElements.h"
@@ -534,8 +536,10 @@ void L3APDUData::writeV( L3Frame& dest, size_t &wp) const
 void L3APDUData::parseV( const L3Frame& src, size_t &rp, size_t expectedLength )
 {
     LOG(DEBUG) << "L3APDUData: parseV " << expectedLength << " bytes";
+    if (rp+expectedLength*8 > src.size()) L3_READ_ERROR;
     mData.resize(expectedLength*8);
-    src.copyToSegment(mData, rp, expectedLength*8); // expectedLength is bytes, not bits
+    src.segmentCopyTo(mData, rp, expectedLength*8); // expectedLength is bytes, not bits
+    rp += expectedLength*8;
     //for ( size_t i = 0 ; i < expectedLength ; ++i)
     //    mData[i] = src.readField(rp, 8);
 }
@@ -165,6 +165,14 @@ class L3ControlChannelDescription : public L3ProtocolElement {
 		mT3212=gConfig.getNum("GSM.T3212")/6;
 	}
 
+	/**@name Paging configuration, GSM 05.02 6.5.2. */
+	//@{
+	unsigned BS_AG_BLKS_RES() const { return mBS_AG_BLKS_RES; }
+	unsigned CCCH_CONF() const { return mCCCH_CONF; }
+	/** Multiframes in the paging cycle, decoded as per GSM 04.08 10.5.2.11. */
+	unsigned BS_PA_MFRMS() const { return mBS_PA_MFRMS+2; }
+	//@}
+
 	size_t lengthV() const { return 3; }
 	void writeV(L3Frame& dest, size_t &wp) const;
 	void parseV(const L3Frame&, size_t&) { assert(0); }
@@ -28,6 +28,8 @@
 
 
 
+#define LOG_MODULE L3
+
 #include <typeinfo>
 #include <iostream>
 
@@ -125,21 +127,11 @@ void L3RRMessage::text(ostream& os) const
 
 L3RRMessage* GSM::L3RRFactory(L3RRMessage::MessageType MTI)
 {
-	switch (MTI) {
-		case L3RRMessage::ChannelRelease: return new L3ChannelRelease();
-		case L3RRMessage::AssignmentComplete: return new L3AssignmentComplete();
-		case L3RRMessage::AssignmentFailure: return new L3AssignmentFailure();
-		case L3RRMessage::RRStatus: return new L3RRStatus();
-		case L3RRMessage::PagingResponse: return new L3PagingResponse();
-		case L3RRMessage::ChannelModeModifyAcknowledge: return new L3ChannelModeModifyAcknowledge();
-		case L3RRMessage::MeasurementReport: return new L3MeasurementReport();
-		case L3RRMessage::ApplicationInformation: return new L3ApplicationInformation();
-        // Partial support just to get along with some phones.
-        case L3RRMessage::GPRSSuspensionRequest: return new L3GPRSSuspensionRequest();
-		default:
-			LOG(WARN) << "no L3 RR factory support for " << MTI;
-			return NULL;
+	L3RRMessage *retVal = static_cast<L3RRMessage*>(L3Factory(L3RadioResourcePD,MTI));
+	if (!retVal) {
+		LOG(WARN) << "no L3 RR factory support for " << MTI;
 	}
+	return retVal;
 }
 
 L3RRMessage* GSM::parseL3RR(const L3Frame& source)
@@ -150,7 +142,14 @@ L3RRMessage* GSM::parseL3RR(const L3Frame& source)
 	L3RRMessage *retVal = L3RRFactory(MTI);
 	if (retVal==NULL) return NULL;
 
-	retVal->parse(source);
+	try {
+		retVal->parse(source);
+	}
+	catch (L3ReadError) {
+		// Don't leak the message on the way out.
+		delete retVal;
+		throw;
+	}
 	return retVal;
 }
 
@@ -219,6 +218,81 @@ void L3PagingRequestType1::text(ostream& os) const
 }
 
 
+size_t L3PagingRequestType2::bodyLength() const
+{
+	size_t sum = 1 + 4 + 4;
+	if (mMobileID3.type()!=NoIDType) sum += mMobileID3.lengthTLV() + restOctetsLength();
+	return sum;
+}
+
+
+
+void L3PagingRequestType2::writeBody(L3Frame& dest, size_t &wp) const
+{
+	// See GSM 04.08 9.1.23.
+	// Page Mode M V 1/2 10.5.2.26
+	// Channels Needed M V 1/2
+	// Mobile Identity 1 M V 4 10.5.2.42 (TMSI)
+	// Mobile Identity 2 M V 4 10.5.2.42 (TMSI)
+	// 0x17 Mobile Identity 3 O TLV 3-10 10.5.1.4
+	// P2 Rest Octets M V 1-11 10.5.2.24
+	dest.writeField(wp,channelNeededCode(mChannelsNeeded[1]),2);
+	dest.writeField(wp,channelNeededCode(mChannelsNeeded[0]),2);
+	dest.writeField(wp,0x0,4);
+	dest.writeField(wp,mTMSIs[0],32);
+	dest.writeField(wp,mTMSIs[1],32);
+	if (mMobileID3.type()==NoIDType) return;
+	mMobileID3.writeTLV(0x17,dest,wp);
+	// P2 rest octets, GSM 04.08 10.5.2.24: H, CN3, then L and padding.
+	// L and H are relative to the 0x2b padding, so L here is 0 and H is 1.
+	dest.writeField(wp,0x80 | (channelNeededCode(mChannelsNeeded[2])<<5) | 0x0b,8);
+}
+
+
+
+void L3PagingRequestType2::text(ostream& os) const
+{
+	L3RRMessage::text(os);
+	os << " mobileIDs=(";
+	for (unsigned i=0; i<2; i++) {
+		os << "(TMSI=0x" << hex << mTMSIs[i] << dec << "," << mChannelsNeeded[i] << "),";
+	}
+	if (mMobileID3.type()!=NoIDType) os << "(" << mMobileID3 << "," << mChannelsNeeded[2] << "),";
+	os << ")";
+}
+
+
+
+void L3PagingRequestType3::writeBody(L3Frame& dest, size_t &wp) const
+{
+	// See GSM 04.08 9.1.24.
+	// Page Mode M V 1/2 10.5.2.26
+	// Channels Needed M V 1/2
+	// Mobile Identity 1-4 M V 4 10.5.2.42 (TMSI)
+	// P3 Rest Octets M V 3 10.5.2.25
+	dest.writeField(wp,channelNeededCode(mChannelsNeeded[1]),2);
+	dest.writeField(wp,channelNeededCode(mChannelsNeeded[0]),2);
+	dest.writeField(wp,0x0,4);
+	for (int i=0; i<4; i++) dest.writeField(wp,mTMSIs[i],32);
+	// P3 rest octets, GSM 04.08 10.5.2.25: H, CN3, CN4, then L and padding.
+	dest.writeField(wp,0x80 | (channelNeededCode(mChannelsNeeded[2])<<5)
+		| (channelNeededCode(mChannelsNeeded[3])<<3) | 0x03,8);
+}
+
+
+
+void L3PagingRequestType3::text(ostream& os) const
+{
+	L3RRMessage::text(os);
+	os << " mobileIDs=(";
+	for (unsigned i=0; i<4; i++) {
+		os << "(TMSI=0x" << hex << mTMSIs[i] << dec << "," << mChannelsNeeded[i] << "),";
+	}
+	os << ")";
+}
+
+
+
 size_t L3PagingResponse::bodyLength() const
 {
 	// The classmark is USUALLY 4 octets.
@@ -193,6 +193,81 @@ class L3PagingRequestType1 : public L3RRMessage {
 
 
 
+/**
+	Paging Request Type 2, GSM 04.08 9.1.23.
+	Two TMSIs and an optional third mobile ID of any type.
+*/
+class L3PagingRequestType2 : public L3RRMessage {
+
+	private:
+
+	unsigned mTMSIs[2];
+	L3MobileIdentity mMobileID3;		///< NoIDType if absent
+	ChannelType mChannelsNeeded[3];
+
+	public:
+
+	L3PagingRequestType2(unsigned wTMSI1, ChannelType wType1,
+			unsigned wTMSI2, ChannelType wType2,
+			const L3MobileIdentity& wID3=L3MobileIdentity(), ChannelType wType3=AnyDCCHType)
+		:L3RRMessage(),
+		mMobileID3(wID3)
+	{
+		mTMSIs[0]=wTMSI1;
+		mTMSIs[1]=wTMSI2;
+		mChannelsNeeded[0]=wType1;
+		mChannelsNeeded[1]=wType2;
+		mChannelsNeeded[2]=wType3;
+	}
+
+	int MTI() const { return PagingRequestType2; }
+
+	size_t bodyLength() const;
+	/** The P2 rest octets carry the channel needed for the third ID. */
+	size_t restOctetsLength() const { return mMobileID3.type()==NoIDType ? 0 : 1; }
+	void writeBody(L3Frame& dest, size_t& wp) const;
+	void parseBody(const L3Frame&, size_t&) { assert(0); }
+	void text(std::ostream&) const;
+};
+
+
+
+/**
+	Paging Request Type 3, GSM 04.08 9.1.24.
+	Four TMSIs.
+*/
+class L3PagingRequestType3 : public L3RRMessage {
+
+	private:
+
+	unsigned mTMSIs[4];
+	ChannelType mChannelsNeeded[4];
+
+	public:
+
+	L3PagingRequestType3(const unsigned wTMSIs[4], const ChannelType wTypes[4])
+		:L3RRMessage()
+	{
+		for (int i=0; i<4; i++) {
+			mTMSIs[i]=wTMSIs[i];
+			mChannelsNeeded[i]=wTypes[i];
+		}
+	}
+
+	int MTI() const { return PagingRequestType3; }
+
+	/** Page mode, four TMSIs and the first P3 rest octet; L2 pads the other two. */
+	size_t bodyLength() const { return 1 + 4*4 + 1; }
+	/** The P3 rest octets carry the channels needed for the third and fourth TMSIs. */
+	size_t restOctetsLength() const { return 1; }
+	void writeBody(L3Frame& dest, size_t& wp) const;
+	void parseBody(const L3Frame&, size_t&) { assert(0); }
+	void text(std::ostream&) const;
+};
+
+
+
+
 /** Paging Response, GSM 04.08 9.1.25 */
 class L3PagingResponse : public L3RRMessage {
 
@@ -26,12 +26,17 @@
 
 
 
+#define LOG_MODULE L2
+
 #include "GSML3RRElements.h"
 #include "GSML3Message.h"
 #include "GSML3RRMessages.h"
 #include "GSMLogicalChannel.h"
 #include "GSMConfig.h"
 
+#include <map>
+#include <sstream>
+
 using namespace std;
 using namespace GSM;
 
@@ -56,6 +61,17 @@ void LogicalChannel::connect()
 		mMux.upstream(mL2[s],s);
 		if (mL2[s]) mL2[s]->downstream(&mMux);
 	}
+	// Name the channel and its layers for OBJLOG filters by type and
+	// order of creation, which the configuration fixes from run to run.
+	// Channels are all made at startup, from one thread.
+	static map<ChannelType,unsigned> counts;
+	ostringstream name;
+	name << type() << '.' << counts[type()]++;
+	gSetLogObjectName(this,name.str());
+	gSetLogObjectName(&mMux,name.str());
+	for (int s=0; s<4; s++) {
+		if (mL2[s]) gSetLogObjectName(mL2[s],name.str());
+	}
 }
 
 
@@ -104,17 +120,17 @@ void CCCHLogicalChannel::serviceLoop()
 	// build the idle frame
 	static const L3PagingRequestType1 filler;
 	static const L3Frame idleFrame(filler,UNIT_DATA);
-	// prime the first idle frame
-	LogicalChannel::send(idleFrame);
-	// run the loop
+	// Fill every block, paced by L1.
+	// Queued messages (access grants) go first, then any pages for
+	// the paging group of the next block, then the idle frame.
 	while (mRunning) {
-		L3Frame* frame = mQ.read();
+		L3Frame* frame = mQ.readNoBlock();
+		if (!frame) frame = gBTS.pager().pagingFrame(this,mL1->encoder()->nextWriteTime());
 		if (frame) {
 			LogicalChannel::send(*frame);
 			OBJLOG(DEBUG) << "CCCHLogicalChannel::serviceLoop sending " << *frame;
 			delete frame;
-		}
-		if (mQ.size()==0) {
+		} else {
 			LogicalChannel::send(idleFrame);
 			OBJLOG(DEEPDEBUG) << "CCCHLogicalChannel::serviceLoop sending idle frame";
 		}
@@ -186,6 +186,8 @@ public:
 	//@{
 	/** Slot number. */
 	unsigned TN() const { return mL1->TN(); }
+	/** Carrier number. */
+	unsigned ARFCN() const { assert(mL1); return mL1->ARFCN(); }
 	/** Receive FER. */
 	float FER() const { assert(mL1); return mL1->FER(); }
 	/** RSSI wrt full scale. */
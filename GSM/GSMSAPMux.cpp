@@ -24,6 +24,8 @@
 
 
 
+#define LOG_MODULE L2
+
 #include "GSMSAPMux.h"
 #include "GSMTransfer.h"
 #include "GSML1FEC.h"
@@ -46,23 +48,33 @@ void SAPMux::writeHighSide(const L2Frame& frame)
 
 
 
-void SAPMux::writeLowSide(const L2Frame& frame)
+void SAPMux::writeLowSide(L2Frame* frame)
 {
-	OBJLOG(DEEPDEBUG) << "SAPMux::writeLowSide SAP" << frame.SAPI() << " " << frame;
-	unsigned SAPI = frame.SAPI();	
-	bool data = frame.primitive()==DATA;
-	if (data && (!mUpstream[SAPI])) {
-		LOG(NOTICE) << "received DATA for unsupported SAP " << SAPI;
+	OBJLOG(DEEPDEBUG) << "SAPMux::writeLowSide SAP" << frame->SAPI() << " " << *frame;
+	unsigned SAPI = frame->SAPI();	
+	if (frame->primitive()==DATA) {
+		if (!mUpstream[SAPI]) {
+			LOG(NOTICE) << "received DATA for unsupported SAP " << SAPI;
+			delete frame;
+			return;
+		}
+		mUpstream[SAPI]->writeLowSide(frame);
 		return;
 	}
-	if (data) {
-		mUpstream[SAPI]->writeLowSide(frame);
-	} else {
-		// If this is a non-data primitive, copy it out to every SAP.
-		for (int i=0; i<4; i++) {
-			if (mUpstream[i]) mUpstream[i]->writeLowSide(frame);
-		}
+	// If this is a non-data primitive, copy it out to every SAP.
+	// The last SAP gets the original.
+	int last = -1;
+	for (int i=0; i<4; i++) {
+		if (mUpstream[i]) last = i;
+	}
+	if (last<0) {
+		delete frame;
+		return;
+	}
+	for (int i=0; i<last; i++) {
+		if (mUpstream[i]) mUpstream[i]->writeLowSide(new L2Frame(*frame));
 	}
+	mUpstream[last]->writeLowSide(frame);
 }
 
 
@@ -71,7 +83,6 @@ void LoopbackSAPMux::writeHighSide(const L2Frame& frame)
 {
 	OBJLOG(DEEPDEBUG) << "TestSAPMux::writeHighSide " << frame;
 	// Substitute primitive
-	L2Frame newFrame(frame);
 	unsigned SAPI = frame.SAPI();	
 	switch (frame.primitive()) {
 		case ERROR: SAPI=0; break;
@@ -83,17 +94,17 @@ void LoopbackSAPMux::writeHighSide(const L2Frame& frame)
 	// and ignore the frame.
 	assert(mUpstream[SAPI]);
 	mLock.lock();
-	mUpstream[SAPI]->writeLowSide(newFrame);
+	mUpstream[SAPI]->writeLowSide(new L2Frame(frame));
 	mLock.unlock();
 }
 
 
 
-void LoopbackSAPMux::writeLowSide(const L2Frame& frame)
+void LoopbackSAPMux::writeLowSide(L2Frame* frame)
 {
 	assert(mDownstream);
-	L2Frame newFrame(frame);
-	mDownstream->writeHighSide(newFrame);
+	mDownstream->writeHighSide(*frame);
+	delete frame;
 }
 
 
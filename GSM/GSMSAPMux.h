@@ -64,7 +64,15 @@ class SAPMux  {
 	virtual ~SAPMux() {}
 
 	virtual void writeHighSide(const L2Frame& frame); 
-	virtual void writeLowSide(const L2Frame& frame); 
+
+	/**
+		Pass an uplink frame to its L2, which takes ownership of it.
+		This is the L1->L2 path; subclasses override this one.
+	*/
+	virtual void writeLowSide(L2Frame* frame);
+
+	/** Pass a copy of an uplink frame to its L2. */
+	void writeLowSide(const L2Frame& frame) { writeLowSide(new L2Frame(frame)); }
 	
 	void upstream( L2DL * wUpstream, unsigned wSAPI=0 )
 		{ assert(mUpstream[wSAPI]==NULL); mUpstream[wSAPI]=wUpstream; }
@@ -87,8 +95,10 @@ class LoopbackSAPMux : public SAPMux {
 
 	LoopbackSAPMux():SAPMux() {}
 
+	using SAPMux::writeLowSide;
+
 	void writeHighSide(const L2Frame& frame);
-	void writeLowSide(const L2Frame& frame);
+	void writeLowSide(L2Frame* frame);
 
 };
 
@@ -105,6 +115,8 @@ class L1TestPointSAPMux : public SAPMux {
 	L1TestPointSAPMux():SAPMux() {}
 	~L1TestPointSAPMux() {}
 
+	using SAPMux::writeLowSide;
+
 	// These are defined in the .h so that we
 	// don't have to link in all of L2 to
 	// use them.
@@ -117,9 +129,10 @@ class L1TestPointSAPMux : public SAPMux {
 		mLock.unlock();
 	}
 
-	void writeLowSide(const L2Frame& frame)
+	void writeLowSide(L2Frame* frame)
 	{
-		LOG(DEBUG) << "SAPMux::writeLowSide frame=" << frame;
+		LOG(DEBUG) << "SAPMux::writeLowSide frame=" << *frame;
+		delete frame;
 	}
 
 };
@@ -208,6 +208,73 @@ void L2Length::write(L2Frame& frame, size_t& wp) const
 
 
 
+void* FramePool::allocate(size_t size)
+{
+	if (size!=mBlockSize) return ::operator new(size);
+	mLock.lock();
+	mAllocs++;
+	mInUse++;
+	if (mInUse>mPeak) mPeak=mInUse;
+	void* block = mFree;
+	if (block) {
+		mFree = *(void**)block;
+		mNumFree--;
+		mLock.unlock();
+		return block;
+	}
+	mHeapAllocs++;
+	mLock.unlock();
+	return ::operator new(mBlockSize);
+}
+
+
+void FramePool::release(void* block, size_t size)
+{
+	if (!block) return;
+	if (size!=mBlockSize) {
+		::operator delete(block);
+		return;
+	}
+	mLock.lock();
+	assert(mInUse>0);
+	mInUse--;
+	if (mNumFree>=mMaxFree) {
+		mLock.unlock();
+		::operator delete(block);
+		return;
+	}
+	*(void**)block = mFree;
+	mFree = block;
+	mNumFree++;
+	mLock.unlock();
+}
+
+
+void FramePool::report(ostream& os) const
+{
+	mLock.lock();
+	os << mName << " frames: allocs=" << mAllocs << " heap=" << mHeapAllocs;
+	os << " inUse=" << mInUse << " peak=" << mPeak << " free=" << mNumFree << endl;
+	mLock.unlock();
+}
+
+
+void GSM::reportFramePools(ostream& os)
+{
+	L2Frame::pool().report(os);
+	L3Frame::pool().report(os);
+}
+
+
+
+FramePool& L2Frame::pool()
+{
+	// Never destroyed, so that static frames can outlive it.
+	static FramePool* thePool = new FramePool("L2",sizeof(L2Frame),1024);
+	return *thePool;
+}
+
+
 void L2Frame::idleFill()
 {
 	// GSM 04.06 2.2
@@ -219,7 +286,7 @@ void L2Frame::idleFill()
 
 
 L2Frame::L2Frame(const BitVector& bits, Primitive prim)
-	:BitVector(23*8),mPrimitive(prim)
+	:BitVector(mBits,23*8),mPrimitive(prim),mRefs(1)
 {
 	assert(bits.size()<=this->size());
 	bits.copyTo(*this);
@@ -227,7 +294,7 @@ L2Frame::L2Frame(const BitVector& bits, Primitive prim)
 
 
 L2Frame::L2Frame(const L2Header& header, const BitVector& l3)
-	:BitVector(23*8),mPrimitive(DATA)
+	:BitVector(mBits,23*8),mPrimitive(DATA),mRefs(1)
 {
 	idleFill();
 	assert((header.bitsNeeded()+l3.size())<=this->size());
@@ -237,7 +304,7 @@ L2Frame::L2Frame(const L2Header& header, const BitVector& l3)
 
 
 L2Frame::L2Frame(const L2Header& header)
-	:BitVector(23*8),mPrimitive(DATA)
+	:BitVector(mBits,23*8),mPrimitive(DATA),mRefs(1)
 {
 	idleFill();
 	header.write(*this);
@@ -440,16 +507,39 @@ ostream& GSM::operator<<(ostream& os, Primitive prim)
 
 
 
+FramePool& L3Frame::pool()
+{
+	static FramePool* thePool = new FramePool("L3",sizeof(L3Frame),256);
+	return *thePool;
+}
+
+
+void L3Frame::allocate(size_t len)
+{
+	if (len>maxBits) {
+		Vector<char>::resize(len);
+		return;
+	}
+	if (mData) {
+		delete[] mData;
+		mData = NULL;
+	}
+	mStart = mBits;
+	mEnd = mBits + len;
+}
+
+
 L3Frame::L3Frame(const L3Message& msg, Primitive wPrimitive)
-	:BitVector(msg.bitsNeeded()),mPrimitive(wPrimitive)
+	:BitVector(mBits,0),mPrimitive(wPrimitive),mRestOctets(msg.restOctetsLength())
 {
+	allocate(msg.bitsNeeded());
 	msg.write(*this);
 }
 
 
 
 L3Frame::L3Frame(const char* hexString)
-	:mPrimitive(DATA)
+	:BitVector(mBits,0),mPrimitive(DATA),mRestOctets(0)
 {
 	size_t len = strlen(hexString);
 	resize(len*4);
@@ -464,7 +554,7 @@ L3Frame::L3Frame(const char* hexString)
 
 
 L3Frame::L3Frame(const char* binary, size_t len)
-	:mPrimitive(DATA)
+	:BitVector(mBits,0),mPrimitive(DATA),mRestOctets(0)
 {
 	resize(len*8);
 	size_t wp=0;
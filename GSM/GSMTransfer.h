@@ -460,15 +460,75 @@ unsigned N201(ChannelType, L2Header::FrameFormat);
 
 
 
+/**
+	A free list of fixed-size blocks for frequently allocated frame objects.
+	Blocks beyond the free list limit go back to the heap.
+	Pools are never destroyed, so they are safe to use from static objects.
+*/
+class FramePool {
+
+	private:
+
+	const char* mName;
+	size_t mBlockSize;
+	unsigned mMaxFree;			///< longest free list kept
+	mutable Mutex mLock;
+	void* mFree;				///< free list, linked through the first word of each block
+	unsigned mNumFree;
+	unsigned long mAllocs;		///< total allocations
+	unsigned long mHeapAllocs;	///< allocations that missed the free list
+	unsigned mInUse;
+	unsigned mPeak;				///< most blocks in use at once
+
+	public:
+
+	FramePool(const char* wName, size_t wBlockSize, unsigned wMaxFree)
+		:mName(wName),mBlockSize(wBlockSize),mMaxFree(wMaxFree),
+		mFree(NULL),mNumFree(0),
+		mAllocs(0),mHeapAllocs(0),mInUse(0),mPeak(0)
+	{ assert(mBlockSize>=sizeof(void*)); }
+
+	/** Get a block, from the free list if possible. */
+	void* allocate(size_t size);
+
+	/** Return a block from allocate(size). */
+	void release(void* block, size_t size);
+
+	/**@name Counters. */
+	//@{
+	unsigned long allocs() const { return mAllocs; }
+	unsigned long heapAllocs() const { return mHeapAllocs; }
+	unsigned inUse() const { return mInUse; }
+	unsigned peak() const { return mPeak; }
+	//@}
+
+	/** Print the counters in one line. */
+	void report(std::ostream& os) const;
+
+};
+
+
+/** Print the counters of the L2 and L3 frame pools. */
+void reportFramePools(std::ostream& os);
+
+
+
+
 /**
 	The bits of an L2Frame
 	Bit ordering is MSB-first in each octet.
+	The bits are held in the frame object itself and frames allocated
+	with new come from a pool, so passing a frame between layers by pointer
+	costs no heap allocation or copy.
+	Frames on the heap can be shared with ref() and release().
 */
 class L2Frame : public BitVector {
 
 	private:
 
 	GSM::Primitive mPrimitive;
+	volatile int mRefs;			///< reference count, for frames on the heap
+	char mBits[23*8];
 
 	public:
 
@@ -477,15 +537,23 @@ class L2Frame : public BitVector {
 
 	/** Build an empty frame with a given primitive. */
 	L2Frame(GSM::Primitive wPrimitive=UNIT_DATA)
-		:BitVector(23*8),
-		mPrimitive(wPrimitive)
+		:BitVector(mBits,23*8),
+		mPrimitive(wPrimitive),mRefs(1)
 	{ idleFill(); }
 
 	/** Make a new L2 frame by copying an existing one. */
 	L2Frame(const L2Frame& other)
-		:BitVector((const BitVector&)other),
-		mPrimitive(other.mPrimitive)
-	{ }
+		:BitVector(mBits,23*8),
+		mPrimitive(other.mPrimitive),mRefs(1)
+	{ other.copyTo(*this); }
+
+	/** Copy the bits and primitive, but not the reference count. */
+	L2Frame& operator=(const L2Frame& other)
+	{
+		other.copyTo(*this);
+		mPrimitive = other.mPrimitive;
+		return *this;
+	}
 
 	/**
 		Make an L2Frame from a block of bits.
@@ -561,6 +629,21 @@ class L2Frame : public BitVector {
 	/** This is used only for testing. */
 	void primitive(Primitive wPrimitive) { mPrimitive=wPrimitive; }
 
+	/**@name Sharing of frames on the heap. */
+	//@{
+	/** Add a reference and return the frame. */
+	L2Frame* ref() { __sync_add_and_fetch(&mRefs,1); return this; }
+	/** Drop a reference, deleting the frame with the last one. */
+	void release() { if (__sync_sub_and_fetch(&mRefs,1)==0) delete this; }
+	//@}
+
+	/**@name Allocation from the L2 frame pool. */
+	//@{
+	static FramePool& pool();
+	static void* operator new(size_t size) { return pool().allocate(size); }
+	static void operator delete(void* frame, size_t size) { pool().release(frame,size); }
+	//@}
+
 };
 
 std::ostream& operator<<(std::ostream& os, const L2Frame& msg);
@@ -570,37 +653,82 @@ typedef InterthreadQueueWithWait<L2Frame> L2FrameFIFO;
 
 
 
+/** An L3 message that runs past the end of its frame or is otherwise unreadable. */
+class L3ReadError : public GSMError {
+	public:
+	L3ReadError():GSMError() {}
+};
+#define L3_READ_ERROR {throw L3ReadError();}
+
+
 /**
 	Representation of a GSM L3 message in a bit vector.
 	Bit ordering is MSB-first in each octet.
+	Messages that fit in the largest LAPDm message are held in the frame
+	object itself, and frames allocated with new come from a pool.
 	NOTE: This is for the GSM message bits, not the message content.  See L3Message.
 */
 class L3Frame : public BitVector {
 
+	public:
+
+	/** Largest message carried by LAPDm, GSM 04.06 5.8.3, in bits. */
+	static const size_t maxBits = 251*8;
+
 	private:
 
 	Primitive mPrimitive;
+	unsigned mRestOctets;		///< octets at the end left out of the L2 pseudo length
+	char mBits[maxBits];
+
+	/** Size the frame, in the object if it fits. */
+	void allocate(size_t len);
 
 	public:
 
 	/** Empty frame with a primitive. */
 	L3Frame(Primitive wPrimitive=DATA, size_t len=0)
-		:BitVector(len),mPrimitive(wPrimitive)
-	{ }
+		:BitVector(mBits,0),mPrimitive(wPrimitive),mRestOctets(0)
+	{ allocate(len); }
 
 	/** Put raw bits into the frame. */
 	L3Frame(const BitVector& source, Primitive wPrimitive=DATA)
-		:BitVector(source),mPrimitive(wPrimitive)
-	{ }
+		:BitVector(mBits,0),mPrimitive(wPrimitive),mRestOctets(0)
+	{ allocate(source.size()); source.copyTo(*this); }
 
 	L3Frame(const L3Frame& f1, const L3Frame& f2)
-		:BitVector(f1,f2),mPrimitive(DATA)
-	{}
+		:BitVector(mBits,0),mPrimitive(DATA),mRestOctets(0)
+	{
+		allocate(f1.size()+f2.size());
+		f1.copyTo(*this);
+		f2.copyToSegment(*this,f1.size());
+	}
+
+	/** Copy a frame. */
+	L3Frame(const L3Frame& other)
+		:BitVector(mBits,0),mPrimitive(other.mPrimitive),mRestOctets(other.mRestOctets)
+	{ allocate(other.size()); other.copyTo(*this); }
 
 	/** Build from an L2Frame. */
 	L3Frame(const L2Frame& source)
-		:BitVector(source.L3Part()),mPrimitive(DATA)
-	{ }
+		:BitVector(mBits,0),mPrimitive(DATA),mRestOctets(0)
+	{ allocate(8*source.L()); source.L3Part().copyTo(*this); }
+
+	L3Frame& operator=(const L3Frame& other)
+	{
+		if (&other==this) return *this;
+		allocate(other.size());
+		other.copyTo(*this);
+		mPrimitive = other.mPrimitive;
+		mRestOctets = other.mRestOctets;
+		return *this;
+	}
+
+	/** Change the size, discarding content.  This hides Vector::resize. */
+	void resize(size_t len) { allocate(len); }
+
+	/** Shorten the frame to its first len bits, keeping content. */
+	void truncate(size_t len) { assert(len<=size()); mEnd = mStart+len; }
 
 	/** Serialize a message into the frame. */
 	L3Frame(const L3Message& msg, Primitive wPrimitive=DATA);
@@ -611,6 +739,22 @@ class L3Frame : public BitVector {
 	/** Get a frame from raw binary. */
 	L3Frame(const char*, size_t len);
 
+	/**@name Field reads for the parsers, which throw L3ReadError past the end of the frame. */
+	//@{
+	uint64_t peekField(size_t readIndex, unsigned length) const
+	{
+		if (readIndex+length > size()) L3_READ_ERROR;
+		return BitVector::peekField(readIndex,length);
+	}
+
+	uint64_t readField(size_t& readIndex, unsigned length) const
+	{
+		const uint64_t retVal = peekField(readIndex,length);
+		readIndex += length;
+		return retVal;
+	}
+	//@}
+
 	/** Protocol Discriminator, GSM 04.08 10.2. */
 	L3PD PD() const { return (L3PD)peekField(4,4); }
 
@@ -629,6 +773,16 @@ class L3Frame : public BitVector {
 	/** Return frame length in BYTES. */
 	size_t length() const { return size()/8; }
 
+	/** Return the length for the L2 pseudo length, GSM 04.08 10.5.2.19, which leaves out rest octets. */
+	size_t pseudoLength() const { return length()-mRestOctets; }
+
+	/**@name Allocation from the L3 frame pool. */
+	//@{
+	static FramePool& pool();
+	static void* operator new(size_t size) { return pool().allocate(size); }
+	static void operator delete(void* frame, size_t size) { pool().release(frame,size); }
+	//@}
+
 };
 
 
@@ -0,0 +1,191 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+	Check the L3 parsers on valid uplink messages, on random damage
+	to them, and for speed.
+
+	Every message in the corpus must parse.  Damaged messages may be
+	rejected, but must never crash the parser.  The benchmark parses and
+	deletes the corpus over and over.
+
+		L3MessageTest [fuzz iterations] [benchmark iterations] [seed]
+*/
+
+
+#include "GSML3Message.h"
+#include "GSML3RRMessages.h"
+#include "GSML3MMMessages.h"
+#include "GSML3CCMessages.h"
+
+#include <Logger.h>
+#include <Timeval.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sstream>
+
+using namespace std;
+using namespace GSM;
+
+
+/** Some of the elements take their defaults from here. */
+ConfigurationTable gConfig("/dev/null");
+
+
+/** Uplink messages that the BTS parses, as hex. */
+static const char* corpus[] = {
+	// RR
+	"06270003331981080910100000000010",		// paging response, IMSI
+	"06270003331981054f12345678",			// paging response, TMSI
+	"062900",								// assignment complete
+	"062f6f",								// assignment failure
+	"061200",								// RR status
+	"0617e81a0a01",							// channel mode modify acknowledge
+	"06153b3b0101ff0000000000000000000000",	// measurement report
+	"063800031122aa",						// application information
+	"0634ffffffff",							// GPRS suspension request
+	// MM
+	"05087000f1100001330809101000000000100",	// location updating request, IMSI
+	"050870" "00f1100001" "33" "054f12345678",	// location updating request, TMSI
+	"050133080910100000000010",				// IMSI detach
+	"05240103331981080910100000000010",		// CM service request
+	"0519080910100000000010",				// identity response
+	"053162",								// MM status
+	// CC
+	"03050401a05e0581214365870f",			// setup
+	"030e",									// emergency setup
+	"8301",									// alerting
+	"83080401a0",							// call confirmed
+	"8307",									// connect
+	"030f",									// connect acknowledge
+	"032502e090",							// disconnect
+	"032d0802e090",							// release
+	"032a",									// release complete
+	"03352c31",								// start DTMF
+	"0331",									// stop DTMF
+	"033d02e090c1",							// status
+	"0318",									// hold
+};
+
+static const unsigned corpusSize = sizeof(corpus)/sizeof(corpus[0]);
+
+
+/** Return a copy of the frame, damaged at random. */
+static L3Frame* damage(const L3Frame& frame, unsigned* seed)
+{
+	unsigned octets = frame.length();
+	switch (rand_r(seed) % 4) {
+		case 0: {
+			// Flip some bits, but keep the header.
+			L3Frame *copy = new L3Frame(frame);
+			unsigned flips = 1 + rand_r(seed)%8;
+			for (unsigned i=0; i<flips; i++) {
+				size_t bit = 16 + rand_r(seed) % (copy->size()-16+1);
+				if (bit<copy->size()) (*copy)[bit] ^= 1;
+			}
+			return copy;
+		}
+		case 1: {
+			// Cut it short.
+			unsigned len = rand_r(seed) % (octets+1);
+			return new L3Frame(frame.head(8*len));
+		}
+		case 2: {
+			// Add junk to the end.
+			unsigned extra = 1 + rand_r(seed)%20;
+			L3Frame *copy = new L3Frame(DATA,frame.size()+8*extra);
+			frame.copyTo(*copy);
+			for (size_t i=frame.size(); i<copy->size(); i++) (*copy)[i] = rand_r(seed) & 0x01;
+			return copy;
+		}
+		default: {
+			// Keep only the header.
+			unsigned len = 2 + rand_r(seed)%40;
+			L3Frame *copy = new L3Frame(DATA,8*len);
+			frame.head(16).copyTo(*copy);
+			for (size_t i=16; i<copy->size(); i++) (*copy)[i] = rand_r(seed) & 0x01;
+			return copy;
+		}
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	unsigned fuzzIterations = argc>1 ? atoi(argv[1]) : 200000;
+	unsigned benchIterations = argc>2 ? atoi(argv[2]) : 200000;
+	unsigned seed = argc>3 ? atoi(argv[3]) : 1;
+	gSetLogLevel("ERROR");
+	gConfig.set("GSM.MCC","001");
+	gConfig.set("GSM.MNC","01");
+	gConfig.set("GSM.LAC",1000);
+	gConfig.set("GSM.CI",10);
+	bool ok = true;
+
+	// Every valid message parses, as the message its header names.
+	L3Frame* frames[corpusSize];
+	for (unsigned i=0; i<corpusSize; i++) {
+		frames[i] = new L3Frame(corpus[i]);
+		L3Message *msg = parseL3(*frames[i]);
+		unsigned mask = (frames[i]->PD()==L3RadioResourcePD) ? 0xff : 0xbf;
+		if (!msg || (msg->PD()!=frames[i]->PD()) || ((unsigned)msg->MTI()!=(frames[i]->MTI() & mask))) {
+			cout << "failed to parse " << corpus[i] << endl;
+			ok = false;
+		}
+		delete msg;
+	}
+
+	// Damaged messages are parsed or rejected, but do not crash.
+	unsigned parsed = 0;
+	for (unsigned i=0; i<fuzzIterations; i++) {
+		L3Frame *frame = damage(*frames[rand_r(&seed)%corpusSize],&seed);
+		L3Message *msg = parseL3(*frame);
+		if (msg) {
+			ostringstream text;
+			text << *msg;
+			parsed++;
+		}
+		delete msg;
+		delete frame;
+	}
+	cout << fuzzIterations << " damaged messages, " << parsed << " parsed" << endl;
+
+	// Parse speed.
+	Timeval start;
+	for (unsigned i=0; i<benchIterations; i++) {
+		delete parseL3(*frames[i%corpusSize]);
+	}
+	long elapsed = start.elapsed();
+	cout << benchIterations << " messages in " << elapsed << " ms";
+	if (elapsed) cout << ", " << (1000ULL*benchIterations/elapsed) << " messages/sec";
+	cout << endl;
+	reportL3MessagePools(cout);
+
+	for (unsigned i=0; i<corpusSize; i++) delete frames[i];
+	cout << (ok ? "PASS" : "FAIL") << endl;
+	return ok ? 0 : 1;
+}
+
+// vim: ts=4 sw=4
@@ -0,0 +1,251 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+	Drive many LAPDm links through the shared engine in one process.
+
+	Each link is a BTS-side and an MS-side SDCCH L2 joined by a loopback
+	that drops frames at random.  The MS establishes the link and sends
+	a multiframe message, the BTS echoes it back, and the MS checks it
+	and releases.  Lost frames exercise T200 and retransmission.
+
+		LAPDmTest [links] [loss]
+*/
+
+
+#include "GSML2LAPDm.h"
+#include "GSMSAPMux.h"
+
+#include <Threads.h>
+#include <Timeval.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+using namespace GSM;
+
+
+/** Longest time allowed for the whole run, in ms. */
+static const unsigned maxRunTime = 300000;
+
+
+/**@name Results, guarded by gLock. */
+//@{
+static Mutex gLock;
+static Signal gSignal;
+static unsigned gReleased = 0;
+static unsigned gFailed = 0;
+static unsigned gEchoed = 0;
+static unsigned gMismatched = 0;
+//@}
+
+
+
+/** The radio path of one end, dropping frames at random. */
+class TestMux : public SAPMux {
+
+	private:
+
+	TestMux *mPeer;
+	double mLoss;
+	unsigned mSeed;		///< one L1 writer at a time uses this mux
+
+	public:
+
+	TestMux(unsigned wSeed)
+		:SAPMux(),mPeer(NULL),mLoss(0.0),mSeed(wSeed)
+	{ }
+
+	void peer(TestMux *wPeer, double wLoss) { mPeer=wPeer; mLoss=wLoss; }
+
+	void writeHighSide(const L2Frame& frame)
+	{
+		// Only DATA goes over the air; the other primitives are for L1.
+		if (frame.primitive()!=DATA) return;
+		if (rand_r(&mSeed) < mLoss*RAND_MAX) return;
+		mPeer->writeLowSide(frame);
+	}
+};
+
+
+
+/** The BTS end, which echoes every message. */
+class TestBTSL2 : public SDCCHL2 {
+
+	public:
+
+	TestBTSL2():SDCCHL2(1,0) {}
+
+	protected:
+
+	void writeL3(L3Frame* frame)
+	{
+		// The echo is the received frame itself.
+		if (frame->primitive()==DATA) post(frame);
+		else delete frame;
+	}
+};
+
+
+
+/** Counts MS releases. */
+class ReleaseTally : public L2Completion {
+
+	public:
+
+	void done(bool ok)
+	{
+		gLock.lock();
+		if (ok) gReleased++;
+		else gFailed++;
+		gSignal.signal();
+		gLock.unlock();
+	}
+};
+
+static ReleaseTally gTally;
+
+
+
+/** The MS end, which sends a message and checks the echo. */
+class TestMSL2 : public SDCCHL2 {
+
+	private:
+
+	L3Frame mMessage;
+
+	public:
+
+	TestMSL2(unsigned index)
+		:SDCCHL2(0,0),
+		mMessage(DATA,8*(30+index%31))
+	{
+		for (size_t i=0; i<mMessage.size()/8; i++) mMessage.fillField(8*i,(index+i)&0x0ff,8);
+	}
+
+	/** Establish the link, without blocking. */
+	void run() { post(L3Frame(ESTABLISH)); }
+
+	protected:
+
+	void writeL3(L3Frame* frame)
+	{
+		// Like L3, send only once the establishment is confirmed.
+		if (frame->primitive()==ESTABLISH) post(mMessage);
+		if (frame->primitive()==DATA) {
+			bool same = frame->size()==mMessage.size();
+			for (size_t i=0; same && i<mMessage.size(); i+=8) {
+				same = frame->peekField(i,8)==mMessage.peekField(i,8);
+			}
+			gLock.lock();
+			if (same) gEchoed++;
+			else gMismatched++;
+			gLock.unlock();
+			post(L3Frame(RELEASE),&gTally);
+		}
+		delete frame;
+	}
+};
+
+
+
+/** Number of threads in this process, from /proc. */
+static int threadCount()
+{
+	FILE *status = fopen("/proc/self/status","r");
+	if (!status) return -1;
+	char line[256];
+	int count = -1;
+	while (fgets(line,sizeof(line),status)) {
+		if (sscanf(line,"Threads: %d",&count)==1) break;
+	}
+	fclose(status);
+	return count;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	unsigned numLinks = 2000;
+	double loss = 0.02;
+	if (argc>1) numLinks = atoi(argv[1]);
+	if (argc>2) loss = atof(argv[2]);
+	if (numLinks==0) {
+		fprintf(stderr,"usage: %s [links] [loss]\n",argv[0]);
+		return 1;
+	}
+
+	// The links run until the engine stops.
+	TestBTSL2 **BTS = new TestBTSL2*[numLinks];
+	TestMSL2 **MS = new TestMSL2*[numLinks];
+	for (unsigned i=0; i<numLinks; i++) {
+		BTS[i] = new TestBTSL2;
+		MS[i] = new TestMSL2(i);
+		TestMux *BTSMux = new TestMux(2*i+1);
+		TestMux *MSMux = new TestMux(2*i+2);
+		BTSMux->peer(MSMux,loss);
+		MSMux->peer(BTSMux,loss);
+		BTSMux->upstream(BTS[i],0);
+		MSMux->upstream(MS[i],0);
+		BTS[i]->downstream(BTSMux);
+		MS[i]->downstream(MSMux);
+		BTS[i]->open();
+		MS[i]->open();
+	}
+
+	Timeval start;
+	for (unsigned i=0; i<numLinks; i++) MS[i]->run();
+
+	gLock.lock();
+	while ((gReleased+gFailed<numLinks) && (start.elapsed()<maxRunTime)) {
+		gSignal.wait(gLock,1000);
+	}
+	unsigned released = gReleased;
+	unsigned failed = gFailed;
+	unsigned echoed = gEchoed;
+	unsigned mismatched = gMismatched;
+	gLock.unlock();
+	long elapsed = start.elapsed();
+	int threads = threadCount();
+
+	cout << numLinks << " links, loss " << loss
+		<< ", " << threads << " threads (" << gLAPDmEngine.numThreads() << " in LAPDm)"
+		<< ", " << elapsed << " ms" << endl;
+	cout << "echoed " << echoed << ", mismatched " << mismatched
+		<< ", released " << released << ", failed " << failed << endl;
+	reportFramePools(cout);
+
+	bool ok = (echoed==numLinks) && (mismatched==0) && (released==numLinks) && (failed==0);
+	// The point of the engine: threads do not scale with links.
+	if ((threads<0) || ((unsigned)threads > gLAPDmEngine.numThreads()+4)) ok = false;
+	cout << (ok ? "PASS" : "FAIL") << endl;
+	// The engine threads use the static locks, so stop them before those go.
+	gLAPDmEngine.stop();
+	return ok ? 0 : 1;
+}
+
+// vim: ts=4 sw=4
@@ -22,6 +22,8 @@
 
 */
 
+#define LOG_MODULE HLR
+
 #include "HLR.h"
 #include <Logger.h>
 #include <Threads.h>
@@ -31,6 +33,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <sys/time.h>
 
 using namespace std;
 
@@ -120,9 +124,12 @@ char *AsteriskHLR::getIMSI(const char *ISDN)
 		return NULL;
 	}
 	reloadConfig();
-	char *cached = mIMSICache.read(ISDN);
-	if (cached) return cached;
+	return mIMSICache.lookup(ISDN);
+}
 
+
+char *AsteriskHLR::lookupIMSI(const char *ISDN)
+{
 	char command[100];
 	sprintf(command,"dialplan show %s@sip-local", ISDN);
 	char *line = getAsteriskLine(command,ISDN);
@@ -139,7 +146,6 @@ char *AsteriskHLR::getIMSI(const char *ISDN)
 	digits[19] = '\0';
 	IMSI = strdup(digits);
 	free(line);
-	mIMSICache.write(ISDN,IMSI);
 	return IMSI;
 
 badParse:
@@ -152,9 +158,12 @@ badParse:
 char *AsteriskHLR::getCLIDLocal(const char* IMSI)
 {
 	reloadConfig();
-	char *cached = mCLIDLocalCache.read(IMSI);
-	if (cached) return cached;
+	return mCLIDLocalCache.lookup(IMSI);
+}
+
 
+char *AsteriskHLR::lookupCLIDLocal(const char* IMSI)
+{
 	char command[100];
 	sprintf(command,"sip show user %s", IMSI);
 	char *line = getAsteriskLine(command,"Callerid");
@@ -171,7 +180,6 @@ char *AsteriskHLR::getCLIDLocal(const char* IMSI)
 	*numberEnd = '\0';
 	CLID = strdup(numberStart+1);
 	free(line);
-	mCLIDLocalCache.write(IMSI,CLID);
 	return CLID;
 
 	// Handle errors here.
@@ -187,7 +195,7 @@ badParse:
 char *AsteriskHLR::getCLIDGlobal(const char* IMSI)
 {
 	reloadConfig();
-	char *cached = mCLIDGlobalCache.read(IMSI);
+	char *cached = mCLIDGlobalCache.lookup(IMSI);
 	if (cached) return cached;
 
 	// FIXME
@@ -210,9 +218,12 @@ char *AsteriskHLR::mapCLIDGlobal(const char *local)
 
 char *AsteriskHLR::getRegistrationIP(const char* IMSI)
 {
-	char *cached = mRegistrationCache.read(IMSI);
-	if (cached) return cached;
+	return mRegistrationCache.lookup(IMSI);
+}
+
 
+char *AsteriskHLR::lookupRegistrationIP(const char* IMSI)
+{
 	char command[100];
 	sprintf(command,"database showkey SIP/Registry/%s", IMSI);
 	char *line = getAsteriskLine(command,IMSI);
@@ -241,7 +252,6 @@ char *AsteriskHLR::getRegistrationIP(const char* IMSI)
 	*third = '\0';
 	IPString = strdup(first);
 	free(line);
-	mRegistrationCache.write(IMSI,IPString,20);
 	return IPString;
 
 	// Handle errors here.
@@ -273,10 +283,14 @@ HLR::Status AsteriskHLR::addUser(const char* IMSI, const char* CLID)
 	// All done.
 	fclose(cf);
 	// Reload the config.
+	mReloadLock.lock();
 	mNeedSIPReload = true;
+	mReloadLock.unlock();
 	HLR::Status stat1 = reloadSIP();
 	// Go ahead and add the extension now, too.
 	HLR::Status stat2 = addAddress(IMSI,CLID);
+	// Answer for the new user now, rather than from the old "none" entries.
+	if (stat1!=FAILURE) mCLIDLocalCache.write(IMSI,CLID);
 
 	return CombinedStatus[stat1][stat2];
 }
@@ -300,7 +314,10 @@ HLR::Status AsteriskHLR::addAddress(const char* IMSI, const char* address)
 	fprintf(cf,"exten => %s,1,Dial(SIP/%s)\n", address, IMSI);
 	fclose(cf);
 	// Reload the config.
+	mReloadLock.lock();
 	mNeedDialplanReload = true;
+	mReloadLock.unlock();
+	mIMSICache.write(address,IMSI);
 	return reloadDialplan();
 }
 
@@ -308,30 +325,56 @@ HLR::Status AsteriskHLR::addAddress(const char* IMSI, const char* address)
 
 HLR::Status AsteriskHLR::reloadSIP()
 {
+	mReloadLock.lock();
 	LOG(DEBUG) << "AsteriskHLR::reloadSIP needReload=" << mNeedSIPReload << " elapsed=" << mLastSIPReloadTime.elapsed();
-	if (!mNeedSIPReload) return SUCCESS;
-	if (mLastSIPReloadTime.elapsed()<1000*mHoldoffTime) return DELAYED;
+	if (!mNeedSIPReload) {
+		mReloadLock.unlock();
+		return SUCCESS;
+	}
+	if (mLastSIPReloadTime.elapsed()<1000*mHoldoffTime) {
+		mReloadLock.unlock();
+		return DELAYED;
+	}
+	// Claim the reload, so that other threads don't run it too
+	// and lookups don't wait on Asterisk.
+	mLastSIPReloadTime.now();
+	mNeedSIPReload = false;
+	mReloadLock.unlock();
 	if (system("asterisk -rx \"sip reload\"")) {
 		LOG(ALARM) << "AsteriskHLR::reloadSIP Asterisk call failed";
+		mReloadLock.lock();
+		mNeedSIPReload = true;
+		mReloadLock.unlock();
 		return FAILURE;
 	}
-	mLastSIPReloadTime.now();
-	mNeedSIPReload = false;
 	return SUCCESS;
 }
 
 
 HLR::Status AsteriskHLR::reloadDialplan()
 {
+	mReloadLock.lock();
 	LOG(DEBUG) << "AsteriskHLR::reloadDialplan needReload=" << mNeedDialplanReload << " elapsed=" << mLastDialplanReloadTime.elapsed();
-	if (!mNeedDialplanReload) return SUCCESS;
-	if (mLastDialplanReloadTime.elapsed()<1000*mHoldoffTime) return DELAYED;
+	if (!mNeedDialplanReload) {
+		mReloadLock.unlock();
+		return SUCCESS;
+	}
+	if (mLastDialplanReloadTime.elapsed()<1000*mHoldoffTime) {
+		mReloadLock.unlock();
+		return DELAYED;
+	}
+	// Claim the reload, so that other threads don't run it too
+	// and lookups don't wait on Asterisk.
+	mLastDialplanReloadTime.now();
+	mNeedDialplanReload = false;
+	mReloadLock.unlock();
 	if (system("asterisk -rx \"dialplan reload\"")) {
 		LOG(ALARM) << "AsteriskHLR::reloadDialplan Asterisk call failed";
+		mReloadLock.lock();
+		mNeedDialplanReload = true;
+		mReloadLock.unlock();
 		return FAILURE;
 	}
-	mLastDialplanReloadTime.now();
-	mNeedDialplanReload = false;
 	return SUCCESS;
 }
 
@@ -344,40 +387,247 @@ HLR::Status AsteriskHLR::reloadConfig()
 
 
 
+/**
+	The thread that refreshes stale HLRCache entries, for all caches.
+	Caches queue keys here without holding their shard locks.
+*/
+class HLRCacheRefresher {
+
+	private:
+
+	Mutex mLock;
+	Signal mSignal;
+	std::list<std::pair<HLRCache*,std::string> > mQueue;
+	HLRCache *mCurrent;			///< cache being refreshed right now
+	bool mStarted;
+
+	public:
+
+	HLRCacheRefresher():mCurrent(NULL),mStarted(false) {}
+
+	void queue(HLRCache* cache, const char* key)
+	{
+		mLock.lock();
+		if (!mStarted) {
+			mStarted = true;
+			// This thread runs for the life of the process.
+			Thread *thread = new Thread;
+			thread->start((void *(*)(void*))HLRCacheRefresherLoopAdapter,this);
+		}
+		mQueue.push_back(std::pair<HLRCache*,std::string>(cache,key));
+		mSignal.signal();
+		mLock.unlock();
+	}
+
+	/** Drop the queued refreshes of a cache and wait out a running one. */
+	void forget(HLRCache* cache)
+	{
+		mLock.lock();
+		std::list<std::pair<HLRCache*,std::string> >::iterator itr = mQueue.begin();
+		while (itr!=mQueue.end()) {
+			if (itr->first==cache) itr = mQueue.erase(itr);
+			else ++itr;
+		}
+		while (mCurrent==cache) mSignal.wait(mLock);
+		mLock.unlock();
+	}
+
+	void loop()
+	{
+		mLock.lock();
+		while (true) {
+			while (mQueue.empty()) mSignal.wait(mLock);
+			HLRCache *cache = mQueue.front().first;
+			std::string key = mQueue.front().second;
+			mQueue.pop_front();
+			mCurrent = cache;
+			mLock.unlock();
+			cache->refresh(key.c_str());
+			mLock.lock();
+			mCurrent = NULL;
+			mSignal.broadcast();
+		}
+	}
+
+	static void *HLRCacheRefresherLoopAdapter(HLRCacheRefresher* refresher)
+	{
+		refresher->loop();
+		return NULL;
+	}
+};
+
+
+/**
+	The refresher of the process.
+	It is never destroyed, since its thread may be waiting on it at exit.
+*/
+static HLRCacheRefresher& refresher()
+{
+	static HLRCacheRefresher *sRefresher = new HLRCacheRefresher;
+	return *sRefresher;
+}
+
+
+
+HLRCache::HLRCache(const char* name, Loader loader, void* arg,
+		unsigned lifetime, unsigned negativeLifetime,
+		unsigned staleLifetime, size_t maxSize)
+	:mName(name),mLoader(loader),mLoaderArg(arg),
+	mLifetime(lifetime),mNegativeLifetime(negativeLifetime),
+	mStaleLifetime(staleLifetime),
+	mShardSize(maxSize/NumShards ? maxSize/NumShards : 1),
+	mHits(0),mNegativeHits(0),mStaleHits(0),mMisses(0),
+	mRefreshes(0),mEvictions(0),
+	mLoadMicroseconds(0),mMaxLoadMicroseconds(0)
+{ }
+
+
+HLRCache::~HLRCache()
+{
+	if (mLoader) refresher().forget(this);
+}
+
+
+HLRCache::Shard& HLRCache::shard(const char* key)
+{
+	// FNV-1a
+	uint32_t h = 2166136261U;
+	while (*key) h = (h ^ (unsigned char)*key++) * 16777619U;
+	return mShards[h % NumShards];
+}
+
+
 void HLRCache::write(const char* key, const char* value, unsigned lifetime)
 {
-	mLock.lock();
-	if (mTable.size()>MaxSize) flush();
-	mTable[key] = HLRCacheEntry(value,lifetime);
-	mLock.unlock();
+	if (!key) return;
+	if (!lifetime) lifetime = value ? mLifetime : mNegativeLifetime;
+	Shard& s = shard(key);
+	s.mLock.lock();
+	EntryMap::iterator itr = s.mTable.find(key);
+	if (itr==s.mTable.end()) {
+		itr = s.mTable.insert(EntryMap::value_type(key,Entry())).first;
+		s.mLRU.push_front(key);
+	} else {
+		s.mLRU.splice(s.mLRU.begin(),s.mLRU,itr->second.mLRU);
+	}
+	Entry& entry = itr->second;
+	entry.mLRU = s.mLRU.begin();
+	entry.mNegative = (value==NULL);
+	entry.mValue = value ? value : "";
+	entry.mExpires = Timeval(1000*lifetime);
+	entry.mRefreshing = false;
+	while (s.mTable.size() > mShardSize) {
+		s.mTable.erase(s.mLRU.back());
+		s.mLRU.pop_back();
+		__sync_fetch_and_add(&mEvictions,1);
+	}
+	s.mLock.unlock();
 }
 
 
-char* HLRCache::read(const char* key)
+char* HLRCache::lookup(const char* key)
 {
 	if (!key) return NULL;
-	char *retVal = NULL;
-	mLock.lock();
-	map<string,HLRCacheEntry>::iterator itr = mTable.find(key);
-	if (itr==mTable.end()) {
-		mLock.unlock();
-		return NULL;
+	Shard& s = shard(key);
+	s.mLock.lock();
+	EntryMap::iterator itr = s.mTable.find(key);
+	if (itr!=s.mTable.end()) {
+		Entry& entry = itr->second;
+		long late = entry.mExpires.elapsed();
+		if (late < 1000*(long)mStaleLifetime) {
+			s.mLRU.splice(s.mLRU.begin(),s.mLRU,entry.mLRU);
+			char *retVal = entry.mNegative ? NULL : strdup(entry.mValue.c_str());
+			bool stale = (late>0) && mLoader && !entry.mRefreshing;
+			if (stale) entry.mRefreshing = true;
+			s.mLock.unlock();
+			__sync_fetch_and_add(&mHits,1);
+			if (!retVal) __sync_fetch_and_add(&mNegativeHits,1);
+			if (stale) {
+				__sync_fetch_and_add(&mStaleHits,1);
+				refresher().queue(this,key);
+			}
+			return retVal;
+		}
+		// Too old even to serve while refreshing.
+		s.mLRU.erase(entry.mLRU);
+		s.mTable.erase(itr);
 	}
-	if (itr!=mTable.end()) retVal = strdup(itr->second.value());
-	if (itr->second.expired()) {
-		mTable.erase(itr);
-		mLock.unlock();
-		return NULL;
+	s.mLock.unlock();
+	__sync_fetch_and_add(&mMisses,1);
+	if (!mLoader) return NULL;
+	char *value = load(key);
+	write(key,value);
+	return value;
+}
+
+
+char* HLRCache::load(const char* key)
+{
+	struct timeval start, end;
+	gettimeofday(&start,NULL);
+	char *value = mLoader(mLoaderArg,key);
+	gettimeofday(&end,NULL);
+	unsigned us = (end.tv_sec-start.tv_sec)*1000000 + (end.tv_usec-start.tv_usec);
+	__sync_fetch_and_add(&mLoadMicroseconds,us);
+	if (us > mMaxLoadMicroseconds) mMaxLoadMicroseconds = us;
+	return value;
+}
+
+
+void HLRCache::refresh(const char* key)
+{
+	char *value = load(key);
+	write(key,value);
+	free(value);
+	__sync_fetch_and_add(&mRefreshes,1);
+}
+
+
+void HLRCache::invalidate(const char* key)
+{
+	if (!key) return;
+	Shard& s = shard(key);
+	s.mLock.lock();
+	EntryMap::iterator itr = s.mTable.find(key);
+	if (itr!=s.mTable.end()) {
+		s.mLRU.erase(itr->second.mLRU);
+		s.mTable.erase(itr);
+	}
+	s.mLock.unlock();
+}
+
+
+size_t HLRCache::size()
+{
+	size_t retVal = 0;
+	for (unsigned i=0; i<NumShards; i++) {
+		mShards[i].mLock.lock();
+		retVal += mShards[i].mTable.size();
+		mShards[i].mLock.unlock();
 	}
-	mLock.unlock();
 	return retVal;
 }
 
 
-void HLRCache::flush()
+void HLRCache::dump(ostream& os)
 {
-	// Discard expired entries.
-	// FIXME -- Implement this.
+	unsigned loads = mMisses + mRefreshes;
+	os << mName << " cache: " << size() << " entries, " << mHits << " hits ("
+		<< mNegativeHits << " none, " << mStaleHits << " stale), " << mMisses << " misses, "
+		<< mRefreshes << " refreshes, " << mEvictions << " evictions";
+	if (mLoader && loads) {
+		os << ", backend avg " << mLoadMicroseconds/loads << " us, max " << mMaxLoadMicroseconds << " us";
+	}
+	os << endl;
+}
+
+
+void AsteriskHLR::dump(ostream& os)
+{
+	mIMSICache.dump(os);
+	mCLIDLocalCache.dump(os);
+	mCLIDGlobalCache.dump(os);
+	mRegistrationCache.dump(os);
 }
 
 
@@ -402,7 +652,318 @@ bool AsteriskHLR::useGateway(const char* ISDN)
 
 
 
+/** Strip leading and trailing white space, in place. */
+static char* trim(char* s)
+{
+	while (isspace(*s)) s++;
+	char *end = s + strlen(s);
+	while (end>s && isspace(end[-1])) end--;
+	*end = '\0';
+	return s;
+}
+
+
+bool NativeHLR::importSIPConf(HLRStore& store, const char* path, unsigned& count)
+{
+	FILE *cf = fopen(path,"r");
+	if (!cf) {
+		LOG(ALARM) << "NativeHLR cannot open " << path;
+		return false;
+	}
+	char line[256];
+	char section[HLRStore::KeyLength] = "";
+	while (fgets(line,sizeof(line),cf)) {
+		char *comment = strchr(line,';');
+		if (comment) *comment = '\0';
+		char *text = trim(line);
+		// [IMSI] starts a user, maybe with a template suffix.
+		if (*text=='[') {
+			char *end = strchr(text,']');
+			section[0] = '\0';
+			if (end && (size_t)(end-text-1)<sizeof(section)) {
+				*end = '\0';
+				strcpy(section,text+1);
+			}
+			if (strcmp(section,"general")==0) section[0] = '\0';
+			continue;
+		}
+		if (!section[0] || strncmp(text,"callerid",8)!=0) continue;
+		char *value = text+8;
+		while (isspace(*value) || *value=='=' || *value=='>') value++;
+		// callerid=2101 or callerid="Name" <2101>
+		char *start = strchr(value,'<');
+		if (start) {
+			char *end = strchr(start,'>');
+			if (!end) continue;
+			*end = '\0';
+			value = start+1;
+		}
+		if (store.writeLocked(HLRStore::CLIDLocal,section,trim(value))) count++;
+	}
+	fclose(cf);
+	return true;
+}
+
+
+bool NativeHLR::importExtensionsConf(HLRStore& store, const char* path, unsigned& count, unsigned depth)
+{
+	FILE *cf = fopen(path,"r");
+	if (!cf) {
+		LOG(ALARM) << "NativeHLR cannot open " << path;
+		return false;
+	}
+	char line[256];
+	while (fgets(line,sizeof(line),cf)) {
+		char *comment = strchr(line,';');
+		if (comment) *comment = '\0';
+		char *text = trim(line);
+		// addAddress provisions into extensions.local.conf, which the dialplan includes.
+		// #include "file" or #include file, relative to this file.
+		if (strncmp(text,"#include",8)==0) {
+			if (depth>=mMaxIncludeDepth) {
+				LOG(WARN) << "NativeHLR ignoring nested " << text << " in " << path;
+				continue;
+			}
+			char *name = trim(text+8);
+			if (*name=='"' || *name=='<') name++;
+			name[strcspn(name,"\">")] = '\0';
+			if (!*name) continue;
+			string included = name;
+			const char *slash = strrchr(path,'/');
+			if (*name!='/' && slash) included = string(path,slash-path+1) + name;
+			// Subscribers from an include that cannot be read would be lost.
+			if (!importExtensionsConf(store,included.c_str(),count,depth+1)) {
+				fclose(cf);
+				return false;
+			}
+			continue;
+		}
+		// exten => ISDN,1,Dial(SIP/IMSI)
+		if (strncmp(text,"exten",5)!=0) continue;
+		char *ISDN = text+5;
+		while (isspace(*ISDN) || *ISDN=='=' || *ISDN=='>') ISDN++;
+		char *comma = strchr(ISDN,',');
+		if (!comma) continue;
+		*comma = '\0';
+		ISDN = trim(ISDN);
+		// Skip patterns; only exact addresses resolve to a subscriber.
+		if (*ISDN=='_' || !*ISDN) continue;
+		char *priority = comma+1;
+		if (strtol(priority,NULL,10)!=1) continue;
+		char *SIP = strstr(priority,"SIP/");
+		if (!SIP) continue;
+		char *IMSI = SIP+4;
+		IMSI[strcspn(IMSI,",)/&@ \t")] = '\0';
+		if (!*IMSI) continue;
+		if (store.writeLocked(HLRStore::Address,ISDN,IMSI)) count++;
+	}
+	fclose(cf);
+	return true;
+}
+
+
+unsigned NativeHLR::importAsterisk(const char* SIPConf, const char* extensionsConf)
+{
+	mImportLock.lock();
+	mSIPConf = SIPConf;
+	mExtensionsConf = extensionsConf;
+	struct stat st;
+	mSIPConfTime = (stat(SIPConf,&st)==0) ? st.st_mtime : 0;
+	mExtensionsConfTime = (stat(extensionsConf,&st)==0) ? st.st_mtime : 0;
+	mNextImportCheck = time(NULL) + mImportHoldoff;
+	// Rebuild from scratch, so subscribers deleted from the config go away too.
+	// The new records are collected aside, so lookups go on meanwhile,
+	// and a file that is missing, or being replaced, does not empty the store.
+	HLRStore fresh;
+	unsigned count = 0;
+	if (!fresh.open(NULL)) {
+		mImportLock.unlock();
+		return 0;
+	}
+	fresh.lock();
+	bool ok = importSIPConf(fresh,SIPConf,count) && importExtensionsConf(fresh,extensionsConf,count);
+	fresh.unlock();
+	if (!ok || !mStore.replace(fresh)) {
+		mImportLock.unlock();
+		LOG(ALARM) << "NativeHLR cannot import " << SIPConf << " and " << extensionsConf << ", keeping " << mStore.size() << " records";
+		return 0;
+	}
+	mStore.sync();
+	mImportLock.unlock();
+	LOG(INFO) << "NativeHLR imported " << count << " records from " << SIPConf << " and " << extensionsConf;
+	return count;
+}
+
+
+void NativeHLR::checkImport()
+{
+	// This is on every lookup, so it only reads the clock most of the time.
+	if (time(NULL) < mNextImportCheck) return;
+	mImportLock.lock();
+	if (mSIPConf.empty() || time(NULL) < mNextImportCheck) {
+		mImportLock.unlock();
+		return;
+	}
+	mNextImportCheck = time(NULL) + mImportHoldoff;
+	struct stat st;
+	time_t SIPConfTime = (stat(mSIPConf.c_str(),&st)==0) ? st.st_mtime : 0;
+	time_t extensionsConfTime = (stat(mExtensionsConf.c_str(),&st)==0) ? st.st_mtime : 0;
+	bool changed = (SIPConfTime!=mSIPConfTime) || (extensionsConfTime!=mExtensionsConfTime);
+	std::string SIPConf = mSIPConf;
+	std::string extensionsConf = mExtensionsConf;
+	mImportLock.unlock();
+	if (changed) importAsterisk(SIPConf.c_str(),extensionsConf.c_str());
+}
+
+
+void NativeHLR::checkRegistry()
+{
+	mRegistryLock.lock();
+	if (mRegistryLoaded && mRegistryTime.elapsed()<1000*(long)mRegistryLifetime) {
+		mRegistryLock.unlock();
+		return;
+	}
+	if (mRegistryLoading) {
+		// Another thread is at it.  Keep the old copy meanwhile,
+		// but there must be a first copy to keep.
+		while (!mRegistryLoaded) mRegistryReady.wait(mRegistryLock);
+		mRegistryLock.unlock();
+		return;
+	}
+	mRegistryLoading = true;
+	mRegistryLock.unlock();
+
+	map<string,string> registry;
+	FILE* asterisk = popen("asterisk -rx \"database show SIP/Registry\"","r");
+	if (!asterisk) {
+		// Answer from an empty registry until the next try.
+		LOG(ALARM) << "Asterisk registry dump failed";
+		mRegistryLock.lock();
+		mRegistryLoaded = true;
+		mRegistryLoading = false;
+		mRegistryTime.now();
+		mRegistryReady.broadcast();
+		mRegistryLock.unlock();
+		return;
+	}
+	// /SIP/Registry/IMSI001010000000001 : 192.168.0.5:5062:3600:...
+	static const char prefix[] = "/SIP/Registry/";
+	char line[512];
+	while (fgets(line,sizeof(line),asterisk)) {
+		char *IMSI = strstr(line,prefix);
+		if (!IMSI) continue;
+		IMSI += sizeof(prefix)-1;
+		char *first = strchr(IMSI,':');
+		if (!first) continue;
+		*first = '\0';
+		char *IP = trim(first+1);
+		char *second = strchr(IP,':');
+		if (!second) continue;
+		char *third = strchr(second+1,':');
+		if (!third) continue;
+		*third = '\0';
+		registry[trim(IMSI)] = IP;
+	}
+	pclose(asterisk);
+	LOG(DEBUG) << "NativeHLR loaded " << registry.size() << " registrations";
+	__sync_fetch_and_add(&mRegistryLoads,1);
+
+	mRegistryLock.lock();
+	mRegistry.swap(registry);
+	mRegistryLoaded = true;
+	mRegistryLoading = false;
+	mRegistryTime.now();
+	mRegistryReady.broadcast();
+	mRegistryLock.unlock();
+}
+
+
+char *NativeHLR::counted(char* value)
+{
+	__sync_fetch_and_add(&mLookups,1);
+	if (!value) __sync_fetch_and_add(&mMisses,1);
+	return value;
+}
+
+
+void NativeHLR::dump(ostream& os)
+{
+	os << "store: " << mStore.size() << " records, " << mLookups << " lookups, " << mMisses << " not found" << endl;
+	mRegistryLock.lock();
+	os << "registry: " << mRegistry.size() << " registrations, " << mRegistryLoads << " loads";
+	if (mRegistryLoaded) os << ", last " << mRegistryTime.elapsed()/1000 << " s ago";
+	os << endl;
+	mRegistryLock.unlock();
+	mAsterisk.dump(os);
+}
+
+
+char *NativeHLR::getIMSI(const char *ISDN)
+{
+	if (!ISDN) {
+		LOG(WARN) << "NativeHLR::getIMSI attempting lookup of NULL IMSI";
+		return NULL;
+	}
+	checkImport();
+	return counted(mStore.read(HLRStore::Address,ISDN));
+}
+
+
+char *NativeHLR::getCLIDLocal(const char* IMSI)
+{
+	checkImport();
+	return counted(mStore.read(HLRStore::CLIDLocal,IMSI));
+}
+
+
+char *NativeHLR::getCLIDGlobal(const char* IMSI)
+{
+	checkImport();
+	char *CLID = mStore.read(HLRStore::CLIDGlobal,IMSI);
+	if (CLID) return CLID;
+	return mAsterisk.getCLIDGlobal(IMSI);
+}
+
 
+char *NativeHLR::mapCLIDGlobal(const char *local)
+{
+	char *IMSI = getIMSI(local);
+	if (!IMSI) return NULL;
+	char *global = getCLIDGlobal(IMSI);
+	free(IMSI);
+	return global;
+}
+
+
+char *NativeHLR::getRegistrationIP(const char* IMSI)
+{
+	if (!IMSI) return NULL;
+	checkRegistry();
+	char *retVal = NULL;
+	mRegistryLock.lock();
+	map<string,string>::const_iterator itr = mRegistry.find(IMSI);
+	if (itr!=mRegistry.end()) retVal = strdup(itr->second.c_str());
+	mRegistryLock.unlock();
+	return retVal;
+}
+
+
+HLR::Status NativeHLR::addUser(const char* IMSI, const char* CLID)
+{
+	// Asterisk still needs the user to route calls.
+	HLR::Status status = mAsterisk.addUser(IMSI,CLID);
+	if (status==FAILURE || status==TRYAGAIN) return status;
+	if (!mStore.write(HLRStore::CLIDLocal,IMSI,CLID)) return FAILURE;
+	return CombinedStatus[status][addAddress(IMSI,CLID)];
+}
+
+
+HLR::Status NativeHLR::addAddress(const char* IMSI, const char* address)
+{
+	if (!mStore.write(HLRStore::Address,address,IMSI)) return FAILURE;
+	mStore.sync();
+	return SUCCESS;
+}
 
 
 // vim: ts=4 sw=4
@@ -29,7 +29,11 @@
 #include <Timeval.h>
 #include <Threads.h>
 #include <map>
+#include <list>
+#include <string>
+#include <ostream>
 #include <stdlib.h>
+#include "HLRStore.h"
 
 
 
@@ -101,67 +105,124 @@ class HLR {
 
 
 
-/** An entry for HLR caches: a string and a timer. */
-class HLRCacheEntry {
+/**
+	An HLR cache in front of a slow lookup.
 
-	private:
-
-	Timeval mTimer;
-	std::string mValue;
+	Keys are spread over shards, each with its own lock and LRU list, so
+	lookups of different keys rarely contend.  A backend answer of "none"
+	is cached too, for a shorter time, so that repeated lookups of an
+	unknown key do not each go to the backend.  An entry that has expired
+	but is within its stale time is still returned, and a background
+	thread asks the backend again; after that, a lookup waits for the
+	backend.  Each shard holds at most its share of the size bound,
+	evicting its least recently used entries.
+*/
+class HLRCache {
 
 	public:
 
-	HLRCacheEntry() {}
-
 	/**
-		Create a cache entry.
-		@param wValue THe value string.
-		@param lifetime The expiration period in seconds.
+		A backend lookup.
+		@param arg The argument given to the cache constructor.
+		@param key The key to look up.
+		@return A C-string to be freed by the caller, NULL if the backend has no value.
 	*/
-	HLRCacheEntry(const char* wValue, unsigned lifetime=3600)
-		:mTimer(1000*lifetime),
-		mValue(wValue)
-	{ }
+	typedef char* (*Loader)(void* arg, const char* key);
 
-	/** Return true if the entry is expired. */
-	bool expired() const { return mTimer.passed(); }
+	private:
 
-	/** Value accessor. */
-	const char* value() const { return mValue.c_str(); }
-};
+	static const unsigned NumShards = 16;
 
+	struct Entry {
+		std::string mValue;
+		bool mNegative;					///< true if the backend had no value
+		Timeval mExpires;
+		bool mRefreshing;				///< true if a background refresh is queued
+		std::list<std::string>::iterator mLRU;
+	};
 
-/** An HLR cache. */
-class HLRCache {
+	typedef std::map<std::string,Entry> EntryMap;
 
-	private:
+	struct Shard {
+		Mutex mLock;
+		EntryMap mTable;
+		std::list<std::string> mLRU;	///< keys, most recently used first
+	};
+
+	Shard mShards[NumShards];
 
-	static const size_t MaxSize = 5000;
-	mutable Mutex mLock;
-	std::map<std::string, HLRCacheEntry> mTable;
+	const char* mName;
+	Loader mLoader;
+	void* mLoaderArg;
+	unsigned mLifetime;					///< for values, in seconds
+	unsigned mNegativeLifetime;			///< for "none" answers, in seconds
+	unsigned mStaleLifetime;			///< past expiration, in seconds
+	size_t mShardSize;					///< most entries per shard
+
+	/**@name Counters. */
+	//@{
+	volatile unsigned mHits;			///< answered from the cache
+	volatile unsigned mNegativeHits;	///< of those, "none" answers
+	volatile unsigned mStaleHits;		///< of those, expired entries refreshed in the background
+	volatile unsigned mMisses;			///< lookups that waited for the backend
+	volatile unsigned mRefreshes;		///< background refreshes
+	volatile unsigned mEvictions;		///< entries dropped for space
+	volatile unsigned long long mLoadMicroseconds;	///< total backend time
+	volatile unsigned mMaxLoadMicroseconds;			///< longest backend lookup
+	//@}
+
+	Shard& shard(const char* key);
 
 	public:
 
 	/**
-		Add an item to the cahce.
+		Create a cache.
+		@param name The name for dump().
+		@param loader The backend lookup, or NULL for a cache that is only written.
+		@param arg The first argument to the loader.
+		@param lifetime The default expiration period of values, in seconds.
+		@param negativeLifetime The expiration period of "none" answers, in seconds.
+		@param staleLifetime How long an expired value is served while it is refreshed, in seconds.
+		@param maxSize The most entries to keep.
+	*/
+	HLRCache(const char* name, Loader loader=NULL, void* arg=NULL,
+		unsigned lifetime=3600, unsigned negativeLifetime=60,
+		unsigned staleLifetime=60, size_t maxSize=5000);
+
+	/** Drops any refresh still queued for the cache. */
+	~HLRCache();
+
+	/**
+		Add an item to the cache.
 		@param key The cache lookup key.
-		@param value The value to cache.
-		@param lifetime The time until expiration, in seconds.
+		@param value The value to cache, or NULL to cache a "none" answer.
+		@param lifetime The time until expiration, in seconds, or 0 for the cache default.
 	*/
-	void write(const char* key, const char* value, unsigned lifetime=3600);
+	void write(const char* key, const char* value, unsigned lifetime=0);
 
 	/**
-		Check the cache for an item, flushes expired items.
-		@param key The key to check.
-		@return A C-string to be freed by the caller or NULL if not found.
+		Look up a key, in the cache and then in the backend.
+		@param key The key to look up.
+		@return A C-string to be freed by the caller or NULL if there is no value.
 	*/
-	char* read(const char* key);
+	char* lookup(const char* key);
 
-	private:
+	/** Drop an item. */
+	void invalidate(const char* key);
+
+	/** Ask the backend again and update the cache; for the refresh thread. */
+	void refresh(const char* key);
 
-	/** Discard expired entries. */
-	void flush();
+	/** Number of entries. */
+	size_t size();
 
+	/** Print the size and counters on one line. */
+	void dump(std::ostream&);
+
+	private:
+
+	/** Call the backend, timing it. */
+	char* load(const char* key);
 };
 
 
@@ -188,6 +249,7 @@ class AsteriskHLR : public HLR {
 	/**@ Mechamisms to limit Asterisk reloads. */
 	//@{
 	static const int mHoldoffTime = 2;		///< reload hold-off in SECONDS
+	Mutex mReloadLock;						///< lookup threads and addUser both reload
 	Timeval mLastSIPReloadTime;
 	bool mNeedSIPReload;
 	Timeval mLastDialplanReloadTime;
@@ -198,6 +260,10 @@ class AsteriskHLR : public HLR {
 	public:
 
 	AsteriskHLR():
+		mIMSICache("ISDN->IMSI",loadIMSI,this),
+		mCLIDLocalCache("IMSI->local CLID",loadCLIDLocal,this),
+		mCLIDGlobalCache("IMSI->global CLID"),
+		mRegistrationCache("registration",loadRegistrationIP,this,20,10,20),
 		mNeedSIPReload(false),
 		mNeedDialplanReload(false)
 	{ }
@@ -215,10 +281,26 @@ class AsteriskHLR : public HLR {
 
 	bool useGateway(const char *ISDN);
 
+	/** Print the cache counters, one cache per line. */
+	void dump(std::ostream&);
+
 	private:
 
 	Status addAddress(const char* IMSI, const char* address);
 
+	/**@name Asterisk lookups behind the caches. */
+	//@{
+	char* lookupIMSI(const char* ISDN);
+	char* lookupCLIDLocal(const char* IMSI);
+	char* lookupRegistrationIP(const char* IMSI);
+	static char* loadIMSI(void* hlr, const char* ISDN)
+		{ return ((AsteriskHLR*)hlr)->lookupIMSI(ISDN); }
+	static char* loadCLIDLocal(void* hlr, const char* IMSI)
+		{ return ((AsteriskHLR*)hlr)->lookupCLIDLocal(IMSI); }
+	static char* loadRegistrationIP(void* hlr, const char* IMSI)
+		{ return ((AsteriskHLR*)hlr)->lookupRegistrationIP(IMSI); }
+	//@}
+
 	/**
 		Send a command to Asterisk and return the fist line containing the tag.
 		@param command The command to send.
@@ -252,6 +334,125 @@ class AsteriskHLR : public HLR {
 
 
 
+/**
+	An HLR facility that answers lookups from an HLRStore in this process.
+
+	The subscribers come from a bulk import of the Asterisk sip.conf and
+	dialplan, which is read again when either file changes, and from
+	addUser, which also provisions them in Asterisk so that calls still
+	route.  Registrations live in Asterisk, so they are read from its
+	registry, all at once, when the last copy is too old.
+*/
+class NativeHLR : public HLR {
+
+	private:
+
+	HLRStore mStore;
+	AsteriskHLR mAsterisk;				///< for provisioning and the registry
+
+	/**@name Asterisk config import. */
+	//@{
+	static const int mImportHoldoff = 2;	///< config check hold-off in SECONDS
+	Mutex mImportLock;
+	std::string mSIPConf;
+	std::string mExtensionsConf;
+	time_t mSIPConfTime;				///< mtime of mSIPConf at the last import
+	time_t mExtensionsConfTime;			///< mtime of mExtensionsConf at the last import
+	volatile time_t mNextImportCheck;	///< no stat calls before this time
+	static const unsigned mMaxIncludeDepth = 4;	///< dialplan #include nesting we follow
+	//@}
+
+	/**@name A copy of the Asterisk registry. */
+	//@{
+	static const unsigned mRegistryLifetime = 20;	///< in SECONDS
+	Mutex mRegistryLock;
+	Signal mRegistryReady;				///< signaled when a load finishes
+	std::map<std::string,std::string> mRegistry;
+	Timeval mRegistryTime;
+	bool mRegistryLoaded;				///< true once the first load has finished
+	bool mRegistryLoading;				///< true while some thread is loading
+	//@}
+
+	/**@name Counters. */
+	//@{
+	volatile unsigned mLookups;			///< store lookups
+	volatile unsigned mMisses;			///< store lookups with no record
+	volatile unsigned mRegistryLoads;	///< registry dumps read from Asterisk
+	//@}
+
+	/** Count a store lookup and pass its result through. */
+	char* counted(char* value);
+
+	public:
+
+	NativeHLR()
+		:mSIPConfTime(0),mExtensionsConfTime(0),mNextImportCheck(0),
+		mRegistryLoaded(false),mRegistryLoading(false),
+		mLookups(0),mMisses(0),mRegistryLoads(0)
+	{ }
+
+	/**
+		Open the store.
+		@param path The store file, or NULL to keep the store in memory.
+		@return True on success.
+	*/
+	bool open(const char* path) { return mStore.open(path); }
+
+	/**
+		Load the subscribers defined in the Asterisk config, replacing what the store held.
+		Later lookups import the files again if they change.
+		The dialplan's #include files are read too.
+		@param SIPConf The sip.conf with a [IMSI] section and callerid for each subscriber.
+		@param extensionsConf The dialplan with the "exten => ISDN,1,Dial(SIP/IMSI)" lines.
+		@return The number of records imported.
+	*/
+	unsigned importAsterisk(const char* SIPConf, const char* extensionsConf);
+
+	/** The store, for tools and tests. */
+	HLRStore& store() { return mStore; }
+
+	char* getIMSI(const char* ISDN);
+
+	char* getCLIDLocal(const char* IMSI);
+	char* getCLIDGlobal(const char* IMSI);
+
+	char* mapCLIDGlobal(const char* IMSI);
+
+	char* getRegistrationIP(const char* IMSI);
+
+	Status addUser(const char* IMSI, const char* CLIDLocal);
+
+	bool useGateway(const char *ISDN) { return mAsterisk.useGateway(ISDN); }
+
+	/** Print the store, registry and Asterisk cache counters. */
+	void dump(std::ostream&);
+
+	private:
+
+	Status addAddress(const char* IMSI, const char* address);
+
+	/** Import the Asterisk config again if it has changed, checking at most every few seconds. */
+	void checkImport();
+
+	/**
+		Import one file, and the files it includes, into a store.
+		@param count Incremented for each record imported.
+		@return False if a file cannot be read.
+	*/
+	bool importSIPConf(HLRStore& store, const char* path, unsigned& count);
+	bool importExtensionsConf(HLRStore& store, const char* path, unsigned& count, unsigned depth=0);
+
+	/**
+		Reload the registry from Asterisk if the copy is too old.
+		While one thread reloads, the others keep using the old copy,
+		or wait for the first one if there is none yet.
+	*/
+	void checkRegistry();
+};
+
+
+
+
 
 
 
@@ -0,0 +1,287 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#define LOG_MODULE HLR
+
+#include "HLRStore.h"
+#include <Logger.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+using namespace std;
+
+
+/** The file starts with this, then the header, then the records. */
+static const char HLRStoreMagic[8] = { 'O','B','T','S','H','L','R','1' };
+
+/** Space for the header, so that the records stay aligned. */
+static const size_t HeaderSize = 128;
+
+/** Smallest index, in slots. */
+static const uint32_t MinIndexSize = 2048;
+
+
+
+HLRStore::HLRStore()
+	:mFD(-1),mMap(NULL),mMapSize(0),
+	mHeader(NULL),mRecords(NULL),mIndexMask(0)
+{
+	pthread_rwlock_init(&mLock,NULL);
+}
+
+
+HLRStore::~HLRStore()
+{
+	close();
+	pthread_rwlock_destroy(&mLock);
+}
+
+
+uint32_t HLRStore::hash(unsigned kind, const char* key)
+{
+	// FNV-1a
+	uint32_t h = 2166136261U;
+	h = (h ^ kind) * 16777619U;
+	while (*key) h = (h ^ (unsigned char)*key++) * 16777619U;
+	return h;
+}
+
+
+bool HLRStore::map(uint32_t capacity)
+{
+	size_t size = HeaderSize + (size_t)capacity*sizeof(Record);
+	if (mFD>=0 && ftruncate(mFD,size)!=0) {
+		LOG(ERROR) << "cannot grow HLR store to " << size << " bytes";
+		return false;
+	}
+	void *region;
+	if (mMap) region = mremap(mMap,mMapSize,size,MREMAP_MAYMOVE);
+	else if (mFD>=0) region = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,mFD,0);
+	else region = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+	if (region==MAP_FAILED) {
+		LOG(ERROR) << "cannot map HLR store of " << size << " bytes";
+		return false;
+	}
+	mMap = (char*)region;
+	mMapSize = size;
+	mHeader = (Header*)mMap;
+	mRecords = (Record*)(mMap + HeaderSize);
+	mHeader->mCapacity = capacity;
+	return true;
+}
+
+
+bool HLRStore::open(const char* path)
+{
+	close();
+	lock();
+	uint32_t capacity = InitialCapacity;
+	if (path) {
+		mFD = ::open(path,O_RDWR|O_CREAT,0644);
+		if (mFD<0) {
+			LOG(ERROR) << "cannot open HLR store " << path;
+			unlock();
+			return false;
+		}
+		struct stat st;
+		if (fstat(mFD,&st)==0 && (size_t)st.st_size>=HeaderSize+sizeof(Record)) {
+			capacity = (st.st_size - HeaderSize) / sizeof(Record);
+		}
+	}
+	if (!map(capacity)) {
+		unlock();
+		close();
+		return false;
+	}
+	if (mHeader->mCount==0 && mHeader->mRecordSize==0) {
+		// A new store.
+		memcpy(mHeader->mMagic,HLRStoreMagic,sizeof(HLRStoreMagic));
+		mHeader->mRecordSize = sizeof(Record);
+	}
+	if (memcmp(mHeader->mMagic,HLRStoreMagic,sizeof(HLRStoreMagic))!=0
+		|| mHeader->mRecordSize!=sizeof(Record)
+		|| mHeader->mCount>mHeader->mCapacity) {
+		LOG(ERROR) << path << " is not an HLR store";
+		unlock();
+		close();
+		return false;
+	}
+	reindex(mHeader->mCount);
+	if (path) {
+		LOG(INFO) << "HLR store " << path << ": " << mHeader->mCount << " records";
+	}
+	unlock();
+	return true;
+}
+
+
+void HLRStore::close()
+{
+	lock();
+	if (mMap) {
+		if (mFD>=0) msync(mMap,mMapSize,MS_SYNC);
+		munmap(mMap,mMapSize);
+	}
+	if (mFD>=0) ::close(mFD);
+	mFD = -1;
+	mMap = NULL;
+	mMapSize = 0;
+	mHeader = NULL;
+	mRecords = NULL;
+	mIndex.clear();
+	mIndexMask = 0;
+	unlock();
+}
+
+
+void HLRStore::reindex(uint32_t count)
+{
+	uint32_t size = MinIndexSize;
+	// Keep the load at or below 1/2 so that probe runs stay short.
+	while (size < 2*count) size <<= 1;
+	mIndex.assign(size,0);
+	mIndexMask = size-1;
+	for (uint32_t i=0; i<mHeader->mCount; i++) {
+		const Record& record = mRecords[i];
+		uint32_t slot = hash(record.mKind,record.mKey) & mIndexMask;
+		while (mIndex[slot]) slot = (slot+1) & mIndexMask;
+		mIndex[slot] = i+1;
+	}
+}
+
+
+const HLRStore::Record* HLRStore::find(unsigned kind, const char* key) const
+{
+	if (!mHeader) return NULL;
+	uint32_t slot = hash(kind,key) & mIndexMask;
+	while (uint32_t n = mIndex[slot]) {
+		const Record* record = mRecords + n - 1;
+		if (record->mKind==kind && strcmp(record->mKey,key)==0) return record;
+		slot = (slot+1) & mIndexMask;
+	}
+	return NULL;
+}
+
+
+bool HLRStore::put(unsigned kind, const char* key, const char* value)
+{
+	if (!mHeader || !key || !value) return false;
+	if (strlen(key)>=KeyLength || strlen(value)>=ValueLength) {
+		LOG(ERROR) << "HLR store record too long, key " << key << " value " << value;
+		return false;
+	}
+	Record *record = (Record*)find(kind,key);
+	if (!record) {
+		if (mHeader->mCount==mHeader->mCapacity && !map(2*mHeader->mCapacity)) return false;
+		uint32_t n = mHeader->mCount;
+		if (2*(n+1) > mIndex.size()) reindex(n+1);
+		record = mRecords + n;
+		memset(record,0,sizeof(Record));
+		record->mKind = kind;
+		strcpy(record->mKey,key);
+		uint32_t slot = hash(kind,key) & mIndexMask;
+		while (mIndex[slot]) slot = (slot+1) & mIndexMask;
+		mIndex[slot] = n+1;
+		// Count the record only once it is complete.
+		mHeader->mCount = n+1;
+	}
+	memset(record->mValue,0,ValueLength);
+	strcpy(record->mValue,value);
+	return true;
+}
+
+
+bool HLRStore::replace(HLRStore& other)
+{
+	other.lock();
+	lock();
+	if (!mHeader || !other.mHeader) {
+		unlock();
+		other.unlock();
+		return false;
+	}
+	uint32_t count = other.mHeader->mCount;
+	uint32_t capacity = mHeader->mCapacity;
+	while (capacity<count) capacity *= 2;
+	if (capacity!=mHeader->mCapacity && !map(capacity)) {
+		unlock();
+		other.unlock();
+		return false;
+	}
+	memcpy(mRecords,other.mRecords,(size_t)count*sizeof(Record));
+	mHeader->mCount = count;
+	// The other index points at the same record numbers, so take it as it is.
+	mIndex.swap(other.mIndex);
+	std::swap(mIndexMask,other.mIndexMask);
+	unlock();
+	other.mHeader->mCount = 0;
+	other.reindex(0);
+	other.unlock();
+	return true;
+}
+
+
+char* HLRStore::read(Kind kind, const char* key) const
+{
+	if (!key) return NULL;
+	pthread_rwlock_rdlock(&mLock);
+	const Record* record = find(kind,key);
+	char *retVal = record ? strdup(record->mValue) : NULL;
+	pthread_rwlock_unlock(&mLock);
+	return retVal;
+}
+
+
+bool HLRStore::write(Kind kind, const char* key, const char* value)
+{
+	lock();
+	bool retVal = put(kind,key,value);
+	unlock();
+	return retVal;
+}
+
+
+void HLRStore::sync()
+{
+	pthread_rwlock_rdlock(&mLock);
+	if (mMap && mFD>=0) msync(mMap,mMapSize,MS_ASYNC);
+	pthread_rwlock_unlock(&mLock);
+}
+
+
+size_t HLRStore::size() const
+{
+	pthread_rwlock_rdlock(&mLock);
+	size_t retVal = mHeader ? mHeader->mCount : 0;
+	pthread_rwlock_unlock(&mLock);
+	return retVal;
+}
+
+
+// vim: ts=4 sw=4
@@ -0,0 +1,152 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef HLRSTORE_H
+#define HLRSTORE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+
+
+/**
+	An indexed store of subscriber records, kept in a mapped file.
+
+	Each record is a kind, a key and a value, all fixed length, in an array
+	that the file holds after a short header.  Records are added or
+	overwritten one at a time, and only removed all at once, when the
+	store is replaced by one built aside.  A hash index over (kind,key) is built in
+	memory when the file is opened, so a lookup is one hash probe and one
+	string copy, with no system call.  Any number of threads may read at
+	once; writers take the store exclusively.  Only one process should
+	write a given file.
+*/
+class HLRStore {
+
+	public:
+
+	/** What a record maps. */
+	enum Kind {
+		CLIDLocal=1,		///< IMSI -> local CLID
+		CLIDGlobal=2,		///< IMSI -> global CLID
+		Address=3			///< ISDN or other numeric address -> IMSI
+	};
+
+	static const unsigned KeyLength = 32;		///< longest key, with the terminator
+	static const unsigned ValueLength = 63;		///< longest value, with the terminator
+
+	private:
+
+	struct Record {
+		unsigned char mKind;		///< 0 for unused
+		char mKey[KeyLength];
+		char mValue[ValueLength];
+	};
+
+	struct Header {
+		char mMagic[8];
+		uint32_t mRecordSize;
+		uint32_t mCount;			///< records in use
+		uint32_t mCapacity;			///< records the file has room for
+	};
+
+	static const unsigned InitialCapacity = 1024;
+
+	mutable pthread_rwlock_t mLock;
+	int mFD;						///< the file, or -1 for a store in memory only
+	char *mMap;
+	size_t mMapSize;
+	Header *mHeader;
+	Record *mRecords;
+	std::vector<uint32_t> mIndex;	///< record number+1 in each slot, 0 for empty
+	uint32_t mIndexMask;
+
+	/** Hash a kind and key. */
+	static uint32_t hash(unsigned kind, const char* key);
+
+	/** Find a record, or NULL; caller holds the lock. */
+	const Record* find(unsigned kind, const char* key) const;
+
+	/** Map a new region of the given capacity, copying or growing the old one. */
+	bool map(uint32_t capacity);
+
+	/** Rebuild the index for at least this many records; caller holds the write lock. */
+	void reindex(uint32_t count);
+
+	/** Add or overwrite a record; caller holds the write lock. */
+	bool put(unsigned kind, const char* key, const char* value);
+
+	public:
+
+	HLRStore();
+
+	~HLRStore();
+
+	/**
+		Open or create the store file, or start an empty store in memory.
+		@param path The file, or NULL to keep the store in memory only.
+		@return True on success.
+	*/
+	bool open(const char* path);
+
+	/** Unmap and close the store. */
+	void close();
+
+	/**
+		Look up a record.
+		@return A C-string to be freed by the caller, NULL if there is none.
+	*/
+	char* read(Kind kind, const char* key) const;
+
+	/**
+		Add or overwrite a record.
+		@return False if the key or value is too long or the store cannot grow.
+	*/
+	bool write(Kind kind, const char* key, const char* value);
+
+	/**@name Bulk writes, under one hold of the write lock. */
+	//@{
+	void lock() { pthread_rwlock_wrlock(&mLock); }
+	bool writeLocked(Kind kind, const char* key, const char* value) { return put(kind,key,value); }
+	void unlock() { pthread_rwlock_unlock(&mLock); }
+	//@}
+
+	/**
+		Replace every record with those of another store, which is left empty.
+		The other store is built without holding this one's lock, so readers
+		here only wait while its records are copied in.
+		@return False if either store is not open or this one cannot grow.
+	*/
+	bool replace(HLRStore& other);
+
+	/** Flush the mapped records to the file. */
+	void sync();
+
+	/** Number of records. */
+	size_t size() const;
+};
+
+
+#endif
+// vim: ts=4 sw=4
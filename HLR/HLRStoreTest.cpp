@@ -0,0 +1,124 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+	Lookup benchmark for HLRStore.
+
+	HLRStoreTest [subscribers [threads [file]]]
+
+	Fills a store with subscribers, each with a local CLID and an address,
+	then has each thread look up random subscribers by address and CLID,
+	the way smqueue does for every message.
+*/
+
+#include "HLRStore.h"
+#include <Logger.h>
+#include <Threads.h>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+using namespace std;
+
+
+static HLRStore gStore;
+static unsigned gSubscribers = 100000;
+static const unsigned LookupsPerThread = 1000000;
+
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+
+void *lookups(void *arg)
+{
+	unsigned seed = (unsigned long)arg;
+	unsigned misses = 0;
+	for (unsigned i=0; i<LookupsPerThread; i++) {
+		unsigned n = rand_r(&seed) % gSubscribers;
+		char ISDN[20];
+		sprintf(ISDN,"%u",2000000+n);
+		char *IMSI = gStore.read(HLRStore::Address,ISDN);
+		if (!IMSI) {
+			misses++;
+			continue;
+		}
+		char *CLID = gStore.read(HLRStore::CLIDLocal,IMSI);
+		if (!CLID) misses++;
+		free(CLID);
+		free(IMSI);
+	}
+	if (misses) cerr << "thread " << (unsigned long)arg << ": " << misses << " misses" << endl;
+	return NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (argc>1) gSubscribers = atoi(argv[1]);
+	unsigned numThreads = (argc>2) ? atoi(argv[2]) : 1;
+	const char *path = (argc>3) ? argv[3] : NULL;
+	if (path) unlink(path);
+	if (!gStore.open(path)) return 1;
+
+	double start = now();
+	gStore.lock();
+	for (unsigned n=0; n<gSubscribers; n++) {
+		char IMSI[24], ISDN[20];
+		sprintf(IMSI,"IMSI00101%010u",n);
+		sprintf(ISDN,"%u",2000000+n);
+		gStore.writeLocked(HLRStore::CLIDLocal,IMSI,ISDN);
+		gStore.writeLocked(HLRStore::Address,ISDN,IMSI);
+	}
+	gStore.unlock();
+	gStore.sync();
+	double loaded = now();
+	cout << gSubscribers << " subscribers, " << gStore.size() << " records loaded in "
+		<< (loaded-start)*1000.0 << " ms" << endl;
+
+	if (path) {
+		// Reopen, to time the index build from the file.
+		gStore.open(path);
+		double opened = now();
+		cout << "reopened in " << (opened-loaded)*1000.0 << " ms" << endl;
+		loaded = opened;
+	}
+
+	Thread *threads = new Thread[numThreads];
+	for (unsigned i=0; i<numThreads; i++) threads[i].start(lookups,(void*)(unsigned long)(i+1));
+	for (unsigned i=0; i<numThreads; i++) threads[i].join();
+	double done = now();
+	double lookupCount = 2.0*LookupsPerThread*numThreads;
+	cout << numThreads << " threads, " << lookupCount << " lookups in " << (done-loaded) << " s, "
+		<< (done-loaded)*1e6*numThreads/lookupCount << " us per lookup per thread" << endl;
+	return 0;
+}
+
+// vim: ts=4 sw=4
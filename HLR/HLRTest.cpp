@@ -24,6 +24,7 @@
 
 #include "HLR.h"
 #include <iostream>
+#include <unistd.h>
 #include <Logger.h>
 
 
@@ -74,7 +75,6 @@ int main(int argc, char *argv[]) {
 	if (CLID) std::cout << "CLID for " << IMSI << " is " << CLID << std::endl;
 	else std::cout << "no CLID found for " << IMSI << std::endl;
 
-
-
+	gHLR.dump(std::cout);
 }
 
@@ -24,6 +24,8 @@
 
 
 
+#define LOG_MODULE SIP
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <iostream>
@@ -39,6 +41,7 @@
 #include "SIPUtility.h"
 #include "SIPMessage.h"
 #include "SIPEngine.h"
+#include "SIPTransaction.h"
 
 
 using namespace std;
@@ -78,6 +81,21 @@ SIPEngine::~SIPEngine()
 	if (mINVITE==NULL) osip_message_free(mINVITE);
 	if (mOK==NULL) osip_message_free(mOK);
 	if (mBYE==NULL) osip_message_free(mBYE);
+	if (mClient) {
+		mClient->cancel();
+		mClient->release();
+	}
+}
+
+
+
+void SIPEngine::startClient(const struct sockaddr_in* destination, const osip_message_t* request)
+{
+	if (mClient) {
+		mClient->cancel();
+		mClient->release();
+	}
+	mClient = gSIPTransactions.request(destination,request);
 }
 
 
@@ -144,6 +162,13 @@ void SIPEngine::User( const char * wCallID, const char * IMSI, const char *origI
 
 
 bool SIPEngine::Register( Method wMethod )
+{
+	startRegister(wMethod);
+	return waitRegister();
+}
+
+
+void SIPEngine::startRegister( Method wMethod )
 {
 	LOG(INFO) << "Register mState=" << mState << " " << wMethod << " callID " << mCallID;
 
@@ -179,49 +204,39 @@ bool SIPEngine::Register( Method wMethod )
 		);
 	} else abort();
  
-	// Write message and delete message to
+	// Start the client transaction and delete message to
 	// prevent memory leak.	
+	// The transaction layer retransmits the REGISTER until it gets an answer.
 	LOG(DEBUG) << "writing " << reg;
-	gSIPInterface.writeAsterisk(reg);	
+	startClient(gSIPInterface.asteriskAddress(),reg);
 	osip_message_free(reg);
+}
 
-	// Poll the message FIFO until timeout or OK.
-	// SIPInterface::read will throw SIPTIimeout if it times out.
-	// It should not return NULL.
-	try {
-		static const int SIPTimeout = 10000;
-		osip_message_t *msg = gSIPInterface.read(mCallID, SIPTimeout);
-		assert(msg);
-		while (msg->status_code!=200) {
-			// Looking for 200 OK.
-			// But will keep waiting if we get 1xx status mesasges, e.g. 100 Trying.
-			LOG(DEBUG) << "received status " << msg->status_code << " " << msg->reason_phrase;
-			if (msg->status_code>=300) {
-				gSIPInterface.removeCall(mCallID);
-				osip_message_free(msg);
-				if (msg->status_code==404) {
-					LOG(DEBUG) << "user not found";
-				} else if (msg->status_code>=300 && msg->status_code<400) {
-					LOG(DEBUG) << "redirection is not implemented yet";
-				} else {
-					LOG(DEBUG) << "unexpected message";
-				}
-				return false;
-			}
-			osip_message_free(msg);
-			msg = gSIPInterface.read(mCallID, SIPTimeout);
-			assert(msg);
-		}
+
+bool SIPEngine::waitRegister()
+{
+	// Wait for the final response.
+	// 1xx responses, e.g. 100 Trying, are absorbed by the transaction.
+	static const int RegisterTimeout = 10000;
+	int status = mClient ? mClient->wait(RegisterTimeout) : 500;
+	gSIPInterface.removeCall(mCallID);
+	if (status==0 || status==408) {
+		LOG(ALARM) << "SIP register timed out.  Is Asterisk OK?";
+		throw SIPTimeout();
+	}
+	LOG(DEBUG) << "received status " << status;
+	if (status>=200 && status<300) {
 		LOG(DEBUG) << "success";
-		gSIPInterface.removeCall(mCallID);
-		osip_message_free(msg);
 		return true;
 	}
-	catch (SIPTimeout) {
-		LOG(ALARM) << "SIP register timed out.  Is Asterisk OK?";
-		gSIPInterface.removeCall(mCallID);	
-		throw SIPTimeout();
+	if (status==404) {
+		LOG(DEBUG) << "user not found";
+	} else if (status>=300 && status<400) {
+		LOG(DEBUG) << "redirection is not implemented yet";
+	} else {
+		LOG(DEBUG) << "unexpected message";
 	}
+	return false;
 }
 
 
@@ -257,7 +272,7 @@ SIPState SIPEngine::MOCSendINVITE( const char * wCalledUsername,
 		mFromTag.c_str(), mViaBranch.c_str(), mCallID.c_str(), mCSeq, mCodec); 
 	
 	// Send Invite to Asterisk.
-	gSIPInterface.writeAsterisk(invite);
+	startClient(gSIPInterface.asteriskAddress(),invite);
 	saveINVITE(invite);
 	osip_message_free(invite);
 	mState = Starting;
@@ -268,8 +283,10 @@ SIPState SIPEngine::MOCSendINVITE( const char * wCalledUsername,
 SIPState SIPEngine::MOCResendINVITE()
 {
 	assert(mINVITE);
+	// A live transaction is already doing the retransmission.
+	if (mClient && !mClient->done()) return mState;
 	LOG(INFO) << "resend INVITE " << mSIPUsername;
-	gSIPInterface.writeAsterisk(mINVITE);
+	startClient(gSIPInterface.asteriskAddress(),mINVITE);
 	return mState;
 }
 
@@ -277,14 +294,15 @@ SIPState  SIPEngine::MOCWaitForOK()
 {
 	LOG(DEBUG) << "mState=" << mState;
 
-	osip_message_t * msg;
-
-	// Read off the fifo. if time out will
-	// clean up and return false.
-	try {
-		msg = gSIPInterface.read(mCallID, INVITETimeout);
+	// Read the next response off the INVITE transaction.
+	// If it times out, return Timeout.
+	if (!mClient) {
+		LOG(ERROR) << "no INVITE transaction for " << mSIPUsername;
+		mState = Fail;
+		return mState;
 	}
-	catch (SIPTimeout& e) { 
+	osip_message_t * msg = mClient->read(INVITETimeout);
+	if (!msg) {
 		LOG(DEBUG) << "timeout";
 		mState = Timeout;
 		return mState;
@@ -390,7 +408,7 @@ SIPState SIPEngine::MODSendBYE()
 		mFromTag.c_str(), mToTag.c_str(), 
 		mViaBranch.c_str(), mCallID.c_str(), mCSeq );
 
-	gSIPInterface.writeAsterisk(bye);
+	startClient(gSIPInterface.asteriskAddress(),bye);
 	saveBYE(bye);
 	osip_message_free(bye);
 	mState = Clearing;
@@ -403,21 +421,28 @@ SIPState SIPEngine::MODResendBYE()
 	LOG(INFO) << "resend BYE " << mSIPUsername;
 	assert(mState==Clearing);
 	assert(mBYE);
-	gSIPInterface.writeAsterisk(mBYE);
+	// A live transaction is already doing the retransmission.
+	if (mClient && !mClient->done()) return mState;
+	startClient(gSIPInterface.asteriskAddress(),mBYE);
 	return mState;
 }
 
 SIPState SIPEngine::MODWaitForOK()
 {
 	LOG(DEBUG) << "mState=" << mState;
-	osip_message_t * ok = gSIPInterface.read(mCallID, BYETimeout);
-	if(ok->status_code == 200 ) {
+	if (!mClient) {
+		LOG(ERROR) << "no BYE transaction for " << mSIPUsername;
+		gSIPInterface.removeCall(mCallID);
+		mState = Fail;
+		return mState;
+	}
+	int status = mClient->wait(BYETimeout);
+	if (status==0) throw SIPTimeout();
+	if (status == 200 ) {
 		mState = Cleared;
 		// Remove Call ID at the end of interaction.
 		gSIPInterface.removeCall(mCallID);	
 	}
-
-	osip_message_free(ok);
 	return mState;	
 }
 
@@ -465,7 +490,8 @@ SIPState SIPEngine::MTDSendOK()
 	LOG(INFO) << "SIP send BYE-OK " << mSIPUsername;
 	assert(mBYE);
 	osip_message_t * okay = sip_b_okay(mBYE);
-	gSIPInterface.writeAsterisk(okay);
+	// The server transaction answers retransmitted BYEs with this OK.
+	gSIPTransactions.respond(gSIPInterface.asteriskAddress(),okay);
 	osip_message_free(okay);
 	mState = Cleared;
 	return mState;
@@ -585,26 +611,15 @@ SIPState SIPEngine::MTCWaitForACK()
 
 void SIPEngine::InitRTP(const osip_message_t * msg )
 {
-	if(session == NULL)
-		session = rtp_session_new(RTP_SESSION_SENDRECV);
-
-	rtp_session_set_blocking_mode(session, TRUE);
-	rtp_session_set_scheduling_mode(session, TRUE);
-
-	rtp_session_set_connected_mode(session, TRUE);
-	rtp_session_set_symmetric_rtp(session, TRUE);
-	// Hardcode RTP session type to GSM full rate (GSM 06.10).
+	// The stream is GSM full rate (GSM 06.10), RTP payload type 3.
 	// FIXME -- Make this work for multiple vocoder types.
-	rtp_session_set_payload_type(session, 3);
-
 	char d_ip_addr[20];
 	char d_port[10];
 	get_rtp_params(msg, d_port, d_ip_addr);
 	LOG(DEBUG) << "IP="<<d_ip_addr<<" "<<d_port<<" "<<mRTPPort;
 
-	rtp_session_set_local_addr(session, "0.0.0.0", mRTPPort );
-	rtp_session_set_remote_addr(session, d_ip_addr, atoi(d_port));
-
+	mRTPRemoteIP = d_ip_addr;
+	mRTPRemotePort = atoi(d_port);
 }
 
 
@@ -624,33 +639,6 @@ void SIPEngine::MOCInitRTP()
 
 
 
-void SIPEngine::TxFrame( unsigned char * tx_frame ){
-	if(mState!=Active) return;
-	else {
-		// HACK -- Hardcoded for GSM/8000.
-		// FIXME -- Make this work for multiple vocoder types.
-		rtp_session_send_with_ts(session, tx_frame, 33, tx_time);
-		tx_time += 160;		
-	}
-}
-
-
-int SIPEngine::RxFrame(unsigned char * rx_frame){
-	if(mState!=Active) return 0; 
-	else {
-		int more;
-		int ret=0;
-		// HACK -- Hardcoded for GSM/8000.
-		// FIXME -- Make this work for multiple vocoder types.
-		ret = rtp_session_recv_with_ts(session, rx_frame, 33, rx_time, &more);
-		rx_time += 160;
-		return ret;
-	}	
-}
-
-
-
-
 SIPState SIPEngine::MOSMSSendMESSAGE(const char * wCalledUsername, 
 	const char * wCalledDomain , const char *messageText)
 {
@@ -677,8 +665,8 @@ SIPState SIPEngine::MOSMSSendMESSAGE(const char * wCalledUsername,
 		mFromTag.c_str(), mViaBranch.c_str(), mCallID.c_str(), mCSeq,
 		messageText); 
 	
-	// Send Invite to Asterisk.
-	gSIPInterface.writeMessenger(message);
+	// Send the MESSAGE to the messenger.
+	startClient(gSIPInterface.messengerAddress(),message);
 	osip_message_free(message);
 	mState = MessageSubmit;
 	return mState;
@@ -689,18 +677,16 @@ SIPState SIPEngine::MOSMSWaitForSubmit()
 {
 	LOG(DEBUG) << "mState=" << mState;
 
-	try {
-		osip_message_t * ok = gSIPInterface.read(mCallID, INVITETimeout);
-		// That should never return NULL.
-		assert(ok);
-		if((ok->status_code==200) || (ok->status_code==202) ) {
-			mState = Cleared;
-			LOG(INFO) << "successful";
-		}
-		osip_message_free(ok);
+	if (!mClient) {
+		LOG(ERROR) << "no MESSAGE transaction for " << mSIPUsername;
+		mState = Fail;
+		return mState;
 	}
-
-	catch (SIPTimeout& e) {
+	int status = mClient->wait(INVITETimeout);
+	if ((status==200) || (status==202)) {
+		mState = Cleared;
+		LOG(INFO) << "successful";
+	} else if (status==0 || status==408) {
 		LOG(ALARM) << "timed out, is SMS server OK?"; 
 		mState = Fail;
 	}
@@ -724,7 +710,7 @@ SIPState SIPEngine::MTSMSSendOK()
 	// Form ack from invite and new parameters.
 	osip_message_t * okay = sip_okay_SMS(mINVITE, mSIPUsername.c_str(),
 		gConfig.getStr("SIP.IP"), mSIPPort, mToTag.c_str());
-	gSIPInterface.writeMessenger(okay);
+	gSIPTransactions.respond(gSIPInterface.messengerAddress(),okay);
 	osip_message_free(okay);
 	mState=Cleared;
 	return mState;
@@ -741,17 +727,14 @@ bool SIPEngine::sendINFOAndWaitForOK(unsigned wInfo)
 		mRemoteUsername.c_str(), mRTPPort, mSIPUsername.c_str(), 
 		mSIPPort, gConfig.getStr("SIP.IP"), mAsteriskIP, 
 		mFromTag.c_str(), mViaBranch.c_str(), mCallID.c_str(), mCSeq); 
-	gSIPInterface.writeAsterisk(info);
+	startClient(gSIPInterface.asteriskAddress(),info);
 	osip_message_free(info);
 
-	try {
-		osip_message_t *msg = gSIPInterface.read(mCallID, INVITETimeout);
-		return (msg->status_code == 200);
-	}
-	catch (SIPTimeout& e) { 
+	int status = mClient ? mClient->wait(INVITETimeout) : 500;
+	if (status==0 || status==408) {
 		LOG(NOTICE) << "timeout";
-		return false;
 	}
+	return (status == 200);
 
 };
 
@@ -32,7 +32,6 @@
 #include <semaphore.h>
 
 #include <osip2/osip.h>
-#include <ortp/ortp.h>
 
 
 #include "Sockets.h"
@@ -69,6 +68,8 @@ const unsigned BYETimeout = 2000;
 
 std::ostream& operator<<(std::ostream& os, SIPState s);
 
+class SIPClientTransaction;
+
 class SIPEngine 
 {
 
@@ -80,6 +81,8 @@ private:
 
 	// MOC, MTC information.
 	short mRTPPort;
+	std::string mRTPRemoteIP;		///< far end of the RTP stream, from the SDP
+	unsigned short mRTPRemotePort;
 	std::string mRemoteUsername;
 	std::string mRemoteDomain;
 	unsigned mCodec;
@@ -103,25 +106,30 @@ private:
 	osip_message_t * mOK;		///< the INVITE-OK message for this transaction
 	osip_message_t * mBYE;		///< the BYE message for this transaction
 
-public:
-	
-	RtpSession * session;
+	SIPClientTransaction *mClient;	///< the latest client transaction, or NULL
 
 private:
 
 	SIPState mState;
 
+	/** Start a client transaction for a request, dropping the previous one. */
+	void startClient(const struct sockaddr_in* destination, const osip_message_t* request);
+
+	/** Engines hold a transaction reference, so they are not copied. */
+	SIPEngine(const SIPEngine&);
+	SIPEngine& operator=(const SIPEngine&);
+
 public:
 	
-	unsigned int tx_time;
-	unsigned int rx_time;
 	int time_outs;
 
 	/** Default contructor. Initialize the object. */
 	SIPEngine()
-		:mCSeq(random()%1000),
+		:mRTPRemotePort(0),
+		mCSeq(random()%1000),
 		mINVITE(NULL), mOK(NULL), mBYE(NULL),
-		session(NULL), mState(NullState),tx_time(0), rx_time(0)
+		mClient(NULL),
+		mState(NullState)
 	{
 		mSIPPort = gConfig.getNum("SIP.Port");
 		const char* wAsteriskIP = gConfig.getStr("Asterisk.IP");
@@ -155,11 +163,25 @@ public:
 
 	/**
 		Send sip register and look at return msg.
+		The REGISTER client transaction retransmits while this waits.
 		Can throw SIPTimeout().
 		@return True on success.
 	*/
 	bool Register(Method wMethod=SIPRegister);	
 
+	/**
+		Send sip register without waiting for the answer,
+		so that several registrations can be in flight at once.
+	*/
+	void startRegister(Method wMethod=SIPRegister);
+
+	/**
+		Wait for the answer to startRegister.
+		Can throw SIPTimeout().
+		@return True on success.
+	*/
+	bool waitRegister();
+
 	/**
 		Send sip unregister and look at return msg.
 		Can throw SIPTimeout().
@@ -260,20 +282,19 @@ public:
 	//@}
 
 
-	void FlushRTP(){
-//		flushq(&session->rtp.rq, FLUSHALL);
-//		flushq(&session->rtp.tev_rq, FLUSHALL);
-	}
-
-	void TxFrame( unsigned char * tx_frame );
-	int  RxFrame(unsigned char * rx_frame);
-
 	// We need the host sides RTP information contained
 	// in INVITE or 200 OK
 	void InitRTP(const osip_message_t * msg );
 	void MOCInitRTP();
 	void MTCInitRTP();
 
+	/**@name RTP endpoints, set by InitRTP; the speech itself goes through the MediaEngine. */
+	//@{
+	unsigned short RTPPort() const { return mRTPPort; }
+	const char* RTPRemoteIP() const { return mRTPRemoteIP.c_str(); }
+	unsigned short RTPRemotePort() const { return mRTPRemotePort; }
+	//@}
+
 	/** In-call Signalling */
 	//@{
 
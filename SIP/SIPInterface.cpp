@@ -25,9 +25,13 @@
 
 
 
-#include <ortp/ortp.h>
+#define LOG_MODULE SIP
+
 #include <osipparser2/sdp_message.h>
 
+#include <sys/socket.h>
+#include <errno.h>
+
 #include "GSMConfig.h"
 #include "ControlCommon.h"
 
@@ -35,6 +39,8 @@
 
 #include "SIPUtility.h"
 #include "SIPInterface.h"
+#include "SIPTransaction.h"
+#include "SIPRegistrationCache.h"
 
 #include <Logger.h>
 
@@ -102,10 +108,11 @@ bool SIPMessageMap::remove(const std::string& call_id)
 
 // SIPInterface method definitions.
 
-bool SIPInterface::addCall(const string &call_id)
+bool SIPInterface::addCall(const string &call_id, const struct sockaddr_in* returnAddress)
 {
 	LOG(INFO) << "creating SIP message FIFO callID " << call_id;
-	return mSIPMap.add(call_id,mSIPSocket.source());
+	if (!returnAddress) returnAddress = &mAsteriskAddress;
+	return mSIPMap.add(call_id,returnAddress);
 }
 
 
@@ -125,7 +132,9 @@ int SIPInterface::fifoSize(const std::string& call_id )
 
 
 SIPInterface::SIPInterface()
-	:mSIPSocket(gConfig.getNum("SIP.Port"), gConfig.getStr("Asterisk.IP"), gConfig.getNum("Asterisk.Port"))
+	:mSIPSocket(gConfig.getNum("SIP.Port"), gConfig.getStr("Asterisk.IP"), gConfig.getNum("Asterisk.Port")),
+	mReceived(0),mDispatched(0),mErrant(0),mSent(0),mReadCalls(0),mWriteCalls(0),
+	mLastReceived(0),mLastDispatched(0),mLastSent(0)
 {
 	mAsteriskPort = gConfig.getNum("Asterisk.Port");
 	mMessengerPort = gConfig.getNum("Smqueue.Port");
@@ -140,13 +149,42 @@ void SIP::driveLoop( SIPInterface * si){
 	}
 }
 
+void SIP::sendLoop(SIPInterface *si)
+{
+	while (true) {
+		si->flush();
+	}
+}
+
+void SIPWorker::start()
+{
+	mThread.start((void *(*)(void*))workerLoop,this);
+}
+
+void SIP::workerLoop(SIPWorker *worker)
+{
+	while (true) {
+		SIPDatagram *datagram = worker->mQ.read();
+		worker->mInterface->dispatch(*datagram);
+		delete datagram;
+	}
+}
+
 void SIPInterface::start(){
-	// Start all the osip/ortp stuff. 
+	// Start all the osip stuff.
+	// RTP is handled by the MediaEngine.
 	parser_init();
-	ortp_init();
-	ortp_scheduler_init();
-	// FIXME -- Can we coordinate this with the global logger?
-	//ortp_set_log_level_mask(ORTP_MESSAGE|ORTP_WARNING|ORTP_ERROR);
+	unsigned numWorkers = 4;
+	if (gConfig.defines("SIP.Workers")) numWorkers = gConfig.getNum("SIP.Workers");
+	if (numWorkers==0) numWorkers = 1;
+	for (unsigned i=0; i<numWorkers; i++) {
+		SIPWorker *worker = new SIPWorker(this);
+		mWorkers.push_back(worker);
+		worker->start();
+	}
+	mStatsTime.now();
+	gSIPTransactions.start();
+	mSendThread.start((void *(*)(void*))sendLoop,this);
 	mDriveThread.start((void *(*)(void*))driveLoop,this );
 }
 
@@ -163,48 +201,194 @@ void SIPInterface::write(const struct sockaddr_in* dest, osip_message_t *msg)
 		return;
 	}
 	char line[1000];
-	sscanf(str,"%[^\n]",line);
+	sscanf(str,"%999[^\n]",line);
 	LOG(INFO) << "write " << line;
 	LOG(DEBUG) << "write " << str;
 
-	mSocketLock.lock();
-	mSIPSocket.send((const struct sockaddr*)dest,str);
-	mSocketLock.unlock();
+	// The NUL goes out too, as it always has.
+	// Anything past the MTU is fragmented by the kernel; only a message
+	// that cannot fit in a datagram at all is dropped.
+	size_t length = strlen(str)+1;
+	if (length>MAX_SIP_LENGTH) {
+		LOG(ALARM) << "SIP message of " << length << " bytes is too long for UDP: " << line;
+		free(str);
+		return;
+	}
+	SIPDatagram *datagram = new SIPDatagram(*dest,str,length);
 	free(str);
+	mSendQ.write(datagram);
+}
+
+
+void SIPInterface::flush()
+{
+	SIPDatagram *batch[SendBatch];
+	unsigned count = 0;
+	batch[count++] = mSendQ.read();
+	while (count<SendBatch && (batch[count]=mSendQ.readNoBlock())) count++;
+
+	struct mmsghdr headers[SendBatch];
+	struct iovec vectors[SendBatch];
+	memset(headers,0,sizeof(headers));
+	for (unsigned i=0; i<count; i++) {
+		vectors[i].iov_base = batch[i]->mData;
+		vectors[i].iov_len = batch[i]->mLength;
+		headers[i].msg_hdr.msg_name = &batch[i]->mAddress;
+		headers[i].msg_hdr.msg_namelen = sizeof(batch[i]->mAddress);
+		headers[i].msg_hdr.msg_iov = &vectors[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	unsigned done = 0;
+	while (done<count) {
+		int numSent = sendmmsg(mSIPSocket.fd(),headers+done,count-done,0);
+		__sync_fetch_and_add(&mWriteCalls,1);
+		if (numSent<0) {
+			if (errno==EINTR) continue;
+			// Drop the datagram that failed and go on with the rest.
+			LOG(ALARM) << "cannot write SIP socket: " << strerror(errno);
+			done++;
+			continue;
+		}
+		done += numSent;
+		__sync_fetch_and_add(&mSent,numSent);
+	}
+
+	for (unsigned i=0; i<count; i++) delete batch[i];
+}
+
+
+
+/** FNV-1a, to spread the Call-IDs over the workers. */
+static unsigned callIDHash(const string& callID)
+{
+	unsigned hash = 2166136261U;
+	for (size_t i=0; i<callID.size(); i++) {
+		hash ^= (unsigned char)callID[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+bool SIP::SIPPreParse(const char *data, string& method, string& callID)
+{
+	// The start line is "METHOD URI SIP/2.0" for a request, "SIP/2.0 code reason" for a response.
+	if (strncmp(data,"SIP/",4)==0) method.clear();
+	else method.assign(data,strcspn(data," \r\n"));
+
+	// Then the headers, up to the blank line.
+	// Call-ID has the compact form "i", RFC 3261 20.8.
+	const char *line = data + strcspn(data,"\r\n");
+	while (*line) {
+		if (*line=='\r') line++;
+		if (*line=='\n') line++;
+		const char *end = line + strcspn(line,"\r\n");
+		if (end==line) return false;
+		size_t nameLength = strcspn(line,":\r\n");
+		if (line[nameLength]==':') {
+			const char *value = line + nameLength + 1;
+			while (nameLength>0 && (line[nameLength-1]==' ' || line[nameLength-1]=='\t')) nameLength--;
+			bool isCallID = (nameLength==7 && strncasecmp(line,"Call-ID",7)==0)
+				|| (nameLength==1 && (line[0]=='i' || line[0]=='I'));
+			if (isCallID) {
+				while (value<end && (*value==' ' || *value=='\t')) value++;
+				const char *valueEnd = end;
+				while (valueEnd>value && (valueEnd[-1]==' ' || valueEnd[-1]=='\t')) valueEnd--;
+				callID.assign(value,valueEnd-value);
+				return !callID.empty();
+			}
+		}
+		line = end;
+	}
+	return false;
 }
 
 
 
 void SIPInterface::drive() 
 {
-	char buffer[2048];
+	// Messages are read into the big buffers and copied out to the workers
+	// in datagrams of their own size.
+	struct mmsghdr headers[ReceiveBatch];
+	struct iovec vectors[ReceiveBatch];
+	memset(headers,0,sizeof(headers));
+	for (unsigned i=0; i<ReceiveBatch; i++) {
+		vectors[i].iov_base = mReceiveBuffers[i];
+		vectors[i].iov_len = MAX_SIP_LENGTH;
+		headers[i].msg_hdr.msg_name = &mReceiveAddresses[i];
+		headers[i].msg_hdr.msg_namelen = sizeof(mReceiveAddresses[i]);
+		headers[i].msg_hdr.msg_iov = &vectors[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
+	}
 
+	// Block for the first datagram, then take whatever else is waiting.
 	LOG(DEBUG) << "blocking on socket";
-	int numRead = mSIPSocket.read(buffer);
+	int numRead = recvmmsg(mSIPSocket.fd(),headers,ReceiveBatch,MSG_WAITFORONE,NULL);
 	if (numRead<0) {
-		LOG(ALARM) << "cannot read SIP socket.";
+		if (errno!=EINTR) {
+			LOG(ALARM) << "cannot read SIP socket: " << strerror(errno);
+		}
 		return;
 	}
-	buffer[numRead+1] = '\0';
+	__sync_fetch_and_add(&mReadCalls,1);
+	__sync_fetch_and_add(&mReceived,numRead);
+
+	string method;
+	string callID;
+	for (int i=0; i<numRead; i++) {
+		if (headers[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			LOG(WARN) << "SIP datagram longer than " << MAX_SIP_LENGTH << " bytes, dropped";
+			__sync_fetch_and_add(&mErrant,1);
+			continue;
+		}
+		size_t length = headers[i].msg_len;
+		mReceiveBuffers[i][length] = '\0';
+		if (!SIPPreParse(mReceiveBuffers[i],method,callID)) {
+			LOG(WARN) << "SIP message with no Call-ID";
+			__sync_fetch_and_add(&mErrant,1);
+			continue;
+		}
+		SIPDatagram *datagram = new SIPDatagram(mReceiveAddresses[i],mReceiveBuffers[i],length);
+		LOG(DEBUG) << "read " << (method.empty() ? "response" : method) << " Call-ID " << callID;
+		mWorkers[callIDHash(callID) % mWorkers.size()]->write(datagram);
+	}
+}
+
 
-	char line[sizeof(buffer)];
-	sscanf(buffer,"%[^\n]",line);
+
+void SIPInterface::dispatch(const SIPDatagram& datagram)
+{
+	char line[1000];
+	line[0] = '\0';
+	sscanf(datagram.mData,"%999[^\n]",line);
 	LOG(INFO) << "read " << line;
-	LOG(DEBUG) << "read " << buffer;
+	LOG(DEBUG) << "read " << datagram.mData;
+
+	// Parse the mesage.
+	osip_message_t * msg;
+	osip_message_init(&msg);
+	if (osip_message_parse(msg, datagram.mData, datagram.mLength)!=0) {
+		LOG(WARN) << "cannot parse SIP message: " << line;
+		osip_message_free(msg);
+		__sync_fetch_and_add(&mErrant,1);
+		return;
+	}
 
-	try {
+	// Responses to our requests go to their client transactions,
+	// and retransmitted requests are answered by their server transactions.
+	if (gSIPTransactions.receive(msg,&datagram.mAddress)) {
+		__sync_fetch_and_add(&mDispatched,1);
+		return;
+	}
 
-		// Parse the mesage.
-		osip_message_t * msg;
-		osip_message_init(&msg);
-		osip_message_parse(msg, buffer, strlen(buffer));
-	
+	try {
 		if (msg->sip_method) LOG(DEBUG) << "read method " << msg->sip_method;
 	
 		// Must check if msg is an invite.
 		// if it is, handle appropriatly.
 		// FIXME -- Check return value in case this failed.
-		checkInvite(msg);
+		checkInvite(msg,&datagram.mAddress);
 
 		// FIXME -- Need to check for early BYE to stop paging .
 		// If it's a BYE, find the corresponding transaction table entry.
@@ -227,17 +411,49 @@ void SIPInterface::drive()
 		string call_num(call_id_num);
 		// FIXME -- If this write fails, send "call leg non-existent" response on SIP interface.
 		mSIPMap.write(call_num, msg);
+		__sync_fetch_and_add(&mDispatched,1);
 	}
 	catch(SIPException) {
-		sscanf(buffer,"%[^\n]",line);
 		LOG(WARN) << "errant SIP Message: " << line;
+		// Nothing took the message, so it is still ours.
+		osip_message_free(msg);
+		__sync_fetch_and_add(&mErrant,1);
 	}
 }
 
 
 
+void SIPInterface::dumpStats(ostream& os)
+{
+	mStatsLock.lock();
+	unsigned received = mReceived;
+	unsigned dispatched = mDispatched;
+	unsigned sent = mSent;
+	long elapsed = mStatsTime.elapsed();
+	os << "received " << received << " in " << mReadCalls << " reads, dispatched " << dispatched;
+	os << ", errant " << mErrant << ", sent " << sent << " in " << mWriteCalls << " writes" << endl;
+	if (elapsed>0) {
+		os << "in the last " << elapsed/1000.0 << " s, per second:";
+		os << " received " << (received-mLastReceived)*1000.0/elapsed;
+		os << " dispatched " << (dispatched-mLastDispatched)*1000.0/elapsed;
+		os << " sent " << (sent-mLastSent)*1000.0/elapsed << endl;
+	}
+	os << "queued: send " << mSendQ.size() << ", workers";
+	for (unsigned i=0; i<mWorkers.size(); i++) os << " " << mWorkers[i]->size();
+	os << endl;
+	gSIPTransactions.dump(os);
+	gSIPRegistrations.dump(os);
+	mLastReceived = received;
+	mLastDispatched = dispatched;
+	mLastSent = sent;
+	mStatsTime.now();
+	mStatsLock.unlock();
+}
+
 
-bool SIPInterface::checkInvite( osip_message_t * msg )
+
+
+bool SIPInterface::checkInvite( osip_message_t * msg, const struct sockaddr_in* source )
 {
 	LOG(DEBUG);
 
@@ -312,22 +528,24 @@ bool SIPInterface::checkInvite( osip_message_t * msg )
 
 	// Check SIP map.  Repeated entry?  Page again.
 	if (mSIPMap.map().readNoBlock(call_id_num) != NULL) { 
-		TransactionEntry transaction;
-		if (!gTransactionTable.find(mobile_id,transaction)) {
+		TransactionRef transaction = gTransactionTable.findByCallID(call_id_num);
+		if (!transaction) {
 			// FIXME -- Send "call leg non-existent" response on SIP interface.
 			LOG(WARN) << "repeated INVITE/MESSAGE with no transaction record";
 			// Delete the bogus FIFO.
 			mSIPMap.remove(call_id_num);
 			return false;
 		}
-		LOG(INFO) << "repeated SIP INVITE/MESSAGE, repaging"; 
-		gBTS.pager().addID(mobile_id,requiredChannel,transaction);	
-		gTransactionTable.update(transaction);
+		if (gBTS.pager().repageID(mobile_id,requiredChannel,*transaction)) {
+			LOG(INFO) << "repeated SIP INVITE/MESSAGE, repaging";
+		} else {
+			LOG(INFO) << "repeated SIP INVITE/MESSAGE, transaction " << transaction->ID() << " no longer paging";
+		}
 		return false;
 	}
 
 	// Add an entry to the SIP Map to route inbound SIP messages.
-	addCall(call_id_num);
+	addCall(call_id_num,source);
 
 	// Install transaction.
 	LOG(INFO) << "make new transaction ";
@@ -350,7 +568,8 @@ bool SIPInterface::checkInvite( osip_message_t * msg )
 	LOG(DEBUG) << "callerID " << callerID << "@" << callerHost;
 	// Build the transaction table entry.
 	// This constructor sets TI flag=0, TI=0 for an MT transaction.
-	TransactionEntry transaction(mobile_id,serviceType,callerID);
+	TransactionRef entry(new TransactionEntry(mobile_id,serviceType,callerID));
+	TransactionEntry& transaction = *entry;
 	LOG(DEBUG) << "call_id_num \"" << call_id_num << "\"";
 	LOG(DEBUG) << "IMSI \"" << IMSI << "\"";
 
@@ -367,7 +586,7 @@ bool SIPInterface::checkInvite( osip_message_t * msg )
 		else LOG(NOTICE) << "MTSMS incoming MESSAGE method with no message body";
 	}
 	LOG(DEBUG) << "MTC MTSMS making transaction and add to transaction table: "<< transaction;
-	gTransactionTable.add(transaction); 
+	gTransactionTable.add(entry);
 	
 	// Add to paging list and tell the remote SIP end that we are trying.
 	LOG(DEBUG) << "MTC MTSMS new SIP invite, initial paging for mobile ID " << mobile_id;
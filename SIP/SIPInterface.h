@@ -30,8 +30,12 @@
 #include <Globals.h>
 #include <Interthread.h>
 #include <Sockets.h>
+#include <Timeval.h>
 #include <osip2/osip.h>
 
+#include <string.h>
+#include <vector>
+
 
 
 namespace GSM {
@@ -127,15 +131,129 @@ std::ostream& operator<<(std::ostream& os, const SIPMessageMap& m);
 
 
 
+/**
+	The largest SIP message we send or receive, the largest UDP payload over IPv4.
+	SIP over UDP is not bound to the link MTU; INVITEs with big SDP bodies
+	are routinely fragmented.
+*/
+#define MAX_SIP_LENGTH 65507
+
+
+/** A SIP datagram on its way into or out of the SIP interface. */
+class SIPDatagram {
+
+	public:
+
+	struct sockaddr_in mAddress;		///< source of a received datagram, destination of one to send
+	size_t mLength;						///< bytes in mData, not counting the added NUL
+	char *mData;						///< the message and a NUL, sized to fit
+
+	/** Copy a message into a new datagram. */
+	SIPDatagram(const struct sockaddr_in& wAddress, const char *wData, size_t wLength)
+		:mAddress(wAddress),mLength(wLength),mData(new char[wLength+1])
+	{
+		memcpy(mData,wData,wLength);
+		mData[wLength] = '\0';
+	}
+
+	~SIPDatagram() { delete[] mData; }
+
+	private:
+
+	SIPDatagram(const SIPDatagram&);
+	SIPDatagram& operator=(const SIPDatagram&);
+};
+
+typedef InterthreadQueue<SIPDatagram> SIPDatagramFIFO;
+
+
+/**
+	Find the method and Call-ID of a SIP message without parsing all of it.
+	@param data The message, NUL-terminated.
+	@param method Set to the request method, or emptied for a response.
+	@param callID Set to the value of the Call-ID header.
+	@return False if the message has no Call-ID.
+*/
+bool SIPPreParse(const char *data, std::string& method, std::string& callID);
+
+
+class SIPInterface;
+
+/** A thread that parses and dispatches the SIP messages of a share of the calls. */
+class SIPWorker {
+
+	private:
+
+	SIPInterface *mInterface;
+	SIPDatagramFIFO mQ;
+	Thread mThread;
+
+	public:
+
+	SIPWorker(SIPInterface *wInterface)
+		:mInterface(wInterface)
+	{ }
 
+	void start();
+
+	/** Queue a datagram for this worker, which then owns it. */
+	void write(SIPDatagram *datagram) { mQ.write(datagram); }
+
+	size_t size() const { return mQ.size(); }
+
+	friend void workerLoop(SIPWorker*);
+};
+
+void workerLoop(SIPWorker*);
+
+
+
+/**
+	The SIP interface of the BTS.
+
+	The drive thread reads datagrams from the SIP socket in batches and
+	finds just the Call-ID of each one.  The messages of a call always go
+	to the same worker thread, chosen by a hash of the Call-ID, which does
+	the full parse and dispatch, so a flood of messages is spread over the
+	workers while the messages of each call stay in order.  Outgoing
+	messages are queued to a send thread that writes them in batches.
+*/
 class SIPInterface 
 {
 	UDPSocket mSIPSocket;
 
-	Mutex mSocketLock;
-	Thread mDriveThread;	
+	Thread mDriveThread;
+	Thread mSendThread;
+	std::vector<SIPWorker*> mWorkers;
+	SIPDatagramFIFO mSendQ;				///< datagrams waiting for the send thread
 	SIPMessageMap mSIPMap;	
-	
+
+	/**@name Datagram batches, at most this many per system call. */
+	//@{
+	static const unsigned ReceiveBatch = 16;
+	static const unsigned SendBatch = 16;
+	char mReceiveBuffers[ReceiveBatch][MAX_SIP_LENGTH+1];	///< owned by the drive thread
+	struct sockaddr_in mReceiveAddresses[ReceiveBatch];		///< owned by the drive thread
+	//@}
+
+	/**@name Traffic counters, updated atomically. */
+	//@{
+	volatile unsigned mReceived;		///< datagrams read
+	volatile unsigned mDispatched;		///< messages delivered to a call's FIFO
+	volatile unsigned mErrant;			///< messages dropped
+	volatile unsigned mSent;			///< datagrams written
+	volatile unsigned mReadCalls;		///< batched reads
+	volatile unsigned mWriteCalls;		///< batched writes
+	//@}
+
+	/**@name Counter values at the last dumpStats, for rates. */
+	//@{
+	Mutex mStatsLock;
+	Timeval mStatsTime;
+	unsigned mLastReceived;
+	unsigned mLastDispatched;
+	unsigned mLastSent;
+	//@}
 
 	struct sockaddr_in mAsteriskAddress;
 	struct sockaddr_in mMessengerAddress;
@@ -165,17 +283,24 @@ public:
 	SIPInterface();
 
 	
-	/** Start the SIP drive loop. */
+	/** Start the SIP drive loop, the workers and the send thread. */
 	void start();
 
-	/** Receive, parse and dispatch a single SIP message. */
+	/** Receive a batch of SIP datagrams and pass each to its call's worker. */
 	void drive();
 
+	/** Parse and dispatch a single SIP message; called in a worker. */
+	void dispatch(const SIPDatagram&);
+
+	/** Send a batch of queued datagrams, blocking until there is one. */
+	void flush();
+
 	/**
 		Look for incoming INVITE messages to start MTC.
+		@param source The address the message came from.
 		@return true if the message is a new INVITE
 	*/
-	bool checkInvite( osip_message_t *);
+	bool checkInvite( osip_message_t *, const struct sockaddr_in* source=NULL);
 
 
 	/**
@@ -188,6 +313,7 @@ public:
 	// to read, you need to have the call_id
 	// then call si.read(call_id)
 
+	/** Queue a message for sending; the send thread writes it. */
 	void write(const struct sockaddr_in*, osip_message_t*);
 
 	void writeAsterisk(osip_message_t * msg)
@@ -196,20 +322,33 @@ public:
 	void writeMessenger(osip_message_t * msg)
 		{ write(&mMessengerAddress, msg); }
 
+	const struct sockaddr_in* asteriskAddress() const { return &mAsteriskAddress; }
+
+	const struct sockaddr_in* messengerAddress() const { return &mMessengerAddress; }
+
 	osip_message_t* read(const std::string& call_id , unsigned readTimeout=3600000)
 		{ return mSIPMap.read(call_id, readTimeout); }
 
-	/** Create a new message FIFO in the SIP interface. */
-	bool addCall(const std::string& call_id);
+	/**
+		Create a new message FIFO in the SIP interface.
+		@param call_id The call ID.
+		@param returnAddress The far end of the call, or NULL for Asterisk.
+	*/
+	bool addCall(const std::string& call_id, const struct sockaddr_in* returnAddress=NULL);
 
 	bool removeCall(const std::string& call_id);
 
 	int fifoSize(const std::string& call_id );
 
+	/** Print the traffic counters, and the rates since the last call. */
+	void dumpStats(std::ostream&);
+
 };
 
 void driveLoop(SIPInterface*);
 
+void sendLoop(SIPInterface*);
+
 
 }; // namespace SIP.
 
@@ -24,11 +24,12 @@
 
 
 
+#define LOG_MODULE SIP
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
 
-#include <ortp/ortp.h>
 #include <osipparser2/sdp_message.h>
 #include <osipparser2/osip_md5.h>
 
@@ -0,0 +1,198 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#define LOG_MODULE SIP
+
+#include <vector>
+
+#include "SIPRegistrationCache.h"
+#include "SIPEngine.h"
+#include "SIPUtility.h"
+
+#include <Configuration.h>
+#include <Logger.h>
+
+
+using namespace std;
+using namespace SIP;
+
+
+SIP::SIPRegistrationCache gSIPRegistrations;
+
+
+
+void *SIP::SIPRegistrationCacheLoopAdapter(SIPRegistrationCache* cache)
+{
+	cache->refreshLoop();
+	return NULL;
+}
+
+
+void SIPRegistrationCache::start()
+{
+	mLock.lock();
+	if (!mStarted) {
+		mStarted = true;
+		// This thread runs for the life of the process.
+		Thread *thread = new Thread;
+		thread->start((void *(*)(void*))SIPRegistrationCacheLoopAdapter,this);
+	}
+	mLock.unlock();
+}
+
+
+bool SIPRegistrationCache::enabled() const
+{
+	if (!gConfig.defines("SIP.RegistrationCache.RefreshWindow")) return false;
+	return gConfig.getNum("SIP.RegistrationCache.RefreshWindow")!=0;
+}
+
+
+unsigned SIPRegistrationCache::period() const
+{
+	return 1000*gConfig.getNum("SIP.RegistrationPeriod");
+}
+
+
+bool SIPRegistrationCache::check(const char* IMSI, unsigned TMSI)
+{
+	if (!enabled()) return false;
+	long window = 1000*gConfig.getNum("SIP.RegistrationCache.RefreshWindow");
+
+	mLock.lock();
+	Map::iterator itr = mMap.find(IMSI);
+	if (itr==mMap.end() || TMSI==0 || itr->second.mTMSI!=TMSI || itr->second.mExpires.passed()) {
+		// Unknown, changed or expired; the caller registers the handset again.
+		if (itr!=mMap.end()) mMap.erase(itr);
+		mMisses++;
+		mLock.unlock();
+		return false;
+	}
+	Entry& entry = itr->second;
+	mHits++;
+	if (!entry.mQueued && entry.mExpires.remaining()<window) {
+		entry.mQueued = true;
+		mQueue.push_back(IMSI);
+		mQueueSignal.signal();
+	}
+	mLock.unlock();
+	return true;
+}
+
+
+void SIPRegistrationCache::add(const char* IMSI, unsigned TMSI)
+{
+	if (!enabled()) return;
+	start();
+	mLock.lock();
+	Entry& entry = mMap[IMSI];
+	entry.mTMSI = TMSI;
+	entry.mExpires = Timeval(period());
+	// A renewal already in the queue leaves mQueued set until it runs.
+	mLock.unlock();
+}
+
+
+void SIPRegistrationCache::remove(const char* IMSI)
+{
+	mLock.lock();
+	mMap.erase(IMSI);
+	mLock.unlock();
+}
+
+
+size_t SIPRegistrationCache::size() const
+{
+	mLock.lock();
+	size_t retVal = mMap.size();
+	mLock.unlock();
+	return retVal;
+}
+
+
+void SIPRegistrationCache::dump(ostream& os) const
+{
+	mLock.lock();
+	os << "registrations: cached " << mMap.size() << ", renewals queued " << mQueue.size();
+	os << ", answered locally " << mHits << ", sent to registrar " << mMisses;
+	os << ", renewed " << mRefreshes << ", renewals failed " << mRefreshFailures << endl;
+	mLock.unlock();
+}
+
+
+void SIPRegistrationCache::refreshLoop()
+{
+	while (true) {
+		// Take up to a batch of queued IMSIs.
+		unsigned batchSize = 16;
+		if (gConfig.defines("SIP.RegistrationCache.BatchSize")) batchSize = gConfig.getNum("SIP.RegistrationCache.BatchSize");
+		if (batchSize==0) batchSize = 1;
+		vector<string> IMSIs;
+		mLock.lock();
+		while (mQueue.empty()) mQueueSignal.wait(mLock);
+		while (!mQueue.empty() && IMSIs.size()<batchSize) {
+			IMSIs.push_back(mQueue.front());
+			mQueue.pop_front();
+		}
+		mLock.unlock();
+
+		// Put the whole batch in flight, then collect the answers.
+		LOG(DEBUG) << "renewing " << IMSIs.size() << " registrations";
+		vector<SIPEngine*> engines;
+		for (unsigned i=0; i<IMSIs.size(); i++) {
+			SIPEngine *engine = new SIPEngine;
+			engine->User(IMSIs[i].c_str());
+			engine->startRegister();
+			engines.push_back(engine);
+		}
+		for (unsigned i=0; i<engines.size(); i++) {
+			bool success = false;
+			try {
+				success = engines[i]->waitRegister();
+			}
+			catch (SIPTimeout) {
+				LOG(ALARM) << "SIP registration renewal timed out.  Is Asterisk running?";
+			}
+			delete engines[i];
+
+			mLock.lock();
+			Map::iterator itr = mMap.find(IMSIs[i]);
+			if (success) {
+				mRefreshes++;
+				if (itr!=mMap.end()) {
+					itr->second.mExpires = Timeval(period());
+					itr->second.mQueued = false;
+				}
+			} else {
+				LOG(INFO) << "renewal FAILED: IMSI" << IMSIs[i];
+				mRefreshFailures++;
+				if (itr!=mMap.end()) mMap.erase(itr);
+			}
+			mLock.unlock();
+		}
+	}
+}
+
+
+// vim: ts=4 sw=4
@@ -0,0 +1,137 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SIPREGISTRATIONCACHE_H
+#define SIPREGISTRATIONCACHE_H
+
+#include <map>
+#include <list>
+#include <string>
+#include <ostream>
+
+#include <Threads.h>
+#include <Timeval.h>
+
+
+namespace SIP {
+
+
+/**
+	The registrations that Asterisk has accepted for our handsets.
+
+	A periodic location update from a handset that is still registered,
+	with the same TMSI, in our own LAI, is answered from here without
+	waiting on the registrar.  When such a registration has less than the
+	refresh window left, it is queued, and a background thread renews the
+	queued registrations in batches, with the REGISTERs of each batch in
+	flight together.  A failed renewal drops the entry, so the next
+	location update goes to the registrar again.
+*/
+class SIPRegistrationCache {
+
+	private:
+
+	struct Entry {
+		unsigned mTMSI;				///< TMSI of the handset at registration
+		Timeval mExpires;			///< when the registrar drops the registration
+		bool mQueued;				///< true if a renewal is pending
+
+		Entry():mTMSI(0),mQueued(false) {}
+	};
+
+	typedef std::map<std::string,Entry> Map;
+
+	mutable Mutex mLock;
+	Signal mQueueSignal;			///< signaled when a renewal is queued
+	Map mMap;
+	std::list<std::string> mQueue;	///< IMSIs waiting for renewal
+	bool mStarted;
+
+	/**@name Counters. */
+	//@{
+	unsigned mHits;					///< location updates answered here
+	unsigned mMisses;				///< location updates sent to the registrar
+	unsigned mRefreshes;			///< successful renewals
+	unsigned mRefreshFailures;		///< renewals rejected or timed out
+	//@}
+
+	/** Registration lifetime, ms. */
+	unsigned period() const;
+
+	public:
+
+	SIPRegistrationCache()
+		:mStarted(false),
+		mHits(0),mMisses(0),mRefreshes(0),mRefreshFailures(0)
+	{ }
+
+	/** Start the renewal thread, if it is not running yet. */
+	void start();
+
+	/** Return true if the cache is turned on in the configuration. */
+	bool enabled() const;
+
+	/**
+		See if a location update can be accepted without a new registration.
+		Queues a renewal if the registration is close to expiry.
+		@param IMSI The IMSI of the handset.
+		@param TMSI The TMSI it presented, or 0.
+		@return True if the handset is still registered with this TMSI.
+	*/
+	bool check(const char* IMSI, unsigned TMSI);
+
+	/** Record a registration that the registrar just accepted. */
+	void add(const char* IMSI, unsigned TMSI);
+
+	/** Forget a handset, e.g. on IMSI detach. */
+	void remove(const char* IMSI);
+
+	/** Number of cached registrations. */
+	size_t size() const;
+
+	/** Print the counters. */
+	void dump(std::ostream&) const;
+
+	protected:
+
+	/** Renew the queued registrations, forever. */
+	void refreshLoop();
+
+	friend void *SIPRegistrationCacheLoopAdapter(SIPRegistrationCache*);
+};
+
+
+/** Thread entry point of SIPRegistrationCache. */
+void *SIPRegistrationCacheLoopAdapter(SIPRegistrationCache*);
+
+
+};	// namespace SIP
+
+
+/** The registration cache of the process. */
+extern SIP::SIPRegistrationCache gSIPRegistrations;
+
+
+#endif
+// vim: ts=4 sw=4
@@ -0,0 +1,486 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#define LOG_MODULE SIP
+
+#include <string.h>
+
+#include "SIPTransaction.h"
+#include "SIPInterface.h"
+
+#include <Logger.h>
+
+
+using namespace std;
+using namespace SIP;
+
+
+
+SIP::SIPTransactionLayer gSIPTransactions;
+
+
+
+/**
+	The key of a message's transaction, RFC 3261 17.1.3 and 17.2.3:
+	the branch of the top Via and the method of the CSeq.
+	@return False if the message has no branch or CSeq.
+*/
+static bool transactionKey(const osip_message_t *msg, string& key)
+{
+	osip_via_t *via = NULL;
+	if (osip_message_get_via(msg,0,&via)<0 || !via) return false;
+	osip_generic_param_t *branch = NULL;
+	osip_via_param_get_byname(via,(char*)"branch",&branch);
+	if (!branch || !branch->gvalue) return false;
+	if (!msg->cseq || !msg->cseq->method) return false;
+	key = branch->gvalue;
+	key += " ";
+	key += msg->cseq->method;
+	return true;
+}
+
+
+
+
+SIPClientTransaction::SIPClientTransaction(SIPTransactionLayer& wLayer, const string& wKey,
+		const struct sockaddr_in* wDestination, const osip_message_t* wRequest)
+	:mRefs(1),mLayer(wLayer),mKey(wKey),
+	mRequest(NULL),mACK(NULL),
+	mState(Calling),mInterval(wLayer.T1()),mTimeout(64*wLayer.T1()),mStatus(0),
+	mResponses(wDestination),
+	mCallback(NULL),mCallbackArg(NULL)
+{
+	memcpy(&mDestination,wDestination,sizeof(mDestination));
+	osip_message_clone(wRequest,&mRequest);
+	mINVITE = wRequest->sip_method && (strcmp(wRequest->sip_method,"INVITE")==0);
+	if (!mINVITE) mState = Trying;
+}
+
+
+SIPClientTransaction::~SIPClientTransaction()
+{
+	if (mRequest) osip_message_free(mRequest);
+	if (mACK) osip_message_free(mACK);
+}
+
+
+SIPClientTransaction::State SIPClientTransaction::state() const
+{
+	mLayer.mLock.lock();
+	State retVal = mState;
+	mLayer.mLock.unlock();
+	return retVal;
+}
+
+
+int SIPClientTransaction::status() const
+{
+	mLayer.mLock.lock();
+	int retVal = mStatus;
+	mLayer.mLock.unlock();
+	return retVal;
+}
+
+
+osip_message_t* SIPClientTransaction::read(unsigned timeout)
+{
+	return mResponses.read(timeout);
+}
+
+
+int SIPClientTransaction::wait(unsigned timeout)
+{
+	Timeval deadline(timeout);
+	mLayer.mLock.lock();
+	while (mStatus==0 && !deadline.passed()) {
+		// The signal wait is in real time, so poll in simulated time.
+		unsigned ms = deadline.remaining();
+		if (gSimulatedTime() && ms>mLayer.mTimers.tickMs()) ms = mLayer.mTimers.tickMs();
+		if (ms) mLayer.mResponded.wait(mLayer.mLock,ms);
+	}
+	int retVal = mStatus;
+	mLayer.mLock.unlock();
+	return retVal;
+}
+
+
+void SIPClientTransaction::callback(Callback wCallback, void *wArg)
+{
+	mLayer.mLock.lock();
+	mCallback = wCallback;
+	mCallbackArg = wArg;
+	if (mStatus!=0) {
+		ref();
+		mLayer.mCallbacks.push_back(this);
+	}
+	mLayer.mLock.unlock();
+	mLayer.runCallbacks();
+}
+
+
+void SIPClientTransaction::cancel()
+{
+	mLayer.mLock.lock();
+	if (mState!=Terminated) {
+		LOG(DEBUG) << "cancel " << mKey;
+		mState = Terminated;
+		mLayer.forget(this);
+	}
+	mLayer.mLock.unlock();
+}
+
+
+void SIPClientTransaction::expired()
+{
+	switch (mState) {
+		case Calling:
+		case Trying:
+		case Proceeding:
+			// Timer B or F.
+			if (mTimeout.passed()) {
+				LOG(NOTICE) << "SIP transaction " << mKey << " timed out";
+				mLayer.mTimeouts++;
+				mState = Terminated;
+				mLayer.finish(this,408);
+				mLayer.forget(this);
+				return;
+			}
+			// Timer A or E.
+			// INVITE backs off without limit, others up to T2, and at T2 once proceeding.
+			LOG(INFO) << "retransmit " << mKey;
+			mLayer.send(&mDestination,mRequest);
+			mLayer.mRetransmissions++;
+			mInterval *= 2;
+			if (!mINVITE && (mInterval>mLayer.T2() || mState==Proceeding)) mInterval = mLayer.T2();
+			{
+				long remaining = mTimeout.remaining();
+				unsigned wait = mInterval;
+				if (remaining < (long)wait) wait = (remaining>0) ? remaining : 0;
+				mLayer.arm(*this,wait);
+			}
+			return;
+		case Completed:
+			// Timer D or K.
+			mState = Terminated;
+			mLayer.forget(this);
+			return;
+		case Terminated:
+			return;
+	}
+}
+
+
+
+
+SIPServerTransaction::~SIPServerTransaction()
+{
+	if (mResponse) osip_message_free(mResponse);
+}
+
+
+void SIPServerTransaction::expired()
+{
+	// Timer J.
+	mLayer.forget(this);
+}
+
+
+
+
+SIPTransactionLayer::SIPTransactionLayer()
+	:mT1(500),mT2(4000),mT4(5000),mStarted(false),
+	mRetransmissions(0),mAbsorbed(0),mTimeouts(0)
+{ }
+
+
+void SIPTransactionLayer::start()
+{
+	mLock.lock();
+	if (!mStarted) {
+		if (gConfig.defines("SIP.Timer.A")) mT1 = gConfig.getNum("SIP.Timer.A");
+		mStarted = true;
+		// This thread runs for the life of the process.
+		Thread *thread = new Thread;
+		thread->start((void *(*)(void*))SIPTransactionLoopAdapter,this);
+	}
+	mLock.unlock();
+}
+
+
+void SIPTransactionLayer::arm(TimerWheelEntry& entry, unsigned ms)
+{
+	mTimers.add(entry,ms);
+	mWakeup.signal();
+}
+
+
+void SIPTransactionLayer::forget(SIPClientTransaction* transaction)
+{
+	mTimers.remove(*transaction);
+	ClientMap::iterator i = mClients.find(transaction->mKey);
+	if (i==mClients.end() || i->second!=transaction) return;
+	mClients.erase(i);
+	transaction->release();
+}
+
+
+void SIPTransactionLayer::forget(SIPServerTransaction* transaction)
+{
+	mTimers.remove(*transaction);
+	ServerMap::iterator i = mServers.find(transaction->mKey);
+	if (i!=mServers.end() && i->second==transaction) mServers.erase(i);
+	delete transaction;
+}
+
+
+void SIPTransactionLayer::finish(SIPClientTransaction* transaction, int status)
+{
+	if (transaction->mStatus==0) transaction->mStatus = status;
+	mResponded.broadcast();
+	if (transaction->mCallback) {
+		transaction->ref();
+		mCallbacks.push_back(transaction);
+	}
+}
+
+
+void SIPTransactionLayer::runCallbacks()
+{
+	mLock.lock();
+	list<SIPClientTransaction*> callbacks;
+	callbacks.swap(mCallbacks);
+	mLock.unlock();
+	while (!callbacks.empty()) {
+		SIPClientTransaction *transaction = callbacks.front();
+		callbacks.pop_front();
+		transaction->mCallback(transaction,transaction->mCallbackArg);
+		transaction->release();
+	}
+}
+
+
+void SIPTransactionLayer::send(const struct sockaddr_in* destination, const osip_message_t* msg)
+{
+	gSIPInterface.write(destination,(osip_message_t*)msg);
+}
+
+
+osip_message_t* SIPTransactionLayer::makeACK(const osip_message_t* invite, const osip_message_t* response)
+{
+	// The Request-URI, Call-ID, From, top Via and CSeq number of the INVITE,
+	// with the To of the response.
+	osip_message_t *ack = NULL;
+	if (osip_message_clone(invite,&ack)!=0) return NULL;
+	osip_free(ack->sip_method);
+	ack->sip_method = osip_strdup("ACK");
+	osip_free(ack->cseq->method);
+	ack->cseq->method = osip_strdup("ACK");
+	if (response->to) {
+		osip_to_free(ack->to);
+		ack->to = NULL;
+		osip_to_clone(response->to,&ack->to);
+	}
+	return ack;
+}
+
+
+SIPClientTransaction* SIPTransactionLayer::request(const struct sockaddr_in* destination, const osip_message_t* request)
+{
+	string key;
+	if (!transactionKey(request,key)) {
+		LOG(ERROR) << "SIP request with no branch or CSeq";
+		return NULL;
+	}
+	SIPClientTransaction *transaction = new SIPClientTransaction(*this,key,destination,request);
+	mLock.lock();
+	// A new request with the same branch and method replaces the old transaction.
+	ClientMap::iterator old = mClients.find(key);
+	if (old!=mClients.end()) {
+		SIPClientTransaction *oldTransaction = old->second;
+		LOG(INFO) << "replacing SIP transaction " << key;
+		oldTransaction->mState = SIPClientTransaction::Terminated;
+		finish(oldTransaction,408);
+		forget(oldTransaction);
+	}
+	// One reference for the caller, one for the map.
+	transaction->ref();
+	mClients[key] = transaction;
+	arm(*transaction,transaction->mInterval);
+	mLock.unlock();
+	runCallbacks();
+	LOG(DEBUG) << "start " << key;
+	send(destination,request);
+	return transaction;
+}
+
+
+void SIPTransactionLayer::respond(const struct sockaddr_in* destination, const osip_message_t* response)
+{
+	string key;
+	if (transactionKey(response,key)) {
+		mLock.lock();
+		SIPServerTransaction *transaction;
+		ServerMap::iterator i = mServers.find(key);
+		if (i!=mServers.end()) transaction = i->second;
+		else {
+			transaction = new SIPServerTransaction(*this,key);
+			mServers[key] = transaction;
+		}
+		if (transaction->mResponse) osip_message_free(transaction->mResponse);
+		osip_message_clone(response,&transaction->mResponse);
+		memcpy(&transaction->mDestination,destination,sizeof(transaction->mDestination));
+		// Timer J, for unreliable transports.
+		arm(*transaction,64*mT1);
+		mLock.unlock();
+	}
+	send(destination,response);
+}
+
+
+bool SIPTransactionLayer::receive(osip_message_t* msg, const struct sockaddr_in* source)
+{
+	string key;
+	if (!transactionKey(msg,key)) return false;
+
+	if (MSG_IS_REQUEST(msg)) {
+		// INVITE server transactions are left to the user, and ACK has none.
+		if (!msg->sip_method) return false;
+		if (strcmp(msg->sip_method,"INVITE")==0 || strcmp(msg->sip_method,"ACK")==0) return false;
+		mLock.lock();
+		ServerMap::iterator i = mServers.find(key);
+		if (i!=mServers.end()) {
+			// A retransmission; answer it if there is an answer yet.
+			SIPServerTransaction *transaction = i->second;
+			if (transaction->mResponse) send(&transaction->mDestination,transaction->mResponse);
+			mAbsorbed++;
+			mLock.unlock();
+			LOG(INFO) << "absorbed retransmitted " << key;
+			osip_message_free(msg);
+			return true;
+		}
+		SIPServerTransaction *transaction = new SIPServerTransaction(*this,key);
+		memcpy(&transaction->mDestination,source,sizeof(transaction->mDestination));
+		mServers[key] = transaction;
+		// Timer J, which also limits the wait for the user's response.
+		arm(*transaction,64*mT1);
+		mLock.unlock();
+		return false;
+	}
+
+	// A response goes to its client transaction, if it still has one.
+	mLock.lock();
+	ClientMap::iterator i = mClients.find(key);
+	if (i==mClients.end()) {
+		mLock.unlock();
+		return false;
+	}
+	SIPClientTransaction *transaction = i->second;
+	int code = msg->status_code;
+	LOG(DEBUG) << key << " status " << code << " in state " << transaction->mState;
+
+	if (transaction->mState==SIPClientTransaction::Completed) {
+		// A retransmitted final response; repeat the ACK for an error.
+		if (transaction->mACK) send(&transaction->mDestination,transaction->mACK);
+		mAbsorbed++;
+		mLock.unlock();
+		osip_message_free(msg);
+		return true;
+	}
+
+	if (code<200) {
+		if (transaction->mState!=SIPClientTransaction::Proceeding) {
+			transaction->mState = SIPClientTransaction::Proceeding;
+			// INVITE stops retransmitting, others go on at T2, RFC 3261 17.1.1.2 and 17.1.2.2.
+			if (transaction->mINVITE) mTimers.remove(*transaction);
+			else transaction->mInterval = mT2;
+		}
+		transaction->mResponses.write(msg);
+		mResponded.broadcast();
+		mLock.unlock();
+		return true;
+	}
+
+	// A final response.
+	// The ACK is made before the user can have the response.
+	bool terminated = false;
+	if (!transaction->mINVITE) {
+		// Timer K.
+		transaction->mState = SIPClientTransaction::Completed;
+		arm(*transaction,mT4);
+	} else if (code>=300) {
+		// Timer D, at least 32 s for unreliable transports.
+		transaction->mACK = makeACK(transaction->mRequest,msg);
+		if (transaction->mACK) send(&transaction->mDestination,transaction->mACK);
+		transaction->mState = SIPClientTransaction::Completed;
+		arm(*transaction,32000);
+	} else {
+		// The user ACKs a 2xx, and its retransmissions go to the user too.
+		transaction->mState = SIPClientTransaction::Terminated;
+		terminated = true;
+	}
+	transaction->mResponses.write(msg);
+	finish(transaction,code);
+	if (terminated) forget(transaction);
+	mLock.unlock();
+	runCallbacks();
+	return true;
+}
+
+
+void SIPTransactionLayer::dump(ostream& os) const
+{
+	mLock.lock();
+	os << "transactions: client " << mClients.size() << ", server " << mServers.size();
+	os << ", retransmitted " << mRetransmissions << ", absorbed " << mAbsorbed;
+	os << ", timed out " << mTimeouts << endl;
+	mLock.unlock();
+}
+
+
+void SIPTransactionLayer::serviceLoop()
+{
+	mLock.lock();
+	while (true) {
+		// Block until the next timer is due or a new one is set.
+		// The signal wait is in real time, so poll each tick in simulated time.
+		unsigned timeout = mTimers.timeout(3600000);
+		if (gSimulatedTime() && timeout>mTimers.tickMs()) timeout = mTimers.tickMs();
+		if (timeout) mWakeup.wait(mLock,timeout);
+		// Expire with the layer locked, as the transactions expect.
+		mTimers.advance();
+		mLock.unlock();
+		runCallbacks();
+		mLock.lock();
+	}
+}
+
+
+void *SIP::SIPTransactionLoopAdapter(SIPTransactionLayer *layer)
+{
+	layer->serviceLoop();
+	return NULL;
+}
+
+
+// vim: ts=4 sw=4
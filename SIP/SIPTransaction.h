@@ -0,0 +1,292 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SIPTRANSACTION_H
+#define SIPTRANSACTION_H
+
+#include <map>
+#include <list>
+#include <string>
+#include <ostream>
+
+#include <Threads.h>
+#include <Timeval.h>
+#include <TimerWheel.h>
+#include <osip2/osip.h>
+
+#include "SIPInterface.h"
+
+
+namespace SIP {
+
+
+class SIPTransactionLayer;
+
+
+/**
+	A client transaction, RFC 3261 17.1.
+
+	It sends its request, retransmits it on Timer A (INVITE) or Timer E
+	(others), and passes each response up once, absorbing retransmitted
+	final responses in the Completed state.  A request that gets no final
+	response by Timer B or F ends with status 408, as in RFC 3261 8.1.3.1.
+	The ACK for a non-2xx final response to an INVITE is sent here; the
+	ACK for a 2xx is the job of the user, as in the RFC.
+
+	The transaction user either blocks in read() or wait(), or sets a
+	callback that the layer runs once the final status is known.
+	Transactions are reference counted; the user gets one reference from
+	SIPTransactionLayer::request and must release() it.
+*/
+class SIPClientTransaction : public TimerWheelEntry {
+
+	public:
+
+	enum State { Calling, Trying, Proceeding, Completed, Terminated };
+
+	typedef void (*Callback)(SIPClientTransaction*, void*);
+
+	private:
+
+	friend class SIPTransactionLayer;
+
+	volatile int mRefs;
+	SIPTransactionLayer& mLayer;
+	std::string mKey;					///< top Via branch and CSeq method
+	bool mINVITE;						///< true for an INVITE transaction
+	osip_message_t *mRequest;			///< our copy of the request
+	osip_message_t *mACK;				///< ACK for a non-2xx final response, or NULL
+	struct sockaddr_in mDestination;
+	State mState;
+	unsigned mInterval;					///< Timer A or E, ms
+	Timeval mTimeout;					///< Timer B or F
+	int mStatus;						///< final status code, 0 until there is one
+	OSIPMessageFIFO mResponses;			///< responses not yet read by the user
+	Callback mCallback;
+	void *mCallbackArg;
+
+	SIPClientTransaction(SIPTransactionLayer& wLayer, const std::string& wKey,
+		const struct sockaddr_in* wDestination, const osip_message_t* wRequest);
+
+	~SIPClientTransaction();
+
+	/** Timers A/B, D, E/F and K; called by the layer's wheel with the layer locked. */
+	void expired();
+
+	public:
+
+	/**@name Reference counting. */
+	//@{
+	void ref() { __sync_fetch_and_add(&mRefs,1); }
+	void release() { if (__sync_sub_and_fetch(&mRefs,1)==0) delete this; }
+	//@}
+
+	State state() const;
+
+	/** Return true once the final status is known. */
+	bool done() const { return status()!=0; }
+
+	/** The final status code, 0 if there is none yet, 408 on timeout. */
+	int status() const;
+
+	/**
+		Wait for the next response, provisional or final.
+		@param timeout The wait in ms.
+		@return The response, which the caller frees, or NULL on timeout.
+	*/
+	osip_message_t* read(unsigned timeout);
+
+	/**
+		Wait for the final status.
+		@param timeout The wait in ms.
+		@return The final status code, or 0 if there is none by the timeout.
+	*/
+	int wait(unsigned timeout);
+
+	/**
+		Set the function to run when the final status is known.
+		It runs in a thread of the SIP stack and must not block.
+		If the status is known already, it runs now.
+	*/
+	void callback(Callback wCallback, void *wArg);
+
+	/** Stop retransmitting and forget the transaction. */
+	void cancel();
+
+	const std::string& key() const { return mKey; }
+};
+
+
+
+/**
+	A non-INVITE server transaction, RFC 3261 17.2.2.
+	It absorbs retransmissions of its request, answering them with the
+	final response once the user has sent one, until Timer J.
+*/
+class SIPServerTransaction : public TimerWheelEntry {
+
+	private:
+
+	friend class SIPTransactionLayer;
+
+	SIPTransactionLayer& mLayer;
+	std::string mKey;
+	osip_message_t *mResponse;			///< our final response, or NULL
+	struct sockaddr_in mDestination;
+
+	SIPServerTransaction(SIPTransactionLayer& wLayer, const std::string& wKey)
+		:mLayer(wLayer),mKey(wKey),mResponse(NULL)
+	{ }
+
+	~SIPServerTransaction();
+
+	/** Timer J. */
+	void expired();
+};
+
+
+
+/**
+	The SIP transaction layer of the process.
+
+	Every transaction's timers are entries in one timer wheel, run by the
+	layer's own thread, so a transaction in progress costs no thread.
+	The SIP interface hands each received message to receive() first.
+*/
+class SIPTransactionLayer {
+
+	private:
+
+	friend class SIPClientTransaction;
+	friend class SIPServerTransaction;
+
+	mutable Mutex mLock;				///< guards everything here and in the transactions
+	Signal mWakeup;						///< wakes the timer thread
+	Signal mResponded;					///< broadcast on each response or final status
+	TimerWheel mTimers;
+
+	typedef std::map<std::string,SIPClientTransaction*> ClientMap;
+	typedef std::map<std::string,SIPServerTransaction*> ServerMap;
+	ClientMap mClients;
+	ServerMap mServers;
+
+	std::list<SIPClientTransaction*> mCallbacks;	///< finished transactions with callbacks to run
+
+	unsigned mT1;						///< RTT estimate, ms
+	unsigned mT2;						///< longest non-INVITE retransmit interval, ms
+	unsigned mT4;						///< longest time a message stays in the network, ms
+	bool mStarted;
+
+	/**@name Counters. */
+	//@{
+	unsigned mRetransmissions;			///< requests retransmitted
+	unsigned mAbsorbed;					///< retransmitted messages absorbed
+	unsigned mTimeouts;					///< transactions ended by Timer B or F
+	//@}
+
+	/** Drop a client transaction; caller holds mLock. */
+	void forget(SIPClientTransaction*);
+
+	/** Drop a server transaction; caller holds mLock. */
+	void forget(SIPServerTransaction*);
+
+	/** Record the final status and queue the callback; caller holds mLock. */
+	void finish(SIPClientTransaction*, int status);
+
+	/** Run the queued callbacks; caller does not hold mLock. */
+	void runCallbacks();
+
+	/** Set a timer and wake the timer thread; caller holds mLock. */
+	void arm(TimerWheelEntry&, unsigned ms);
+
+	/** Send a message, from any thread. */
+	void send(const struct sockaddr_in*, const osip_message_t*);
+
+	/** Build the ACK for a non-2xx final response to an INVITE, RFC 3261 17.1.1.3. */
+	osip_message_t* makeACK(const osip_message_t* invite, const osip_message_t* response);
+
+	public:
+
+	SIPTransactionLayer();
+
+	/** Read the timer values and start the timer thread, if it is not running yet. */
+	void start();
+
+	/**
+		Start a client transaction.
+		@param destination Where to send the request.
+		@param request The request; the transaction takes a copy.
+		@return The transaction, with a reference for the caller, or NULL if the request has no branch.
+	*/
+	SIPClientTransaction* request(const struct sockaddr_in* destination, const osip_message_t* request);
+
+	/**
+		Send a final response to a non-INVITE request, through its server transaction.
+		@param destination Where to send it.
+		@param response The response; the layer takes a copy.
+	*/
+	void respond(const struct sockaddr_in* destination, const osip_message_t* response);
+
+	/**
+		Look at a received message.
+		A response to one of our requests goes to its client transaction, and
+		a retransmitted request is answered by its server transaction.
+		@param msg The message; if this returns true, the layer has taken it.
+		@param source Where it came from.
+		@return True if the message was taken.
+	*/
+	bool receive(osip_message_t* msg, const struct sockaddr_in* source);
+
+	/** Print the transaction counts and counters. */
+	void dump(std::ostream&) const;
+
+	/** @name Timer values, ms. */
+	//@{
+	unsigned T1() const { return mT1; }
+	unsigned T2() const { return mT2; }
+	unsigned T4() const { return mT4; }
+	//@}
+
+	protected:
+
+	/** Run the timers, forever. */
+	void serviceLoop();
+
+	friend void *SIPTransactionLoopAdapter(SIPTransactionLayer*);
+};
+
+
+/** Thread entry point of SIPTransactionLayer. */
+void *SIPTransactionLoopAdapter(SIPTransactionLayer*);
+
+
+};	// namespace SIP
+
+
+/** The SIP transaction layer of the process. */
+extern SIP::SIPTransactionLayer gSIPTransactions;
+
+
+#endif
+// vim: ts=4 sw=4
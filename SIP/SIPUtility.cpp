@@ -23,6 +23,8 @@
 */
 
 
+#define LOG_MODULE SIP
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -30,7 +32,6 @@
 #include <signal.h>
 #include <stdlib.h>
 
-#include <ortp/ortp.h>
 #include <osipparser2/osip_md5.h>
 #include <osipparser2/sdp_message.h>
 
@@ -22,6 +22,8 @@
 * See the LEGAL file in the main directory for details.
 */
 
+#define LOG_MODULE L3
+
 #include <cstdio>
 
 #include "SMSMessages.h"
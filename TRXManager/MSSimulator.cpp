@@ -0,0 +1,1661 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "MSSimulator.h"
+
+#include <GSM610Tables.h>
+
+
+using namespace std;
+using namespace GSM;
+
+
+/** Length of the GSM hyperframe in frames, GSM 05.02 4.3.3. */
+static const uint32_t hyperframe = 2048UL*26UL*51UL;
+
+/** Frames to wait for an answer to a RACH burst before trying again. */
+static const unsigned accessTimeoutFrames = 433;
+
+/** Time to wait for the link after a SABM, in ms. */
+static const unsigned establishTimeout = 2000;
+
+/** Longest a transaction may take, not counting the call hold time, in ms. */
+static const unsigned transactionTimeout = 60000;
+
+/** Time to ignore repeated paging after a transaction, in ms. */
+static const unsigned pageHoldoff = 5000;
+
+
+
+
+
+const char* MSProcedureName(MSProcedure procedure)
+{
+	switch (procedure) {
+		case MSLocationUpdate: return "LUR";
+		case MSMOSMS: return "MO-SMS";
+		case MSMTSMS: return "MT-SMS";
+		case MSMOCall: return "MO-call";
+		case MSMTCall: return "MT-call";
+		default: return "?";
+	}
+}
+
+
+
+
+MSStats::MSStats()
+	:mAccessBursts(0),mAssignments(0),mRejects(0),mAccessTimeouts(0),mPages(0)
+{
+	for (int i=0; i<MSNumProcedures; i++) {
+		mAttempts[i] = 0;
+		mSuccesses[i] = 0;
+		mFailures[i] = 0;
+	}
+}
+
+
+void MSStats::attempt(MSProcedure procedure)
+{
+	mLock.lock();
+	mAttempts[procedure]++;
+	mLock.unlock();
+}
+
+
+void MSStats::success(MSProcedure procedure, long latencyMs)
+{
+	mLock.lock();
+	mSuccesses[procedure]++;
+	mLatencies[procedure].push_back(latencyMs);
+	mLock.unlock();
+}
+
+
+void MSStats::failure(MSProcedure procedure)
+{
+	mLock.lock();
+	mFailures[procedure]++;
+	mLock.unlock();
+}
+
+
+void MSStats::countAccessBurst() { mLock.lock(); mAccessBursts++; mLock.unlock(); }
+void MSStats::countAssignment() { mLock.lock(); mAssignments++; mLock.unlock(); }
+void MSStats::countReject() { mLock.lock(); mRejects++; mLock.unlock(); }
+void MSStats::countAccessTimeout() { mLock.lock(); mAccessTimeouts++; mLock.unlock(); }
+void MSStats::countPage() { mLock.lock(); mPages++; mLock.unlock(); }
+
+
+void MSStats::report(FILE *fp, double seconds) const
+{
+	mLock.lock();
+	fprintf(fp,"%-10s %8s %8s %8s %8s %8s %8s %8s\n",
+		"procedure","attempts","success","failure","succ/s","p50 ms","p90 ms","p99 ms");
+	for (int i=0; i<MSNumProcedures; i++) {
+		vector<long> sorted(mLatencies[i]);
+		sort(sorted.begin(),sorted.end());
+		long p50 = 0, p90 = 0, p99 = 0;
+		if (sorted.size()) {
+			size_t last = sorted.size()-1;
+			p50 = sorted[last*50/100];
+			p90 = sorted[last*90/100];
+			p99 = sorted[last*99/100];
+		}
+		fprintf(fp,"%-10s %8u %8u %8u %8.2f %8ld %8ld %8ld\n",
+			MSProcedureName((MSProcedure)i),
+			mAttempts[i], mSuccesses[i], mFailures[i],
+			seconds>0.0 ? mSuccesses[i]/seconds : 0.0,
+			p50, p90, p99);
+	}
+	fprintf(fp,"RACH bursts %u, assignments %u, rejects %u, unanswered %u, pages %u\n",
+		mAccessBursts, mAssignments, mRejects, mAccessTimeouts, mPages);
+	mLock.unlock();
+}
+
+
+
+
+MSBlockCoder::MSBlockCoder()
+	:mBlockCoder(0x10004820009ULL,40,224),
+	mU(228),mP(mU.segment(184,40)),mDP(mU.head(224)),mD(mU.head(184))
+{
+	mU.zero();
+}
+
+
+void MSBlockCoder::encode(const BitVector& frame, BitVector& c)
+{
+	// GSM 05.03 4.1.1 -- octets go out LSB first.
+	frame.copyToSegment(mU,0);
+	mD.LSB8MSB();
+	// GSM 05.03 4.1.2 -- parity and tail bits.
+	mBlockCoder.writeParityWord(mD,mP);
+	for (unsigned k=224; k<228; k++) mU[k] = 0;
+	// GSM 05.03 4.1.3
+	mU.encode(mVCoder,c);
+}
+
+
+bool MSBlockCoder::decode(const SoftVector& c, BitVector& frame)
+{
+	// Same as XCCHL1Decoder::decode.
+	c.decode(mVCoder,mU);
+	mP.invert();
+	if (mBlockCoder.syndrome(mDP)!=0) return false;
+	mD.LSB8MSB();
+	mD.copyTo(frame);
+	return true;
+}
+
+
+
+void MSInterleave(const BitVector& c, BitVector* I, unsigned depth, unsigned offset)
+{
+	for (unsigned k=0; k<456; k++) {
+		unsigned B = (k+offset) % depth;
+		unsigned j = 2*((49*k) % 57) + ((k%8)/4);
+		I[B][j] = c[k];
+	}
+}
+
+
+void MSDeinterleave(SoftVector* I, SoftVector& c, unsigned depth, unsigned offset)
+{
+	for (unsigned k=0; k<456; k++) {
+		unsigned B = (k+offset) % depth;
+		unsigned j = 2*((49*k) % 57) + ((k%8)/4);
+		c[k] = I[B][j];
+		I[B][j] = 0.5F;
+	}
+}
+
+
+
+
+static void *MSReaderAdapter(void *arg)
+{
+	MSChannel::Reader *reader = (MSChannel::Reader*)arg;
+	reader->channel->readerLoop(reader->SAPI);
+	return NULL;
+}
+
+
+MSChannel::MSChannel(unsigned wTN, const MappingPair& wMapping)
+	:SAPMux(),
+	mTN(wTN),mMapping(wMapping),
+	mOpen(false),mStarted(false),mTSC(0),
+	mRxC(456),mRxD(184),mTxC(456)
+{
+	for (int i=0; i<4; i++) {
+		mL2[i] = NULL;
+		mReaders[i].channel = this;
+		mReaders[i].SAPI = i;
+	}
+}
+
+
+void MSChannel::connect()
+{
+	for (unsigned SAPI=0; SAPI<4; SAPI++) {
+		if (!mL2[SAPI]) continue;
+		upstream(mL2[SAPI],SAPI);
+		mL2[SAPI]->downstream(this);
+	}
+}
+
+
+void MSChannel::open(unsigned wTSC)
+{
+	mL1Lock.lock();
+	mTSC = wTSC;
+	resetL1();
+	mTxQ.clear();
+	mOpen = true;
+	if (!mStarted) {
+		for (unsigned SAPI=0; SAPI<4; SAPI++) {
+			if (!mL2[SAPI]) continue;
+			mReaderThreads[SAPI].start(MSReaderAdapter,&mReaders[SAPI]);
+		}
+		mStarted = true;
+	}
+	mL1Lock.unlock();
+	mL3Q.clear();
+	for (unsigned SAPI=0; SAPI<4; SAPI++) {
+		if (mL2[SAPI]) mL2[SAPI]->open();
+	}
+}
+
+
+void MSChannel::close()
+{
+	mL1Lock.lock();
+	mOpen = false;
+	mTxQ.clear();
+	mL1Lock.unlock();
+	for (unsigned SAPI=0; SAPI<4; SAPI++) {
+		if (mL2[SAPI]) mL2[SAPI]->writeHighSide(L3Frame(HARDRELEASE));
+	}
+}
+
+
+bool MSChannel::isOpen() const
+{
+	mL1Lock.lock();
+	bool retVal = mOpen;
+	mL1Lock.unlock();
+	return retVal;
+}
+
+
+bool MSChannel::txIdle() const
+{
+	return mTxQ.size()==0;
+}
+
+
+void MSChannel::writeHighSide(const L2Frame& frame)
+{
+	// The other primitives are L2 bookkeeping and never reach the radio.
+	if (frame.primitive()!=DATA) return;
+	if (!isOpen()) return;
+	mTxQ.write(new L2Frame(frame));
+}
+
+
+void MSChannel::readerLoop(unsigned SAPI)
+{
+	while (true) {
+		L3Frame *frame = mL2[SAPI]->readHighSide();
+		if (!frame) continue;
+		mL3Q.write(new MSL3Frame(*frame,SAPI));
+		delete frame;
+	}
+}
+
+
+void MSChannel::mapBurst(const BitVector& I, TxBurst& burst) const
+{
+	// GSM 05.03 4.1.5, 05.02 5.2.3
+	I.segment(0,57).copyToSegment(burst,3);
+	I.segment(57,57).copyToSegment(burst,88);
+	gTrainingSequence[mTSC].copyToSegment(burst,61);
+}
+
+
+
+
+MSSDCCH::MSSDCCH(unsigned wTN, const MappingPair& wMapping)
+	:MSChannel(wTN,wMapping),
+	mTxBlock(false)
+{
+	for (int i=0; i<4; i++) {
+		mRxI[i] = SoftVector(114);
+		mRxI[i].unknown();
+		mTxI[i] = BitVector(114);
+		mTxI[i].zero();
+	}
+	// C/R=0 makes these handset-side LAPDm entities.
+	L2LAPDm *SAP0 = new SDCCHL2(0,0);
+	L2LAPDm *SAP3 = new SDCCHL2(0,3);
+	SAP3->master(SAP0);
+	mL2[0] = SAP0;
+	mL2[3] = SAP3;
+	connect();
+}
+
+
+void MSSDCCH::resetL1()
+{
+	mTxBlock = false;
+	for (int i=0; i<4; i++) mRxI[i].unknown();
+}
+
+
+bool MSSDCCH::txIdle() const
+{
+	mL1Lock.lock();
+	bool retVal = !mTxBlock && mTxQ.size()==0;
+	mL1Lock.unlock();
+	return retVal;
+}
+
+
+void MSSDCCH::receiveBurst(uint32_t FN, const SoftVector& burst)
+{
+	int B = mMapping.downlink().reverseMapping(FN);
+	if (B<0) return;
+	B = B % 4;
+	mL1Lock.lock();
+	if (!mOpen) {
+		mL1Lock.unlock();
+		return;
+	}
+	burst.segment(3,57).copyToSegment(mRxI[B],0);
+	burst.segment(88,57).copyToSegment(mRxI[B],57);
+	if (B!=3) {
+		mL1Lock.unlock();
+		return;
+	}
+	MSDeinterleave(mRxI,mRxC,4,0);
+	bool good = mCoder.decode(mRxC,mRxD);
+	mL1Lock.unlock();
+	if (good) writeLowSide(new L2Frame(mRxD,DATA));
+}
+
+
+bool MSSDCCH::transmitBurst(uint32_t FN, TxBurst& burst)
+{
+	int B = mMapping.uplink().reverseMapping(FN);
+	if (B<0) return false;
+	B = B % 4;
+	mL1Lock.lock();
+	if (!mOpen) {
+		mL1Lock.unlock();
+		return false;
+	}
+	// Unlike the core, the handset sends nothing between frames.
+	if (B==0) {
+		L2Frame *frame = mTxQ.readNoBlock();
+		mTxBlock = (frame!=NULL);
+		if (frame) {
+			mCoder.encode(*frame,mTxC);
+			MSInterleave(mTxC,mTxI,4,0);
+			delete frame;
+		}
+	}
+	bool retVal = mTxBlock;
+	if (retVal) {
+		mapBurst(mTxI[B],burst);
+		burst.Hl(true);
+		burst.Hu(true);
+	}
+	if (B==3) mTxBlock = false;
+	mL1Lock.unlock();
+	return retVal;
+}
+
+
+
+
+BitVector MSTCHFACCH::sSilenceC;
+
+
+void MSTCHFACCH::buildSilence()
+{
+	// An all-zero GSM 06.10 frame, coded as in TCHFACCHL1Encoder::encodeTCH.
+	VocoderFrame vFrame;
+	vFrame.payload().zero();
+	BitVector d(260);
+	vFrame.payload().map(g610BitOrder,260,d);
+	BitVector u(189);
+	BitVector class1A = d.head(50);
+	BitVector p = u.segment(91,3);
+	Parity parity(0x0b,3,50);
+	parity.writeParityWord(class1A,p);
+	for (unsigned k=0; k<=90; k++) {
+		u[k] = d[2*k];
+		u[184-k] = d[2*k+1];
+	}
+	for (unsigned k=185; k<=188; k++) u[k] = 0;
+	sSilenceC = BitVector(456);
+	BitVector class1 = sSilenceC.head(378);
+	ViterbiR2O4 coder;
+	u.encode(coder,class1);
+	d.segment(182,78).copyToSegment(sSilenceC,378);
+}
+
+
+MSTCHFACCH::MSTCHFACCH(unsigned wTN, const MappingPair& wMapping)
+	:MSChannel(wTN,wMapping),
+	mPreviousFACCH(false),mCurrentFACCH(false),mTxStarted(false)
+{
+	if (sSilenceC.size()==0) buildSilence();
+	for (int i=0; i<8; i++) {
+		mRxI[i] = SoftVector(114);
+		mRxI[i].unknown();
+		mTxI[i] = BitVector(114);
+		mTxI[i].zero();
+	}
+	mL2[0] = new FACCHL2(0,0);
+	connect();
+}
+
+
+void MSTCHFACCH::resetL1()
+{
+	mPreviousFACCH = false;
+	mCurrentFACCH = false;
+	mTxStarted = false;
+	for (int i=0; i<8; i++) {
+		mRxI[i].unknown();
+		mTxI[i].zero();
+	}
+}
+
+
+void MSTCHFACCH::receiveBurst(uint32_t FN, const SoftVector& burst)
+{
+	int B = mMapping.downlink().reverseMapping(FN);
+	if (B<0) return;
+	B = B % 8;
+	mL1Lock.lock();
+	if (!mOpen) {
+		mL1Lock.unlock();
+		return;
+	}
+	burst.segment(3,57).copyToSegment(mRxI[B],0);
+	burst.segment(88,57).copyToSegment(mRxI[B],57);
+	if (B%4!=3) {
+		mL1Lock.unlock();
+		return;
+	}
+	// Same phasing as TCHFACCHL1Decoder::processBurst.
+	// Speech is of no interest here, only stolen frames are decoded.
+	MSDeinterleave(mRxI,mRxC,8,(B==3) ? 4 : 0);
+	bool stolen = burst[gHlIndex]>0.5F;
+	bool good = stolen && mCoder.decode(mRxC,mRxD);
+	mL1Lock.unlock();
+	if (good) writeLowSide(new L2Frame(mRxD,DATA));
+}
+
+
+bool MSTCHFACCH::transmitBurst(uint32_t FN, TxBurst& burst)
+{
+	int B = mMapping.uplink().reverseMapping(FN);
+	if (B<0) return false;
+	B = B % 8;
+	mL1Lock.lock();
+	if (!mOpen) {
+		mL1Lock.unlock();
+		return false;
+	}
+	if (B%4==0) {
+		// New block, by priority: FACCH, then silence.
+		// The interleaver phase follows the frame so that the core's
+		// decoder, which keys on the frame, sees whole blocks.
+		mPreviousFACCH = mCurrentFACCH;
+		L2Frame *frame = mTxQ.readNoBlock();
+		mCurrentFACCH = (frame!=NULL);
+		if (frame) {
+			mCoder.encode(*frame,mTxC);
+			delete frame;
+		} else {
+			sSilenceC.copyTo(mTxC);
+		}
+		MSInterleave(mTxC,mTxI,8,B);
+		mTxStarted = true;
+	}
+	if (!mTxStarted) {
+		mL1Lock.unlock();
+		return false;
+	}
+	mapBurst(mTxI[B],burst);
+	burst.Hu(mCurrentFACCH);
+	burst.Hl(mPreviousFACCH);
+	mL1Lock.unlock();
+	return true;
+}
+
+
+
+
+MSRadio::MSRadio(unsigned basePort, MSStats& wStats, int wBSIC)
+	:mClockSocket(basePort,"127.0.0.1",basePort+100),
+	mControlSocket(basePort+1,"127.0.0.1",basePort+101),
+	mDataSocket(basePort+2,"127.0.0.1",basePort+102),
+	mStats(wStats),
+	mPoweredOn(false),mTSC(0),mBSIC(wBSIC),
+	mCCCHFrame(184),mCCCHC(456),
+	mRACHParity(0x06f,6,8),
+	mDownlinkBursts(0),mUplinkBursts(0),mCommands(0)
+{
+	for (int TN=0; TN<8; TN++) mCombination[TN] = 0;
+	for (int i=0; i<3; i++) {
+		for (int B=0; B<4; B++) {
+			mCCCHI[i][B] = SoftVector(114);
+			mCCCHI[i][B].unknown();
+		}
+	}
+}
+
+
+void MSRadio::requestAccess(MSHandset* handset, unsigned RA)
+{
+	AccessRequest request;
+	request.handset = handset;
+	request.RA = RA;
+	request.FN = 0;
+	mLock.lock();
+	mAccessQueue.push_back(request);
+	mLock.unlock();
+}
+
+
+MSChannel* MSRadio::channel(unsigned TN, unsigned typeAndOffset)
+{
+	if (TN>=8) return NULL;
+	MSChannel *retVal = NULL;
+	mLock.lock();
+	for (unsigned i=0; i<mChannels[TN].size(); i++) {
+		if ((unsigned)mChannels[TN][i]->typeAndOffset()!=typeAndOffset) continue;
+		retVal = mChannels[TN][i];
+		break;
+	}
+	mLock.unlock();
+	return retVal;
+}
+
+
+void MSRadio::registerIMSI(const string& IMSI, MSHandset* handset)
+{
+	mLock.lock();
+	mIMSIs[IMSI] = handset;
+	mLock.unlock();
+}
+
+
+void MSRadio::registerTMSI(unsigned TMSI, MSHandset* handset)
+{
+	mLock.lock();
+	mTMSIs[TMSI] = handset;
+	mLock.unlock();
+}
+
+
+void MSRadio::addChannels(unsigned TN, unsigned combination)
+{
+	static const MappingPair* SDCCH4[4] = {
+		&gSDCCH_4_0Pair, &gSDCCH_4_1Pair, &gSDCCH_4_2Pair, &gSDCCH_4_3Pair
+	};
+	mLock.lock();
+	mCombination[TN] = combination;
+	// The core may reconfigure on a restart; keep the channels we have.
+	if (mChannels[TN].size()==0) {
+		switch (combination) {
+			case 5:
+				for (int i=0; i<4; i++) mChannels[TN].push_back(new MSSDCCH(TN,*SDCCH4[i]));
+				break;
+			case 7:
+				for (int i=0; i<8; i++) mChannels[TN].push_back(new MSSDCCH(TN,gSDCCH8[i].LCH()));
+				break;
+			case 1:
+				mChannels[TN].push_back(new MSTCHFACCH(TN,gTCHF_T[TN].LCH()));
+				break;
+			default:
+				break;
+		}
+	}
+	mLock.unlock();
+}
+
+
+void MSRadio::sendClock(uint32_t FN)
+{
+	char command[32];
+	sprintf(command,"IND CLOCK %u",FN);
+	mClockSocket.write(command,strlen(command)+1);
+}
+
+
+void MSRadio::handleCommand(char *buffer, int len, uint32_t FN)
+{
+	buffer[len] = '\0';
+	char cmdcheck[4];
+	char command[32];
+	if (sscanf(buffer,"%3s %31s",cmdcheck,command)!=2 || strcmp(cmdcheck,"CMD")!=0) {
+		fprintf(stderr,"bogus message on control interface: %s\n",buffer);
+		return;
+	}
+	mCommands++;
+	const char *params = buffer + 4 + strlen(command);
+	while (*params==' ') params++;
+	// The handsets need the same view of the cell as the core's radio.
+	if (strcmp(command,"POWERON")==0) mPoweredOn = true;
+	if (strcmp(command,"POWEROFF")==0) mPoweredOn = false;
+	if (strcmp(command,"SETTSC")==0) mTSC = atoi(params) & 0x07;
+	if (strcmp(command,"SETSLOT")==0) {
+		unsigned TN, combination;
+		if (sscanf(params,"%u %u",&TN,&combination)==2 && TN<8) addChannels(TN,combination);
+	}
+	char response[MAX_UDP_LENGTH];
+	if (*params) snprintf(response,sizeof(response),"RSP %s 0 %s",command,params);
+	else snprintf(response,sizeof(response),"RSP %s 0",command);
+	mControlSocket.write(response,strlen(response)+1);
+	sendClock(FN);
+}
+
+
+bool MSRadio::serviceSockets(uint32_t FN, long quietUsec, long maxUsec)
+{
+	struct timeval start;
+	gettimeofday(&start,NULL);
+	while (true) {
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(mControlSocket.fd(),&fds);
+		FD_SET(mDataSocket.fd(),&fds);
+		int maxFD = mControlSocket.fd();
+		if (mDataSocket.fd()>maxFD) maxFD = mDataSocket.fd();
+		struct timeval timeout;
+		timeout.tv_sec = quietUsec / 1000000;
+		timeout.tv_usec = quietUsec % 1000000;
+		int rc = select(maxFD+1,&fds,NULL,NULL,&timeout);
+		if (rc<=0) return true;
+		char buffer[MAX_UDP_LENGTH+1];
+		if (FD_ISSET(mControlSocket.fd(),&fds)) {
+			int len = mControlSocket.read(buffer);
+			if (len>0) handleCommand(buffer,len,FN);
+		}
+		if (FD_ISSET(mDataSocket.fd(),&fds)) {
+			int len = mDataSocket.read(buffer);
+			if (len>0) handleDownlink(buffer,len);
+		}
+		struct timeval now;
+		gettimeofday(&now,NULL);
+		long elapsed = 1000000L*(now.tv_sec-start.tv_sec) + (now.tv_usec-start.tv_usec);
+		if (elapsed>=maxUsec) return false;
+	}
+}
+
+
+void MSRadio::handleDownlink(const char *buffer, int len)
+{
+	// See README.TRXManager for the format.
+	if (len<(int)(6+gSlotLen)) return;
+	const unsigned char *rp = (const unsigned char*)buffer;
+	unsigned TN = (*rp++) & 0x07;
+	uint32_t FN = *rp++;
+	FN = (FN<<8) + (*rp++);
+	FN = (FN<<8) + (*rp++);
+	FN = (FN<<8) + (*rp++);
+	// skip the power level
+	rp++;
+	mDownlinkBursts++;
+
+	SoftVector burst(gSlotLen);
+	for (unsigned i=0; i<gSlotLen; i++) burst[i] = rp[i] ? 1.0F : 0.0F;
+
+	if (TN==0 && mCombination[0]==5) receiveCCCH(FN,burst);
+
+	mLock.lock();
+	vector<MSChannel*> channels(mChannels[TN]);
+	mLock.unlock();
+	for (unsigned i=0; i<channels.size(); i++) channels[i]->receiveBurst(FN,burst);
+}
+
+
+void MSRadio::receiveCCCH(uint32_t FN, const SoftVector& burst)
+{
+	// The C-V CCCH blocks, as configured by the core.
+	static const TDMAMapping* CCCH[3] = {
+		&gCCCH_0Mapping, &gCCCH_1Mapping, &gCCCH_2Mapping
+	};
+	for (int i=0; i<3; i++) {
+		int B = CCCH[i]->reverseMapping(FN);
+		if (B<0) continue;
+		B = B % 4;
+		burst.segment(3,57).copyToSegment(mCCCHI[i][B],0);
+		burst.segment(88,57).copyToSegment(mCCCHI[i][B],57);
+		if (B!=3) return;
+		MSDeinterleave(mCCCHI[i],mCCCHC,4,0);
+		if (mCCCHCoder.decode(mCCCHC,mCCCHFrame)) handleCCCH(mCCCHFrame);
+		return;
+	}
+}
+
+
+void MSRadio::handleCCCH(const BitVector& frame)
+{
+	// Skip the L2 pseudo-length, GSM 04.08 10.5.2.19.
+	const L3Frame L3(frame.tail(8));
+	if (L3.PD()!=L3RadioResourcePD) return;
+	switch (L3.MTI()) {
+		case 0x3F: handleAssignment(L3); break;
+		case 0x3A: handleReject(L3); break;
+		case 0x21: handlePaging(L3); break;
+		default: break;
+	}
+}
+
+
+list<MSRadio::AccessRequest>::iterator MSRadio::findAccess(const L3Frame& frame, size_t rp)
+{
+	// Request Reference, GSM 04.08 10.5.2.30.
+	unsigned RA = frame.readField(rp,8);
+	unsigned T1p = frame.readField(rp,5);
+	unsigned T3 = frame.readField(rp,6);
+	unsigned T2 = frame.readField(rp,5);
+	list<AccessRequest>::iterator itr = mAccessSent.begin();
+	while (itr!=mAccessSent.end()) {
+		uint32_t FN = itr->FN;
+		if (itr->RA==RA && (FN/1326)%32==T1p && FN%51==T3 && FN%26==T2) break;
+		++itr;
+	}
+	return itr;
+}
+
+
+void MSRadio::handleAssignment(const L3Frame& frame)
+{
+	// Immediate Assignment, GSM 04.08 9.1.18.
+	// Channel Description, GSM 04.08 10.5.2.5.
+	unsigned typeAndOffset = frame.peekField(3*8,5);
+	unsigned TN = frame.peekField(3*8+5,3);
+	mLock.lock();
+	list<AccessRequest>::iterator itr = findAccess(frame,6*8);
+	if (itr==mAccessSent.end()) {
+		mLock.unlock();
+		return;
+	}
+	MSHandset *handset = itr->handset;
+	mAccessSent.erase(itr);
+	mLock.unlock();
+	mStats.countAssignment();
+	handset->accessResult(channel(TN,typeAndOffset),false);
+}
+
+
+void MSRadio::handleReject(const L3Frame& frame)
+{
+	// Immediate Assignment Reject, GSM 04.08 9.1.20.
+	for (unsigned i=0; i<4; i++) {
+		mLock.lock();
+		list<AccessRequest>::iterator itr = findAccess(frame,(3+4*i)*8);
+		if (itr==mAccessSent.end()) {
+			mLock.unlock();
+			continue;
+		}
+		MSHandset *handset = itr->handset;
+		mAccessSent.erase(itr);
+		mLock.unlock();
+		mStats.countReject();
+		handset->accessResult(NULL,true);
+	}
+}
+
+
+void MSRadio::handlePaging(const L3Frame& frame)
+{
+	// Paging Request Type 1, GSM 04.08 9.1.22.
+	unsigned channelNeeded2 = frame.peekField(2*8,2);
+	unsigned channelNeeded1 = frame.peekField(2*8+2,2);
+	size_t rp = 3*8;
+	L3MobileIdentity identity1;
+	identity1.parseLV(frame,rp);
+	page(identity1,channelNeeded1);
+	L3MobileIdentity identity2;
+	if (rp+8<frame.size() && identity2.parseTLV(0x17,frame,rp)) page(identity2,channelNeeded2);
+}
+
+
+void MSRadio::page(const L3MobileIdentity& identity, unsigned channelNeeded)
+{
+	MSHandset *handset = NULL;
+	bool byTMSI = (identity.type()==TMSIType);
+	mLock.lock();
+	if (byTMSI) {
+		map<unsigned,MSHandset*>::iterator itr = mTMSIs.find(identity.TMSI());
+		if (itr!=mTMSIs.end()) handset = itr->second;
+	} else if (identity.type()==IMSIType) {
+		map<string,MSHandset*>::iterator itr = mIMSIs.find(identity.digits());
+		if (itr!=mIMSIs.end()) handset = itr->second;
+	}
+	mLock.unlock();
+	if (!handset) return;
+	mStats.countPage();
+	handset->paged(channelNeeded,byTMSI);
+}
+
+
+void MSRadio::encodeRACH(unsigned RA, TxBurst& burst)
+{
+	// GSM 05.03 4.6, the inverse of RACHL1Decoder::writeLowSide.
+	BitVector u(18);
+	BitVector d = u.head(8);
+	size_t wp = 0;
+	d.writeField(wp,RA,8);
+	d.LSB8MSB();
+	unsigned parity = d.parity(mRACHParity);
+	u.fillField(8,(~(BSIC()^parity)) & 0x03f,6);
+	u.fillField(14,0,4);
+	BitVector e(36);
+	u.encode(mRACHCoder,e);
+	burst.zero();
+	e.copyToSegment(burst,49);
+}
+
+
+void MSRadio::sendBurst(unsigned TN, uint32_t FN, const TxBurst& burst)
+{
+	// See README.TRXManager for the format.
+	char buffer[8+gSlotLen];
+	unsigned char *wp = (unsigned char*)buffer;
+	*wp++ = TN;
+	*wp++ = (FN>>24) & 0x0ff;
+	*wp++ = (FN>>16) & 0x0ff;
+	*wp++ = (FN>>8) & 0x0ff;
+	*wp++ = FN & 0x0ff;
+	// RSSI -50 dB, no timing error.
+	*wp++ = 50;
+	*wp++ = 0;
+	*wp++ = 0;
+	for (unsigned i=0; i<gSlotLen; i++) *wp++ = burst.bit(i) ? 255 : 0;
+	mDataSocket.write(buffer,sizeof(buffer));
+	mUplinkBursts++;
+}
+
+
+void MSRadio::transmit(uint32_t FN)
+{
+	TxBurst burst;
+
+	// One access burst per RACH slot, first come first served.
+	if (mCombination[0]==5 && gRACHC5Mapping.reverseMapping(FN)>=0) {
+		bool send = false;
+		unsigned RA = 0;
+		mLock.lock();
+		if (mAccessQueue.size()) {
+			AccessRequest request = mAccessQueue.front();
+			mAccessQueue.pop_front();
+			request.FN = FN;
+			mAccessSent.push_back(request);
+			RA = request.RA;
+			send = true;
+		}
+		mLock.unlock();
+		if (send) {
+			encodeRACH(RA,burst);
+			sendBurst(0,FN,burst);
+			mStats.countAccessBurst();
+		}
+	}
+
+	// Give up on RACH bursts that got no answer.
+	vector<MSHandset*> expired;
+	mLock.lock();
+	list<AccessRequest>::iterator itr = mAccessSent.begin();
+	while (itr!=mAccessSent.end()) {
+		if ((FN+hyperframe-itr->FN)%hyperframe > accessTimeoutFrames) {
+			expired.push_back(itr->handset);
+			itr = mAccessSent.erase(itr);
+		} else {
+			++itr;
+		}
+	}
+	mLock.unlock();
+	for (unsigned i=0; i<expired.size(); i++) {
+		mStats.countAccessTimeout();
+		expired[i]->accessResult(NULL,false);
+	}
+
+	// Dedicated channels.  The mappings on a slot never collide.
+	for (unsigned TN=0; TN<8; TN++) {
+		mLock.lock();
+		vector<MSChannel*> channels(mChannels[TN]);
+		mLock.unlock();
+		for (unsigned i=0; i<channels.size(); i++) {
+			if (!channels[i]->transmitBurst(FN,burst)) continue;
+			sendBurst(TN,FN,burst);
+			break;
+		}
+	}
+}
+
+
+
+
+/**
+	Builds an uplink L3 message.
+	The L3Message classes only parse the MS side of most messages,
+	so the handset encodes its messages here, octet by octet.
+*/
+class MSL3Writer {
+
+	private:
+
+	L3Frame mFrame;
+	size_t mWP;
+
+	public:
+
+	MSL3Writer(unsigned header, unsigned MTI)
+		:mFrame(DATA,8*251),mWP(0)
+	{
+		writeByte(header);
+		writeByte(MTI);
+	}
+
+	L3Frame& frame() { return mFrame; }
+
+	size_t& wp() { return mWP; }
+
+	void writeByte(unsigned value) { mFrame.writeField(mWP,value & 0x0ff,8); }
+
+	/** Start an LV or TLV element; returns the position of the length. */
+	size_t startLength()
+	{
+		size_t retVal = mWP;
+		writeByte(0);
+		return retVal;
+	}
+
+	/** Fill in the length of the element started at lengthWP. */
+	void endLength(size_t lengthWP)
+	{
+		mFrame.fillField(lengthWP,(mWP-lengthWP)/8-1,8);
+	}
+
+	/** Packed BCD digits, GSM 04.08 10.5.4.7. */
+	void writeBCD(const string& digits)
+	{
+		for (size_t i=0; i<digits.size(); i+=2) {
+			unsigned high = (i+1<digits.size()) ? digits[i+1]-'0' : 0x0f;
+			mFrame.writeField(mWP,high,4);
+			mFrame.writeField(mWP,digits[i]-'0',4);
+		}
+	}
+
+	/** Mobile Station Classmark 2, GSM 04.08 10.5.1.6, as LV. */
+	void writeClassmark2()
+	{
+		// Phase 2, A5/1, power class 4, SMS capable.
+		writeByte(3);
+		writeByte(0x33);
+		writeByte(0x19);
+		writeByte(0x00);
+	}
+
+	L3Frame result() const { return L3Frame(mFrame.head(mWP)); }
+
+};
+
+
+/** GSM 04.07 11.2.3.1.3 */
+static unsigned TIHeader(unsigned TIFlag, unsigned TI, L3PD PD)
+{
+	return (TIFlag<<7) | ((TI & 0x07)<<4) | PD;
+}
+
+
+
+/** The state of the transaction a handset is running. */
+struct MSHandset::Transaction {
+	MSProcedure procedure;
+	bool known;				///< false until a paged transaction shows what it is
+	Timeval start;
+	MSChannel *chan;
+	bool paged;
+	bool pagedByTMSI;
+	unsigned TI;			///< CC or SMS transaction identifier
+	unsigned TIFlag;		///< the flag we send, 0 if we originated the transaction
+	unsigned ref;			///< RP message reference
+	bool finished;			///< success or failure has been counted
+	bool released;			///< the network sent Channel Release
+	bool linkDown;			///< SAP0 was released
+	bool SMSSent;
+	bool answerPending;		///< MT call waiting for a traffic channel to answer on
+	bool connected;
+	Timeval connectTime;
+	bool clearing;
+
+	Transaction()
+		:procedure(MSLocationUpdate),known(false),chan(NULL),
+		paged(false),pagedByTMSI(false),TI(0),TIFlag(0),ref(0),
+		finished(false),released(false),linkDown(false),SMSSent(false),
+		answerPending(false),connected(false),clearing(false)
+	{ }
+};
+
+
+
+static void *MSHandsetServiceLoopAdapter(MSHandset *handset)
+{
+	handset->serviceLoop();
+	return NULL;
+}
+
+
+MSHandset::MSHandset(MSRadio& wRadio, MSStats& wStats, const MSHandsetParams& wParams,
+		const string& wIMSI, const string& wIMEI)
+	:mRadio(wRadio),mStats(wStats),mParams(wParams),
+	mIMSI(wIMSI),mIMEI(wIMEI),
+	mBusy(false),mAttached(false),mHaveTMSI(false),mTMSI(0),
+	mNextTI(0),mNextRef(0)
+{
+	mRandom = strtoul(mIMSI.c_str()+mIMSI.size()-9,NULL,10);
+	mRadio.registerIMSI(mIMSI,this);
+}
+
+
+void MSHandset::start()
+{
+	mThread.start((void*(*)(void*))MSHandsetServiceLoopAdapter,this);
+}
+
+
+bool MSHandset::busy() const
+{
+	mLock.lock();
+	bool retVal = mBusy;
+	mLock.unlock();
+	return retVal;
+}
+
+
+bool MSHandset::attached() const
+{
+	mLock.lock();
+	bool retVal = mAttached;
+	mLock.unlock();
+	return retVal;
+}
+
+
+bool MSHandset::startProcedure(MSProcedure procedure)
+{
+	mLock.lock();
+	if (mBusy) {
+		mLock.unlock();
+		return false;
+	}
+	mBusy = true;
+	mLock.unlock();
+	MSTask *task = new MSTask;
+	task->procedure = procedure;
+	task->start.now();
+	task->paged = false;
+	task->channelNeeded = 0;
+	task->pagedByTMSI = false;
+	mTasks.write(task);
+	return true;
+}
+
+
+void MSHandset::expectMTSMS()
+{
+	mStats.attempt(MSMTSMS);
+	mLock.lock();
+	mMTSMSPending.push_back(Timeval());
+	mLock.unlock();
+}
+
+
+void MSHandset::expireMTSMS(unsigned timeout)
+{
+	unsigned expired = 0;
+	mLock.lock();
+	while (mMTSMSPending.size() && mMTSMSPending.front().elapsed()>(long)timeout) {
+		mMTSMSPending.pop_front();
+		expired++;
+	}
+	mLock.unlock();
+	for (unsigned i=0; i<expired; i++) mStats.failure(MSMTSMS);
+}
+
+
+void MSHandset::accessResult(MSChannel* channel, bool rejected)
+{
+	MSAccessResult *result = new MSAccessResult;
+	result->channel = channel;
+	result->rejected = rejected;
+	mAccessResults.write(result);
+}
+
+
+void MSHandset::paged(unsigned channelNeeded, bool byTMSI)
+{
+	// The core repeats pages, so ignore them while busy and just after.
+	mLock.lock();
+	if (mBusy || !mPageHoldoff.passed()) {
+		mLock.unlock();
+		return;
+	}
+	mBusy = true;
+	mLock.unlock();
+	MSTask *task = new MSTask;
+	task->procedure = MSMTCall;
+	task->start.now();
+	task->paged = true;
+	task->channelNeeded = channelNeeded;
+	task->pagedByTMSI = byTMSI;
+	mTasks.write(task);
+}
+
+
+void MSHandset::serviceLoop()
+{
+	while (true) {
+		MSTask *task = mTasks.read();
+		run(*task);
+		delete task;
+		mLock.lock();
+		mBusy = false;
+		mPageHoldoff.future(pageHoldoff);
+		mLock.unlock();
+	}
+}
+
+
+unsigned MSHandset::randomBits(unsigned bits)
+{
+	mRandom = mRandom*1103515245 + 12345;
+	return (mRandom>>16) & ((1<<bits)-1);
+}
+
+
+MSChannel* MSHandset::access(unsigned RA)
+{
+	// GSM 04.08 3.3.1.1.2, with a fixed number of tries.
+	for (unsigned tries=0; tries<3; tries++) {
+		mAccessResults.clear();
+		mRadio.requestAccess(this,RA);
+		// The radio loop always answers, if only with a timeout.
+		MSAccessResult *result = mAccessResults.read(transactionTimeout);
+		if (!result) return NULL;
+		MSChannel *chan = result->channel;
+		bool rejected = result->rejected;
+		delete result;
+		if (chan) return chan;
+		if (rejected) return NULL;
+	}
+	return NULL;
+}
+
+
+bool MSHandset::waitForPrimitive(MSChannel* chan, Primitive prim, unsigned SAPI, unsigned timeout)
+{
+	Timeval deadline(timeout);
+	while (!deadline.passed()) {
+		long remaining = deadline.remaining();
+		MSL3Frame *frame = chan->recv(remaining>0 ? remaining : 1);
+		if (!frame) continue;
+		bool match = (frame->primitive()==prim) && (frame->SAPI()==SAPI);
+		delete frame;
+		if (match) return true;
+	}
+	return false;
+}
+
+
+void MSHandset::run(const MSTask& task)
+{
+	Transaction t;
+	t.procedure = task.procedure;
+	t.known = !task.paged;
+	t.start = task.start;
+	t.paged = task.paged;
+	t.pagedByTMSI = task.pagedByTMSI;
+	if (t.known && t.procedure!=MSMTSMS) mStats.attempt(t.procedure);
+
+	// Establishment cause, GSM 04.08 9.1.8 Table 9.9, with NECI=1.
+	unsigned RA;
+	if (t.paged) {
+		switch (task.channelNeeded) {
+			case 1: RA = 0x10 | randomBits(4); break;
+			case 2:
+			case 3: RA = 0x20 | randomBits(4); break;
+			default: RA = 0x80 | randomBits(5); break;
+		}
+	} else {
+		switch (t.procedure) {
+			case MSLocationUpdate: RA = 0x00 | randomBits(4); break;
+			case MSMOCall: RA = 0xE0 | randomBits(5); break;
+			default: RA = 0x10 | randomBits(4); break;
+		}
+	}
+
+	t.chan = access(RA);
+	if (!t.chan) {
+		if (t.known) finish(t,false);
+		return;
+	}
+
+	t.chan->open(mRadio.TSC());
+	t.chan->send(ESTABLISH);
+	if (!waitForPrimitive(t.chan,ESTABLISH,0,establishTimeout)) {
+		t.chan->close();
+		if (t.known) finish(t,false);
+		return;
+	}
+	sendInitialMessage(t);
+
+	// Run the transaction until the network releases the channel.
+	Timeval guard(transactionTimeout + 1000*mParams.holdSeconds);
+	while (!guard.passed()) {
+		if (t.connected && !t.clearing && t.connectTime.elapsed()>=(long)(1000*mParams.holdSeconds)) {
+			// Hang up, GSM 04.08 5.4.3.
+			MSL3Writer msg(TIHeader(t.TIFlag,t.TI,L3CallControlPD),0x25);
+			msg.writeByte(2);
+			msg.writeByte(0xE0);
+			msg.writeByte(0x90);
+			t.chan->send(msg.result());
+			t.clearing = true;
+		}
+		MSL3Frame *frame = t.chan->recv(100);
+		if (!frame) continue;
+		bool more = dispatch(t,*frame);
+		delete frame;
+		if (!more) break;
+	}
+
+	// Let L2 answer the DISC before going quiet.
+	if (t.released && !t.linkDown) waitForPrimitive(t.chan,RELEASE,0,establishTimeout);
+	for (unsigned i=0; i<50 && !t.chan->txIdle(); i++) delete t.chan->recv(20);
+	t.chan->close();
+
+	// A paged transaction that never showed its purpose is not counted.
+	// MT-SMS failures are counted when the message expires.
+	if (t.known && t.procedure!=MSMTSMS) finish(t,false);
+}
+
+
+void MSHandset::finish(Transaction& t, bool ok)
+{
+	if (t.finished) return;
+	t.finished = true;
+	if (ok) mStats.success(t.procedure,t.start.elapsed());
+	else mStats.failure(t.procedure);
+}
+
+
+void MSHandset::writeIdentityLV(L3Frame& frame, size_t& wp, unsigned type) const
+{
+	// Mobile Identity, GSM 04.08 10.5.1.4.
+	mLock.lock();
+	bool haveTMSI = mHaveTMSI;
+	unsigned TMSI = mTMSI;
+	mLock.unlock();
+	if (type==TMSIType && haveTMSI) {
+		L3MobileIdentity(TMSI).writeLV(frame,wp);
+		return;
+	}
+	if (type!=IMEIType && type!=IMEISVType) {
+		L3MobileIdentity(mIMSI.c_str()).writeLV(frame,wp);
+		return;
+	}
+	// L3MobileIdentity only does IMSI and TMSI.
+	string digits = mIMEI;
+	if (type==IMEISVType) digits = mIMEI.substr(0,14) + "01";
+	size_t n = digits.size();
+	frame.writeField(wp,n/2+1,8);
+	frame.writeField(wp,digits[0]-'0',4);
+	frame.writeField(wp,((n%2)<<3) | type,4);
+	for (size_t i=1; i<n; i+=2) {
+		unsigned high = (i+1<n) ? digits[i+1]-'0' : 0x0f;
+		frame.writeField(wp,high,4);
+		frame.writeField(wp,digits[i]-'0',4);
+	}
+}
+
+
+void MSHandset::sendInitialMessage(Transaction& t)
+{
+	mLock.lock();
+	bool haveTMSI = mHaveTMSI;
+	bool attached = mAttached;
+	mLock.unlock();
+	unsigned identityType = haveTMSI ? TMSIType : IMSIType;
+
+	if (t.paged) {
+		// Paging Response, GSM 04.08 9.1.25, CKSN 7 means no key.
+		MSL3Writer msg(L3RadioResourcePD,0x27);
+		msg.writeByte(0x07);
+		msg.writeClassmark2();
+		writeIdentityLV(msg.frame(),msg.wp(),t.pagedByTMSI ? identityType : IMSIType);
+		t.chan->send(msg.result());
+		return;
+	}
+
+	switch (t.procedure) {
+		case MSLocationUpdate: {
+			// Location Updating Request, GSM 04.08 9.2.15.
+			// Normal updating once attached, IMSI attach before that.
+			MSL3Writer msg(L3MobilityManagementPD,0x08);
+			msg.writeByte(0x70 | (attached ? 0 : 2));
+			L3LocationAreaIdentity(mParams.MCC.c_str(),mParams.MNC.c_str(),mParams.LAC)
+				.writeV(msg.frame(),msg.wp());
+			msg.writeByte(0x33);
+			writeIdentityLV(msg.frame(),msg.wp(),identityType);
+			t.chan->send(msg.result());
+			return;
+		}
+		case MSMOSMS:
+		case MSMOCall: {
+			// CM Service Request, GSM 04.08 9.2.9.
+			MSL3Writer msg(L3MobilityManagementPD,0x24);
+			msg.writeByte(0x70 | (t.procedure==MSMOSMS ? 4 : 1));
+			msg.writeClassmark2();
+			writeIdentityLV(msg.frame(),msg.wp(),identityType);
+			t.chan->send(msg.result());
+			return;
+		}
+		default:
+			return;
+	}
+}
+
+
+bool MSHandset::dispatch(Transaction& t, const MSL3Frame& frame)
+{
+	switch (frame.primitive()) {
+		case DATA:
+			break;
+		case ESTABLISH:
+			// SAP3 is up for our MO SMS, GSM 04.11 2.3.
+			if (frame.SAPI()==3 && t.known && t.procedure==MSMOSMS && !t.SMSSent) {
+				t.TI = mNextTI++ % 7;
+				t.TIFlag = 0;
+				t.ref = mNextRef++ & 0x0ff;
+				MSL3Writer msg(TIHeader(0,t.TI,L3SMSPD),0x01);
+				size_t CPUD = msg.startLength();
+				// RP-DATA, GSM 04.11 7.3.1.2, no originator, empty SC address.
+				msg.writeByte(0x00);
+				msg.writeByte(t.ref);
+				msg.writeByte(0);
+				msg.writeByte(1);
+				msg.writeByte(0x91);
+				size_t RPUD = msg.startLength();
+				// SMS-SUBMIT, GSM 03.40 9.2.2.2, relative validity period.
+				msg.writeByte(0x11);
+				msg.writeByte(t.ref);
+				msg.writeByte(mParams.destination.size());
+				msg.writeByte(0x81);
+				msg.writeBCD(mParams.destination);
+				msg.writeByte(0x00);
+				msg.writeByte(0x00);
+				msg.writeByte(0xA7);
+				// 7-bit default alphabet, GSM 03.38 6.1.2.1.
+				static const char text[] = "msSimulator";
+				size_t len = strlen(text);
+				msg.writeByte(len);
+				unsigned acc = 0, bits = 0;
+				for (size_t i=0; i<len; i++) {
+					acc |= (text[i] & 0x7f) << bits;
+					bits += 7;
+					while (bits>=8) {
+						msg.writeByte(acc & 0x0ff);
+						acc >>= 8;
+						bits -= 8;
+					}
+				}
+				if (bits) msg.writeByte(acc);
+				msg.endLength(RPUD);
+				msg.endLength(CPUD);
+				t.chan->send(msg.result(),3);
+				t.SMSSent = true;
+			}
+			return true;
+		case RELEASE:
+		case ERROR:
+		case HARDRELEASE:
+			// Only the loss of SAP0 ends the transaction.
+			if (frame.SAPI()!=0) return true;
+			t.linkDown = true;
+			return false;
+		default:
+			return true;
+	}
+
+	if (frame.size()<16) return true;
+	switch (frame.PD()) {
+		case L3RadioResourcePD: return dispatchRR(t,frame);
+		case L3MobilityManagementPD: return dispatchMM(t,frame);
+		case L3CallControlPD: return dispatchCC(t,frame);
+		case L3SMSPD: return dispatchSMS(t,frame);
+		default: return true;
+	}
+}
+
+
+bool MSHandset::dispatchRR(Transaction& t, const MSL3Frame& frame)
+{
+	switch (frame.MTI()) {
+		case 0x0D:
+			// Channel Release
+			t.released = true;
+			return false;
+		case 0x2E: {
+			// Assignment Command, GSM 04.08 9.1.2.
+			unsigned typeAndOffset = frame.peekField(2*8,5);
+			unsigned TN = frame.peekField(2*8+5,3);
+			MSChannel *TCH = mRadio.channel(TN,typeAndOffset);
+			if (!TCH) return true;
+			// The core drops the old channel on its own after the assignment.
+			t.chan->close();
+			t.chan = TCH;
+			TCH->open(mRadio.TSC());
+			TCH->send(ESTABLISH);
+			if (!waitForPrimitive(TCH,ESTABLISH,0,establishTimeout)) {
+				t.linkDown = true;
+				return false;
+			}
+			// Assignment Complete, GSM 04.08 9.1.3, normal event.
+			MSL3Writer msg(L3RadioResourcePD,0x29);
+			msg.writeByte(0x00);
+			t.chan->send(msg.result());
+			if (t.answerPending) answer(t);
+			return true;
+		}
+		case 0x10: {
+			// Channel Mode Modify, GSM 04.08 9.1.5, answered in kind.
+			MSL3Writer msg(L3RadioResourcePD,0x17);
+			for (unsigned i=2; i<6 && i<frame.length(); i++) msg.writeByte(frame.peekField(8*i,8));
+			t.chan->send(msg.result());
+			if (t.answerPending) answer(t);
+			return true;
+		}
+		case 0x13: {
+			// Classmark Enquiry, answered with Classmark Change, GSM 04.08 9.1.11.
+			MSL3Writer msg(L3RadioResourcePD,0x16);
+			msg.writeClassmark2();
+			t.chan->send(msg.result());
+			return true;
+		}
+		default:
+			return true;
+	}
+}
+
+
+bool MSHandset::dispatchMM(Transaction& t, const MSL3Frame& frame)
+{
+	// The top bits of the MTI are the send sequence number.
+	switch (frame.MTI() & 0x3f) {
+		case 0x18: {
+			// Identity Request, GSM 04.08 9.2.10.
+			MSL3Writer msg(L3MobilityManagementPD,0x19);
+			writeIdentityLV(msg.frame(),msg.wp(),frame.peekField(2*8+5,3));
+			t.chan->send(msg.result());
+			return true;
+		}
+		case 0x02: {
+			// Location Updating Accept, GSM 04.08 9.2.13, maybe with a new TMSI.
+			size_t rp = 7*8;
+			L3MobileIdentity identity;
+			if (rp+8<frame.size() && identity.parseTLV(0x17,frame,rp) && identity.type()==TMSIType) {
+				mLock.lock();
+				mTMSI = identity.TMSI();
+				mHaveTMSI = true;
+				mLock.unlock();
+				mRadio.registerTMSI(identity.TMSI(),this);
+				// TMSI Reallocation Complete, GSM 04.08 9.2.18.
+				t.chan->send(MSL3Writer(L3MobilityManagementPD,0x1B).result());
+			}
+			mLock.lock();
+			mAttached = true;
+			mLock.unlock();
+			if (t.known && t.procedure==MSLocationUpdate) finish(t,true);
+			return true;
+		}
+		case 0x04:
+			// Location Updating Reject
+			if (t.known && t.procedure==MSLocationUpdate) finish(t,false);
+			return true;
+		case 0x21:
+			// CM Service Accept
+			if (t.known && t.procedure==MSMOSMS) {
+				t.chan->send(ESTABLISH,3);
+			} else if (t.known && t.procedure==MSMOCall) {
+				// Setup, GSM 04.08 9.3.23.2, full rate speech.
+				t.TI = mNextTI++ % 7;
+				t.TIFlag = 0;
+				MSL3Writer msg(TIHeader(0,t.TI,L3CallControlPD),0x05);
+				msg.writeByte(0x04);
+				msg.writeByte(1);
+				msg.writeByte(0xA0);
+				msg.writeByte(0x5E);
+				size_t called = msg.startLength();
+				msg.writeByte(0x81);
+				msg.writeBCD(mParams.destination);
+				msg.endLength(called);
+				t.chan->send(msg.result());
+			}
+			return true;
+		case 0x22:
+			// CM Service Reject
+			if (t.known) finish(t,false);
+			return true;
+		default:
+			return true;
+	}
+}
+
+
+void MSHandset::answer(Transaction& t)
+{
+	// Alerting and Connect, GSM 04.08 9.3.1.2 and 9.3.5.2.
+	t.answerPending = false;
+	t.chan->send(MSL3Writer(TIHeader(t.TIFlag,t.TI,L3CallControlPD),0x01).result());
+	t.chan->send(MSL3Writer(TIHeader(t.TIFlag,t.TI,L3CallControlPD),0x07).result());
+}
+
+
+bool MSHandset::dispatchCC(Transaction& t, const MSL3Frame& frame)
+{
+	switch (frame.MTI() & 0x3f) {
+		case 0x05:
+			// Setup for an MT call; confirm now, answer on the traffic channel.
+			if (!t.known) {
+				t.known = true;
+				t.procedure = MSMTCall;
+				mStats.attempt(MSMTCall);
+			}
+			t.TI = frame.TIValue();
+			t.TIFlag = 1;
+			t.chan->send(MSL3Writer(TIHeader(t.TIFlag,t.TI,L3CallControlPD),0x08).result());
+			t.answerPending = true;
+			return true;
+		case 0x07:
+			// Connect, answered with Connect Acknowledge.
+			t.chan->send(MSL3Writer(TIHeader(t.TIFlag,t.TI,L3CallControlPD),0x0F).result());
+			// fall through
+		case 0x0F:
+			// Connect Acknowledge
+			if (!t.connected) {
+				t.connected = true;
+				t.connectTime.now();
+				if (t.known) finish(t,true);
+			}
+			return true;
+		case 0x25:
+			// Disconnect, answered with Release.
+			t.chan->send(MSL3Writer(TIHeader(t.TIFlag,t.TI,L3CallControlPD),0x2D).result());
+			t.clearing = true;
+			if (t.known) finish(t,t.connected);
+			return true;
+		case 0x2D:
+			// Release, answered with Release Complete.
+			t.chan->send(MSL3Writer(TIHeader(t.TIFlag,t.TI,L3CallControlPD),0x2A).result());
+			t.clearing = true;
+			if (t.known) finish(t,t.connected);
+			return true;
+		default:
+			return true;
+	}
+}
+
+
+bool MSHandset::dispatchSMS(Transaction& t, const MSL3Frame& frame)
+{
+	// The reply goes back with the other TI flag, GSM 04.07 11.2.3.1.3.
+	unsigned TI = frame.TIValue();
+	unsigned TIFlag = !frame.TIFlag();
+	switch (frame.MTI()) {
+		case 0x01: {
+			// CP-DATA, acknowledged at the CP layer first, GSM 04.11 5.2.
+			t.chan->send(MSL3Writer(TIHeader(TIFlag,TI,L3SMSPD),0x04).result(),3);
+			if (frame.length()<5) return true;
+			unsigned RPMTI = frame.peekField(3*8,8) & 0x07;
+			unsigned ref = frame.peekField(4*8,8);
+			switch (RPMTI) {
+				case 0x01: {
+					// RP-DATA from the network, answered with RP-ACK.
+					MSL3Writer msg(TIHeader(TIFlag,TI,L3SMSPD),0x01);
+					msg.writeByte(2);
+					msg.writeByte(0x02);
+					msg.writeByte(ref);
+					t.chan->send(msg.result(),3);
+					// Charge the delivery to the oldest submission.
+					mLock.lock();
+					bool pending = mMTSMSPending.size()>0;
+					if (pending) {
+						t.start = mMTSMSPending.front();
+						mMTSMSPending.pop_front();
+					}
+					mLock.unlock();
+					t.known = true;
+					t.procedure = MSMTSMS;
+					if (pending) finish(t,true);
+					else t.finished = true;
+					return true;
+				}
+				case 0x03:
+					// RP-ACK for our MO SMS
+					if (t.known && t.procedure==MSMOSMS) finish(t,true);
+					return true;
+				case 0x05:
+					// RP-ERROR
+					if (t.known && t.procedure==MSMOSMS) finish(t,false);
+					return true;
+				default:
+					return true;
+			}
+		}
+		case 0x10:
+			// CP-ERROR
+			if (t.known && t.procedure==MSMOSMS) finish(t,false);
+			return true;
+		default:
+			return true;
+	}
+}
+
+
+// vim: ts=4 sw=4
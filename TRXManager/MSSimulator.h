@@ -0,0 +1,584 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef MSSIMULATOR_H
+#define MSSIMULATOR_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+
+#include <Threads.h>
+#include <Interthread.h>
+#include <Sockets.h>
+#include <BitVector.h>
+#include <Timeval.h>
+
+#include <GSMCommon.h>
+#include <GSMTransfer.h>
+#include <GSMTDMA.h>
+#include <GSMSAPMux.h>
+#include <GSML2LAPDm.h>
+#include <GSML3CommonElements.h>
+
+
+/*
+	The handset side of the air interface, for load testing the core.
+
+	MSRadio stands in for the transceiver on the TRX UDP interface.
+	Instead of discarding the downlink, it decodes the bursts for the
+	channels that handsets are using and answers with uplink bursts
+	coded the way a real handset would code them.  The core sees
+	RACH bursts, SABMs and I-frames exactly as it would from the radio.
+
+	Each MSHandset runs its procedures (location updating, SMS, calls)
+	in its own thread against an MSChannel, which is an MS-mode LAPDm
+	(C/R bit 0) on top of the handset-side L1 FEC.
+*/
+
+
+/** The procedures a simulated handset can run, for scheduling and statistics. */
+enum MSProcedure {
+	MSLocationUpdate,
+	MSMOSMS,
+	MSMTSMS,
+	MSMOCall,
+	MSMTCall,
+	MSNumProcedures
+};
+
+const char* MSProcedureName(MSProcedure);
+
+
+/** Throughput and latency counters for all of the handsets. */
+class MSStats {
+
+	private:
+
+	mutable Mutex mLock;
+	unsigned mAttempts[MSNumProcedures];
+	unsigned mSuccesses[MSNumProcedures];
+	unsigned mFailures[MSNumProcedures];
+	std::vector<long> mLatencies[MSNumProcedures];	///< in ms, one per success
+
+	unsigned mAccessBursts;			///< RACH bursts sent
+	unsigned mAssignments;			///< immediate assignments matched to a handset
+	unsigned mRejects;				///< immediate assignment rejects matched to a handset
+	unsigned mAccessTimeouts;		///< RACH bursts that got no answer
+	unsigned mPages;				///< paging requests for our handsets
+
+	public:
+
+	MSStats();
+
+	void attempt(MSProcedure);
+	void success(MSProcedure, long latencyMs);
+	void failure(MSProcedure);
+
+	void countAccessBurst();
+	void countAssignment();
+	void countReject();
+	void countAccessTimeout();
+	void countPage();
+
+	/** Print the counters and latency percentiles, given the test duration. */
+	void report(FILE*, double seconds) const;
+
+};
+
+
+
+/**
+	The XCCH block code of GSM 05.03 4.1, used by the handset on the
+	SDCCH, FACCH and (downlink only) the CCCH.
+	This is the same coding as XCCHL1Encoder/Decoder, seen from the other end.
+*/
+class MSBlockCoder {
+
+	private:
+
+	ViterbiR2O4 mVCoder;
+	Parity mBlockCoder;
+	BitVector mU;				///< u[], GSM 05.03 4.1.2
+	BitVector mP;				///< p[], alias into u[]
+	BitVector mDP;				///< d[]:p[], alias into u[]
+	BitVector mD;				///< d[], alias into u[]
+
+	public:
+
+	MSBlockCoder();
+
+	/** Encode a 184-bit L2 frame into c[456]. */
+	void encode(const BitVector& frame, BitVector& c);
+
+	/**
+		Decode c[456] into a 184-bit L2 frame.
+		@return true if the parity check passed.
+	*/
+	bool decode(const SoftVector& c, BitVector& frame);
+
+};
+
+
+/** Rectangular (depth 4) or diagonal (depth 8) interleaving, GSM 05.03 3.1.3 and 4.1.4. */
+void MSInterleave(const BitVector& c, BitVector* I, unsigned depth, unsigned offset);
+
+/** The inverse of MSInterleave, marking the consumed bits as unknown. */
+void MSDeinterleave(SoftVector* I, SoftVector& c, unsigned depth, unsigned offset);
+
+
+/** An L3 frame tagged with the SAP it came from. */
+class MSL3Frame : public GSM::L3Frame {
+
+	private:
+
+	unsigned mSAPI;
+
+	public:
+
+	MSL3Frame(const GSM::L3Frame& frame, unsigned wSAPI)
+		:GSM::L3Frame(static_cast<const BitVector&>(frame),frame.primitive()),mSAPI(wSAPI)
+	{ }
+
+	unsigned SAPI() const { return mSAPI; }
+
+};
+
+typedef InterthreadQueue<MSL3Frame> MSL3FrameFIFO;
+typedef InterthreadQueue<GSM::L2Frame> MSL2FrameFIFO;
+
+
+
+/**
+	A dedicated channel as seen from the handset.
+	The SAPMux sits between the MS-mode LAPDm entities and the handset L1.
+	Uplink L2 frames are queued here until the radio loop reaches
+	the channel's next uplink block.
+*/
+class MSChannel : public GSM::SAPMux {
+
+	public:
+
+	/** Arguments for a reader thread. */
+	struct Reader {
+		MSChannel *channel;
+		unsigned SAPI;
+	};
+
+	protected:
+
+	unsigned mTN;
+	const GSM::MappingPair& mMapping;
+	GSM::L2LAPDm* mL2[4];
+
+	MSL3FrameFIFO mL3Q;					///< L3 frames from every SAP, tagged
+	MSL2FrameFIFO mTxQ;					///< uplink L2 frames waiting for L1
+
+	Reader mReaders[4];
+	Thread mReaderThreads[4];
+
+	mutable Mutex mL1Lock;				///< guards the L1 state below
+	bool mOpen;
+	bool mStarted;						///< true once the reader threads are running
+	unsigned mTSC;
+	MSBlockCoder mCoder;
+	SoftVector mRxC;					///< downlink c[]
+	BitVector mRxD;						///< downlink d[]
+	BitVector mTxC;						///< uplink c[]
+
+	public:
+
+	MSChannel(unsigned wTN, const GSM::MappingPair& wMapping);
+
+	virtual ~MSChannel() {}
+
+	unsigned TN() const { return mTN; }
+
+	GSM::TypeAndOffset typeAndOffset() const
+		{ return mMapping.downlink().typeAndOffset(); }
+
+	/** Start a new transaction on the channel, with a given training sequence. */
+	void open(unsigned wTSC);
+
+	/** Drop the channel and stop transmitting. */
+	void close();
+
+	bool isOpen() const;
+
+	/** Return true if there is nothing left to transmit. */
+	virtual bool txIdle() const;
+
+	/**@name The handset's L3 interface. */
+	//@{
+	void send(const GSM::L3Frame& frame, unsigned SAPI=0)
+		{ assert(mL2[SAPI]); mL2[SAPI]->writeHighSide(frame); }
+
+	void send(GSM::Primitive prim, unsigned SAPI=0)
+		{ send(GSM::L3Frame(prim),SAPI); }
+
+	/** Read the next L3 frame or primitive, NULL on timeout.  Caller deletes. */
+	MSL3Frame* recv(unsigned timeout)
+		{ return mL3Q.read(timeout); }
+	//@}
+
+	/** The L2->L1 side; only DATA frames go on the air. */
+	void writeHighSide(const GSM::L2Frame& frame);
+
+	/**@name The radio loop's side. */
+	//@{
+	/** Accept a downlink burst, already known to be on this channel's TN. */
+	virtual void receiveBurst(uint32_t FN, const SoftVector& burst) =0;
+
+	/**
+		Fill in the uplink burst for this frame, if any.
+		@return true if the burst should be sent.
+	*/
+	virtual bool transmitBurst(uint32_t FN, GSM::TxBurst& burst) =0;
+	//@}
+
+	/** The reader thread body, moving L3 frames from one SAP into mL3Q. */
+	void readerLoop(unsigned SAPI);
+
+	protected:
+
+	/** Hook the L2 entities to this mux; called by the subclass constructor. */
+	void connect();
+
+	/** Reset the L1 state; called by open() with mL1Lock held. */
+	virtual void resetL1() =0;
+
+	/** Put training sequence and data bits into a normal burst. */
+	void mapBurst(const BitVector& I, GSM::TxBurst& burst) const;
+
+};
+
+
+/** SDCCH/4 or SDCCH/8, with SAP0 and SAP3. */
+class MSSDCCH : public MSChannel {
+
+	private:
+
+	SoftVector mRxI[4];
+	BitVector mTxI[4];
+	bool mTxBlock;						///< true while an uplink block is going out
+
+	public:
+
+	MSSDCCH(unsigned wTN, const GSM::MappingPair& wMapping);
+
+	void receiveBurst(uint32_t FN, const SoftVector& burst);
+
+	bool transmitBurst(uint32_t FN, GSM::TxBurst& burst);
+
+	bool txIdle() const;
+
+	protected:
+
+	void resetL1();
+
+};
+
+
+/**
+	TCH/F with FACCH.
+	While open, the uplink carries a silent speech frame whenever there
+	is no FACCH frame to send, so the core's T3109 keeps running.
+*/
+class MSTCHFACCH : public MSChannel {
+
+	private:
+
+	SoftVector mRxI[8];
+	BitVector mTxI[8];
+	bool mPreviousFACCH;
+	bool mCurrentFACCH;
+	bool mTxStarted;					///< true once the first uplink block is out
+
+	/** c[] for a silent GSM 06.10 frame, built once. */
+	static BitVector sSilenceC;
+
+	static void buildSilence();
+
+	public:
+
+	MSTCHFACCH(unsigned wTN, const GSM::MappingPair& wMapping);
+
+	void receiveBurst(uint32_t FN, const SoftVector& burst);
+
+	bool transmitBurst(uint32_t FN, GSM::TxBurst& burst);
+
+	protected:
+
+	void resetL1();
+
+};
+
+
+
+class MSHandset;
+
+
+/** The answer to an access attempt, passed from the radio loop to the handset. */
+struct MSAccessResult {
+	MSChannel *channel;		///< the assigned channel, or NULL
+	bool rejected;			///< true for an immediate assignment reject
+};
+
+
+/** The handset-side of the TRX interface for one ARFCN (C0). */
+class MSRadio {
+
+	private:
+
+	/** A RACH burst on its way to the core. */
+	struct AccessRequest {
+		MSHandset *handset;
+		unsigned RA;
+		uint32_t FN;			///< frame it was sent in
+	};
+
+	UDPSocket mClockSocket;
+	UDPSocket mControlSocket;
+	UDPSocket mDataSocket;
+
+	MSStats& mStats;
+
+	mutable Mutex mLock;				///< guards the access lists and the identity maps
+	std::list<AccessRequest> mAccessQueue;	///< waiting for a RACH slot
+	std::list<AccessRequest> mAccessSent;	///< waiting for an assignment
+	std::map<std::string,MSHandset*> mIMSIs;
+	std::map<unsigned,MSHandset*> mTMSIs;
+
+	bool mPoweredOn;
+	unsigned mTSC;
+	int mBSIC;							///< -1 until known
+	unsigned mCombination[8];
+	std::vector<MSChannel*> mChannels[8];	///< dedicated channels per TN
+
+	BitVector mCCCHFrame;
+	MSBlockCoder mCCCHCoder;
+	SoftVector mCCCHI[3][4];			///< one deinterleaver per C-V CCCH block
+	SoftVector mCCCHC;
+
+	ViterbiR2O4 mRACHCoder;
+	Parity mRACHParity;
+
+	unsigned long mDownlinkBursts;
+	unsigned long mUplinkBursts;
+	unsigned long mCommands;
+
+	public:
+
+	MSRadio(unsigned basePort, MSStats& wStats, int wBSIC=-1);
+
+	bool poweredOn() const { return mPoweredOn; }
+
+	unsigned TSC() const { return mTSC; }
+
+	/** The BSIC for RACH coding, NCC 0 and BCC=TSC unless given. */
+	unsigned BSIC() const { return mBSIC>=0 ? mBSIC : mTSC; }
+
+	unsigned long downlinkBursts() const { return mDownlinkBursts; }
+	unsigned long uplinkBursts() const { return mUplinkBursts; }
+	unsigned long commands() const { return mCommands; }
+
+	/**@name Handset interface, thread-safe. */
+	//@{
+	/** Queue a RACH burst; the result comes back through the handset. */
+	void requestAccess(MSHandset* handset, unsigned RA);
+
+	/** Find the channel for an assignment, NULL if it is not configured. */
+	MSChannel* channel(unsigned TN, unsigned typeAndOffset);
+
+	void registerIMSI(const std::string& IMSI, MSHandset* handset);
+	void registerTMSI(unsigned TMSI, MSHandset* handset);
+	//@}
+
+	/**@name Radio loop. */
+	//@{
+	void sendClock(uint32_t FN);
+
+	/**
+		Service the sockets until none has had traffic for quietUsec.
+		@return false if the wait was cut short by maxUsec.
+	*/
+	bool serviceSockets(uint32_t FN, long quietUsec, long maxUsec);
+
+	/** Send the uplink bursts for one frame and expire unanswered RACH bursts. */
+	void transmit(uint32_t FN);
+	//@}
+
+	private:
+
+	void handleCommand(char *buffer, int len, uint32_t FN);
+
+	void handleDownlink(const char *buffer, int len);
+
+	void receiveCCCH(uint32_t FN, const SoftVector& burst);
+
+	void handleCCCH(const BitVector& frame);
+
+	void handleAssignment(const GSM::L3Frame& frame);
+
+	void handleReject(const GSM::L3Frame& frame);
+
+	void handlePaging(const GSM::L3Frame& frame);
+
+	void page(const GSM::L3MobileIdentity& identity, unsigned channelNeeded);
+
+	/** Match a request reference against the sent RACH bursts, with mLock held. */
+	std::list<AccessRequest>::iterator findAccess(const GSM::L3Frame& frame, size_t rp);
+
+	void addChannels(unsigned TN, unsigned combination);
+
+	/** Fill in an access burst, GSM 05.03 4.6. */
+	void encodeRACH(unsigned RA, GSM::TxBurst& burst);
+
+	void sendBurst(unsigned TN, uint32_t FN, const GSM::TxBurst& burst);
+
+};
+
+
+
+/** A task for a handset's service thread. */
+struct MSTask {
+	MSProcedure procedure;
+	Timeval start;					///< latency is measured from here
+	bool paged;						///< answering a page, the procedure is found later
+	unsigned channelNeeded;			///< from the paging request, GSM 04.08 10.5.2.8
+	bool pagedByTMSI;
+};
+
+typedef InterthreadQueue<MSTask> MSTaskFIFO;
+
+
+/** Parameters shared by all of the handsets. */
+struct MSHandsetParams {
+	std::string MCC;
+	std::string MNC;
+	unsigned LAC;
+	std::string destination;		///< called number for MO calls and SMS
+	unsigned holdSeconds;			///< call duration once connected
+};
+
+
+/** One simulated mobile station. */
+class MSHandset {
+
+	private:
+
+	MSRadio& mRadio;
+	MSStats& mStats;
+	const MSHandsetParams& mParams;
+	std::string mIMSI;
+	std::string mIMEI;
+
+	mutable Mutex mLock;			///< guards the state visible to other threads
+	bool mBusy;
+	bool mAttached;
+	bool mHaveTMSI;
+	unsigned mTMSI;
+	std::list<Timeval> mMTSMSPending;	///< submit times of MT SMS not yet delivered
+	Timeval mPageHoldoff;			///< ignore repeated pages until this time
+
+	MSTaskFIFO mTasks;
+	InterthreadQueue<MSAccessResult> mAccessResults;
+	Thread mThread;
+
+	unsigned mNextTI;				///< transaction identifier for the next MO transaction
+	unsigned mNextRef;				///< RP message reference for the next MO SMS
+	unsigned mRandom;				///< state of the RA random reference generator
+
+	public:
+
+	MSHandset(MSRadio& wRadio, MSStats& wStats, const MSHandsetParams& wParams,
+		const std::string& wIMSI, const std::string& wIMEI);
+
+	void start();
+
+	const std::string& IMSI() const { return mIMSI; }
+
+	bool busy() const;
+
+	bool attached() const;
+
+	/** Queue a procedure; false if the handset is busy. */
+	bool startProcedure(MSProcedure procedure);
+
+	/** Count an MT SMS submitted to the core for this handset. */
+	void expectMTSMS();
+
+	/** Fail any MT SMS submitted more than timeout ms ago. */
+	void expireMTSMS(unsigned timeout);
+
+	/**@name Called from the radio loop. */
+	//@{
+	void accessResult(MSChannel* channel, bool rejected);
+	void paged(unsigned channelNeeded, bool byTMSI);
+	//@}
+
+	/** The service thread body. */
+	void serviceLoop();
+
+	private:
+
+	struct Transaction;
+
+	void run(const MSTask& task);
+
+	/** RACH until assigned, up to a few tries. */
+	MSChannel* access(unsigned RA);
+
+	/** Wait for a primitive on a SAP, discarding anything else. */
+	bool waitForPrimitive(MSChannel* chan, GSM::Primitive prim, unsigned SAPI, unsigned timeout);
+
+	/** Handle one downlink frame; false once the channel is released. */
+	bool dispatch(Transaction& t, const MSL3Frame& frame);
+	bool dispatchRR(Transaction& t, const MSL3Frame& frame);
+	bool dispatchMM(Transaction& t, const MSL3Frame& frame);
+	bool dispatchCC(Transaction& t, const MSL3Frame& frame);
+	bool dispatchSMS(Transaction& t, const MSL3Frame& frame);
+
+	/** Send the first message of the transaction on a new channel. */
+	void sendInitialMessage(Transaction& t);
+
+	/** Answer an MT call: Alerting then Connect. */
+	void answer(Transaction& t);
+
+	void finish(Transaction& t, bool ok);
+
+	void writeIdentityLV(GSM::L3Frame& frame, size_t& wp, unsigned type) const;
+
+	unsigned randomBits(unsigned bits);
+
+};
+
+
+#endif
+// vim: ts=4 sw=4
@@ -26,6 +26,8 @@
 
 #define NDEBUG
 
+#define LOG_MODULE L1
+
 #include "TRXManager.h"
 #include "GSMCommon.h"
 #include "GSMTransfer.h"
@@ -100,6 +102,11 @@ void TransceiverManager::clockHandler()
 		uint32_t FN;
 		sscanf(buffer,"IND CLOCK %u", &FN);
 		LOG(DEBUG) << "CLOCK indication, clock="<<FN;
+		// In simulated time, the clock indications are what moves time forward.
+		if (gSimulatedTime() && mHaveClock) {
+			int32_t delta = FNDelta(FN,gBTS.clock().FN());
+			if (delta>0) gAdvanceSimulatedTime(delta*gFrameMicroseconds);
+		}
 		gBTS.clock().set(FN);
 		mHaveClock = true;
 		return;
@@ -0,0 +1,290 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+	A stand-in for the transceiver that emulates a population of handsets.
+
+	Like simTransceiver, it answers the control interface and clocks
+	the core, but it also decodes the downlink and sends real uplink
+	bursts: RACH, then LAPDm on the assigned SDCCH or TCH/FACCH.
+	Each handset attaches with a location update, then runs procedures
+	drawn at the given cell-wide Poisson rates.  MT SMS are submitted
+	through the OpenBTS CLI on stdout, so pipe stdout into OpenBTS:
+
+		msSimulator -N 50 -s 0.5 -t 0.5 -n 100000 | OpenBTS
+
+	Calls need a SIP switch that routes the destination number; MT calls
+	are answered whenever the switch sends them.  Results go to stderr.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+
+#include <Timeval.h>
+#include <Configuration.h>
+
+#include "MSSimulator.h"
+
+
+/**
+	The core's configuration, for the cell identity.
+	The L3 elements also default from it.
+*/
+ConfigurationTable gConfig("OpenBTS.config");
+
+
+/** Length of the GSM hyperframe in frames, GSM 05.02 4.3.3. */
+static const uint32_t hyperframe = 2048UL*26UL*51UL;
+
+/** Duration of a GSM frame, in microseconds. */
+static const unsigned frameMicroseconds = 4615;
+
+/** Time allowed for an MT SMS to arrive, in ms. */
+static const unsigned MTSMSTimeout = 60000;
+
+
+static double secondsSince(const struct timeval& then)
+{
+	struct timeval now;
+	gettimeofday(&now,NULL);
+	return (now.tv_sec-then.tv_sec) + 1e-6*(now.tv_usec-then.tv_usec);
+}
+
+
+/** Return true with the probability of a Poisson event in one frame. */
+static bool arrival(double ratePerSecond)
+{
+	if (ratePerSecond<=0.0) return false;
+	return drand48() < ratePerSecond*frameMicroseconds*1e-6;
+}
+
+
+/** Pick a random handset for a procedure; NULL if it cannot run one now. */
+static MSHandset* pick(std::vector<MSHandset*>& handsets, bool needAttached)
+{
+	MSHandset *handset = handsets[lrand48() % handsets.size()];
+	if (handset->busy()) return NULL;
+	if (needAttached && !handset->attached()) return NULL;
+	return handset;
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,"usage: %s [options]\n",name);
+	fprintf(stderr,"  -p <port>    TRX base port (5700)\n");
+	fprintf(stderr,"  -N <n>       number of handsets (10)\n");
+	fprintf(stderr,"  -i <IMSI>    IMSI of the first handset, the others count up (001010000000001)\n");
+	fprintf(stderr,"  -L <m,n,lac> MCC, MNC and LAC of the cell (from OpenBTS.config, else 001,01,666)\n");
+	fprintf(stderr,"  -b <BSIC>    BSIC for RACH coding (from OpenBTS.config, else NCC 0 and BCC from SETTSC)\n");
+	fprintf(stderr,"  -n <frames>  stop after this many frames past power-on, then send \"exit\" (run forever)\n");
+	fprintf(stderr,"  -f           run in simulated time, moving on when the core goes quiet\n");
+	fprintf(stderr,"  -q <usec>    quiet time that ends a frame with -f (500)\n");
+	fprintf(stderr,"  -m <usec>    longest real time spent on one frame with -f (100000)\n");
+	fprintf(stderr,"  -A <sec>     spread of the initial IMSI attaches (10)\n");
+	fprintf(stderr,"  -l <rate>    location updates per second, cell-wide (0)\n");
+	fprintf(stderr,"  -s <rate>    MO SMS per second, cell-wide (0)\n");
+	fprintf(stderr,"  -t <rate>    MT SMS per second, cell-wide (0)\n");
+	fprintf(stderr,"  -c <rate>    MO calls per second, cell-wide (0)\n");
+	fprintf(stderr,"  -d <number>  called number for MO calls and SMS (2600)\n");
+	fprintf(stderr,"  -H <sec>     call hold time (10)\n");
+	exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+	unsigned basePort = 5700;
+	unsigned numHandsets = 10;
+	std::string firstIMSI = "001010000000001";
+	int BSIC = -1;
+	unsigned long maxFrames = 0;
+	bool fast = false;
+	long quietUsec = 500;
+	long maxFrameUsec = 100000;
+	double attachSpread = 10.0;
+	double rates[MSNumProcedures] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+
+	MSHandsetParams params;
+	params.MCC = "001";
+	params.MNC = "01";
+	params.LAC = 666;
+	if (gConfig.defines("GSM.MCC")) params.MCC = gConfig.getStr("GSM.MCC");
+	if (gConfig.defines("GSM.MNC")) params.MNC = gConfig.getStr("GSM.MNC");
+	if (gConfig.defines("GSM.LAC")) params.LAC = gConfig.getNum("GSM.LAC");
+	if (gConfig.defines("GSM.NCC") && gConfig.defines("GSM.BCC")) {
+		BSIC = ((gConfig.getNum("GSM.NCC") & 0x07) << 3) | (gConfig.getNum("GSM.BCC") & 0x07);
+	}
+	params.destination = "2600";
+	params.holdSeconds = 10;
+
+	int opt;
+	while ((opt=getopt(argc,argv,"p:N:i:L:b:n:fq:m:A:l:s:t:c:d:H:h"))!=-1) {
+		switch (opt) {
+			case 'p': basePort = atoi(optarg); break;
+			case 'N': numHandsets = atoi(optarg); break;
+			case 'i': firstIMSI = optarg; break;
+			case 'L': {
+				char MCC[4], MNC[4];
+				unsigned LAC;
+				if (sscanf(optarg,"%3[0-9],%3[0-9],%u",MCC,MNC,&LAC)!=3) usage(argv[0]);
+				params.MCC = MCC;
+				params.MNC = MNC;
+				params.LAC = LAC;
+				break;
+			}
+			case 'b': BSIC = atoi(optarg) & 0x03f; break;
+			case 'n': maxFrames = strtoul(optarg,NULL,10); break;
+			case 'f': fast = true; break;
+			case 'q': quietUsec = atol(optarg); break;
+			case 'm': maxFrameUsec = atol(optarg); break;
+			case 'A': attachSpread = atof(optarg); break;
+			case 'l': rates[MSLocationUpdate] = atof(optarg); break;
+			case 's': rates[MSMOSMS] = atof(optarg); break;
+			case 't': rates[MSMTSMS] = atof(optarg); break;
+			case 'c': rates[MSMOCall] = atof(optarg); break;
+			case 'd': params.destination = optarg; break;
+			case 'H': params.holdSeconds = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (numHandsets==0 || firstIMSI.size()<10 || firstIMSI.size()>15) usage(argv[0]);
+
+	// The handset threads must see the same clock as the radio loop.
+	if (fast) gEnableSimulatedTime();
+
+	MSStats stats;
+	MSRadio radio(basePort,stats,BSIC);
+
+	// IMSIs count up from the first; IMEIs are made up from the IMSI.
+	std::vector<MSHandset*> handsets;
+	std::vector<unsigned long> attachFrames;
+	unsigned long long IMSIBase = strtoull(firstIMSI.c_str(),NULL,10);
+	for (unsigned i=0; i<numHandsets; i++) {
+		char IMSI[16], IMEI[16];
+		sprintf(IMSI,"%0*llu",(int)firstIMSI.size(),IMSIBase+i);
+		sprintf(IMEI,"35%013llu",(IMSIBase+i) % 10000000000000ULL);
+		handsets.push_back(new MSHandset(radio,stats,params,IMSI,IMEI));
+		attachFrames.push_back((unsigned long)(drand48()*attachSpread*1e6/frameMicroseconds));
+	}
+	std::vector<bool> attachStarted(numHandsets,false);
+
+	uint32_t FN = 0;
+	unsigned long frames = 0;
+	unsigned long slowFrames = 0;
+	unsigned blocked[MSNumProcedures] = { 0, 0, 0, 0, 0 };
+	struct timeval startTime;
+	gettimeofday(&startTime,NULL);
+	bool wasOn = false;
+
+	while (true) {
+		if (radio.poweredOn() && !wasOn) {
+			fprintf(stderr,"power on at FN %u\n",FN);
+			gettimeofday(&startTime,NULL);
+			frames = 0;
+			wasOn = true;
+			for (unsigned i=0; i<handsets.size(); i++) handsets[i]->start();
+		}
+
+		if (wasOn) {
+			if (maxFrames && frames>=maxFrames) break;
+
+			// Initial attaches, retried until they get going.
+			for (unsigned i=0; i<handsets.size(); i++) {
+				if (attachStarted[i] || frames<attachFrames[i]) continue;
+				attachStarted[i] = handsets[i]->startProcedure(MSLocationUpdate);
+			}
+
+			// New procedures, one draw per procedure per frame.
+			for (int p=0; p<MSNumProcedures; p++) {
+				if (!arrival(rates[p])) continue;
+				MSHandset *handset = pick(handsets,p!=MSLocationUpdate);
+				if (!handset) {
+					blocked[p]++;
+					continue;
+				}
+				if (p==MSMTSMS) {
+					// The core pages the handset and delivers through its SMS path.
+					handset->expectMTSMS();
+					fprintf(stdout,"sendsms %s 1000\nmsSimulator %lu\n",handset->IMSI().c_str(),frames);
+					fflush(stdout);
+					continue;
+				}
+				handset->startProcedure((MSProcedure)p);
+			}
+
+			if (frames%217==0) {
+				for (unsigned i=0; i<handsets.size(); i++) handsets[i]->expireMTSMS(MTSMSTimeout);
+			}
+		}
+
+		radio.sendClock(FN);
+		radio.transmit(FN);
+
+		if (!wasOn) {
+			// Until the core is up, run in real time.
+			radio.serviceSockets(FN,frameMicroseconds,frameMicroseconds);
+		} else if (fast) {
+			if (!radio.serviceSockets(FN,quietUsec,maxFrameUsec)) slowFrames++;
+			gAdvanceSimulatedTime(frameMicroseconds);
+			frames++;
+		} else {
+			// Keep frames on absolute deadlines so that lateness does not add up.
+			frames++;
+			while (true) {
+				double due = frames * frameMicroseconds * 1e-6;
+				long ahead = (long)((due - secondsSince(startTime))*1e6);
+				if (ahead<=0) break;
+				radio.serviceSockets(FN,ahead,ahead);
+			}
+		}
+
+		FN = (FN+1) % hyperframe;
+	}
+
+	fprintf(stdout,"exit\n");
+	fflush(stdout);
+
+	double realSeconds = secondsSince(startTime);
+	double simSeconds = frames * frameMicroseconds * 1e-6;
+	fprintf(stderr,"frames %lu, simulated %.1f s, real %.1f s, speedup %.1f\n",
+		frames, simSeconds, realSeconds, realSeconds>0.0 ? simSeconds/realSeconds : 0.0);
+	fprintf(stderr,"downlink bursts %lu, uplink bursts %lu, commands %lu, frames cut short %lu\n",
+		radio.downlinkBursts(), radio.uplinkBursts(), radio.commands(), slowFrames);
+	fprintf(stderr,"blocked (handset busy or detached):");
+	for (int p=0; p<MSNumProcedures; p++) fprintf(stderr," %s %u",MSProcedureName((MSProcedure)p),blocked[p]);
+	fprintf(stderr,"\n");
+	stats.report(stderr,simSeconds);
+	return 0;
+}
+
+// vim: ts=4 sw=4
@@ -0,0 +1,352 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+/*
+	A stand-in for the transceiver that drives OpenBTS in simulated time.
+
+	It answers the control interface, swallows downlink bursts and sends
+	a CLOCK indication for every frame.  Once the core powers the radio on,
+	it moves to the next frame as soon as the core has gone quiet for a
+	while, so the core runs as fast as it can get its work done.
+	Run the core with Simulation.VirtualTime set and TRX.Path undefined.
+
+	A load script can be given; its commands are written to stdout at the
+	scheduled frames, so that piping stdout into OpenBTS drives its CLI:
+
+		simTransceiver -n 500000 load.script | OpenBTS
+
+	Each script line is
+		<frame> [x<count>/<period>] <CLI command>
+	where <frame> counts from power-on, an optional repeat issues the
+	command <count> times every <period> frames, "%n" in the command is
+	replaced by the repeat index and "\n" starts a new input line.
+	Lines starting with '#' are comments.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/select.h>
+
+#include <string>
+#include <vector>
+
+#include <Sockets.h>
+
+
+/** Length of the GSM hyperframe in frames, GSM 05.02 4.3.3. */
+static const uint32_t hyperframe = 2048UL*26UL*51UL;
+
+/** Duration of a GSM frame, in microseconds. */
+static const unsigned frameMicroseconds = 4615;
+
+
+/** One line of the load script. */
+struct ScriptEntry {
+	unsigned long frame;	///< first frame to issue the command
+	unsigned count;			///< number of times to issue it
+	unsigned period;		///< frames between issues
+	unsigned issued;		///< number issued so far
+	std::string command;
+};
+
+
+static std::vector<ScriptEntry> gScript;
+
+
+static bool loadScript(const char *path)
+{
+	FILE *fp = fopen(path,"r");
+	if (!fp) {
+		perror(path);
+		return false;
+	}
+	char line[1024];
+	unsigned lineNum = 0;
+	while (fgets(line,sizeof(line),fp)) {
+		lineNum++;
+		char *cp = line;
+		while (*cp==' ' || *cp=='\t') cp++;
+		if (*cp=='#' || *cp=='\n' || *cp=='\0') continue;
+		char *nl = strchr(cp,'\n');
+		if (nl) *nl = '\0';
+		ScriptEntry entry;
+		entry.count = 1;
+		entry.period = 1;
+		entry.issued = 0;
+		char *end;
+		entry.frame = strtoul(cp,&end,10);
+		if (end==cp) {
+			fprintf(stderr,"%s:%u: missing frame number\n",path,lineNum);
+			fclose(fp);
+			return false;
+		}
+		cp = end;
+		while (*cp==' ' || *cp=='\t') cp++;
+		if (*cp=='x') {
+			if (sscanf(cp,"x%u/%u",&entry.count,&entry.period)!=2 || entry.period==0) {
+				fprintf(stderr,"%s:%u: bad repeat\n",path,lineNum);
+				fclose(fp);
+				return false;
+			}
+			while (*cp && *cp!=' ' && *cp!='\t') cp++;
+			while (*cp==' ' || *cp=='\t') cp++;
+		}
+		// Expand "\n" now; "%n" is expanded when the command is issued.
+		for (const char *rp=cp; *rp; rp++) {
+			if (rp[0]=='\\' && rp[1]=='n') {
+				entry.command += '\n';
+				rp++;
+			} else {
+				entry.command += *rp;
+			}
+		}
+		gScript.push_back(entry);
+	}
+	fclose(fp);
+	return true;
+}
+
+
+/** Write any script commands that are due, return the number outstanding. */
+static unsigned runScript(unsigned long frame)
+{
+	unsigned outstanding = 0;
+	for (unsigned i=0; i<gScript.size(); i++) {
+		ScriptEntry &entry = gScript[i];
+		while (entry.issued<entry.count &&
+			entry.frame + (unsigned long)entry.issued*entry.period <= frame) {
+			char index[16];
+			sprintf(index,"%u",entry.issued);
+			std::string command = entry.command;
+			size_t pos;
+			while ((pos=command.find("%n"))!=std::string::npos) command.replace(pos,2,index);
+			fprintf(stdout,"%s\n",command.c_str());
+			entry.issued++;
+		}
+		outstanding += entry.count - entry.issued;
+	}
+	fflush(stdout);
+	return outstanding;
+}
+
+
+/** The transceiver side of one ARFCN interface. */
+struct ARFCNSockets {
+	UDPSocket *control;
+	UDPSocket *data;
+};
+
+
+static UDPSocket *gClockSocket;
+static std::vector<ARFCNSockets> gARFCNs;
+static bool gPoweredOn = false;
+static unsigned long gDownlinkBursts = 0;
+static unsigned long gCommands = 0;
+
+
+static void sendClock(uint32_t FN)
+{
+	char command[32];
+	sprintf(command,"IND CLOCK %u",FN);
+	gClockSocket->write(command,strlen(command)+1);
+}
+
+
+/** Answer a control command; every command succeeds. */
+static void handleCommand(UDPSocket *socket, char *buffer, int len, uint32_t FN)
+{
+	buffer[len] = '\0';
+	char cmdcheck[4];
+	char command[32];
+	if (sscanf(buffer,"%3s %31s",cmdcheck,command)!=2 || strcmp(cmdcheck,"CMD")!=0) {
+		fprintf(stderr,"bogus message on control interface: %s\n",buffer);
+		return;
+	}
+	gCommands++;
+	if (strcmp(command,"POWERON")==0) gPoweredOn = true;
+	if (strcmp(command,"POWEROFF")==0) gPoweredOn = false;
+	// Echo any parameters back, as the real transceiver does.
+	const char *params = buffer + 4 + strlen(command);
+	while (*params==' ') params++;
+	char response[MAX_UDP_LENGTH];
+	if (*params) snprintf(response,sizeof(response),"RSP %s 0 %s",command,params);
+	else snprintf(response,sizeof(response),"RSP %s 0",command);
+	socket->write(response,strlen(response)+1);
+	// The transceiver also refreshes the clock on every command.
+	sendClock(FN);
+}
+
+
+/**
+	Service the sockets until none has had traffic for quietUsec.
+	@return false if the wait was cut short by maxUsec.
+*/
+static bool serviceSockets(uint32_t FN, long quietUsec, long maxUsec)
+{
+	struct timeval start;
+	gettimeofday(&start,NULL);
+	while (true) {
+		fd_set fds;
+		FD_ZERO(&fds);
+		int maxFD = 0;
+		for (unsigned i=0; i<gARFCNs.size(); i++) {
+			FD_SET(gARFCNs[i].control->fd(),&fds);
+			FD_SET(gARFCNs[i].data->fd(),&fds);
+			if (gARFCNs[i].control->fd()>maxFD) maxFD = gARFCNs[i].control->fd();
+			if (gARFCNs[i].data->fd()>maxFD) maxFD = gARFCNs[i].data->fd();
+		}
+		struct timeval timeout;
+		timeout.tv_sec = quietUsec / 1000000;
+		timeout.tv_usec = quietUsec % 1000000;
+		int rc = select(maxFD+1,&fds,NULL,NULL,&timeout);
+		if (rc<=0) return true;
+		char buffer[MAX_UDP_LENGTH+1];
+		for (unsigned i=0; i<gARFCNs.size(); i++) {
+			if (FD_ISSET(gARFCNs[i].control->fd(),&fds)) {
+				int len = gARFCNs[i].control->read(buffer);
+				if (len>0) handleCommand(gARFCNs[i].control,buffer,len,FN);
+			}
+			if (FD_ISSET(gARFCNs[i].data->fd(),&fds)) {
+				if (gARFCNs[i].data->read(buffer)>0) gDownlinkBursts++;
+			}
+		}
+		struct timeval now;
+		gettimeofday(&now,NULL);
+		long elapsed = 1000000L*(now.tv_sec-start.tv_sec) + (now.tv_usec-start.tv_usec);
+		if (elapsed>=maxUsec) return false;
+	}
+}
+
+
+static double secondsSince(const struct timeval& then)
+{
+	struct timeval now;
+	gettimeofday(&now,NULL);
+	return (now.tv_sec-then.tv_sec) + 1e-6*(now.tv_usec-then.tv_usec);
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,"usage: %s [options] [script]\n",name);
+	fprintf(stderr,"  -p <port>    TRX base port (5700)\n");
+	fprintf(stderr,"  -a <n>       number of ARFCNs (1)\n");
+	fprintf(stderr,"  -n <frames>  stop after this many frames past power-on, then send \"exit\" (run forever)\n");
+	fprintf(stderr,"  -q <usec>    quiet time that ends a frame (500)\n");
+	fprintf(stderr,"  -m <usec>    longest real time spent on one frame (100000)\n");
+	fprintf(stderr,"  -s <factor>  run no faster than this multiple of real time (unlimited)\n");
+	exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+	unsigned basePort = 5700;
+	unsigned numARFCNs = 1;
+	unsigned long maxFrames = 0;
+	long quietUsec = 500;
+	long maxFrameUsec = 100000;
+	double speed = 0.0;
+
+	int opt;
+	while ((opt=getopt(argc,argv,"p:a:n:q:m:s:h"))!=-1) {
+		switch (opt) {
+			case 'p': basePort = atoi(optarg); break;
+			case 'a': numARFCNs = atoi(optarg); break;
+			case 'n': maxFrames = strtoul(optarg,NULL,10); break;
+			case 'q': quietUsec = atol(optarg); break;
+			case 'm': maxFrameUsec = atol(optarg); break;
+			case 's': speed = atof(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind<argc && !loadScript(argv[optind])) return 1;
+
+	// Same port plan as the real transceiver, see README.TRXManager.
+	gClockSocket = new UDPSocket(basePort,"127.0.0.1",basePort+100);
+	for (unsigned i=0; i<numARFCNs; i++) {
+		unsigned thisBasePort = basePort + 1 + 2*i;
+		ARFCNSockets sockets;
+		sockets.control = new UDPSocket(thisBasePort,"127.0.0.1",thisBasePort+100);
+		sockets.data = new UDPSocket(thisBasePort+1,"127.0.0.1",thisBasePort+101);
+		gARFCNs.push_back(sockets);
+	}
+
+	uint32_t FN = 0;
+	unsigned long frames = 0;
+	unsigned long slowFrames = 0;
+	struct timeval startTime;
+	gettimeofday(&startTime,NULL);
+	bool wasOn = false;
+
+	while (true) {
+		if (gPoweredOn && !wasOn) {
+			fprintf(stderr,"power on at FN %u\n",FN);
+			gettimeofday(&startTime,NULL);
+			frames = 0;
+			wasOn = true;
+		}
+
+		if (wasOn) {
+			runScript(frames);
+			if (maxFrames && frames>=maxFrames) break;
+		}
+
+		sendClock(FN);
+
+		if (!wasOn) {
+			// Until the core is up, run in real time.
+			serviceSockets(FN,frameMicroseconds,frameMicroseconds);
+		} else {
+			if (!serviceSockets(FN,quietUsec,maxFrameUsec)) slowFrames++;
+			if (speed>0.0) {
+				double due = frames * frameMicroseconds * 1e-6 / speed;
+				double ahead = due - secondsSince(startTime);
+				if (ahead>0.0) usleep((useconds_t)(ahead*1e6));
+			}
+			frames++;
+		}
+
+		FN = (FN+1) % hyperframe;
+	}
+
+	fprintf(stdout,"exit\n");
+	fflush(stdout);
+
+	double realSeconds = secondsSince(startTime);
+	double simSeconds = frames * frameMicroseconds * 1e-6;
+	fprintf(stderr,"frames %lu, simulated %.1f s, real %.1f s, speedup %.1f\n",
+		frames, simSeconds, realSeconds, realSeconds>0.0 ? simSeconds/realSeconds : 0.0);
+	fprintf(stderr,"downlink bursts %lu, commands %lu, frames cut short %lu\n",
+		gDownlinkBursts, gCommands, slowFrames);
+	return 0;
+}
+
+// vim: ts=4 sw=4
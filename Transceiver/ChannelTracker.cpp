@@ -0,0 +1,111 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#define LOG_MODULE Transceiver
+
+#include <math.h>
+
+#include "ChannelTracker.h"
+
+#include <Logger.h>
+
+
+using namespace std;
+
+
+ChannelTracker::ChannelTracker(int samplesPerSymbol, int Nf,
+			       float gain, float redesignThreshold,
+			       unsigned maxAge)
+  :mSamplesPerSymbol(samplesPerSymbol),mNf(Nf),
+   mGain(gain),mRedesignThreshold(redesignThreshold),mMaxAge(maxAge),
+   mValid(false),mOffset(0.0),mSNR(1.0),
+   mEstimate(6*samplesPerSymbol),mChannel(6*samplesPerSymbol),
+   mDesignChannel(6*samplesPerSymbol),mDesignSNR(1.0),
+   mDFEForward(Nf),mDFEFeedback(6*samplesPerSymbol-1),
+   mUpdates(0),mRedesigns(0)
+{
+  assert(Nf <= MAX_DFE_TAPS);
+  mEstimate.fill(0.0);
+  mChannel.fill(0.0);
+  mDesignChannel.fill(0.0);
+  mDFEForward.fill(0.0);
+  mDFEFeedback.fill(0.0);
+}
+
+
+bool ChannelTracker::stale(const GSM::Time& when) const
+{
+  if (!mValid) return true;
+  int age = when - mLastUpdate;
+  return (age < 0) || ((unsigned) age > mMaxAge);
+}
+
+
+bool ChannelTracker::redesign()
+{
+  if (!designDFE(mChannel,mSNR,mNf,mDFEForward,mDFEFeedback)) return false;
+  mChannel.copyTo(mDesignChannel);
+  mDesignSNR = mSNR;
+  mRedesigns++;
+  LOG(DEBUG) << "SNR: " << mSNR << ", DFE forward: " << mDFEForward << ", DFE backward: " << mDFEFeedback;
+  return true;
+}
+
+
+bool ChannelTracker::update(float offset, float SNR, const GSM::Time& when)
+{
+  mUpdates++;
+  mSNR = SNR;
+
+  // A new or moved channel starts over.
+  // A shift of the estimation window is a new delay profile, not a small change.
+  if (stale(when) || (offset != mOffset)) {
+    mEstimate.copyTo(mChannel);
+    mOffset = offset;
+    mLastUpdate = when;
+    mValid = redesign();
+    return mValid;
+  }
+  mLastUpdate = when;
+
+  // h = (1-g)h + g*e, and the distance from the design channel along the way.
+  signalVector::iterator h = mChannel.begin();
+  signalVector::const_iterator e = mEstimate.begin();
+  signalVector::const_iterator h0 = mDesignChannel.begin();
+  float change = 0.0;
+  float designEnergy = 0.0;
+  for (; h != mChannel.end(); h++, e++, h0++) {
+    *h = (*h)*(1.0F-mGain) + (*e)*mGain;
+    change += (*h - *h0).norm2();
+    designEnergy += h0->norm2();
+  }
+
+  // Also redesign if the SNR has moved by more than 3 dB,
+  // since it sets the noise term of the DFE.
+  bool SNRMoved = (mSNR > 2.0F*mDesignSNR) || (2.0F*mSNR < mDesignSNR);
+  if ((change <= mRedesignThreshold*designEnergy) && !SNRMoved) return false;
+  mValid = redesign();
+  return mValid;
+}
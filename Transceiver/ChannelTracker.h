@@ -0,0 +1,120 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef CHANNELTRACKER_H
+#define CHANNELTRACKER_H
+
+#include "sigProcLib.h"
+#include "GSMCommon.h"
+
+
+/**
+	Channel estimate and DFE of one timeslot, updated burst by burst.
+
+	Each detected normal burst contributes its midamble estimate to an
+	exponentially weighted average of the channel, which is the recursive
+	least-squares solution for a fixed training sequence with forgetting
+	factor 1-gain.  The DFE is only redesigned when the averaged channel or
+	the SNR has moved far enough from the ones it was designed for.
+	All of the storage is allocated once, in the constructor.
+*/
+class ChannelTracker {
+
+  private:
+
+  int mSamplesPerSymbol;
+  int mNf;			///< feedforward taps
+  float mGain;			///< weight of each new estimate, 1-forgetting factor
+  float mRedesignThreshold;	///< relative channel change that triggers a new DFE
+  unsigned mMaxAge;		///< frames without an update before the estimate is dropped
+
+  bool mValid;			///< true if mChannel and the DFE are usable
+  GSM::Time mLastUpdate;	///< time of the last burst folded in
+  float mOffset;		///< channel response offset, as from analyzeTrafficBurst
+  float mSNR;			///< latest SNR estimate, linear
+
+  signalVector mEstimate;	///< per-burst estimate, written by analyzeTrafficBurst
+  signalVector mChannel;	///< tracked channel
+  signalVector mDesignChannel;	///< channel that the current DFE was designed for
+  float mDesignSNR;		///< SNR that the current DFE was designed for
+  signalVector mDFEForward;
+  signalVector mDFEFeedback;
+
+  unsigned mUpdates;		///< bursts folded in
+  unsigned mRedesigns;		///< DFE designs
+
+  /** Design the DFE for the current channel. */
+  bool redesign();
+
+  public:
+
+  /**
+	Constructor.
+	@param samplesPerSymbol Samples per symbol of the receive path.
+	@param Nf Number of DFE feedforward taps.
+	@param gain Weight of each new burst in the channel average.
+	@param redesignThreshold Relative change, |h-h0|^2/|h0|^2, that triggers a new DFE.
+	@param maxAge Frames without a detected burst after which the estimate is dropped.
+  */
+  ChannelTracker(int samplesPerSymbol = 1, int Nf = 7,
+		 float gain = 0.125, float redesignThreshold = 0.05,
+		 unsigned maxAge = 50);
+
+  /** Forget the channel, e.g. when a new handset may be on the slot. */
+  void reset() { mValid = false; }
+
+  /** Return true if there is a channel estimate and DFE. */
+  bool valid() const { return mValid; }
+
+  /** True if a new burst at this time would start over rather than be averaged in. */
+  bool stale(const GSM::Time& when) const;
+
+  /** Storage for analyzeTrafficBurst to write a burst's estimate into. */
+  signalVector& estimate() { return mEstimate; }
+
+  /**
+	Fold estimate() into the tracked channel.
+	The estimate must already be normalized by the burst amplitude.
+	@param offset The channel response offset reported with the estimate.
+	@param SNR The current SNR estimate, linear.
+	@param when The time of the burst.
+	@return True if the DFE was redesigned.
+  */
+  bool update(float offset, float SNR, const GSM::Time& when);
+
+  /**@name The current equalizer, valid only if valid(). */
+  //@{
+  float offset() const { return mOffset; }
+  const signalVector& channel() const { return mChannel; }
+  signalVector& feedForward() { return mDFEForward; }
+  signalVector& feedback() { return mDFEFeedback; }
+  float SNR() const { return mSNR; }
+  //@}
+
+  unsigned updates() const { return mUpdates; }
+  unsigned redesigns() const { return mRedesigns; }
+
+};
+
+#endif
@@ -0,0 +1,391 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#define LOG_MODULE Transceiver
+
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "FileDevice.h"
+
+#include <Logger.h>
+
+
+using namespace std;
+
+
+/**@name Little-endian field access for the capture headers. */
+//@{
+
+static void putLE(unsigned char *dst, uint64_t val, unsigned bytes)
+{
+  for (unsigned i = 0; i < bytes; i++) {
+    dst[i] = val & 0x0ff;
+    val >>= 8;
+  }
+}
+
+static uint64_t getLE(const unsigned char *src, unsigned bytes)
+{
+  uint64_t val = 0;
+  for (int i = bytes-1; i >= 0; i--) val = (val << 8) | src[i];
+  return val;
+}
+
+//@}
+
+
+
+IQCaptureWriter::IQCaptureWriter()
+  :mFile(NULL),mBlockSamples(0),mBlock(NULL),mBlockFill(0),mBlockTimestamp(0)
+{ }
+
+
+bool IQCaptureWriter::open(const char *path, double sampleRate, unsigned blockSamples)
+{
+  close();
+  mFile = fopen(path,"w");
+  if (!mFile) {
+    LOG(ERROR) << "cannot create I/Q capture " << path;
+    return false;
+  }
+  unsigned char header[IQCaptureHeaderSize];
+  memset(header,0,IQCaptureHeaderSize);
+  memcpy(header,IQCaptureMagic,8);
+  putLE(header+8,(uint32_t) (sampleRate+0.5),4);
+  putLE(header+12,blockSamples,4);
+  if (fwrite(header,1,IQCaptureHeaderSize,mFile)!=IQCaptureHeaderSize) {
+    LOG(ERROR) << "cannot write I/Q capture header to " << path;
+    fclose(mFile);
+    mFile = NULL;
+    return false;
+  }
+  mBlockSamples = blockSamples;
+  mBlock = new short[IQCaptureBlockHeaderSize/sizeof(short) + 2*blockSamples];
+  mBlockFill = 0;
+  return true;
+}
+
+
+bool IQCaptureWriter::flushBlock()
+{
+  if (!mFile || (mBlockFill==0)) return true;
+  unsigned char *hdr = (unsigned char *) mBlock;
+  memset(hdr,0,IQCaptureBlockHeaderSize);
+  putLE(hdr,mBlockTimestamp,8);
+  putLE(hdr+8,mBlockFill,4);
+  short *samples = mBlock + IQCaptureBlockHeaderSize/sizeof(short);
+  memset(samples+2*mBlockFill,0,2*(mBlockSamples-mBlockFill)*sizeof(short));
+  size_t blockBytes = IQCaptureBlockHeaderSize + 2*mBlockSamples*sizeof(short);
+  mBlockFill = 0;
+  if (fwrite(mBlock,1,blockBytes,mFile)!=blockBytes) {
+    LOG(ERROR) << "I/Q capture write failed";
+    return false;
+  }
+  return true;
+}
+
+
+void IQCaptureWriter::close()
+{
+  if (!mFile) return;
+  flushBlock();
+  fclose(mFile);
+  mFile = NULL;
+  delete[] mBlock;
+  mBlock = NULL;
+}
+
+
+bool IQCaptureWriter::write(const short *buf, unsigned len, TIMESTAMP timestamp)
+{
+  if (!mFile) return false;
+  // A discontinuity starts a new block.
+  if (mBlockFill && (timestamp != mBlockTimestamp + mBlockFill)) {
+    if (!flushBlock()) return false;
+  }
+  short *samples = mBlock + IQCaptureBlockHeaderSize/sizeof(short);
+  while (len) {
+    if (mBlockFill==0) mBlockTimestamp = timestamp;
+    unsigned span = mBlockSamples - mBlockFill;
+    if (span > len) span = len;
+    memcpy(samples+2*mBlockFill,buf,2*span*sizeof(short));
+    mBlockFill += span;
+    buf += 2*span;
+    timestamp += span;
+    len -= span;
+    if (mBlockFill==mBlockSamples) {
+      if (!flushBlock()) return false;
+    }
+  }
+  return true;
+}
+
+
+
+IQCaptureReader::IQCaptureReader()
+  :mFD(-1),mMap(NULL),mMapSize(0),mBlockSamples(0),mBlockBytes(0),
+   mNumBlocks(0),mSampleRate(0.0),mLastBlock(0)
+{ }
+
+
+bool IQCaptureReader::open(const char *path)
+{
+  close();
+  mFD = ::open(path,O_RDONLY);
+  if (mFD<0) {
+    LOG(ERROR) << "cannot open I/Q capture " << path;
+    return false;
+  }
+  struct stat st;
+  if ((fstat(mFD,&st)!=0) || ((size_t)st.st_size < IQCaptureHeaderSize)) {
+    LOG(ERROR) << "I/Q capture " << path << " is too short";
+    close();
+    return false;
+  }
+  mMapSize = st.st_size;
+  void *map = mmap(NULL,mMapSize,PROT_READ,MAP_SHARED,mFD,0);
+  if (map==MAP_FAILED) {
+    LOG(ERROR) << "cannot map I/Q capture " << path;
+    mMap = NULL;
+    close();
+    return false;
+  }
+  mMap = (const unsigned char *) map;
+  if (memcmp(mMap,IQCaptureMagic,8)!=0) {
+    LOG(ERROR) << path << " is not an I/Q capture";
+    close();
+    return false;
+  }
+  mSampleRate = getLE(mMap+8,4);
+  mBlockSamples = getLE(mMap+12,4);
+  if (mBlockSamples==0) {
+    LOG(ERROR) << "I/Q capture " << path << " has a bad block size";
+    close();
+    return false;
+  }
+  mBlockBytes = IQCaptureBlockHeaderSize + 2*mBlockSamples*sizeof(short);
+  mNumBlocks = (mMapSize - IQCaptureHeaderSize) / mBlockBytes;
+  mLastBlock = 0;
+  // We read the capture sequentially.
+  madvise((void *) mMap,mMapSize,MADV_SEQUENTIAL);
+  LOG(INFO) << "I/Q capture " << path << ": " << mNumBlocks << " blocks of "
+	    << mBlockSamples << " samples at " << mSampleRate << " Hz";
+  return true;
+}
+
+
+void IQCaptureReader::close()
+{
+  if (mMap) munmap((void *) mMap,mMapSize);
+  mMap = NULL;
+  mMapSize = 0;
+  mNumBlocks = 0;
+  if (mFD>=0) ::close(mFD);
+  mFD = -1;
+}
+
+
+TIMESTAMP IQCaptureReader::blockTimestamp(size_t index) const
+{
+  return getLE(block(index),8);
+}
+
+
+unsigned IQCaptureReader::blockLength(size_t index) const
+{
+  unsigned len = getLE(block(index)+8,4);
+  return (len > mBlockSamples) ? mBlockSamples : len;
+}
+
+
+TIMESTAMP IQCaptureReader::endTimestamp() const
+{
+  if (mNumBlocks==0) return 0;
+  return blockTimestamp(mNumBlocks-1) + blockLength(mNumBlocks-1);
+}
+
+
+size_t IQCaptureReader::findBlock(TIMESTAMP timestamp)
+{
+  if (mNumBlocks==0) return mNumBlocks;
+  // Fast path for sequential reads: the same or the next block.
+  for (size_t i = mLastBlock; (i < mLastBlock+2) && (i < mNumBlocks); i++) {
+    if ((blockTimestamp(i) <= timestamp) &&
+        ((i+1==mNumBlocks) || (blockTimestamp(i+1) > timestamp))) {
+      mLastBlock = i;
+      return i;
+    }
+  }
+  if (timestamp < blockTimestamp(0)) return mNumBlocks;
+  // Binary search for the last block starting at or before timestamp.
+  size_t lo = 0;
+  size_t hi = mNumBlocks;
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (blockTimestamp(mid) <= timestamp) lo = mid;
+    else hi = mid;
+  }
+  mLastBlock = lo;
+  return lo;
+}
+
+
+unsigned IQCaptureReader::read(short *buf, unsigned len, TIMESTAMP timestamp)
+{
+  unsigned copied = 0;
+  while (len) {
+    size_t index = findBlock(timestamp);
+    unsigned span = len;
+    if (index==mNumBlocks) {
+      // Before the first block.
+      if (mNumBlocks && (blockTimestamp(0) - timestamp < span))
+        span = blockTimestamp(0) - timestamp;
+      memset(buf,0,2*span*sizeof(short));
+    }
+    else {
+      TIMESTAMP start = blockTimestamp(index);
+      unsigned valid = blockLength(index);
+      if (timestamp < start + valid) {
+        unsigned offset = timestamp - start;
+        if (valid - offset < span) span = valid - offset;
+        const unsigned char *src = block(index) + IQCaptureBlockHeaderSize + 2*offset*sizeof(short);
+        memcpy(buf,src,2*span*sizeof(short));
+        copied += span;
+      }
+      else {
+        // In a gap or past the end.
+        if ((index+1 < mNumBlocks) && (blockTimestamp(index+1) - timestamp < span))
+          span = blockTimestamp(index+1) - timestamp;
+        memset(buf,0,2*span*sizeof(short));
+      }
+    }
+    buf += 2*span;
+    timestamp += span;
+    len -= span;
+  }
+  return copied;
+}
+
+
+
+FileDevice::FileDevice(double sampleRate, const char *rxPath, const char *txPath,
+		       bool realTime)
+  :mSampleRate(sampleRate),mRealTime(realTime),
+   mStarted(false),mFirstRead(true),mFirstReadTimestamp(0),mEndReported(false),
+   samplesRead(0),samplesWritten(0)
+{
+  if (rxPath) mRxPath = rxPath;
+  if (txPath) mTxPath = txPath;
+  LOG(INFO) << "creating file device, RX " << mRxPath << ", TX " << mTxPath
+	    << (mRealTime ? ", real time" : ", free running");
+}
+
+
+bool FileDevice::make()
+{
+  if (mRxPath.size()) {
+    if (!mReader.open(mRxPath.c_str())) return false;
+    if (fabs(mReader.sampleRate() - mSampleRate) > 1.0) {
+      LOG(ERROR) << "I/Q capture sample rate " << mReader.sampleRate()
+		 << " does not match device sample rate " << mSampleRate;
+      return false;
+    }
+  }
+  if (mTxPath.size()) {
+    if (!mWriter.open(mTxPath.c_str(),mSampleRate)) return false;
+  }
+  return true;
+}
+
+
+bool FileDevice::start()
+{
+  LOG(INFO) << "starting file device";
+  mStarted = true;
+  mFirstRead = true;
+  return true;
+}
+
+
+bool FileDevice::stop()
+{
+  mStarted = false;
+  mWriter.close();
+  return true;
+}
+
+
+int FileDevice::readSamples(short *buf, int len, bool *overrun,
+			    TIMESTAMP timestamp,
+			    bool *underrun,
+			    unsigned *RSSI)
+{
+  if (overrun) *overrun = false;
+  if (underrun) *underrun = false;
+  if (RSSI) *RSSI = 0;
+
+  // The first read is aligned with the start of the capture.
+  if (mFirstRead) {
+    mFirstRead = false;
+    mFirstReadTimestamp = timestamp;
+    gettimeofday(&mStartTime,NULL);
+  }
+
+  if (mRealTime) {
+    // Wait until the last requested sample would have arrived over the air.
+    double sampleTime = (timestamp + len - mFirstReadTimestamp)/mSampleRate;
+    struct timeval now;
+    gettimeofday(&now,NULL);
+    double elapsed = (now.tv_sec - mStartTime.tv_sec) + 1.0e-6*(now.tv_usec - mStartTime.tv_usec);
+    if (sampleTime > elapsed) usleep((useconds_t) (1.0e6*(sampleTime - elapsed)));
+  }
+
+  TIMESTAMP captureTime = timestamp - mFirstReadTimestamp + mReader.firstTimestamp();
+  unsigned copied = mReader.read(buf,len,captureTime);
+  if ((copied < (unsigned) len) && (captureTime + len > mReader.endTimestamp()) && !mEndReported) {
+    LOG(NOTICE) << "end of I/Q capture " << mRxPath << ", receiving zeros";
+    mEndReported = true;
+  }
+
+  samplesRead += len;
+  return len;
+}
+
+
+int FileDevice::writeSamples(short *buf, int len, bool *underrun,
+			     TIMESTAMP timestamp,
+			     bool isControl)
+{
+  if (underrun) *underrun = false;
+  if (isControl) return len;
+  if (mTxPath.size()) mWriter.write(buf,len,timestamp);
+  samplesWritten += len;
+  return len;
+}
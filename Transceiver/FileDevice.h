@@ -0,0 +1,218 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef FILEDEVICE_H
+#define FILEDEVICE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <string>
+
+#include "radioDevice.h"
+
+
+/**@name I/Q capture file format.
+
+	All fields are little-endian.
+
+	File header, 32 bytes:
+		char     magic[8]		"OBTSIQ" 0x00 0x01
+		uint32   sampleRate		in Hz, rounded
+		uint32   blockSamples	samples per block, fixed for the file
+		uint64   reserved[2]
+
+	Followed by blocks of 16 + 4*blockSamples bytes each:
+		uint64   timestamp		timestamp of the first sample
+		uint32   numSamples		number of valid samples, <= blockSamples
+		uint32   reserved
+		int16    I/Q pairs [2*blockSamples]
+
+	Block timestamps strictly increase, but need not be contiguous.
+	Since all blocks have the same size, a timestamp is found with
+	a binary search over the block index.
+*/
+//@{
+
+static const char IQCaptureMagic[8] = { 'O','B','T','S','I','Q',0x00,0x01 };
+static const unsigned IQCaptureHeaderSize = 32;
+static const unsigned IQCaptureBlockHeaderSize = 16;
+static const unsigned IQCaptureDefaultBlockSamples = 4096;
+
+//@}
+
+
+/** Writes a stream of timestamped samples into a capture file. */
+class IQCaptureWriter {
+
+  private:
+
+  FILE *mFile;
+  unsigned mBlockSamples;
+  short *mBlock;		///< current block, header and samples
+  unsigned mBlockFill;		///< number of samples in the current block
+  TIMESTAMP mBlockTimestamp;	///< timestamp of the first sample of the current block
+
+  /** Write the current block out, padding unused samples with zeros. */
+  bool flushBlock();
+
+  public:
+
+  IQCaptureWriter();
+
+  ~IQCaptureWriter() { close(); }
+
+  /** Create the file and write the header */
+  bool open(const char *path, double sampleRate,
+	    unsigned blockSamples = IQCaptureDefaultBlockSamples);
+
+  /** Flush the current block and close the file */
+  void close();
+
+  /** Append samples; a timestamp discontinuity starts a new block */
+  bool write(const short *buf, unsigned len, TIMESTAMP timestamp);
+
+};
+
+
+/** Random access reader of a memory-mapped capture file. */
+class IQCaptureReader {
+
+  private:
+
+  int mFD;
+  const unsigned char *mMap;
+  size_t mMapSize;
+  unsigned mBlockSamples;
+  size_t mBlockBytes;
+  size_t mNumBlocks;
+  double mSampleRate;
+  size_t mLastBlock;		///< block index of the previous lookup, for sequential reads
+
+  const unsigned char *block(size_t index) const
+    { return mMap + IQCaptureHeaderSize + index*mBlockBytes; }
+
+  TIMESTAMP blockTimestamp(size_t index) const;
+
+  unsigned blockLength(size_t index) const;
+
+  /** Return the last block starting at or before timestamp, or mNumBlocks if none. */
+  size_t findBlock(TIMESTAMP timestamp);
+
+  public:
+
+  IQCaptureReader();
+
+  ~IQCaptureReader() { close(); }
+
+  /** Map a capture file and check its header */
+  bool open(const char *path);
+
+  void close();
+
+  double sampleRate() const { return mSampleRate; }
+
+  /** Timestamp of the first sample in the capture */
+  TIMESTAMP firstTimestamp() const { return mNumBlocks ? blockTimestamp(0) : 0; }
+
+  /** Timestamp after the last sample in the capture */
+  TIMESTAMP endTimestamp() const;
+
+  /**
+	Copy samples starting at a timestamp.
+	Gaps in the capture and samples past its end are returned as zeros.
+	@return The number of samples that came from the capture.
+  */
+  unsigned read(short *buf, unsigned len, TIMESTAMP timestamp);
+
+};
+
+
+/**
+	A RadioDevice that receives from a capture file and transmits into another.
+	This lets the transceiver run without a radio, in real time or as fast as
+	the CPU allows.
+*/
+class FileDevice: public RadioDevice {
+
+  private:
+
+  std::string mRxPath;		///< capture file replayed on receive, may be empty
+  std::string mTxPath;		///< capture file recording transmit, may be empty
+  double mSampleRate;
+  bool mRealTime;		///< if true, reads are paced to the sample rate
+
+  IQCaptureReader mReader;
+  IQCaptureWriter mWriter;
+
+  bool mStarted;
+  bool mFirstRead;
+  TIMESTAMP mFirstReadTimestamp;	///< read timestamp that maps to the start of the capture
+  struct timeval mStartTime;		///< wall clock time of the first read
+  bool mEndReported;
+
+  unsigned long long samplesRead;
+  unsigned long long samplesWritten;
+
+  public:
+
+  /**
+	Object constructor.
+	@param sampleRate The sample rate, must match that of the RX capture.
+	@param rxPath The capture to replay, or NULL to receive zeros.
+	@param txPath The file to record transmitted samples, or NULL.
+	@param realTime If false, run as fast as the reader allows.
+  */
+  FileDevice(double sampleRate, const char *rxPath, const char *txPath,
+	     bool realTime = true);
+
+  /** Open the capture files */
+  bool make();
+
+  bool start();
+
+  bool stop();
+
+  int  readSamples(short *buf, int len, bool *overrun,
+		   TIMESTAMP timestamp = 0xffffffff,
+		   bool *underrun = NULL,
+		   unsigned *RSSI = NULL);
+
+  int  writeSamples(short *buf, int len, bool *underrun,
+		    TIMESTAMP timestamp = 0xffffffff,
+		    bool isControl = false);
+
+  bool updateAlignment(TIMESTAMP timestamp) { return true; }
+
+  bool setTxFreq(double wFreq) { return true; }
+
+  bool setRxFreq(double wFreq) { return true; }
+
+  double getSampleRate() { return mSampleRate; }
+  double numberRead() { return samplesRead; }
+  double numberWritten() { return samplesWritten; }
+
+};
+
+#endif
@@ -29,6 +29,8 @@
 */
 
 
+#define LOG_MODULE Transceiver
+
 #include <stdio.h>
 #include <cstdio>
 
@@ -75,10 +77,7 @@ Transceiver::Transceiver(int wBasePort,
     }
     delete modBurst;
     mChanType[i] = NONE;
-    channelResponse[i] = NULL;
-    DFEForward[i] = NULL;
-    DFEFeedback[i] = NULL;
-    channelEstimateTime[i] = startTime;
+    mChannelTracker[i] = new ChannelTracker(mSamplesPerSymbol);
   }
 
   mOn = false;
@@ -92,6 +91,7 @@ Transceiver::Transceiver(int wBasePort,
 Transceiver::~Transceiver()
 {
   delete gsmPulse;
+  for (int i = 0; i < 8; i++) delete mChannelTracker[i];
   sigProcLibDestroy();
   mTransmitPriorityQueue.clear();
 }
@@ -311,50 +311,33 @@ SoftVector *Transceiver::pullRadioVector(GSM::Time &wTime,
   bool success = false;
   if (corrType==TSC) {
     LOG(DEEPDEBUG) << "looking for TSC at time: " << rxBurst->time();
-    signalVector *channelResp;
-    double framesElapsed = rxBurst->time()-channelEstimateTime[timeslot];
-    bool estimateChannel = false;
-    if ((framesElapsed > 50) || (channelResponse[timeslot]==NULL)) {
-	if (channelResponse[timeslot]) delete channelResponse[timeslot];
-        if (DFEForward[timeslot]) delete DFEForward[timeslot];
-        if (DFEFeedback[timeslot]) delete DFEFeedback[timeslot];
-        channelResponse[timeslot] = NULL;
-        DFEForward[timeslot] = NULL;
-        DFEFeedback[timeslot] = NULL;
-	estimateChannel = true;
-    }
+    // The channel is tracked burst by burst; see ChannelTracker.
+    ChannelTracker &tracker = *mChannelTracker[timeslot];
     float chanOffset;
     success = analyzeTrafficBurst(*vectorBurst,
 				  mTSC,
 				  3.0,
 				  mSamplesPerSymbol,
 				  &amplitude,
-				  &TOA, //);
-				  estimateChannel,
-				  &channelResp,
+				  &TOA,
+				  &tracker.estimate(),
 				  &chanOffset);
     if (success) {
       LOG(DEBUG) << "FOUND TSC!!!!!! " << amplitude << " " << TOA;
       mEnergyThreshold -= 1.0F;
       if (mEnergyThreshold < 0.0) mEnergyThreshold = 0.0;
       SNRestimate[timeslot] = amplitude.norm2()/(mEnergyThreshold*mEnergyThreshold+1.0); // this is not highly accurate
-      if (estimateChannel) {
-         LOG(DEBUG) << "estimating channel...";
-         channelResponse[timeslot] = channelResp;
-       	 chanRespOffset[timeslot] = chanOffset;
-         chanRespAmplitude[timeslot] = amplitude;
-	 scaleVector(*channelResp, complex(1.0,0.0)/amplitude);
-         designDFE(*channelResp, SNRestimate[timeslot], 7, &DFEForward[timeslot], &DFEFeedback[timeslot]);
-         channelEstimateTime[timeslot] = rxBurst->time();  
-         LOG(DEBUG) << "SNR: " << SNRestimate[timeslot] << ", DFE forward: " << *DFEForward[timeslot] << ", DFE backward: " << *DFEFeedback[timeslot];
-      }
+      scaleVector(tracker.estimate(), complex(1.0,0.0)/amplitude);
+      tracker.update(chanOffset,SNRestimate[timeslot],rxBurst->time());
+      // without a DFE there is nothing to equalize with
+      success = tracker.valid();
     }
     else {
+      // A false detection says nothing about the channel, so keep tracking it.
       double framesElapsed = rxBurst->time()-prevFalseDetectionTime; 
       LOG(DEEPDEBUG) << "wTime: " << rxBurst->time() << ", pTime: " << prevFalseDetectionTime << ", fElapsed: " << framesElapsed;
       mEnergyThreshold += 10.0F*exp(-framesElapsed);
       prevFalseDetectionTime = rxBurst->time();
-      channelResponse[timeslot] = NULL;
     }
   }
   else {
@@ -368,7 +351,7 @@ SoftVector *Transceiver::pullRadioVector(GSM::Time &wTime,
       LOG(DEBUG) << "FOUND RACH!!!!!! " << amplitude << " " << TOA;
       mEnergyThreshold -= 1.0F;
       if (mEnergyThreshold < 0.0) mEnergyThreshold = 0.0;
-      channelResponse[timeslot] = NULL; 
+      mChannelTracker[timeslot]->reset();
     }
     else {
       double framesElapsed = rxBurst->time()-prevFalseDetectionTime;
@@ -389,11 +372,12 @@ SoftVector *Transceiver::pullRadioVector(GSM::Time &wTime,
     }
     else { // TSC
       scaleVector(*vectorBurst,complex(1.0,0.0)/amplitude);
+      ChannelTracker &tracker = *mChannelTracker[timeslot];
       burst = equalizeBurst(*vectorBurst,
-			    TOA-chanRespOffset[timeslot],
+			    TOA-tracker.offset(),
 			    mSamplesPerSymbol,
-			    *DFEForward[timeslot],
-			    *DFEFeedback[timeslot]);
+			    tracker.feedForward(),
+			    tracker.feedback());
     }
     wTime = rxBurst->time();
     // FIXME:  what is full scale for the USRP?  we get more that 12 bits of resolution...
@@ -631,7 +615,7 @@ bool Transceiver::driveTransmitPriorityQueue()
   
   addRadioVector(newBurst,RSSI,currTime);
   
-  LOG(DEEPDEBUG) "added burst - time: " << currTime << ", RSSI: " << RSSI; // << ", data: " << newBurst; 
+  LOG(DEEPDEBUG) << "added burst - time: " << currTime << ", RSSI: " << RSSI; // << ", data: " << newBurst; 
 
   return true;
 
@@ -30,6 +30,7 @@
 */
 
 #include "radioInterface.h"
+#include "ChannelTracker.h"
 #include "Interthread.h"
 #include "GSMCommon.h"
 #include "Sockets.h"
@@ -134,13 +135,8 @@ private:
   int fillerModulus[8];                ///< modulus values of all timeslots, in frames
   signalVector *fillerTable[102][8];   ///< table of modulated filler waveforms for all timeslots
 
-  GSM::Time    channelEstimateTime[8]; ///< last timestamp of each timeslot's channel estimate
-  signalVector *channelResponse[8];    ///< most recent channel estimate of all timeslots
+  ChannelTracker *mChannelTracker[8]; ///< channel estimate and DFE of all timeslots
   float        SNRestimate[8];         ///< most recent SNR estimate of all timeslots
-  signalVector *DFEForward[8];         ///< most recent DFE feedforward filter of all timeslots
-  signalVector *DFEFeedback[8];        ///< most recent DFE feedback filter of all timeslots
-  float        chanRespOffset[8];      ///< most recent timing offset, e.g. TOA, of all timeslots
-  complex      chanRespAmplitude[8];   ///< most recent channel amplitude of all timeslots
 
 public:
 
@@ -30,6 +30,8 @@
 */ 
 
 
+#define LOG_MODULE Transceiver
+
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
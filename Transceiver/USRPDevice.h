@@ -31,6 +31,7 @@
 #include "usrp_standard.h"
 #include "usrp_bytesex.h"
 #include "usrp_prims.h"
+#include "radioDevice.h"
 #include <sys/time.h>
 #include <math.h>
 #include <string>
@@ -44,11 +45,8 @@ typedef boost::shared_ptr<usrp_standard_tx> usrp_standard_tx_sptr;
 typedef boost::shared_ptr<usrp_standard_rx> usrp_standard_rx_sptr;
 #endif // HAVE_LIBUSRP_3_2
 
-/** a 64-bit virtual timestamp for USRP data */
-typedef unsigned long long TIMESTAMP;
-
 /** A class to handle a USRP rev 4, with a two RFX900 daughterboards */
-class USRPDevice {
+class USRPDevice: public RadioDevice {
 
 private:
 
@@ -215,6 +213,11 @@ private:
   /** Set the receiver frequency */
   bool setRxFreq(double wFreq);
 
+  /** The USRP delivers Q before I, except in software loopback */
+#ifndef SWLOOPBACK
+  bool swapIQ() const { return true; }
+#endif
+
   /** Return internal status values */
   inline double getTxFreq() { return 0;}
   inline double getRxFreq() { return 0;}
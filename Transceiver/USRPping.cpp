@@ -24,7 +24,10 @@
 
 
 
+#define LOG_MODULE Transceiver
+
 #include "Transceiver.h"
+#include "USRPDevice.h"
 #include <Logger.h>
 
 using namespace std;
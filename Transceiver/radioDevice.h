@@ -0,0 +1,97 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef RADIODEVICE_H
+#define RADIODEVICE_H
+
+#include <stddef.h>
+
+
+/** a 64-bit virtual timestamp for radio data */
+typedef unsigned long long TIMESTAMP;
+
+/**
+	The sample source/sink used by the RadioInterface.
+	Samples are interleaved 16-bit I/Q in little-endian (USRP) byte order.
+*/
+class RadioDevice {
+
+  public:
+
+  virtual ~RadioDevice() {}
+
+  /** Start the device */
+  virtual bool start()=0;
+
+  /** Stop the device */
+  virtual bool stop()=0;
+
+  /**
+	Read samples from the device.
+	@param buf preallocated buf to contain read result
+	@param len number of samples desired
+	@param overrun Set if read buffer has been overrun, e.g. data not being read fast enough
+	@param timestamp The timestamp of the first samples to be read
+	@param underrun Set if device does not have data to transmit, e.g. data not being sent fast enough
+	@param RSSI The received signal strength of the read result
+	@return The number of samples actually read
+  */
+  virtual int  readSamples(short *buf, int len, bool *overrun,
+			   TIMESTAMP timestamp = 0xffffffff,
+			   bool *underrun = NULL,
+			   unsigned *RSSI = NULL)=0;
+
+  /**
+        Write samples to the device.
+        @param buf Contains the data to be written.
+        @param len number of samples to write.
+        @param underrun Set if device does not have data to transmit, e.g. data not being sent fast enough
+        @param timestamp The timestamp of the first sample of the data buffer.
+        @param isControl Set if data is a control packet, e.g. a ping command
+        @return The number of samples actually written
+  */
+  virtual int  writeSamples(short *buf, int len, bool *underrun,
+			    TIMESTAMP timestamp = 0xffffffff,
+			    bool isControl = false)=0;
+
+  /** Update the alignment between the read and write timestamps */
+  virtual bool updateAlignment(TIMESTAMP timestamp)=0;
+
+  /** Set the transmitter frequency */
+  virtual bool setTxFreq(double wFreq)=0;
+
+  /** Set the receiver frequency */
+  virtual bool setRxFreq(double wFreq)=0;
+
+  /** Return true if received samples arrive with I and Q swapped */
+  virtual bool swapIQ() const { return false; }
+
+  /** Return internal status values */
+  virtual double getSampleRate()=0;
+  virtual double numberRead()=0;
+  virtual double numberWritten()=0;
+
+};
+
+#endif
@@ -23,7 +23,10 @@
 */
 
 //#define NDEBUG
+#define LOG_MODULE Transceiver
+
 #include "radioInterface.h"
+#include "usrp_bytesex.h"
 #include <Logger.h>
 
 
@@ -37,7 +40,7 @@ GSM::Time VectorQueue::nextTime() const
   return retVal;
 }
 
-RadioInterface::RadioInterface(USRPDevice *wUsrp,
+RadioInterface::RadioInterface(RadioDevice *wUsrp,
                                int wReceiveOffset,
 			       int wSamplesPerSymbol,
 			       GSM::Time wStartTime)
@@ -97,16 +100,12 @@ signalVector *RadioInterface::unUSRPifyVector(short *shortVector, int numSamples
   signalVector::iterator itr = newVector->begin();
   short *shortItr = shortVector;
 
-// need to flip I and Q from USRP
-#ifndef SWLOOPBACK
-#define FLIP_IQ 1
-#else
-#define FLIP_IQ 0
-#endif
+  // need to flip I and Q from USRP
+  const int flipIQ = usrp->swapIQ() ? 1 : 0;
 
   while (itr < newVector->end()) {
-    *itr++ = Complex<float>(usrp_to_host_short(*(shortItr+FLIP_IQ)),
-		            usrp_to_host_short(*(shortItr+1-FLIP_IQ)));
+    *itr++ = Complex<float>(usrp_to_host_short(*(shortItr+flipIQ)),
+		            usrp_to_host_short(*(shortItr+1-flipIQ)));
     //LOG(DEEPDEBUG) << (*(itr-1));
     shortItr += 2;
   }
@@ -25,7 +25,7 @@
 
 
 #include "sigProcLib.h"  
-#include "USRPDevice.h"
+#include "radioDevice.h"
 #include "GSMCommon.h"
 #include "Interthread.h"
 
@@ -104,7 +104,7 @@ public:
 };
 
 
-/** class to interface the transceiver with the USRP */
+/** class to interface the transceiver with the radio device */
 class RadioInterface {
 
 private:
@@ -119,7 +119,7 @@ private:
   signalVector* sendHistory;		      ///< block of previous transmitted samples
   signalVector* rcvHistory;		      ///< block of previous received samples
   
-  USRPDevice *usrp;			      ///< the USRP object
+  RadioDevice *usrp;			      ///< the radio device, a USRP or a capture file
   
   signalVector* sendBuffer;		      ///< block of samples to be transmitted
   signalVector* rcvBuffer;		      ///< block of received samples to be processed
@@ -160,7 +160,7 @@ public:
   void start();
 
   /** constructor */
-  RadioInterface(USRPDevice* wUsrp = NULL,
+  RadioInterface(RadioDevice* wUsrp = NULL,
 		 int receiveOffset = 3,
 		 int wSamplesPerSymbol = SAMPSPERSYM,
 		 GSM::Time wStartTime = GSM::Time(0));
@@ -171,8 +171,8 @@ public:
   /** check for underrun, resets underrun value */
   bool isUnderrun() { bool retVal = underrun; underrun = false; return retVal;}
   
-  /** attach an existing USRP to this interface */
-  void attach(USRPDevice *wUsrp) {if (!mOn) usrp = wUsrp;}
+  /** attach an existing radio device to this interface */
+  void attach(RadioDevice *wUsrp) {if (!mOn) usrp = wUsrp;}
 
   /** return the transmit FIFO */
   VectorFIFO* transmitFIFO() { return &mTransmitFIFO;}
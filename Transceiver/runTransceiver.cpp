@@ -26,8 +26,11 @@
 
 
 #include "Transceiver.h"
+#include "USRPDevice.h"
+#include "FileDevice.h"
 #include "GSMCommon.h"
 #include <time.h>
+#include <string.h>
 
 #include <Logger.h>
 
@@ -37,8 +40,10 @@ int main(int argc, char *argv[]) {
 
   // Configure logger.
   if (argc<2) {
-    cerr << argv[0] << " <logLevel> [logFilePath]" << endl;
+    cerr << argv[0] << " <logLevel> [logFilePath [rxCapture txCapture [fast]]]" << endl;
     cerr << "Log levels are ERROR, ALARM, WARN, NOTICE, INFO, DEBUG, DEEPDEBUG" << endl;
+    cerr << "With capture files, I/Q samples are replayed from rxCapture and recorded to txCapture instead of using the USRP." << endl;
+    cerr << "\"fast\" runs the capture as fast as possible instead of in real time." << endl;
     exit(0);
   }
   gSetLogLevel(argv[1]);
@@ -46,8 +51,21 @@ int main(int argc, char *argv[]) {
 
   srandom(time(NULL));
 
-  USRPDevice *usrp = new USRPDevice(400.0e3); //533.333333333e3); //400e3);
-  usrp->make();
+  RadioDevice *usrp;
+  if (argc>4) {
+    bool realTime = !((argc>5) && (strcmp(argv[5],"fast")==0));
+    FileDevice *fileDevice = new FileDevice(400.0e3,argv[3],argv[4],realTime);
+    if (!fileDevice->make()) {
+      cerr << "cannot open capture files" << endl;
+      exit(1);
+    }
+    usrp = fileDevice;
+  }
+  else {
+    USRPDevice *usrpDevice = new USRPDevice(400.0e3); //533.333333333e3); //400e3);
+    usrpDevice->make();
+    usrp = usrpDevice;
+  }
   RadioInterface* radio = new RadioInterface(usrp,3);
   Transceiver *trx = new Transceiver(5700,"127.0.0.1",SAMPSPERSYM,GSM::Time(2,0),radio);
   trx->transmitFIFO(radio->transmitFIFO());
@@ -26,6 +26,8 @@
 
 #define NDEBUG
 
+#define LOG_MODULE Transceiver
+
 #include "sigProcLib.h"
 #include "GSMCommon.h"
 #include "sendLPF_961.h"
@@ -938,8 +940,7 @@ bool analyzeTrafficBurst(signalVector &rxBurst,
 			 int samplesPerSymbol,
 			 complex *amplitude,
 			 float *TOA,
-			 bool requestChannel,
-                         signalVector **channelResponse,
+			 signalVector *channelResponse,
 			 float *channelResponseOffset) 
 {
 
@@ -1002,28 +1003,28 @@ bool analyzeTrafficBurst(signalVector &rxBurst,
 
   LOG(DEEPDEBUG) << "autocorr: " << *correlatedBurst;
   
-  if (requestChannel && (peakToMean > detectThreshold)) {
+  if (channelResponse && (peakToMean > detectThreshold)) {
+    assert(channelResponse->size() == (size_t) 6*samplesPerSymbol);
     float TOAoffset = gMidambles[TSC]->TOA+(66-56)*samplesPerSymbol;
     delayVector(*correlatedBurst,-(*TOA));
     // midamble only allows estimation of a 6-tap channel
-    signalVector channelVector(6*samplesPerSymbol);
+    // pick the 6-tap window with the most energy, using the output as scratch
     float maxEnergy = -1.0;
     int maxI = -1;
     for (int i = 0; i < 7; i++) {
-      if (TOAoffset+(i-5)*samplesPerSymbol + channelVector.size() > correlatedBurst->size()) continue;
+      if (TOAoffset+(i-5)*samplesPerSymbol + channelResponse->size() > correlatedBurst->size()) continue;
       if (TOAoffset+(i-5)*samplesPerSymbol < 0) continue;
-      correlatedBurst->segmentCopyTo(channelVector,(int) floor(TOAoffset+(i-5)*samplesPerSymbol),channelVector.size());
-      float energy = vectorNorm2(channelVector);
+      correlatedBurst->segmentCopyTo(*channelResponse,(int) floor(TOAoffset+(i-5)*samplesPerSymbol),channelResponse->size());
+      float energy = vectorNorm2(*channelResponse);
       if (energy > 0.95*maxEnergy) {
 	maxI = i;
 	maxEnergy = energy;
       }
     }
 	
-    *channelResponse = new signalVector(channelVector.size());
-    correlatedBurst->segmentCopyTo(**channelResponse,(int) floor(TOAoffset+(maxI-5)*samplesPerSymbol),(*channelResponse)->size());
-    scaleVector(**channelResponse,complex(1.0,0.0)/gMidambles[TSC]->gain);
-    LOG(DEEPDEBUG) << "channelResponse: " << **channelResponse;
+    correlatedBurst->segmentCopyTo(*channelResponse,(int) floor(TOAoffset+(maxI-5)*samplesPerSymbol),channelResponse->size());
+    scaleVector(*channelResponse,complex(1.0,0.0)/gMidambles[TSC]->gain);
+    LOG(DEEPDEBUG) << "channelResponse: " << *channelResponse;
     
     if (channelResponseOffset) 
       *channelResponseOffset = 5*samplesPerSymbol-maxI;
@@ -1036,6 +1037,27 @@ bool analyzeTrafficBurst(signalVector &rxBurst,
 		  
 }
 
+
+bool analyzeTrafficBurst(signalVector &rxBurst,
+			 unsigned TSC,
+			 float detectThreshold,
+			 int samplesPerSymbol,
+			 complex *amplitude,
+			 float *TOA,
+			 bool requestChannel,
+                         signalVector **channelResponse,
+			 float *channelResponseOffset) 
+{
+  signalVector *channelVector = NULL;
+  if (requestChannel) channelVector = new signalVector(6*samplesPerSymbol);
+  bool success = analyzeTrafficBurst(rxBurst,TSC,detectThreshold,samplesPerSymbol,
+				     amplitude,TOA,channelVector,channelResponseOffset);
+  if (!requestChannel) return success;
+  if (success) *channelResponse = channelVector;
+  else delete channelVector;
+  return success;
+}
+
 signalVector *decimateVector(signalVector &wVector,
 			     int decimationFactor) 
 {
@@ -1243,100 +1265,89 @@ signalVector *resampleVector(signalVector &wVector,
 
 // Assumes symbol-spaced sampling!!!
 // Based upon paper by Al-Dhahir and Cioffi
-bool designDFE(signalVector &channelResponse,
+// Works in fixed-size local arrays so that it can be run on every
+// channel update without touching the heap.
+bool designDFE(const signalVector &channelResponse,
 	       float SNRestimate,
 	       int Nf,
-	       signalVector **feedForwardFilter,
-	       signalVector **feedbackFilter)
+	       signalVector &feedForwardFilter,
+	       signalVector &feedbackFilter)
 {
-  
-  signalVector G0(Nf);
-  signalVector G1(Nf);
-  signalVector::iterator G0ptr = G0.begin();
-  signalVector::iterator G1ptr = G1.begin();
-  signalVector::iterator chanPtr = channelResponse.begin();
-
   int nu = channelResponse.size()-1;
+  if ((Nf > MAX_DFE_TAPS) || (nu < 0) || (nu+1 > Nf)) return false;
+  if (((int) feedForwardFilter.size() != Nf) || ((int) feedbackFilter.size() != nu)) return false;
 
-  *G0ptr = 1.0/sqrtf(SNRestimate);
-  for(int j = 0; j <= nu; j++) {
-    *G1ptr = chanPtr->conj();
-    G1ptr++; chanPtr++;
+  complex G0[MAX_DFE_TAPS];
+  complex G1[MAX_DFE_TAPS];
+  complex L[MAX_DFE_TAPS][2*MAX_DFE_TAPS];
+
+  for (int j = 0; j < Nf; j++) {
+    G0[j] = 0.0;
+    G1[j] = 0.0;
   }
+  G0[0] = 1.0/sqrtf(SNRestimate);
+  signalVector::const_iterator chanPtr = channelResponse.begin();
+  for (int j = 0; j <= nu; j++) G1[j] = chanPtr[j].conj();
 
-  signalVector *L[Nf];
-  signalVector::iterator Lptr;
-  // There's a worning here on some compilers.  It's OK.
   float d;
-  for(int i = 0; i < Nf; i++) {
-    d = G0.begin()->norm2() + G1.begin()->norm2();
-    L[i] = new signalVector(Nf+nu);
-    Lptr = L[i]->begin()+i;
-    G0ptr = G0.begin(); G1ptr = G1.begin();
-    while ((G0ptr < G0.end()) &&  (Lptr < L[i]->end())) {
-      *Lptr = (*G0ptr*(G0.begin()->conj()) + *G1ptr*(G1.begin()->conj()) )/d;
-      Lptr++;
-      G0ptr++;
-      G1ptr++;
-    }
-    complex k = (*G1.begin())/(*G0.begin());
+  for (int i = 0; i < Nf; i++) {
+    d = G0[0].norm2() + G1[0].norm2();
+    for (int j = 0; j < Nf+nu; j++) L[i][j] = 0.0;
+    for (int j = 0; (j < Nf) && (i+j < Nf+nu); j++)
+      L[i][i+j] = (G0[j]*(G0[0].conj()) + G1[j]*(G1[0].conj()))/d;
+    complex k = G1[0]/G0[0];
 
     if (i != Nf-1) {
-      signalVector G0new = G1;
-      scaleVector(G0new,k.conj());
-      addVector(G0new,G0);
-
-      signalVector G1new = G0;
-      scaleVector(G1new,k*(-1.0));
-      addVector(G1new,G1);
-      delayVector(G1new,-1.0);
-
-      scaleVector(G0new,1.0/sqrtf(1.0+k.norm2()));
-      scaleVector(G1new,1.0/sqrtf(1.0+k.norm2()));
-      G0 = G0new;
-      G1 = G1new;
+      complex scale = 1.0/sqrtf(1.0+k.norm2());
+      complex G0new[MAX_DFE_TAPS];
+      complex G1new[MAX_DFE_TAPS];
+      for (int j = 0; j < Nf; j++) {
+        G0new[j] = G1[j]*k.conj() + G0[j];
+        G1new[j] = G0[j]*(k*(-1.0)) + G1[j];
+      }
+      // advance G1 by one sample
+      for (int j = 0; j < Nf-1; j++) G1new[j] = G1new[j+1];
+      G1new[Nf-1] = 0.0;
+      for (int j = 0; j < Nf; j++) {
+        G0[j] = G0new[j]*scale;
+        G1[j] = G1new[j]*scale;
+      }
     }
   }
 
-  *feedbackFilter = new signalVector(nu);
-  L[Nf-1]->segmentCopyTo(**feedbackFilter,Nf,nu);
-  scaleVector(**feedbackFilter,(complex) -1.0);
-  conjugateVector(**feedbackFilter);
-
-  signalVector v(Nf);
-  signalVector::iterator vStart = v.begin();
-  signalVector::iterator vPtr;
-  *(vStart+Nf-1) = (complex) 1.0;
-  for(int k = Nf-2; k >= 0; k--) {
-    Lptr = L[k]->begin()+k+1;
-    vPtr = vStart + k+1;
+  signalVector::iterator b = feedbackFilter.begin();
+  for (int j = 0; j < nu; j++) b[j] = (L[Nf-1][Nf+j]*(complex) -1.0).conj();
+
+  complex v[MAX_DFE_TAPS];
+  v[Nf-1] = (complex) 1.0;
+  for (int k = Nf-2; k >= 0; k--) {
     complex v_k = 0.0;
-    for (int j = k+1; j < Nf; j++) {
-      v_k -= (*vPtr)*(*Lptr);
-      vPtr++; Lptr++;
-    }
-     *(vStart + k) = v_k;
+    for (int j = k+1; j < Nf; j++) v_k -= v[j]*L[k][j];
+    v[k] = v_k;
   }
 
-  *feedForwardFilter = new signalVector(Nf);
-  signalVector::iterator w = (*feedForwardFilter)->begin();
+  signalVector::iterator w = feedForwardFilter.begin();
   for (int i = 0; i < Nf; i++) {
-    delete L[i];
     complex w_i = 0.0;
     int endPt = ( nu < (Nf-1-i) ) ? nu : (Nf-1-i);
-    vPtr = vStart+i;
-    chanPtr = channelResponse.begin();
-    for (int k = 0; k < endPt+1; k++) {
-      w_i += (*vPtr)*(chanPtr->conj());
-      vPtr++; chanPtr++;
-    }
-    *w = w_i/d;
-    w++;
+    for (int k = 0; k < endPt+1; k++) w_i += v[i+k]*(chanPtr[k].conj());
+    w[i] = w_i/d;
   }
 
-
   return true;
-  
+}
+
+
+bool designDFE(signalVector &channelResponse,
+	       float SNRestimate,
+	       int Nf,
+	       signalVector **feedForwardFilter,
+	       signalVector **feedbackFilter)
+{
+  *feedForwardFilter = new signalVector(Nf);
+  *feedbackFilter = new signalVector(channelResponse.size()-1);
+  return designDFE((const signalVector&) channelResponse,SNRestimate,Nf,
+		   **feedForwardFilter,**feedbackFilter);
 }
 
 // Assumes symbol-rate sampling!!!!
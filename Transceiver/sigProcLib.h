@@ -23,6 +23,8 @@
 */
 
 
+#ifndef SIGPROCLIB_H
+#define SIGPROCLIB_H
 
 #include "Vector.h"
 #include "Complex.h"
@@ -295,6 +297,22 @@ bool analyzeTrafficBurst(signalVector &rxBurst,
 			 signalVector** channelResponse = NULL,
 			 float *channelResponseOffset = NULL);
 
+/**
+	Normal burst correlator, detector, channel estimator, with the
+	channel estimate written into caller-owned storage.
+	@param channelResponse If not NULL, filled in with the channel
+		estimate when the burst is detected; must be 6*samplesPerSymbol long.
+	Other parameters and the return value are as above.
+*/
+bool analyzeTrafficBurst(signalVector &rxBurst,
+			 unsigned TSC,
+			 float detectThreshold,
+			 int samplesPerSymbol,
+			 complex *amplitude,
+			 float *TOA,
+			 signalVector *channelResponse,
+			 float *channelResponseOffset = NULL);
+
 /**
 	Decimate a vector.
         @param wVector The vector of interest.
@@ -368,6 +386,24 @@ bool designDFE(signalVector &channelResponse,
 	       signalVector **feedForwardFilter,
 	       signalVector **feedbackFilter);
 
+/** Largest feedforward filter (and channel) designDFE will handle. */
+#define MAX_DFE_TAPS 32
+
+/**
+	Design the DFE filters into caller-owned storage, without allocation.
+	@param channelResponse The multipath channel that we're mitigating.
+	@param SNRestimate The signal-to-noise estimate of the channel, a linear value
+	@param Nf The number of taps in the feedforward filter, at most MAX_DFE_TAPS.
+	@param feedForwardFilter Filled in, must be Nf long.
+	@param feedbackFilter Filled in, must be one shorter than channelResponse.
+	@return True if DFE can be designed.
+*/
+bool designDFE(const signalVector &channelResponse,
+	       float SNRestimate,
+	       int Nf,
+	       signalVector &feedForwardFilter,
+	       signalVector &feedbackFilter);
+
 /**
 	Equalize/demodulate a received burst via a decision-feedback equalizer.
 	@param rxBurst The received burst to be demodulated.
@@ -382,3 +418,5 @@ SoftVector *equalizeBurst(signalVector &rxBurst,
 		       int samplesPerSymbol,
 		       signalVector &w, 
 		       signalVector &b);
+
+#endif
@@ -22,6 +22,7 @@
 
 
 #include "Transceiver.h"
+#include "USRPDevice.h"
 
 using namespace std;
 
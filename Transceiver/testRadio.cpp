@@ -22,6 +22,7 @@
 
 
 #include "Transceiver.h"
+#include "USRPDevice.h"
 #include "TRXManager.h"
 #include "GSMConfig.h"
 #include "GSMCommon.h"
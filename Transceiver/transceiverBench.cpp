@@ -0,0 +1,615 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+/*
+	Offline benchmark of the transceiver receive chain.
+
+	Bursts are either synthesized here or replayed from a burst file
+	and then pushed through the same sequence of sigProcLib calls that
+	Transceiver::pullRadioVector uses:
+	energy detection, RACH/midamble correlation, DFE design and
+	demodulation/equalization.  No radio is needed.
+
+	Synthesized normal bursts can go through a multipath channel whose
+	taps rotate at their own Doppler shifts, to exercise channel tracking.
+	With -R the channel is instead re-estimated from scratch every 50
+	frames, as the Transceiver did before ChannelTracker.
+
+	Burst file format, one record per burst, no file header:
+		uint8  TN
+		uint8  burst type (0=TSC, 1=RACH, 2=IDLE, 3=NOISE)
+		uint8  transmitted bits [gSlotLen]
+		int16  interleaved I/Q, host byte order, [2*(156+(TN%4==0))]
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "sigProcLib.h"
+#include "ChannelTracker.h"
+#include "GSMCommon.h"
+#include <Logger.h>
+
+using namespace std;
+
+
+/** Burst types of the benchmark mix. */
+enum BenchBurstType {
+	BENCH_TSC = 0,		///< normal burst with the configured TSC
+	BENCH_RACH = 1,		///< access burst
+	BENCH_IDLE = 2,		///< background noise only, should fail energy detection
+	BENCH_NOISE = 3,	///< strong noise, should fail correlation
+	BENCH_NUM_TYPES = 4
+};
+
+static const char* typeNames[] = { "TSC", "RACH", "IDLE", "NOISE" };
+
+/** Pipeline stages that are timed separately. */
+enum BenchStage {
+	STAGE_ENERGY,
+	STAGE_CORRELATE,
+	STAGE_DFE,
+	STAGE_DEMOD,
+	NUM_STAGES
+};
+
+static const char* stageNames[] = { "energyDetect", "correlate", "channel/DFE", "demod/equalize" };
+
+
+/** One burst of the benchmark set. */
+struct BenchBurst {
+	unsigned TN;
+	BenchBurstType type;
+	BitVector bits;			///< transmitted bits, gSlotLen long
+	signalVector *samples;
+};
+
+
+/** Benchmark parameters, settable from the command line. */
+struct BenchParams {
+	unsigned numBursts;
+	unsigned passes;
+	float SNR;			///< in dB
+	float delay;		///< in symbols
+	float freqOffset;	///< in Hz
+	float amplitude;	///< burst amplitude in radio units
+	std::vector<float> taps;	///< multipath tap amplitudes, symbol spaced, empty for none
+	float doppler;		///< largest tap Doppler shift, in Hz
+	bool rebuild;		///< re-estimate every 50 frames instead of tracking
+	unsigned TSC;
+	unsigned mix[BENCH_NUM_TYPES];	///< relative weights of the burst types
+	const char* inFile;
+	const char* outFile;
+	unsigned seed;
+};
+
+
+static uint64_t nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+
+static const int samplesPerSymbol = 1;
+static const float symbolRate = 1625.0e3/6.0;
+static const float frameSeconds = 120.0e-3/26.0;
+
+
+/** Fixed phases and Doppler shifts of the multipath taps. */
+static std::vector<float> tapPhase;
+static std::vector<float> tapDoppler;
+
+
+/** Pick a random phase and Doppler shift for each tap. */
+static void makeChannel(const BenchParams& p)
+{
+	for (unsigned k=0; k<p.taps.size(); k++) {
+		tapPhase.push_back(2.0*M_PI*(random()/(RAND_MAX+1.0)));
+		tapDoppler.push_back(p.doppler*cos(2.0*M_PI*(random()/(RAND_MAX+1.0))));
+	}
+}
+
+
+/** Pass a burst through the multipath channel as it is at time t, in seconds. */
+static void applyChannel(const BenchParams& p, signalVector& burst, double t)
+{
+	unsigned numTaps = p.taps.size();
+	complex h[numTaps];
+	for (unsigned k=0; k<numTaps; k++) {
+		float phase = tapPhase[k] + 2.0*M_PI*tapDoppler[k]*t;
+		h[k] = complex(p.taps[k]*cos(phase),p.taps[k]*sin(phase));
+	}
+	signalVector in(burst);
+	for (unsigned n=0; n<burst.size(); n++) {
+		complex acc = 0.0;
+		for (unsigned k=0; k<numTaps && k<=n; k++) acc += in[n-k]*h[k];
+		burst[n] = acc;
+	}
+}
+
+
+/** Build the bit pattern of a burst of the given type. */
+static void makeBits(BenchBurstType type, unsigned TSC, BitVector& bits)
+{
+	bits.zero();
+	if (type==BENCH_TSC) {
+		// 3 tail, 58 data, 26 training, 58 data, 3 tail
+		for (unsigned i=3; i<61; i++) bits[i] = random() & 0x01;
+		gTrainingSequence[TSC].copyToSegment(bits,61);
+		for (unsigned i=87; i<145; i++) bits[i] = random() & 0x01;
+	} else if (type==BENCH_RACH) {
+		// 8 extended tail, 41 synch, 36 data, 3 tail, then guard
+		static const BitVector extendedTail("00111010");
+		extendedTail.copyToSegment(bits,0);
+		gRACHSynchSequence.copyToSegment(bits,8);
+		for (unsigned i=49; i<85; i++) bits[i] = random() & 0x01;
+	}
+}
+
+
+/** Synthesize one burst: modulate, delay, frequency shift, add noise. */
+static signalVector* synthesize(const BenchParams& p, const signalVector& gsmPulse,
+	unsigned TN, BenchBurstType type, const BitVector& bits, double t)
+{
+	int guard = 8 + (TN % 4 == 0);
+	int burstLen = (gSlotLen + guard)*samplesPerSymbol;
+	signalVector *burst = NULL;
+
+	if ((type==BENCH_TSC) || (type==BENCH_RACH)) {
+		if (type==BENCH_TSC) {
+			burst = modulateBurst(bits,gsmPulse,guard,samplesPerSymbol);
+		} else {
+			BitVector rach(bits.head(88));
+			burst = modulateBurst(rach,gsmPulse,guard+gSlotLen-88,samplesPerSymbol);
+		}
+		scaleVector(*burst,p.amplitude);
+		if ((type==BENCH_TSC) && p.taps.size()) applyChannel(p,*burst,t);
+		if (p.delay != 0.0) delayVector(*burst,p.delay*samplesPerSymbol);
+		if (p.freqOffset != 0.0)
+			frequencyShift(burst,burst,2.0*M_PI*p.freqOffset/(symbolRate*samplesPerSymbol));
+	} else {
+		burst = new signalVector(burstLen);
+		burst->fill(0.0);
+	}
+
+	// The nominal signal power is amplitude^2, since the pulse and the taps are normalized.
+	// gaussianNoise variance is per component.
+	float signalPower = p.amplitude*p.amplitude;
+	float noiseVar = signalPower/pow(10.0,p.SNR/10.0)/2.0;
+	if (type==BENCH_NOISE) noiseVar = signalPower/2.0;
+	signalVector *noise = gaussianNoise(burst->size(),noiseVar);
+	addVector(*burst,*noise);
+	delete noise;
+	return burst;
+}
+
+
+static bool writeBurst(FILE* fp, const BenchBurst& b)
+{
+	unsigned char hdr[2] = { (unsigned char)b.TN, (unsigned char)b.type };
+	if (fwrite(hdr,1,2,fp)!=2) return false;
+	unsigned char bits[gSlotLen];
+	for (unsigned i=0; i<gSlotLen; i++) bits[i] = b.bits.bit(i);
+	if (fwrite(bits,1,gSlotLen,fp)!=gSlotLen) return false;
+	size_t len = b.samples->size();
+	int16_t *iq = new int16_t[2*len];
+	for (size_t i=0; i<len; i++) {
+		iq[2*i] = (int16_t)lrintf((*b.samples)[i].real());
+		iq[2*i+1] = (int16_t)lrintf((*b.samples)[i].imag());
+	}
+	bool ok = (fwrite(iq,sizeof(int16_t),2*len,fp)==2*len);
+	delete[] iq;
+	return ok;
+}
+
+
+static bool readBurst(FILE* fp, BenchBurst& b)
+{
+	unsigned char hdr[2];
+	if (fread(hdr,1,2,fp)!=2) return false;
+	if ((hdr[0]>7) || (hdr[1]>=BENCH_NUM_TYPES)) {
+		CERR("bad burst record" << endl);
+		return false;
+	}
+	b.TN = hdr[0];
+	b.type = (BenchBurstType)hdr[1];
+	unsigned char bits[gSlotLen];
+	if (fread(bits,1,gSlotLen,fp)!=gSlotLen) return false;
+	b.bits = BitVector(gSlotLen);
+	for (unsigned i=0; i<gSlotLen; i++) b.bits[i] = bits[i] & 0x01;
+	size_t len = (gSlotLen + 8 + (b.TN % 4 == 0))*samplesPerSymbol;
+	int16_t *iq = new int16_t[2*len];
+	if (fread(iq,sizeof(int16_t),2*len,fp)!=2*len) {
+		delete[] iq;
+		return false;
+	}
+	b.samples = new signalVector(len);
+	for (size_t i=0; i<len; i++) (*b.samples)[i] = complex(iq[2*i],iq[2*i+1]);
+	delete[] iq;
+	return true;
+}
+
+
+/** Per-timeslot receiver state, as kept by the Transceiver. */
+struct SlotState {
+	ChannelTracker *tracker;
+	/**@name Used with -R. */
+	//@{
+	unsigned lastEstimate;		///< burst index of the last channel estimate
+	signalVector *channelResponse;
+	signalVector *DFEForward;
+	signalVector *DFEFeedback;
+	float chanRespOffset;
+	//@}
+};
+
+
+/** Accumulated results. */
+struct BenchStats {
+	uint64_t stageNs[NUM_STAGES];
+	unsigned stageCount[NUM_STAGES];
+	unsigned sent[BENCH_NUM_TYPES];
+	unsigned detected[BENCH_NUM_TYPES];
+	unsigned bitErrors[BENCH_NUM_TYPES];
+	unsigned bitsCompared[BENCH_NUM_TYPES];
+	unsigned DFEDesigns;
+	uint64_t totalNs;
+};
+
+
+/** Count bit errors between a demodulated burst and the transmitted bits. */
+static void countErrors(const SoftVector& rx, const BenchBurst& b, BenchStats& s)
+{
+	unsigned start, end;
+	if (b.type==BENCH_TSC) { start = 3; end = 145; }
+	else { start = 49; end = 85; }
+	for (unsigned i=start; i<end && i<rx.size(); i++) {
+		if (b.type==BENCH_TSC && i>=61 && i<87) continue;
+		bool bit = rx[i] > 0.5F;
+		if (bit != b.bits.bit(i)) s.bitErrors[b.type]++;
+		s.bitsCompared[b.type]++;
+	}
+}
+
+
+/**
+	Run one burst through the receive chain.
+	This follows Transceiver::pullRadioVector step for step.
+*/
+static void receiveBurst(const BenchBurst& b, unsigned index, unsigned TSC,
+	float energyThreshold, const signalVector& gsmPulse, bool rebuild,
+	SlotState& slot, BenchStats& s)
+{
+	signalVector burst(*b.samples);
+	bool expectRACH = (b.type==BENCH_RACH) || ((b.type!=BENCH_TSC) && (index & 0x01));
+	s.sent[b.type]++;
+
+	uint64_t t0 = nowNs();
+	float avgPwr;
+	bool energy = energyDetect(burst,20*samplesPerSymbol,energyThreshold,&avgPwr);
+	uint64_t t1 = nowNs();
+	s.stageNs[STAGE_ENERGY] += t1-t0;
+	s.stageCount[STAGE_ENERGY]++;
+	if (!energy) return;
+
+	complex amplitude = 0.0;
+	float TOA = 0.0;
+	bool success;
+	bool estimateChannel = false;
+	signalVector *channelResp = NULL;
+	float chanOffset;
+	if (!expectRACH && !rebuild) {
+		success = analyzeTrafficBurst(burst,TSC,3.0,samplesPerSymbol,
+				&amplitude,&TOA,&slot.tracker->estimate(),&chanOffset);
+	} else if (!expectRACH) {
+		if ((index - slot.lastEstimate > 50*8) || (slot.channelResponse==NULL)) {
+			delete slot.channelResponse;
+			delete slot.DFEForward;
+			delete slot.DFEFeedback;
+			slot.channelResponse = NULL;
+			slot.DFEForward = NULL;
+			slot.DFEFeedback = NULL;
+			estimateChannel = true;
+		}
+		success = analyzeTrafficBurst(burst,TSC,3.0,samplesPerSymbol,
+				&amplitude,&TOA,estimateChannel,&channelResp,&chanOffset);
+	} else {
+		success = detectRACHBurst(burst,5.0,samplesPerSymbol,&amplitude,&TOA);
+	}
+	uint64_t t2 = nowNs();
+	s.stageNs[STAGE_CORRELATE] += t2-t1;
+	s.stageCount[STAGE_CORRELATE]++;
+
+	if (!success) {
+		if (!expectRACH && rebuild) {
+			if (estimateChannel) delete channelResp;
+			slot.channelResponse = NULL;
+		}
+		return;
+	}
+
+	if (!expectRACH && !rebuild) {
+		// Tracking cost is charged to the DFE stage, along with any redesign.
+		float SNRestimate = amplitude.norm2()/(energyThreshold*energyThreshold+1.0);
+		scaleVector(slot.tracker->estimate(),complex(1.0,0.0)/amplitude);
+		GSM::Time when(index/8,b.TN);
+		if (slot.tracker->update(chanOffset,SNRestimate,when)) s.DFEDesigns++;
+		uint64_t t3 = nowNs();
+		s.stageNs[STAGE_DFE] += t3-t2;
+		s.stageCount[STAGE_DFE]++;
+		t2 = t3;
+		if (!slot.tracker->valid()) return;
+	} else if (!expectRACH && estimateChannel) {
+		float SNRestimate = amplitude.norm2()/(energyThreshold*energyThreshold+1.0);
+		slot.channelResponse = channelResp;
+		slot.chanRespOffset = chanOffset;
+		scaleVector(*channelResp,complex(1.0,0.0)/amplitude);
+		designDFE(*channelResp,SNRestimate,7,&slot.DFEForward,&slot.DFEFeedback);
+		slot.lastEstimate = index;
+		uint64_t t3 = nowNs();
+		s.stageNs[STAGE_DFE] += t3-t2;
+		s.stageCount[STAGE_DFE]++;
+		s.DFEDesigns++;
+		t2 = t3;
+	}
+
+	SoftVector *bits;
+	if (expectRACH) {
+		bits = demodulateBurst(burst,gsmPulse,samplesPerSymbol,amplitude,TOA);
+	} else if (!rebuild) {
+		scaleVector(burst,complex(1.0,0.0)/amplitude);
+		bits = equalizeBurst(burst,TOA-slot.tracker->offset(),samplesPerSymbol,
+				slot.tracker->feedForward(),slot.tracker->feedback());
+	} else {
+		scaleVector(burst,complex(1.0,0.0)/amplitude);
+		bits = equalizeBurst(burst,TOA-slot.chanRespOffset,samplesPerSymbol,
+				*slot.DFEForward,*slot.DFEFeedback);
+	}
+	uint64_t t4 = nowNs();
+	s.stageNs[STAGE_DEMOD] += t4-t2;
+	s.stageCount[STAGE_DEMOD]++;
+
+	s.detected[b.type]++;
+	if ((b.type==BENCH_TSC) || (b.type==BENCH_RACH)) countErrors(*bits,b,s);
+	delete bits;
+}
+
+
+static void usage(const char* name)
+{
+	cerr << "usage: " << name << " [options]" << endl
+		<< "  -n bursts     number of bursts to synthesize (default 8000)" << endl
+		<< "  -p passes     number of passes over the burst set (default 1)" << endl
+		<< "  -s SNR        signal-to-noise ratio in dB (default 20)" << endl
+		<< "  -d delay      burst delay in symbols (default 0)" << endl
+		<< "  -f offset     frequency offset in Hz (default 0)" << endl
+		<< "  -a amplitude  burst amplitude in radio units (default 4000)" << endl
+		<< "  -M a0,a1,...  multipath tap amplitudes, one per symbol of delay (default none)" << endl
+		<< "  -D doppler    largest multipath Doppler shift in Hz (default 0)" << endl
+		<< "  -R            re-estimate the channel every 50 frames instead of tracking it" << endl
+		<< "  -t TSC        training sequence code (default 0)" << endl
+		<< "  -m T,R,I,N    weights of the TSC,RACH,IDLE,NOISE mix (default 4,2,1,1)" << endl
+		<< "  -r seed       random seed (default 1)" << endl
+		<< "  -i file       replay bursts from file instead of synthesizing" << endl
+		<< "  -o file       save synthesized bursts to file" << endl
+		<< "  -l level      logging level (default WARN)" << endl;
+}
+
+
+int main(int argc, char *argv[])
+{
+	BenchParams p;
+	p.numBursts = 8000;
+	p.passes = 1;
+	p.SNR = 20.0;
+	p.delay = 0.0;
+	p.freqOffset = 0.0;
+	p.amplitude = 4000.0;
+	p.doppler = 0.0;
+	p.rebuild = false;
+	p.TSC = 0;
+	p.mix[BENCH_TSC] = 4;
+	p.mix[BENCH_RACH] = 2;
+	p.mix[BENCH_IDLE] = 1;
+	p.mix[BENCH_NOISE] = 1;
+	p.inFile = NULL;
+	p.outFile = NULL;
+	p.seed = 1;
+
+	int opt;
+	while ((opt = getopt(argc,argv,"n:p:s:d:f:a:M:D:Rt:m:r:i:o:l:h")) != -1) {
+		switch (opt) {
+			case 'n': p.numBursts = atoi(optarg); break;
+			case 'p': p.passes = atoi(optarg); break;
+			case 's': p.SNR = atof(optarg); break;
+			case 'd': p.delay = atof(optarg); break;
+			case 'f': p.freqOffset = atof(optarg); break;
+			case 'a': p.amplitude = atof(optarg); break;
+			case 'M': {
+				char *cp = optarg;
+				while (*cp) {
+					char *end;
+					p.taps.push_back(strtod(cp,&end));
+					if (end==cp) {
+						usage(argv[0]);
+						return 1;
+					}
+					cp = end;
+					if (*cp==',') cp++;
+				}
+				break;
+			}
+			case 'D': p.doppler = atof(optarg); break;
+			case 'R': p.rebuild = true; break;
+			case 't': p.TSC = atoi(optarg) & 0x07; break;
+			case 'm':
+				if (sscanf(optarg,"%u,%u,%u,%u",&p.mix[0],&p.mix[1],&p.mix[2],&p.mix[3])!=4) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'r': p.seed = atoi(optarg); break;
+			case 'i': p.inFile = optarg; break;
+			case 'o': p.outFile = optarg; break;
+			case 'l': gSetLogLevel(optarg); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	unsigned mixTotal = p.mix[0]+p.mix[1]+p.mix[2]+p.mix[3];
+	if (mixTotal==0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	srandom(p.seed);
+	srand(p.seed);
+
+	// Normalize the power delay profile so that SNR keeps its meaning.
+	float tapPower = 0.0;
+	for (unsigned k=0; k<p.taps.size(); k++) tapPower += p.taps[k]*p.taps[k];
+	for (unsigned k=0; k<p.taps.size(); k++) p.taps[k] /= sqrtf(tapPower);
+	makeChannel(p);
+
+	sigProcLibSetup(samplesPerSymbol);
+	signalVector *gsmPulse = generateGSMPulse(2,samplesPerSymbol);
+	generateRACHSequence(*gsmPulse,samplesPerSymbol);
+	generateMidamble(*gsmPulse,samplesPerSymbol,p.TSC);
+
+	// Build the burst set.
+	vector<BenchBurst> bursts;
+	if (p.inFile) {
+		FILE *fp = fopen(p.inFile,"r");
+		if (!fp) {
+			CERR("cannot open " << p.inFile << endl);
+			return 1;
+		}
+		BenchBurst b;
+		while (readBurst(fp,b)) bursts.push_back(b);
+		fclose(fp);
+		printf("loaded %u bursts from %s\n",(unsigned)bursts.size(),p.inFile);
+	} else {
+		for (unsigned i=0; i<p.numBursts; i++) {
+			BenchBurst b;
+			b.TN = i % 8;
+			unsigned r = random() % mixTotal;
+			unsigned t = 0;
+			while (r >= p.mix[t]) r -= p.mix[t++];
+			b.type = (BenchBurstType)t;
+			b.bits = BitVector(gSlotLen);
+			makeBits(b.type,p.TSC,b.bits);
+			b.samples = synthesize(p,*gsmPulse,b.TN,b.type,b.bits,(i/8)*frameSeconds);
+			bursts.push_back(b);
+		}
+	}
+	if (bursts.size()==0) return 1;
+
+	if (p.outFile) {
+		FILE *fp = fopen(p.outFile,"w");
+		if (!fp) {
+			CERR("cannot open " << p.outFile << endl);
+			return 1;
+		}
+		for (unsigned i=0; i<bursts.size(); i++) {
+			if (!writeBurst(fp,bursts[i])) {
+				CERR("write failed on " << p.outFile << endl);
+				break;
+			}
+		}
+		fclose(fp);
+	}
+
+	// Put the energy threshold 6 dB above the noise floor of the weakest burst.
+	float noisePower = p.amplitude*p.amplitude/pow(10.0,p.SNR/10.0);
+	float energyThreshold = 2.0*sqrtf(noisePower);
+
+	SlotState slots[8];
+	for (unsigned i=0; i<8; i++) {
+		slots[i].tracker = new ChannelTracker(samplesPerSymbol);
+		slots[i].lastEstimate = 0;
+		slots[i].channelResponse = NULL;
+		slots[i].DFEForward = NULL;
+		slots[i].DFEFeedback = NULL;
+		slots[i].chanRespOffset = 0.0;
+	}
+	BenchStats s;
+	memset(&s,0,sizeof(s));
+
+	uint64_t start = nowNs();
+	unsigned index = 0;
+	for (unsigned pass=0; pass<p.passes; pass++) {
+		for (unsigned i=0; i<bursts.size(); i++) {
+			const BenchBurst& b = bursts[i];
+			receiveBurst(b,index++,p.TSC,energyThreshold,*gsmPulse,p.rebuild,slots[b.TN],s);
+		}
+	}
+	s.totalNs = nowNs() - start;
+
+	// Report.
+	unsigned total = index;
+	printf("bursts: %u, SNR: %.1f dB, delay: %.2f sym, freq offset: %.1f Hz\n",
+		total, p.SNR, p.delay, p.freqOffset);
+	if (p.taps.size()) {
+		printf("multipath: %u taps, Doppler %.1f Hz\n",(unsigned)p.taps.size(),p.doppler);
+	}
+	printf("channel: %s\n", p.rebuild ? "re-estimated every 50 frames" : "tracked");
+	printf("throughput: %.0f bursts/sec, %.0f ns/burst\n",
+		total/(s.totalNs*1.0e-9), (double)s.totalNs/total);
+	for (unsigned i=0; i<NUM_STAGES; i++) {
+		if (s.stageCount[i]==0) continue;
+		printf("  %-16s %8u calls %10.0f ns/call\n", stageNames[i],
+			s.stageCount[i], (double)s.stageNs[i]/s.stageCount[i]);
+	}
+	printf("  DFE designs %u, %.1f per 1000 detected TSC bursts\n", s.DFEDesigns,
+		s.detected[BENCH_TSC] ? 1000.0*s.DFEDesigns/s.detected[BENCH_TSC] : 0.0);
+	for (unsigned t=0; t<BENCH_NUM_TYPES; t++) {
+		if (s.sent[t]==0) continue;
+		printf("  %-6s sent %7u, detected %6.2f%%", typeNames[t], s.sent[t],
+			100.0*s.detected[t]/s.sent[t]);
+		if (s.bitsCompared[t])
+			printf(", BER %.5f", (double)s.bitErrors[t]/s.bitsCompared[t]);
+		printf("\n");
+	}
+
+	for (unsigned i=0; i<8; i++) {
+		delete slots[i].tracker;
+		delete slots[i].channelResponse;
+		delete slots[i].DFEForward;
+		delete slots[i].DFEFeedback;
+	}
+	for (unsigned i=0; i<bursts.size(); i++) delete bursts[i].samples;
+	delete gsmPulse;
+	sigProcLibDestroy();
+	return 0;
+}
+
+// vim: ts=4 sw=4
@@ -28,6 +28,8 @@
 */
 
 
+#define LOG_MODULE Transceiver
+
 #include <stdio.h>
 #include "Transceiver.h"
 #include <Logger.h>
@@ -622,7 +624,7 @@ bool Transceiver::driveTransmitPriorityQueue()
   
   addRadioVector(newBurst,RSSI,currTime);
   
-  LOG(DEEPDEBUG) "added burst - time: " << currTime << ", RSSI: " << RSSI; // << ", data: " << newBurst; 
+  LOG(DEEPDEBUG) << "added burst - time: " << currTime << ", RSSI: " << RSSI; // << ", data: " << newBurst; 
 
   return true;
 
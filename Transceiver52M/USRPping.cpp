@@ -24,6 +24,8 @@
 
 
 
+#define LOG_MODULE Transceiver
+
 #include <stdio.h>
 #include "Transceiver.h"
 #include <Logger.h>
@@ -23,6 +23,8 @@
 */
 
 //#define NDEBUG
+#define LOG_MODULE Transceiver
+
 #include "radioInterface.h"
 #include <Logger.h>
 
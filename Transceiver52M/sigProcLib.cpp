@@ -26,6 +26,8 @@
 
 #define NDEBUG
 
+#define LOG_MODULE Transceiver
+
 #include "sigProcLib.h"
 #include "GSMCommon.h"
 #include "sendLPF_961.h"
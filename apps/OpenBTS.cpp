@@ -39,6 +39,7 @@
 #include <CLI.h>
 #include <PowerManager.h>
 #include <RRLPQueryController.h>
+#include <MediaEngine.h>
 
 #include <assert.h>
 #include <unistd.h>
@@ -173,10 +174,15 @@ int main(int argc, char *argv[])
 {
 	srandom(time(NULL));
 
+	// Simulated time has to be enabled before any threads start.
+	if (gConfig.defines("Simulation.VirtualTime") && gConfig.getNum("Simulation.VirtualTime")) {
+		gEnableSimulatedTime();
+	}
+
 	COUT("\n\n" << gOpenBTSWelcome << "\n");
 	COUT("\nStarting the system...");
 
-	gSetLogLevel(gConfig.getStr("LogLevel"));
+	gSetLogLevels(gConfig);
 	if (gConfig.defines("LogFileName")) {
 		gSetLogFile(gConfig.getStr("LogFileName"));
 	}
@@ -185,9 +191,20 @@ int main(int argc, char *argv[])
 
 	restartTransceiver();
 
+	// Reload the TMSIs from the last run.
+	if (gConfig.defines("Control.TMSITable.SavePath")) {
+		gTMSITable.open(gConfig.getStr("Control.TMSITable.SavePath"));
+	}
+
+	// Start reaping dead transactions.
+	gTransactionTable.start();
+
 	// Start the SIP interface.
 	gSIPInterface.start();
 
+	// Start the RTP media pump.
+	gMediaEngine.start();
+
 	// Start the transceiver interface.
 	gTRX.start();
 
@@ -301,9 +318,10 @@ int main(int argc, char *argv[])
 			for other values of CCCH-CONF               
 	*/
 
-	// Set up the pager.
 	// Set up paging channels.
-	// HACK -- For now, use a single paging channel, since paging groups are broken.
+	// With the combined CCCH (CCCH-CONF 1) and BS-AG-BLKS-RES 2, the first two
+	// CCCH blocks are for access grants only and the third is the one paging block.
+	// The pager makes its paging groups from the PCHs in block order; see Pager::start.
 	gBTS.addPCH(&CCCH2);
 
 	// OK, now it is safe to start the BTS.
@@ -0,0 +1,158 @@
+/*
+* Copyright 2009 Free Software Foundation, Inc.
+*
+* This software is distributed under the terms of the GNU Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+	Flood the SIP interface of OpenBTS with REGISTER and MESSAGE requests,
+	to measure how many messages per second it can take in.
+
+	Every request has its own Call-ID, so the load spreads over the SIP
+	workers the way a registration storm does.  The sending rate is
+	reported here; the "sip" command of the OpenBTS CLI reports the rates
+	at which the messages were received and dispatched.  Note that each
+	MESSAGE to a known IMSI also starts paging for an MT SMS.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <Sockets.h>
+#include <Timeval.h>
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,"usage: %s [options]\n",name);
+	fprintf(stderr,"  -h <IP>      address of OpenBTS (127.0.0.1)\n");
+	fprintf(stderr,"  -p <port>    SIP port of OpenBTS (5062)\n");
+	fprintf(stderr,"  -l <port>    local port (5065)\n");
+	fprintf(stderr,"  -n <count>   requests to send (100000)\n");
+	fprintf(stderr,"  -r <rate>    requests per second, 0 for as fast as possible (0)\n");
+	fprintf(stderr,"  -m <frac>    fraction of the requests that are MESSAGE, the rest are REGISTER (0)\n");
+	fprintf(stderr,"  -i <IMSI>    first IMSI, the others count up (001010000000001)\n");
+	fprintf(stderr,"  -N <n>       number of IMSIs (1000)\n");
+	exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *host = "127.0.0.1";
+	unsigned port = 5062;
+	unsigned localPort = 5065;
+	unsigned long count = 100000;
+	double rate = 0.0;
+	double messageFraction = 0.0;
+	unsigned long long firstIMSI = 1010000000001ULL;
+	unsigned numIMSIs = 1000;
+
+	int opt;
+	while ((opt=getopt(argc,argv,"h:p:l:n:r:m:i:N:"))!=-1) {
+		switch (opt) {
+			case 'h': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'l': localPort = atoi(optarg); break;
+			case 'n': count = strtoul(optarg,NULL,10); break;
+			case 'r': rate = atof(optarg); break;
+			case 'm': messageFraction = atof(optarg); break;
+			case 'i': firstIMSI = strtoull(optarg,NULL,10); break;
+			case 'N': numIMSIs = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (numIMSIs==0) usage(argv[0]);
+
+	UDPSocket sock(localPort,host,port);
+
+	static const char registerForm[] =
+		"REGISTER sip:%s SIP/2.0\r\n"
+		"Via: SIP/2.0/UDP 127.0.0.1:%u;branch=z9hG4bK%08lx\r\n"
+		"Max-Forwards: 70\r\n"
+		"From: <sip:IMSI%015llu@%s>;tag=%lx\r\n"
+		"To: <sip:IMSI%015llu@%s>\r\n"
+		"Call-ID: %lx-%lu@127.0.0.1\r\n"
+		"CSeq: 1 REGISTER\r\n"
+		"Contact: <sip:IMSI%015llu@127.0.0.1:%u>\r\n"
+		"Expires: 3600\r\n"
+		"Content-Length: 0\r\n\r\n";
+	static const char messageForm[] =
+		"MESSAGE sip:IMSI%015llu@%s SIP/2.0\r\n"
+		"Via: SIP/2.0/UDP 127.0.0.1:%u;branch=z9hG4bK%08lx\r\n"
+		"Max-Forwards: 70\r\n"
+		"From: <sip:1000@127.0.0.1>;tag=%lx\r\n"
+		"To: <sip:IMSI%015llu@%s>\r\n"
+		"Call-ID: %lx-%lu@127.0.0.1\r\n"
+		"CSeq: 1 MESSAGE\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: %u\r\n\r\n%s";
+	static const char text[] = "sipFlood";
+
+	long runID = random() ^ getpid();
+	char buffer[MAX_UDP_LENGTH];
+	unsigned long sent = 0;
+	unsigned long failed = 0;
+	unsigned long lastSent = 0;
+	Timeval start;
+	Timeval lastReport;
+	while (sent+failed < count) {
+		// Pace to the rate, if there is one.
+		if (rate>0.0) {
+			long due = (long)((sent+failed)*1000.0/rate);
+			long ahead = due - start.elapsed();
+			if (ahead>0) usleep(ahead*1000);
+		}
+		unsigned long n = sent+failed;
+		unsigned long long IMSI = firstIMSI + (n % numIMSIs);
+		int length;
+		if (drand48() < messageFraction) {
+			length = snprintf(buffer,sizeof(buffer),messageForm,IMSI,host,localPort,random(),random(),
+				IMSI,host,runID,n,(unsigned)strlen(text),text);
+		} else {
+			length = snprintf(buffer,sizeof(buffer),registerForm,host,localPort,random(),IMSI,host,
+				random(),IMSI,host,runID,n,IMSI,localPort);
+		}
+		// Only a very long -h address can do this.
+		if (length<0 || length>=(int)sizeof(buffer)) {
+			fprintf(stderr,"%s: request does not fit in a datagram; is the address right?\n",argv[0]);
+			return 1;
+		}
+		if (sock.write(buffer,length)<0) failed++;
+		else sent++;
+
+		if (lastReport.elapsed()>=1000) {
+			printf("%lu sent, %.0f/s\n",sent,(sent-lastSent)*1000.0/lastReport.elapsed());
+			fflush(stdout);
+			lastSent = sent;
+			lastReport.now();
+		}
+	}
+	long elapsed = start.elapsed();
+	printf("%lu sent, %lu failed, in %.3f s, %.0f/s\n",
+		sent, failed, elapsed/1000.0, elapsed>0 ? sent*1000.0/elapsed : 0.0);
+	return 0;
+}
+
+// vim: ts=4 sw=4
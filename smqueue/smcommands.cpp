@@ -19,6 +19,8 @@
  * See the COPYING file in the main directory for details.
  */
 
+#define LOG_MODULE smqueue
+
 #include "smqueue.h"
 #include "smnet.h"
 #include <iostream>
@@ -67,7 +69,7 @@ shortcode_quick_chk (const char *imsi, const char *msgtext,
 {
 	ostringstream answer;
 	
-	answer << scp->scp_smq->time_sorted_list.size() << " queued.";
+	answer << scp->scp_smq->message_list.size() << " queued.";
 	scp->scp_reply = new_strdup(answer.str().c_str());
 	return SCA_REPLY;
 }
@@ -85,8 +87,8 @@ shortcode_four_one_one (const char *imsi, const char *msgtext,
         short_msg_p_list::iterator x;
         int n = 0, missing = 0, registering = 0, bouncing = 0;
         
-        for (x = scp->scp_smq->time_sorted_list.begin();
-             x != scp->scp_smq->time_sorted_list.end(); x++) {
+        for (x = scp->scp_smq->message_list.begin();
+             x != scp->scp_smq->message_list.end(); x++) {
 	    n++;
 	    switch (x->state) {
 		case REQUEST_DESTINATION_SIPURL:
@@ -164,7 +166,6 @@ shortcode_zap_queued (const char *imsi, const char *msgtext,
 {
 	ostringstream answer;
     short_msg_p_list::iterator sent_msg;
-    short_msg_p_list resplist;
     bool noreply = false;
 
     if (msgtext[0] == '-') {
@@ -176,17 +177,16 @@ shortcode_zap_queued (const char *imsi, const char *msgtext,
         // Delete all messages in queue in NO_STATE state or with
         // huge timeouts.
         short_msg_p_list::iterator x;
-        time_t toolate = 5000 
-                       + scp->scp_smq->time_sorted_list.begin()->gettime();
+        time_t toolate = 5000 + time(NULL);
         int n = 0;
         
-        for (x = scp->scp_smq->time_sorted_list.begin();
-             x != scp->scp_smq->time_sorted_list.end(); x++) {
-            if (x->state == NO_STATE || toolate <= x->next_action_time) {
+        for (x = scp->scp_smq->message_list.begin();
+             x != scp->scp_smq->message_list.end(); ) {
+            // Step past x before it goes away.
+            short_msg_p_list::iterator here = x++;
+            if (here->state == NO_STATE || toolate <= here->next_action_time) {
                 n++;
-                resplist.splice(resplist.begin(),
-                                scp->scp_smq->time_sorted_list, x);
-                resplist.pop_front();   // pop and delete the sent_msg.
+                scp->scp_smq->delete_message(here);
             }
         }
         answer <<  "Removed " << n << " messages.";
@@ -201,9 +201,7 @@ shortcode_zap_queued (const char *imsi, const char *msgtext,
                    << " in state " << sent_msg->state
                    << " and timeout " 
                    << sent_msg->next_action_time - sent_msg->gettime();
-           resplist.splice(resplist.begin(),
-                           scp->scp_smq->time_sorted_list, sent_msg);
-           resplist.pop_front();   // pop and delete the sent_msg.
+           scp->scp_smq->delete_message(sent_msg);
         }
     }
 
@@ -0,0 +1,157 @@
+/*
+ * smheap.h - Timer heap for the Short Message queue of OpenBTS.
+ *
+ * Copyright 2009 Free Software Foundation, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * See the COPYING file in the main directory for details.
+ */
+
+#ifndef SM_HEAP_H
+#define SM_HEAP_H
+
+#include <stddef.h>
+#include <vector>
+
+namespace SMqueue {
+
+/*
+ * A binary min-heap of list iterators, ordered by the next_action_time
+ * of the elements they point to.  Each element remembers its own
+ * position in the heap (heap_index), so that an element whose time has
+ * changed can be moved, or taken out, without searching for it.  List
+ * iterators stay valid while other elements come and go, which is
+ * what makes them usable as handles here.
+ *
+ * The elements need three public members:
+ *	time_t next_action_time;	// The key
+ *	size_t heap_index;		// Position, or timer_heap::npos
+ *	unsigned long heap_seq;		// Tie-breaker, set by the heap
+ *
+ * Elements with the same time come off the heap in the order they
+ * were scheduled.
+ */
+class timer_heap_base {
+	public:
+	// heap_index of an element that isn't in a heap.  (This lives
+	// outside the template so that the element class can use it
+	// before its own iterator type exists.)
+	static const size_t npos = (size_t)-1;
+};
+
+template <class Iter>
+class timer_heap: public timer_heap_base {
+	public:
+
+	timer_heap() : heap(), seq(0) { }
+
+	bool empty() const { return heap.empty(); }
+	size_t size() const { return heap.size(); }
+
+	/* The element with the earliest time.  The heap must not be empty. */
+	Iter top() const { return heap[0]; }
+
+	/* Add an element, or move it if its time has changed.  */
+	void
+	schedule(Iter x) {
+		x->heap_seq = seq++;
+		if (x->heap_index == npos) {
+			x->heap_index = heap.size();
+			heap.push_back(x);
+			sift_up(x->heap_index);
+		} else {
+			sift_down(sift_up(x->heap_index));
+		}
+	}
+
+	/* Take an element out.  It is all right if it isn't in.  */
+	void
+	remove(Iter x) {
+		size_t i = x->heap_index;
+		if (i == npos)
+			return;
+		x->heap_index = npos;
+		Iter last = heap.back();
+		heap.pop_back();
+		if (i == heap.size())
+			return;		// It was the last one.
+		heap[i] = last;
+		last->heap_index = i;
+		sift_down(sift_up(i));
+	}
+
+	void
+	clear() {
+		for (size_t i = 0; i < heap.size(); i++)
+			heap[i]->heap_index = npos;
+		heap.clear();
+	}
+
+	private:
+
+	std::vector<Iter> heap;
+	unsigned long seq;		// Schedule order, for ties
+
+	static bool
+	earlier(const Iter &a, const Iter &b) {
+		if (a->next_action_time != b->next_action_time)
+			return a->next_action_time < b->next_action_time;
+		// Wraparound-safe comparison of the schedule order.
+		return (long)(a->heap_seq - b->heap_seq) < 0;
+	}
+
+	void
+	place(size_t i, Iter x) {
+		heap[i] = x;
+		x->heap_index = i;
+	}
+
+	// Move heap[i] toward the root; return where it ended up.
+	size_t
+	sift_up(size_t i) {
+		Iter x = heap[i];
+		while (i > 0) {
+			size_t parent = (i - 1) / 2;
+			if (!earlier(x, heap[parent]))
+				break;
+			place(i, heap[parent]);
+			i = parent;
+		}
+		place(i, x);
+		return i;
+	}
+
+	// Move heap[i] toward the leaves.
+	void
+	sift_down(size_t i) {
+		Iter x = heap[i];
+		size_t n = heap.size();
+		while (true) {
+			size_t child = 2 * i + 1;
+			if (child >= n)
+				break;
+			if (child + 1 < n && earlier(heap[child + 1], heap[child]))
+				child++;
+			if (!earlier(heap[child], x))
+				break;
+			place(i, heap[child]);
+			i = child;
+		}
+		place(i, x);
+	}
+};
+
+} // namespace SMqueue
+
+#endif
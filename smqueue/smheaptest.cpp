@@ -0,0 +1,174 @@
+/*
+ * smheaptest.cpp - Queue-depth benchmark for the smqueue timer heap.
+ *
+ * Copyright 2009 Free Software Foundation, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * See the COPYING file in the main directory for details.
+ */
+
+/*
+ * smheaptest [depth ...]
+ *
+ * For each queue depth, fills a queue with messages spread over an
+ * hour, then repeatedly takes the earliest one and gives it a new
+ * timeout, the way SMq::process_timeout does with a backlog of
+ * undeliverable messages.  It times this with the timer heap that SMq
+ * uses, and with the time-sorted list and linear reinsertion that SMq
+ * used before, and checks that the heap hands out messages in order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#include <list>
+
+#include "smheap.h"
+
+using namespace SMqueue;
+
+// Just the fields of a short_msg_pending that the queue looks at.
+struct test_msg {
+	time_t next_action_time;
+	size_t heap_index;
+	unsigned long heap_seq;
+
+	test_msg() : next_action_time(0), heap_index(timer_heap_base::npos),
+		heap_seq(0) { }
+};
+
+typedef std::list<test_msg> test_list;
+
+static const unsigned reschedules = 100000;
+
+static double
+now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+// A retry timeout, like the ones in the timeouts table.
+static time_t
+retry_time(time_t base)
+{
+	return base + 1 + random() % 3600;
+}
+
+// The old way: splice out, then walk from the head to reinsert.
+static void
+list_reinsert(test_list &sorted, test_list::iterator sm)
+{
+	test_list temp;
+	temp.splice(temp.begin(), sorted, sm);
+	for (test_list::iterator x = sorted.begin(); true; x++) {
+		if (x == sorted.end()
+		    || x->next_action_time >= sm->next_action_time) {
+			sorted.splice(x, temp);
+			break;
+		}
+	}
+}
+
+// Seconds per reschedule with the time-sorted list.
+static double
+time_list(unsigned depth)
+{
+	test_list sorted;
+	srandom(depth);
+	for (unsigned i = 0; i < depth; i++) {
+		sorted.push_front(test_msg());
+		sorted.begin()->next_action_time = retry_time(0);
+		list_reinsert(sorted, sorted.begin());
+	}
+
+	double start = now();
+	for (unsigned i = 0; i < reschedules; i++) {
+		test_list::iterator sm = sorted.begin();
+		sm->next_action_time = retry_time(sm->next_action_time);
+		list_reinsert(sorted, sm);
+	}
+	return (now() - start) / reschedules;
+}
+
+// Seconds per reschedule with the heap, or a negative number if the
+// heap got the order wrong.
+static double
+time_heap(unsigned depth)
+{
+	test_list messages;
+	timer_heap<test_list::iterator> timers;
+	srandom(depth);
+	for (unsigned i = 0; i < depth; i++) {
+		messages.push_front(test_msg());
+		messages.begin()->next_action_time = retry_time(0);
+		timers.schedule(messages.begin());
+	}
+
+	time_t last = 0;
+	bool ordered = true;
+	double start = now();
+	for (unsigned i = 0; i < reschedules; i++) {
+		test_list::iterator sm = timers.top();
+		if (sm->next_action_time < last)
+			ordered = false;
+		last = sm->next_action_time;
+		sm->next_action_time = retry_time(sm->next_action_time);
+		timers.schedule(sm);
+	}
+	double elapsed = now() - start;
+
+	// Take out messages from the middle, then drain the rest.
+	test_list::iterator x = messages.begin();
+	for (unsigned i = 0; i < depth / 2; i++, x++)
+		if (i % 3 == 0)
+			timers.remove(x);
+	last = 0;
+	while (!timers.empty()) {
+		test_list::iterator sm = timers.top();
+		if (sm->next_action_time < last)
+			ordered = false;
+		last = sm->next_action_time;
+		timers.remove(sm);
+		if (sm->heap_index != timer_heap_base::npos)
+			ordered = false;
+	}
+	return ordered? elapsed / reschedules: -1.0;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const unsigned default_depths[] = { 100, 1000, 10000, 50000 };
+	unsigned ndepths = sizeof(default_depths) / sizeof(default_depths[0]);
+	int result = 0;
+
+	printf("%10s %14s %14s\n", "depth", "list us/op", "heap us/op");
+	for (unsigned i = 0; i < (argc > 1? (unsigned)argc - 1: ndepths); i++) {
+		unsigned depth = argc > 1? atoi(argv[i + 1]): default_depths[i];
+		if (depth == 0)
+			continue;
+		double heap = time_heap(depth);
+		double list = time_list(depth);
+		if (heap < 0) {
+			printf("%10u heap out of order!\n", depth);
+			result = 1;
+			continue;
+		}
+		printf("%10u %14.3f %14.3f\n", depth, list * 1e6, heap * 1e6);
+	}
+	return result;
+}
@@ -0,0 +1,714 @@
+/*
+ * smjournal.cpp - Write-ahead journal of the Short Message queue of OpenBTS.
+ *
+ * Copyright 2009 Free Software Foundation, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * See the COPYING file in the main directory for details.
+ */
+
+#include "smjournal.h"
+#include "smqueue.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+using namespace std;
+using namespace SMqueue;
+
+/* Every journal file starts with this.  */
+static const char journal_magic[8] = { 'S','M','Q','J','R','N','L','1' };
+
+/* Record types */
+enum { JR_PUT = 1, JR_STATE = 2, JR_DELETE = 3 };
+
+/*
+ * A record is
+ *	uint32	length of the rest of the record
+ *	uint32	FNV-1a hash of the rest of the record
+ *	uint8	type
+ *	uint8	state
+ *	uint16	length of the source address
+ *	uint32	length of the text
+ *	uint64	journal_id
+ *	int64	next_action_time
+ *	the source address, then the text.
+ * in the byte order of the machine; the journal doesn't travel.
+ */
+static const size_t record_prefix = 8;
+static const size_t record_fixed = 24;
+
+/* Longest that the snapshot writer buffers before writing.  */
+static const size_t snapshot_chunk = 1 << 20;
+
+static uint32_t
+fnv(const char *p, size_t n)
+{
+	uint32_t hash = 2166136261U;
+	while (n--) {
+		hash ^= (unsigned char)*p++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void
+encode(std::string &buf, int type, unsigned long long id, int state,
+       time_t when, const char *addr, size_t addrlen,
+       const char *text, size_t textlen)
+{
+	uint32_t length = record_fixed + addrlen + textlen;
+	size_t start = buf.size();
+	buf.resize(start + record_prefix + length);
+	char *p = &buf[start];
+	char *body = p + record_prefix;
+
+	uint8_t t = type, s = state;
+	uint16_t al = addrlen;
+	uint32_t tl = textlen;
+	uint64_t i = id;
+	int64_t w = when;
+	memcpy(body + 0, &t, 1);
+	memcpy(body + 1, &s, 1);
+	memcpy(body + 2, &al, 2);
+	memcpy(body + 4, &tl, 4);
+	memcpy(body + 8, &i, 8);
+	memcpy(body + 16, &w, 8);
+	if (addrlen)
+		memcpy(body + record_fixed, addr, addrlen);
+	if (textlen)
+		memcpy(body + record_fixed + addrlen, text, textlen);
+
+	uint32_t check = fnv(body, length);
+	memcpy(p, &length, 4);
+	memcpy(p + 4, &check, 4);
+}
+
+static bool
+write_all(int fd, const char *p, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static double
+seconds_since(const struct timeval &then)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - then.tv_sec) + 1e-6 * (now.tv_usec - then.tv_usec);
+}
+
+
+SMjournal::SMjournal() :
+	segment_bytes(8 << 20),
+	sync_interval(1000),
+	dir(),
+	fd(-1),
+	segment(0),
+	segment_size(0),
+	buffer(),
+	unsynced(false),
+	next_id(1),
+	snapshot(0),
+	snapshot_size(0),
+	closed(),
+	compact_at(0),
+	compacting(NULL),
+	compactor(NULL),
+	records(0),
+	bytes(0),
+	writes(0),
+	syncs(0),
+	unsynced_records(0),
+	synced_records(0),
+	compactions(0),
+	recovery_seconds(0.0),
+	recovered(0)
+{
+	gettimeofday(&last_sync, NULL);
+}
+
+SMjournal::~SMjournal()
+{
+	close();
+}
+
+std::string
+SMjournal::file_name(const std::string &dir, const char *kind, unsigned n)
+{
+	char name[40];
+	snprintf(name, sizeof(name), "/%s.%08u", kind, n);
+	return dir + name;
+}
+
+bool
+SMjournal::sync_dir(const std::string &dir)
+{
+	int dfd = ::open(dir.c_str(), O_RDONLY);
+	if (dfd < 0)
+		return false;
+	bool ok = fsync(dfd) == 0;
+	::close(dfd);
+	return ok;
+}
+
+bool
+SMjournal::open(const std::string &path)
+{
+	close();
+	dir = path;
+	if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+		cerr << "Cannot create journal directory " << dir << ": "
+		     << strerror(errno) << endl;
+		return false;
+	}
+	DIR *d = opendir(dir.c_str());
+	if (!d) {
+		cerr << "Cannot read journal directory " << dir << ": "
+		     << strerror(errno) << endl;
+		return false;
+	}
+
+	std::vector<unsigned> segments, snapshots;
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		unsigned n;
+		char extra;
+		if (sscanf(e->d_name, "journal.%u%c", &n, &extra) == 1)
+			segments.push_back(n);
+		else if (sscanf(e->d_name, "snapshot.%u%c", &n, &extra) == 1)
+			snapshots.push_back(n);
+		else if (!strncmp(e->d_name, "snapshot.", 9))
+			// A compaction that didn't finish.
+			unlink((dir + "/" + e->d_name).c_str());
+	}
+	closedir(d);
+
+	// Use the latest snapshot.  Anything older is left over from a
+	// compaction that finished but didn't get to clean up.
+	snapshot = 0;
+	for (unsigned i = 0; i < snapshots.size(); i++)
+		if (snapshots[i] > snapshot)
+			snapshot = snapshots[i];
+	for (unsigned i = 0; i < snapshots.size(); i++)
+		if (snapshots[i] != snapshot)
+			unlink(file_name(dir, "snapshot", snapshots[i]).c_str());
+
+	struct stat st;
+	snapshot_size = 0;
+	if (snapshot && stat(file_name(dir, "snapshot", snapshot).c_str(), &st) == 0)
+		snapshot_size = st.st_size;
+
+	closed.clear();
+	unsigned last = snapshot;
+	for (unsigned i = 0; i < segments.size(); i++) {
+		std::string name = file_name(dir, "journal", segments[i]);
+		if (segments[i] <= snapshot) {
+			unlink(name.c_str());
+			continue;
+		}
+		closed[segments[i]] = stat(name.c_str(), &st) == 0? st.st_size: 0;
+		if (segments[i] > last)
+			last = segments[i];
+	}
+	compact_at = 0;
+
+	// Never append to an old segment; it may end in a torn record.
+	return open_segment(last + 1);
+}
+
+bool
+SMjournal::open_segment(unsigned n)
+{
+	std::string name = file_name(dir, "journal", n);
+	int f = ::open(name.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_APPEND, 0644);
+	if (f < 0) {
+		cerr << "Cannot create journal segment " << name << ": "
+		     << strerror(errno) << endl;
+		return false;
+	}
+	// The new file has to survive a crash before anything in it can.
+	if (!write_all(f, journal_magic, sizeof(journal_magic))
+	    || fdatasync(f) < 0 || !sync_dir(dir)) {
+		cerr << "Cannot start journal segment " << name << ": "
+		     << strerror(errno) << endl;
+		::close(f);
+		unlink(name.c_str());
+		return false;
+	}
+	fd = f;
+	segment = n;
+	segment_size = sizeof(journal_magic);
+	return true;
+}
+
+void
+SMjournal::close()
+{
+	if (compacting)
+		finish_compaction();
+	if (fd >= 0) {
+		commit(true);
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+	}
+	buffer.clear();
+}
+
+void
+SMjournal::fail(const char *what)
+{
+	cerr << "Journal " << what << " failed: " << strerror(errno)
+	     << "; no longer journaling." << endl;
+	::close(fd);
+	fd = -1;
+	buffer.clear();
+	unsynced = false;
+}
+
+/*
+ * Replay one file into msgs.  A torn or corrupt record ends the file;
+ * that's what the end of the last segment looks like after a crash.
+ * Returns false only if the file can't be read at all.
+ */
+bool
+SMjournal::replay(const std::string &path, saved_msg_map &msgs,
+		  unsigned long long &max_id)
+{
+	int f = ::open(path.c_str(), O_RDONLY);
+	if (f < 0) {
+		cerr << "Cannot open journal file " << path << ": "
+		     << strerror(errno) << endl;
+		return false;
+	}
+	struct stat st;
+	if (fstat(f, &st) < 0) {
+		::close(f);
+		return false;
+	}
+	size_t size = st.st_size;
+	if (size <= sizeof(journal_magic)) {
+		// Empty, or cut off while it was being started.
+		::close(f);
+		return true;
+	}
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, f, 0);
+	::close(f);
+	if (map == MAP_FAILED) {
+		cerr << "Cannot map journal file " << path << ": "
+		     << strerror(errno) << endl;
+		return false;
+	}
+	const char *p = (const char *)map;
+	const char *end = p + size;
+	if (memcmp(p, journal_magic, sizeof(journal_magic))) {
+		cerr << "Journal file " << path << " has a bad header." << endl;
+		munmap(map, size);
+		return false;
+	}
+	p += sizeof(journal_magic);
+
+	while ((size_t)(end - p) >= record_prefix) {
+		uint32_t length, check;
+		memcpy(&length, p, 4);
+		memcpy(&check, p + 4, 4);
+		const char *body = p + record_prefix;
+		if (length < record_fixed || (size_t)(end - body) < length)
+			break;
+		if (fnv(body, length) != check)
+			break;
+
+		uint8_t type, state;
+		uint16_t addrlen;
+		uint32_t textlen;
+		uint64_t id;
+		int64_t when;
+		memcpy(&type, body + 0, 1);
+		memcpy(&state, body + 1, 1);
+		memcpy(&addrlen, body + 2, 2);
+		memcpy(&textlen, body + 4, 4);
+		memcpy(&id, body + 8, 8);
+		memcpy(&when, body + 16, 8);
+		if (record_fixed + addrlen + textlen != length)
+			break;
+
+		if (type == JR_PUT) {
+			saved_msg &m = msgs[id];
+			m.state = state;
+			m.next_action_time = when;
+			m.srcaddr.assign(body + record_fixed, addrlen);
+			m.text.assign(body + record_fixed + addrlen, textlen);
+		} else if (type == JR_STATE) {
+			saved_msg_map::iterator m = msgs.find(id);
+			if (m != msgs.end()) {
+				m->second.state = state;
+				m->second.next_action_time = when;
+			}
+		} else if (type == JR_DELETE) {
+			msgs.erase(id);
+		} else {
+			break;
+		}
+		if (id > max_id)
+			max_id = id;
+		p = body + length;
+	}
+	if (p != end) {
+		cerr << "Journal file " << path << ": ignoring "
+		     << (end - p) << " bytes after the last good record."
+		     << endl;
+	}
+	munmap(map, size);
+	return true;
+}
+
+bool
+SMjournal::recover(saved_msg_map &msgs)
+{
+	if (!is_open())
+		return false;
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	unsigned long long max_id = 0;
+	bool ok = true;
+	if (snapshot)
+		ok = replay(file_name(dir, "snapshot", snapshot), msgs, max_id);
+	for (std::map<unsigned, size_t>::iterator s = closed.begin();
+	     s != closed.end(); s++) {
+		if (!replay(file_name(dir, "journal", s->first), msgs, max_id))
+			ok = false;
+	}
+	next_id = max_id + 1;
+
+	recovered = msgs.size();
+	recovery_seconds = seconds_since(start);
+	cerr << "Journal " << dir << ": recovered " << recovered
+	     << " messages in " << recovery_seconds * 1000.0 << " ms." << endl;
+	return ok;
+}
+
+void
+SMjournal::adopt(short_msg_pending &smp, unsigned long long id)
+{
+	smp.journal_id = id;
+	smp.journal_hash = fnv(smp.text, smp.text_length);
+}
+
+void
+SMjournal::append(int type, unsigned long long id, int state, time_t when,
+		  const char *addr, size_t addrlen,
+		  const char *text, size_t textlen)
+{
+	encode(buffer, type, id, state, when, addr, addrlen, text, textlen);
+	records++;
+	unsynced_records++;
+}
+
+void
+SMjournal::put(short_msg_pending &smp)
+{
+	if (!is_open())
+		return;
+	smp.make_text_valid();
+	if (!smp.journal_id)
+		smp.journal_id = next_id++;
+	smp.journal_hash = fnv(smp.text, smp.text_length);
+	append(JR_PUT, smp.journal_id, smp.state, smp.next_action_time,
+	       smp.srcaddr, smp.srcaddrlen, smp.text, smp.text_length);
+}
+
+void
+SMjournal::change_state(short_msg_pending &smp)
+{
+	if (!is_open())
+		return;
+	// Most states don't touch the text; the ones that do (lookups
+	// that rewrite the addresses) need the whole message again.
+	smp.make_text_valid();
+	if (!smp.journal_id
+	    || fnv(smp.text, smp.text_length) != smp.journal_hash) {
+		put(smp);
+		return;
+	}
+	append(JR_STATE, smp.journal_id, smp.state, smp.next_action_time,
+	       NULL, 0, NULL, 0);
+}
+
+void
+SMjournal::remove(short_msg_pending &smp)
+{
+	if (!smp.journal_id)
+		return;
+	forget(smp.journal_id);
+	smp.journal_id = 0;
+}
+
+void
+SMjournal::forget(unsigned long long id)
+{
+	if (!is_open())
+		return;
+	append(JR_DELETE, id, 0, 0, NULL, 0, NULL, 0);
+}
+
+bool
+SMjournal::commit(bool durable)
+{
+	if (!is_open())
+		return false;
+	if (!buffer.empty()) {
+		if (!write_all(fd, buffer.data(), buffer.size())) {
+			fail("write");
+			return false;
+		}
+		segment_size += buffer.size();
+		bytes += buffer.size();
+		writes++;
+		buffer.clear();
+		unsynced = true;
+	}
+	if (unsynced && (durable
+			 || seconds_since(last_sync) * 1000.0 >= sync_interval))
+		return sync();
+	return true;
+}
+
+bool
+SMjournal::sync()
+{
+	if (fdatasync(fd) < 0) {
+		fail("sync");
+		return false;
+	}
+	gettimeofday(&last_sync, NULL);
+	unsynced = false;
+	syncs++;
+	synced_records += unsynced_records;
+	unsynced_records = 0;
+	return true;
+}
+
+int
+SMjournal::commit_timeout()
+{
+	if (!is_open() || (!unsynced && buffer.empty()))
+		return -1;
+	int left = sync_interval - (int)(seconds_since(last_sync) * 1000.0);
+	return left > 0? left: 0;
+}
+
+void
+SMjournal::maintain()
+{
+	if (compacting && compacting->done)
+		finish_compaction();
+	if (!is_open())
+		return;
+
+	if (segment_size >= segment_bytes) {
+		// Everything in the old segment reaches the disk before the
+		// compactor can fold it into a snapshot.
+		if (!commit(true))
+			return;
+		::close(fd);
+		fd = -1;
+		closed[segment] = segment_size;
+		if (!open_segment(segment + 1)) {
+			cerr << "No longer journaling." << endl;
+			return;
+		}
+	}
+
+	if (!compacting && !closed.empty()) {
+		size_t closed_bytes = 0;
+		for (std::map<unsigned, size_t>::iterator s = closed.begin();
+		     s != closed.end(); s++)
+			closed_bytes += s->second;
+		size_t threshold = segment_bytes > snapshot_size?
+			segment_bytes: snapshot_size;
+		if (compact_at > threshold)
+			threshold = compact_at;
+		if (closed_bytes >= threshold)
+			start_compaction();
+	}
+}
+
+void
+SMjournal::start_compaction()
+{
+	compacting = new compaction;
+	compacting->dir = dir;
+	compacting->base = snapshot;
+	for (std::map<unsigned, size_t>::iterator s = closed.begin();
+	     s != closed.end(); s++)
+		compacting->segments.push_back(s->first);
+	compacting->ok = false;
+	compacting->size = 0;
+	compacting->msgs = 0;
+	compacting->done = false;
+	compactor = new Thread;
+	compactor->start(compact, compacting);
+}
+
+void
+SMjournal::finish_compaction()
+{
+	compactor->join();
+	delete compactor;
+	compactor = NULL;
+
+	if (compacting->ok) {
+		unsigned last = compacting->segments.back();
+		closed.erase(closed.begin(), closed.upper_bound(last));
+		snapshot = last;
+		snapshot_size = compacting->size;
+		compact_at = 0;
+		compactions++;
+		cerr << "Journal " << dir << ": compacted to "
+		     << compacting->msgs << " messages in snapshot " << last
+		     << "." << endl;
+	} else {
+		// Try again once there's another segment's worth.
+		size_t closed_bytes = 0;
+		for (std::map<unsigned, size_t>::iterator s = closed.begin();
+		     s != closed.end(); s++)
+			closed_bytes += s->second;
+		compact_at = closed_bytes + segment_bytes;
+		cerr << "Journal " << dir << ": compaction failed." << endl;
+	}
+	delete compacting;
+	compacting = NULL;
+}
+
+/* Compactor thread.  */
+void *
+SMjournal::compact(void *arg)
+{
+	compaction *c = (compaction *)arg;
+	saved_msg_map msgs;
+	unsigned long long max_id = 0;
+
+	c->ok = true;
+	if (c->base)
+		c->ok = replay(file_name(c->dir, "snapshot", c->base),
+			       msgs, max_id);
+	for (unsigned i = 0; c->ok && i < c->segments.size(); i++)
+		c->ok = replay(file_name(c->dir, "journal", c->segments[i]),
+			       msgs, max_id);
+
+	unsigned last = c->segments.back();
+	if (c->ok)
+		c->ok = write_snapshot(file_name(c->dir, "snapshot", last),
+				       msgs, c->size)
+			&& sync_dir(c->dir);
+	if (c->ok) {
+		// The snapshot stands in for these now.
+		if (c->base)
+			unlink(file_name(c->dir, "snapshot", c->base).c_str());
+		for (unsigned i = 0; i < c->segments.size(); i++)
+			unlink(file_name(c->dir, "journal", c->segments[i]).c_str());
+	}
+	c->msgs = msgs.size();
+
+	__sync_synchronize();
+	c->done = true;
+	return NULL;
+}
+
+bool
+SMjournal::write_snapshot(const std::string &path, const saved_msg_map &msgs,
+			  size_t &size)
+{
+	std::string tmp = path + ".tmp";
+	int f = ::open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (f < 0) {
+		cerr << "Cannot create journal snapshot " << tmp << ": "
+		     << strerror(errno) << endl;
+		return false;
+	}
+
+	std::string chunk(journal_magic, sizeof(journal_magic));
+	bool ok = true;
+	size = 0;
+	for (saved_msg_map::const_iterator m = msgs.begin();
+	     ok && m != msgs.end(); m++) {
+		encode(chunk, JR_PUT, m->first, m->second.state,
+		       m->second.next_action_time,
+		       m->second.srcaddr.data(), m->second.srcaddr.size(),
+		       m->second.text.data(), m->second.text.size());
+		if (chunk.size() >= snapshot_chunk) {
+			ok = write_all(f, chunk.data(), chunk.size());
+			size += chunk.size();
+			chunk.clear();
+		}
+	}
+	if (ok) {
+		ok = write_all(f, chunk.data(), chunk.size());
+		size += chunk.size();
+	}
+	if (ok)
+		ok = fdatasync(f) == 0;
+	if (!ok)
+		cerr << "Cannot write journal snapshot " << tmp << ": "
+		     << strerror(errno) << endl;
+	::close(f);
+	if (ok && rename(tmp.c_str(), path.c_str()) < 0) {
+		cerr << "Cannot rename journal snapshot " << tmp << ": "
+		     << strerror(errno) << endl;
+		ok = false;
+	}
+	if (!ok)
+		unlink(tmp.c_str());
+	return ok;
+}
+
+void
+SMjournal::dump(std::ostream &os)
+{
+	os << "Journal " << dir << ": ";
+	if (!is_open()) {
+		os << "not open." << endl;
+		return;
+	}
+	os << "segment " << segment << " (" << segment_size << " bytes), "
+	   << closed.size() << " closed segments after snapshot " << snapshot
+	   << " (" << snapshot_size << " bytes)"
+	   << (compacting? ", compacting": "") << endl;
+	os << "  " << records << " records, " << bytes << " bytes, "
+	   << writes << " writes, " << syncs << " syncs";
+	if (syncs)
+		os << " (" << (double)synced_records / syncs << " records each)";
+	os << ", " << compactions << " compactions" << endl;
+	os << "  recovered " << recovered << " messages in "
+	   << recovery_seconds * 1000.0 << " ms" << endl;
+}
@@ -0,0 +1,184 @@
+/*
+ * smjournal.h - Write-ahead journal of the Short Message queue of OpenBTS.
+ *
+ * Copyright 2009 Free Software Foundation, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * See the COPYING file in the main directory for details.
+ */
+
+#ifndef SM_JOURNAL_H
+#define SM_JOURNAL_H
+
+#include <time.h>
+#include <sys/time.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <iostream>
+
+#include <Threads.h>
+
+namespace SMqueue {
+
+class short_msg_pending;		// Forward declaration
+
+/*
+ * The journal is a directory of files that, replayed in order, give
+ * back the queue:
+ *
+ *	snapshot.N	Every message that was queued after journal.N
+ *	journal.M	Changes since, for M > N, oldest first.
+ *
+ * Each file is a header followed by binary records, each with its own
+ * length and checksum.  A message is added or replaced by a PUT record
+ * (state, time, source address and text), has its state changed by a
+ * STATE record, and leaves the queue with a DELETE record.  Messages
+ * are known by a journal_id that the journal gives them.
+ *
+ * Records are buffered, and commit() writes them out.  A durable
+ * commit also waits for the disk, so the main loop batches up the
+ * acknowledgements of the messages it accepts and makes one durable
+ * commit for the lot of them (group commit).  Other changes are
+ * synced at most sync_interval ms after they are written.
+ *
+ * When a segment is full, the journal goes on in a new one.  Once
+ * the closed segments add up to more than the last snapshot, a thread
+ * replays the snapshot and the closed segments into a new snapshot and
+ * deletes the old files.  It only reads files that the main loop is
+ * finished with, so it never touches the queue itself.
+ */
+class SMjournal {
+	public:
+
+	/* A message as the journal remembers it.  */
+	struct saved_msg {
+		int state;
+		time_t next_action_time;
+		std::string srcaddr;
+		std::string text;
+
+		saved_msg() : state(0), next_action_time(0), srcaddr(), text() { }
+	};
+	typedef std::map<unsigned long long, saved_msg> saved_msg_map;
+
+	/* Tunables; set them before open().  */
+	size_t segment_bytes;		// Start a new segment after this
+	int sync_interval;		// Longest ms that changes go unsynced
+
+	SMjournal();
+	~SMjournal();
+
+	/* Open the journal in a directory, creating it if need be.
+	   Return false if it can't be used.  */
+	bool open(const std::string &dir);
+	bool is_open() const { return fd >= 0; }
+	/* Commit what's buffered and close.  Waits for any compaction.  */
+	void close();
+
+	/* Read back the messages that were queued when the journal was
+	   last closed (or crashed).  Call it once, right after open().  */
+	bool recover(saved_msg_map &msgs);
+
+	/* Note that a recovered message is back in the queue.  */
+	void adopt(short_msg_pending &smp, unsigned long long id);
+
+	/* Record a message going into the queue, changing state, or
+	   leaving the queue.  These only buffer the record.  */
+	void put(short_msg_pending &smp);
+	void change_state(short_msg_pending &smp);
+	void remove(short_msg_pending &smp);
+	/* Drop a recovered message that isn't going back in the queue.  */
+	void forget(unsigned long long id);
+
+	/* Write what's buffered.  If durable, or if the sync interval has
+	   passed, also wait for it to reach the disk.  */
+	bool commit(bool durable);
+
+	/* How many ms the main loop can wait before calling commit()
+	   again to keep the sync interval; -1 for as long as it likes.  */
+	int commit_timeout();
+
+	/* Start new segments and compactions as needed, and collect
+	   finished compactions.  Call it from the main loop.  */
+	void maintain();
+
+	void dump(std::ostream &os);
+
+	private:
+
+	std::string dir;
+	int fd;				// Current segment, or -1
+	unsigned segment;		// Its number
+	size_t segment_size;		// Its length so far
+	std::string buffer;		// Records not written yet
+	bool unsynced;			// Written but not synced
+	struct timeval last_sync;
+	unsigned long long next_id;
+
+	unsigned snapshot;		// Number of the latest snapshot, or 0
+	size_t snapshot_size;
+	std::map<unsigned, size_t> closed; // Closed segments since, and sizes
+	size_t compact_at;		// Closed bytes that start a compaction
+
+	/* A compaction in progress.  */
+	struct compaction {
+		std::string dir;
+		unsigned base;		// Snapshot to start from, or 0
+		std::vector<unsigned> segments;	// Segments to fold in
+		bool ok;
+		size_t size;		// Of the new snapshot
+		size_t msgs;		// Messages in it
+		volatile bool done;
+	};
+	compaction *compacting;
+	Thread *compactor;
+
+	/* Statistics */
+	unsigned long records;
+	unsigned long long bytes;
+	unsigned long writes;
+	unsigned long syncs;
+	unsigned long unsynced_records;	// Written since the last sync
+	unsigned long synced_records;	// Records made durable by syncs
+	unsigned long compactions;
+	double recovery_seconds;
+	size_t recovered;
+
+	bool open_segment(unsigned n);
+	void append(int type, unsigned long long id, int state, time_t when,
+		    const char *addr, size_t addrlen,
+		    const char *text, size_t textlen);
+	bool sync();
+	void fail(const char *what);
+	void start_compaction();
+	void finish_compaction();
+
+	static void *compact(void *arg);
+	static bool replay(const std::string &path, saved_msg_map &msgs,
+			   unsigned long long &max_id);
+	static bool write_snapshot(const std::string &path,
+				   const saved_msg_map &msgs, size_t &size);
+	static std::string file_name(const std::string &dir,
+				     const char *kind, unsigned n);
+	static bool sync_dir(const std::string &dir);
+
+	// Not copyable.
+	SMjournal(const SMjournal &);
+	SMjournal & operator= (const SMjournal &);
+};
+
+} // namespace SMqueue
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * smjournaltest.cpp - Recovery tests for the smqueue journal.
+ *
+ * Copyright 2009 Free Software Foundation, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * See the COPYING file in the main directory for details.
+ */
+
+/*
+ * smjournaltest
+ *
+ * Writes journal segments by hand, the way a crashed smqueue leaves
+ * them, and checks what SMjournal recovers from them:
+ *
+ *  - A segment that ends in a torn record, or in a record with a bad
+ *    checksum, gives back every record before it.
+ *  - Compacting closed segments into a snapshot deletes them, and a
+ *    journal opened afterwards recovers the same messages from the
+ *    snapshot.
+ *
+ * It works in a new directory under /tmp and removes it when done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string>
+
+#include "smjournal.h"
+
+using namespace SMqueue;
+
+typedef SMjournal::saved_msg_map msg_map;
+
+// The record format in smjournal.cpp, written out independently so
+// that the test notices if the two drift apart.
+enum { JR_PUT = 1, JR_STATE = 2, JR_DELETE = 3 };
+static const char magic[8] = { 'S','M','Q','J','R','N','L','1' };
+
+// smjournal.cpp gets this through smqueue.h.  The real one is in
+// smqueue.cpp, which we don't link.
+namespace SMqueue {
+void
+abfuckingort()
+{
+	abort();
+}
+}
+
+static int failures = 0;
+
+static void
+check(bool ok, const char *what)
+{
+	if (!ok) {
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+static uint32_t
+fnv(const char *p, size_t n)
+{
+	uint32_t hash = 2166136261U;
+	while (n--) {
+		hash ^= (unsigned char)*p++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void
+record(std::string &buf, int type, unsigned long long id, int state,
+       time_t when, const std::string &addr, const std::string &text)
+{
+	std::string body(24, '\0');
+	uint8_t t = type, s = state;
+	uint16_t al = addr.size();
+	uint32_t tl = text.size();
+	uint64_t i = id;
+	int64_t w = when;
+	memcpy(&body[0], &t, 1);
+	memcpy(&body[1], &s, 1);
+	memcpy(&body[2], &al, 2);
+	memcpy(&body[4], &tl, 4);
+	memcpy(&body[8], &i, 8);
+	memcpy(&body[16], &w, 8);
+	body += addr;
+	body += text;
+
+	uint32_t length = body.size();
+	uint32_t hash = fnv(body.data(), body.size());
+	buf.append((const char *)&length, 4);
+	buf.append((const char *)&hash, 4);
+	buf += body;
+}
+
+static void
+put(std::string &buf, unsigned long long id, int state, time_t when,
+    const char *text)
+{
+	record(buf, JR_PUT, id, state, when, "10.0.0.1:5062", text);
+}
+
+static std::string
+file_name(const std::string &dir, const char *kind, unsigned n)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/%s.%08u", kind, n);
+	return dir + name;
+}
+
+static bool
+exists(const std::string &path)
+{
+	struct stat st;
+	return stat(path.c_str(), &st) == 0;
+}
+
+static void
+write_file(const std::string &path, const std::string &records)
+{
+	std::string data(magic, sizeof(magic));
+	data += records;
+	FILE *f = fopen(path.c_str(), "w");
+	if (!f || fwrite(data.data(), 1, data.size(), f) != data.size()) {
+		perror(path.c_str());
+		exit(2);
+	}
+	fclose(f);
+}
+
+static std::string
+make_dir()
+{
+	char tmpl[] = "/tmp/smjournaltest.XXXXXX";
+	if (!mkdtemp(tmpl)) {
+		perror("mkdtemp");
+		exit(2);
+	}
+	return tmpl;
+}
+
+static void
+remove_dir(const std::string &dir)
+{
+	DIR *d = opendir(dir.c_str());
+	if (!d)
+		return;
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL)
+		if (strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+			unlink((dir + "/" + e->d_name).c_str());
+	closedir(d);
+	rmdir(dir.c_str());
+}
+
+static bool
+has(const msg_map &msgs, unsigned long long id, int state, time_t when,
+    const char *text)
+{
+	msg_map::const_iterator m = msgs.find(id);
+	return m != msgs.end() && m->second.state == state
+		&& m->second.next_action_time == when
+		&& m->second.srcaddr == "10.0.0.1:5062"
+		&& m->second.text == text;
+}
+
+// Recover from a segment that ends part way through a record, then
+// from one whose last record is corrupt.
+static void
+test_torn_tail()
+{
+	std::string dir = make_dir();
+
+	std::string good;
+	put(good, 1, 3, 100, "first");
+	put(good, 2, 3, 200, "second");
+	put(good, 3, 3, 300, "third");
+	record(good, JR_STATE, 2, 5, 250, "", "");
+	record(good, JR_DELETE, 3, 0, 0, "", "");
+	write_file(file_name(dir, "journal", 1), good);
+
+	// The second segment was being written when smqueue crashed.
+	std::string tail;
+	put(tail, 5, 3, 500, "fifth");
+	std::string cut;
+	put(cut, 6, 3, 600, "sixth, half written");
+	tail += cut.substr(0, cut.size() / 2);
+	write_file(file_name(dir, "journal", 2), tail);
+
+	SMjournal j;
+	msg_map msgs;
+	check(j.open(dir), "open a journal with a torn segment");
+	check(j.recover(msgs), "recover from a torn segment");
+	check(msgs.size() == 3, "torn segment: three messages recovered");
+	check(has(msgs, 1, 3, 100, "first"), "torn segment: message 1");
+	check(has(msgs, 2, 5, 250, "second"),
+	      "torn segment: message 2 has its new state");
+	check(msgs.find(3) == msgs.end(), "torn segment: message 3 deleted");
+	check(has(msgs, 5, 3, 500, "fifth"),
+	      "torn segment: record before the tear");
+	check(msgs.find(6) == msgs.end(), "torn segment: torn record dropped");
+	check(exists(file_name(dir, "journal", 3)),
+	      "torn segment: new records go in a new segment");
+
+	// Drop one, as smqueue does with a message it won't requeue.
+	j.forget(1);
+	check(j.commit(true), "commit after recovery");
+	j.close();
+
+	// Corrupt the last record of a segment without changing its length.
+	std::string bad;
+	put(bad, 7, 3, 700, "seventh");
+	put(bad, 8, 3, 800, "eighth, bit-flipped");
+	bad[bad.size() - 1] ^= 0x20;
+	write_file(file_name(dir, "journal", 4), bad);
+
+	SMjournal k;
+	msgs.clear();
+	check(k.open(dir), "reopen");
+	check(k.recover(msgs), "recover from a corrupt record");
+	check(msgs.size() == 3, "corrupt record: three messages recovered");
+	check(msgs.find(1) == msgs.end(), "corrupt record: forgotten message");
+	check(has(msgs, 2, 5, 250, "second"), "corrupt record: message 2");
+	check(has(msgs, 5, 3, 500, "fifth"), "corrupt record: message 5");
+	check(has(msgs, 7, 3, 700, "seventh"),
+	      "corrupt record: record before the bad one");
+	check(msgs.find(8) == msgs.end(), "corrupt record: bad record dropped");
+	k.close();
+
+	remove_dir(dir);
+}
+
+// Fold closed segments into a snapshot, then recover from it.
+static void
+test_compaction()
+{
+	std::string dir = make_dir();
+
+	std::string seg;
+	msg_map expected;
+	for (unsigned n = 1; n <= 3; n++) {
+		seg.clear();
+		for (unsigned i = 0; i < 20; i++) {
+			unsigned long long id = (n - 1) * 20 + i + 1;
+			char text[40];
+			snprintf(text, sizeof(text), "message %llu", id);
+			put(seg, id, 3, id * 10, text);
+			SMjournal::saved_msg &m = expected[id];
+			m.state = 3;
+			m.next_action_time = id * 10;
+			m.srcaddr = "10.0.0.1:5062";
+			m.text = text;
+		}
+		// Each segment deletes a few from the one before, and
+		// moves another along.
+		if (n > 1) {
+			for (unsigned long long id = (n - 2) * 20 + 1;
+			     id <= (n - 2) * 20 + 5; id++) {
+				record(seg, JR_DELETE, id, 0, 0, "", "");
+				expected.erase(id);
+			}
+			unsigned long long id = (n - 2) * 20 + 10;
+			record(seg, JR_STATE, id, 7, 12345, "", "");
+			expected[id].state = 7;
+			expected[id].next_action_time = 12345;
+		}
+		write_file(file_name(dir, "journal", n), seg);
+	}
+
+	SMjournal j;
+	msg_map msgs;
+	j.segment_bytes = 1;		// Every segment is full.
+	check(j.open(dir), "open for compaction");
+	check(j.recover(msgs), "recover before compaction");
+	check(msgs.size() == expected.size(),
+	      "before compaction: right number of messages");
+
+	// Segment 4 is the one open() started; change it too.
+	j.forget(60);
+	expected.erase(60);
+	check(j.commit(true), "commit before compaction");
+
+	// Closes segment 4 and folds segments 1-4 into snapshot 4.
+	j.maintain();
+	j.close();
+
+	check(exists(file_name(dir, "snapshot", 4)), "snapshot 4 written");
+	for (unsigned n = 1; n <= 4; n++)
+		check(!exists(file_name(dir, "journal", n)),
+		      "compacted segment deleted");
+	check(exists(file_name(dir, "journal", 5)),
+	      "segment opened after the rotation kept");
+
+	SMjournal k;
+	msgs.clear();
+	check(k.open(dir), "reopen after compaction");
+	check(k.recover(msgs), "recover after compaction");
+	check(msgs.size() == expected.size(),
+	      "after compaction: right number of messages");
+	bool same = true;
+	for (msg_map::iterator m = expected.begin(); m != expected.end(); m++)
+		if (!has(msgs, m->first, m->second.state,
+			 m->second.next_action_time, m->second.text.c_str()))
+			same = false;
+	check(same, "after compaction: same messages");
+	k.close();
+
+	remove_dir(dir);
+}
+
+int
+main(int argc, char **argv)
+{
+	test_torn_tail();
+	test_compaction();
+	if (failures) {
+		printf("%d checks failed.\n", failures);
+		return 1;
+	}
+	printf("All journal checks passed.\n");
+	return 0;
+}
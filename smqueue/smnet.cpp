@@ -19,6 +19,8 @@
  * See the COPYING file in the main directory for details.
  */
 
+#define LOG_MODULE smqueue
+
 #include <time.h>
 #include <osipparser2/osip_message.h>	/* from osipparser2 */
 #include <iostream>
@@ -31,6 +33,7 @@
 #include <fcntl.h>
 #include <cstdlib>			// l64a
 #include <arpa/inet.h>			// inet_ntop
+#include <unistd.h>			// read
 
 #include "smnet.h"
 #include "smqueue.h"
@@ -202,6 +205,16 @@ SMnet::get_next_dgram (char *buffer, size_t bufferlen, int mstimeout)
 		fd = sockets[j].fd;
 		revents = sockets[j].revents;
 
+		if (fd == wakeup_fd) {
+			if (revents & POLLIN) {
+				char junk[64];
+				while (read(fd, junk, sizeof(junk)) > 0)
+					continue;
+				return 0;	// Tell caller to look around
+			}
+			continue;
+		}
+
 #ifdef POLLRDHUP
 		if (revents & (POLLIN|POLLPRI|POLLRDHUP))
 #else
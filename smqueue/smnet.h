@@ -58,6 +58,9 @@ class SMnet {
 	char *random_string;
 	// The file descriptor we read random numbers from.
 	int random_fd;
+	// A pipe that wakes us up when someone else has work for us,
+	// or -1.  It belongs to whoever gave it to us.
+	int wakeup_fd;
 
 	void abfuckingort();	// where did C library abort() go?
 
@@ -71,7 +74,8 @@ class SMnet {
 		recvaddrlen (0),
 		my_network_hostname (0),
 		random_string (0),
-		random_fd (0)
+		random_fd (0),
+		wakeup_fd (-1)
 	{
 	}
 
@@ -87,7 +91,8 @@ class SMnet {
 		recvaddrlen (0),
 		my_network_hostname (0),
 		random_string (0),
-		random_fd (0)
+		random_fd (0),
+		wakeup_fd (-1)
 	{
 		abfuckingort();
 	}
@@ -103,7 +108,8 @@ class SMnet {
 	~SMnet() {
 		unsigned i;
   		for (i = 0; i < numsockets; i++) {
-			(void) close(sockets[i].fd);  // Ignore result.
+			if (sockets[i].fd != wakeup_fd)
+				(void) close(sockets[i].fd);  // Ignore result.
 		}
 		delete [] sockets;
 		delete [] sockinfo;
@@ -164,6 +170,22 @@ class SMnet {
 		// We never shrink the allocation; it's almost peanuts.
 	}
 
+	/* Also return from get_next_dgram when fd becomes readable.
+	   It reads fd dry and returns 0, as for a timeout.  */
+	void
+	add_wakeup(int fd) {
+		remove_wakeup();
+		wakeup_fd = fd;
+		add_socket(fd, POLLIN, 0, 0, 0, NULL, 0);
+	}
+
+	void
+	remove_wakeup() {
+		if (wakeup_fd >= 0)
+			remove_socket(wakeup_fd);
+		wakeup_fd = -1;
+	}
+
 	/* Change the event mask for socket so that we'll awaken when
   	 * it's possible to write to the socket (or not).  
  	 *
@@ -19,6 +19,8 @@
  * See the COPYING file in the main directory for details.
  */
 
+#define LOG_MODULE smqueue
+
 #include "smqueue.h"
 #include "smnet.h"
 #include <time.h>
@@ -31,6 +33,8 @@
 #include <sys/stat.h>           // open
 #include <fcntl.h>          // open
 #include <ctype.h>		// isdigit
+#include <math.h>		// ceil
+#include <unistd.h>		// access
 
 #include <Logger.h>
 #include <Configuration.h>	// DAB
@@ -56,26 +60,29 @@ ConfigurationTable gConfig("smqueue.config");
 #define RT	600	/* seconds = 5 minutes - "Re Try" - for state
 			   transitions where we're starting over from
 			   scratch due to some error. */
+#define LT	60	/* seconds - "Lookup Timeout" - how long to wait
+			   for a lookup worker to answer; its queue may
+			   be long behind a slow HLR. */
 /* Timeout when moving from this state to new state:
  NS  RF  AF   WD  RD  AD   WS  RS  AS   WM  RM  AM   DM   WR  RH  AR  */
 int timeouts_NO_STATE[STATE_MAX_PLUS_ONE] = {
  NT,  0, NT,  NT,  0, NT,  NT,  0, NT,  NT,  0, NT,   0,  NT, NT, NT,};
 int timeouts_REQUEST_FROM_ADDRESS_LOOKUP[STATE_MAX_PLUS_ONE] = {
-  0, 10, 10,  NT,  0, NT,  NT, NT, NT,  NT, NT, NT,   0,   1,  0, NT,};
+  0, 10, LT,  NT,  0, NT,  NT, NT, NT,  NT, NT, NT,   0,   1,  0, NT,};
 int timeouts_ASKED_FOR_FROM_ADDRESS_LOOKUP[STATE_MAX_PLUS_ONE] = {
-  0, 60, NT,  NT, NT, NT,  NT, NT, NT,  NT, NT, NT,   0,  NT, NT, NT,};
+  0, 60, NT,  NT,  0, NT,  NT, NT, NT,  NT, NT, NT,   0,   1,  0, NT,};
 int timeouts_AWAITING_TRY_DESTINATION_IMSI[STATE_MAX_PLUS_ONE] = {
   0, RT, NT,  RT, NT, NT,  NT, NT, NT,  NT, NT, NT,   0,  NT, NT, NT,};
 int timeouts_REQUEST_DESTINATION_IMSI[STATE_MAX_PLUS_ONE] = {
-  0, RT, NT,  RT, NT, NT,  NT,  0, NT,  NT, NT, NT,   0,  NT, NT, NT,};
+  0, RT, NT,  RT, NT, LT,  NT,  0, NT,  NT, NT, NT,   0,  NT, NT, NT,};
 int timeouts_ASKED_FOR_DESTINATION_IMSI[STATE_MAX_PLUS_ONE] = {
-  0, RT, NT,  RT, NT, NT,  NT, NT, NT,  NT, NT, NT,   0,  NT, NT, NT,};
+  0, RT, NT,  RT, 60, NT,  NT,  0, NT,  NT, NT, NT,   0,  NT, NT, NT,};
 int timeouts_AWAITING_TRY_DESTINATION_SIPURL[STATE_MAX_PLUS_ONE] = {
   0, RT, NT,  RT, NT, NT,  NT, NT, NT,  NT, NT, NT,   0,  NT, NT, NT,};
 int timeouts_REQUEST_DESTINATION_SIPURL[STATE_MAX_PLUS_ONE] = {
-  0, RT, NT,  RT, NT, NT,  NT, NT, NT,  NT,  0, NT,   0,  NT, NT, NT,};
+  0, RT, NT,  RT, NT, NT,  NT, NT, LT,  NT,  0, NT,   0,  NT, NT, NT,};
 int timeouts_ASKED_FOR_DESTINATION_SIPURL[STATE_MAX_PLUS_ONE] = {
-  0, RT, NT,  RT, NT, NT,  NT, NT, NT,  NT, NT, NT,   0,  NT, NT, NT,};
+  0, RT, NT,  RT, NT, NT,  NT, 60, NT,  NT,  0, NT,   0,  NT, NT, NT,};
 int timeouts_AWAITING_TRY_MSG_DELIVERY[STATE_MAX_PLUS_ONE] = {
   0, RT, NT,  RT, NT, NT,  NT, NT, NT,  75,  0, NT,   0,  NT, NT, NT,};
 int timeouts_REQUEST_MSG_DELIVERY[STATE_MAX_PLUS_ONE] = {
@@ -95,6 +102,7 @@ int timeouts_ASKED_TO_REGISTER_HANDSET[STATE_MAX_PLUS_ONE] = {
 
 #undef NT	/* No longer needed */
 #undef RT
+#undef LT
 
 /* Index to all timeouts.  Keep in order!  */
 int (*SMqueue::timeouts[STATE_MAX_PLUS_ONE])[STATE_MAX_PLUS_ONE] = {
@@ -147,6 +155,18 @@ string sm_state_string(enum sm_state astate)
 	else	return "Invalid State Number";
 }
 
+/* The state that asks for the lookup we're waiting for in astate.  */
+static enum sm_state
+unasked_state(enum sm_state astate)
+{
+	switch (astate) {
+	case ASKED_FOR_FROM_ADDRESS_LOOKUP:	return REQUEST_FROM_ADDRESS_LOOKUP;
+	case ASKED_FOR_DESTINATION_IMSI:	return REQUEST_DESTINATION_IMSI;
+	case ASKED_FOR_DESTINATION_SIPURL:	return REQUEST_DESTINATION_SIPURL;
+	default:				return astate;
+	}
+}
+
 /* Global variables */
 bool SMqueue::osip_initialized = false;	// Have we called lib's initializer?
 struct osip *SMqueue::osipptr = NULL;	// Ptr to struct sorta used by library
@@ -231,14 +251,13 @@ SMq::process_timeout()
 	enum sm_state newstate;
 
 	/* When we modify a timestamp below (in the set_state function),
-	   we re-queue the message within the queue, so we have to
-	   restart the iterator every time around the loop.   In effect,
-	   we're always looking at the top thing on the list (thus the
-	   earliest one in time).  */
+	   we move the message within the timer heap, so we have to
+	   look at the top of the heap again every time around the loop.
+	   In effect, we're always looking at the earliest message.  */
 	
 	while (true) {
-		qmsg = time_sorted_list.begin();
-		if (qmsg == time_sorted_list.end())
+		qmsg = next_message();
+		if (qmsg == message_list.end())
 			return;			/* Empty queue */
 		if (qmsg->next_action_time > now)
 			return;			/* Wait til later to do more */
@@ -254,17 +273,9 @@ SMq::process_timeout()
 			// Fall thru into DELETE_ME_STATE!
 		case DELETE_ME_STATE:
 			// This message should quietly go away.
-	            {
-			short_msg_p_list temp;
-			// Extract the current sm from the time_sorted_list
-			temp.splice(temp.begin(), time_sorted_list, qmsg);
-			// When we remove it from the new "temp" list,
-			// this entry will be deallocated.  qmsg still
-			// points to its (dead) storage, so be careful
-			// not to reference qmsg (I don't know a C++ way
-			// to set it to NULL or delete it or something).
-			temp.pop_front();
-		    }
+			// qmsg still points to its (dead) storage after
+			// this, so be careful not to reference it.
+			delete_message(qmsg);
 			break;
 
 		default: 
@@ -287,7 +298,10 @@ SMq::process_timeout()
 
 			if (MSG_IS_REQUEST(qmsg->parsed)) {
 				// It's a MESSAGE or invalid REGISTER
-				// Deal with it!
+				// Deal with it!  (Or have a worker look up
+				// who it's from, then deal with it.)
+				if (start_lookup(qmsg))
+					break;
 				newstate = handle_sms_message(qmsg);
 				set_state(qmsg, newstate);
 				break;
@@ -303,6 +317,8 @@ SMq::process_timeout()
 		case REQUEST_DESTINATION_IMSI:
 			/* Ask to translate the destination phone
 			   number in the Request URI into an IMSI.  */
+			if (start_lookup(qmsg))
+				break;
 			newstate = lookup_uri_imsi(&*qmsg);
 			set_state(qmsg, newstate);
 			break;
@@ -310,10 +326,25 @@ SMq::process_timeout()
 		case REQUEST_DESTINATION_SIPURL:
 			/* Ask to translate the IMSI in the Request URI
 			   into the host/port combo to send it to.  */
+			if (start_lookup(qmsg))
+				break;
 			newstate = lookup_uri_hostport(&*qmsg);
 			set_state(qmsg, newstate);
 			break;
 
+		case ASKED_FOR_FROM_ADDRESS_LOOKUP:
+		case ASKED_FOR_DESTINATION_IMSI:
+		case ASKED_FOR_DESTINATION_SIPURL:
+			/* A lookup worker never answered (or we were
+			   restarted while it was busy).  Forget about
+			   it, and ask again.  */
+			cerr << "Lookup for " << qmsg->qtag << " in "
+			     << sm_state_string(qmsg->state)
+			     << " timed out." << endl;
+			forget_lookup(&*qmsg);
+			set_state(qmsg, unasked_state(qmsg->state));
+			break;
+
 		case AWAITING_TRY_MSG_DELIVERY:
 			/* We have waited awhile and now want to try 
 			   delivering the message again. */
@@ -322,6 +353,25 @@ SMq::process_timeout()
 		case REQUEST_MSG_DELIVERY:
 			/* We are trying to deliver to the handset now (or
 			   again after congestion).  */
+			// If we're sending too fast, in all or to this
+			// handset, wait until the limit lets us try again.
+			// Others waiting for the same handset will wait
+			// behind this one.
+			if (my_limits.limited()) {
+				double wait = my_limits.admit(
+					qmsg->parsed->req_uri->username?
+					qmsg->parsed->req_uri->username: "",
+					sm_now());
+				if (wait > 0) {
+					hold_message(qmsg, now + (time_t)ceil(wait));
+					break;
+				}
+			}
+			if (qmsg->queued_at) {
+				// Only count the first try.
+				send_latency.add(sm_now() - qmsg->queued_at);
+				qmsg->queued_at = 0;
+			}
 			// debug_dump();	// FIXME, remove
 			// Only print delivering msg if delivering to non-
 			// localhost.
@@ -413,7 +463,7 @@ SMq::handle_response(short_msg_p_list::iterator qmsgit)
 	// First, remove this response message from the queue.  That way,
 	// when we search the queue, we won't find OURSELF.  We also don't
 	// want the response hanging around in the queue anyway.
-	resplist.splice(resplist.begin(), time_sorted_list, qmsgit);
+	unqueue_message(qmsgit, resplist);
 	// We'll delete the list element on our way out of this function as
 	// resplist goes out of scope.
 
@@ -477,7 +527,7 @@ SMq::handle_response(short_msg_p_list::iterator qmsgit)
 				// Special code in registration processing
 				// will notice it's a re-reg and just reply
 				// with a welcome message.
-				oldsms->set_state(REQUEST_FROM_ADDRESS_LOOKUP);
+				set_state(oldsms, REQUEST_FROM_ADDRESS_LOOKUP);
 			} else {
 				// Orig SMS exists, but not in a normal state.
 				// Assume that the original SMS is in a
@@ -489,9 +539,7 @@ SMq::handle_response(short_msg_p_list::iterator qmsgit)
 		// Whether a response to a REGISTER or a MESSAGE, delete 
 		// the datagram that we sent, which has been responded to.
 		cerr << "Deleting sent message." <<endl;
-		resplist.splice(resplist.begin(),
-				time_sorted_list, sent_msg);
-		resplist.pop_front();	// pop and delete the sent_msg.
+		delete_message(sent_msg);
 
 		// FIXME, consider breaking loose any other messages for
 		// the same destination now.
@@ -503,7 +551,7 @@ SMq::handle_response(short_msg_p_list::iterator qmsgit)
 			ostringstream errmsg;
 			errmsg << qmsg->parsed->status_code << " "
 			       << qmsg->parsed->reason_phrase;
-			sent_msg->set_state(
+			set_state(sent_msg,
 			     bounce_message((&*sent_msg), errmsg.str().c_str()));
 		}
 		break;
@@ -517,7 +565,7 @@ SMq::handle_response(short_msg_p_list::iterator qmsgit)
 	case 3: // 3xx -- message needs redirection
 	case 6: // 6xx -- message rejected (by this destination).
 		// Try going back through looking up the destination again.
-		sent_msg->set_state(REQUEST_DESTINATION_IMSI);
+		set_state(sent_msg, REQUEST_DESTINATION_IMSI);
 		break;
 
 	default:
@@ -537,11 +585,12 @@ bool
 SMq::find_queued_msg_by_tag(short_msg_p_list::iterator &mymsg,
 			    const char *tag, int taghash)
 {
-	short_msg_p_list::iterator x; 
+	std::pair<tag_index_t::iterator, tag_index_t::iterator> range =
+		tag_index.equal_range(taghash);
 
-	for (x = time_sorted_list.begin(); x != time_sorted_list.end(); x++) {
-		if (taghash == x->qtaghash && !strcmp (tag, x->qtag)) {
-			mymsg = x;
+	for (tag_index_t::iterator x = range.first; x != range.second; x++) {
+		if (!strcmp (tag, x->second->qtag)) {
+			mymsg = x->second;
 		    	return true;
 		}
 	}
@@ -553,7 +602,51 @@ bool
 SMq::find_queued_msg_by_tag(short_msg_p_list::iterator &mymsg,
 			    const char *tag)
 {
-	return find_queued_msg_by_tag(mymsg, tag, mymsg->taghash_of(tag));
+	return find_queued_msg_by_tag(mymsg, tag,
+				      short_msg_pending::taghash_of(tag));
+}
+
+/*
+ * Keep the tag index in step with the queue.  A message is indexed
+ * under the hash of the qtag it had when it went in, so anything that
+ * changes the qtag of a queued message has to go through retag().
+ */
+void
+SMq::index_tag(short_msg_p_list::iterator sm)
+{
+	if (!sm->qtag)
+		return;
+	tag_index.insert(tag_index_t::value_type(sm->qtaghash, sm));
+}
+
+bool
+SMq::unindex_tag(short_msg_pending *sm, short_msg_p_list::iterator *where)
+{
+	if (!sm->qtag)
+		return false;
+	std::pair<tag_index_t::iterator, tag_index_t::iterator> range =
+		tag_index.equal_range(sm->qtaghash);
+
+	for (tag_index_t::iterator x = range.first; x != range.second; x++) {
+		if (&*x->second == sm) {
+			if (where)
+				*where = x->second;
+			tag_index.erase(x);
+			return true;
+		}
+	}
+	return false;
+}
+
+int
+SMq::retag(short_msg_pending *sm)
+{
+	short_msg_p_list::iterator where;
+	bool queued = unindex_tag(sm, &where);
+	int result = sm->set_qtag();
+	if (queued)
+		index_tag(where);
+	return result;
 }
 
 
@@ -834,10 +927,7 @@ short_msg_pending::set_qtag()
 	 || qtag[len-2] == '\0')
 		abfuckingort();
 
-	// Set the taghash too.  
-	// FIXME, if we set this with a good hash function,
-	// our linear searches will run much faster, avoiding
-	// almost all strcmp's.  For now, punt easy.
+	// Set the taghash too, for the SMq's tag index.
 	qtaghash = taghash_of(qtag);
 
 	return 0;
@@ -845,14 +935,19 @@ short_msg_pending::set_qtag()
 
 /* 
  * Hash a tag value for fast searches.
+ * This is FNV-1a; tags that differ anywhere hash differently,
+ * so the index almost never has to strcmp more than once.
  */
-// FIXME, if we set this with a good hash function,
-// our linear searches will run much faster, avoiding
-// almost all strcmp's.  For now, punt easy.
 int
 short_msg_pending::taghash_of (const char *fromtag)
 {
-	return fromtag[0];
+	unsigned hash = 2166136261U;
+
+	for (const unsigned char *p = (const unsigned char *)fromtag; *p; p++) {
+		hash ^= *p;
+		hash *= 16777619U;
+	}
+	return (int)hash;
 }
 
 /* Check the host and port number specified.
@@ -914,7 +1009,7 @@ SMq::set_linktag(short_msg_p_list::iterator newmsg,
 		 short_msg_p_list::iterator oldmsg)
 {
 	if (!oldmsg->qtag) {
-		oldmsg->set_qtag();
+		retag(&*oldmsg);
 	}
 
 	size_t len = strlen(oldmsg->qtag);
@@ -1252,7 +1347,7 @@ SMq::register_handset (short_msg_p_list::iterator qmsg)
  * Initial handling of SMS messages found in the queue
  */
 enum sm_state
-SMq::handle_sms_message (short_msg_p_list::iterator qmsg)
+SMq::handle_sms_message (short_msg_p_list::iterator qmsg, sm_lookup *answer)
 {
 	osip_body_t *bod1;
 	char *bods;
@@ -1350,14 +1445,14 @@ SMq::handle_sms_message (short_msg_p_list::iterator qmsg)
 	}
 
 	// For non-special messages, look up who they're from.
-	return lookup_from_address (&*qmsg);
+	return lookup_from_address (&*qmsg, answer);
 }
 
 
 /* Change the From address to a valid phone number in + countrycode phonenum
    format.  Also add a Via: line about us.  */
 enum sm_state
-SMq::lookup_from_address (short_msg_pending *qmsg)
+SMq::lookup_from_address (short_msg_pending *qmsg, sm_lookup *answer)
 {
 	char *host = qmsg->parsed->from->url->host;
 	bool got_phone = false;
@@ -1445,7 +1540,10 @@ SMq::lookup_from_address (short_msg_pending *qmsg)
 	/* Look up the IMSI in the Home Location Register. */
 	char *newfrom;
 
-	newfrom = my_hlr.getCLIDLocal(username);
+	if (answer && answer->key == username)
+		newfrom = sm_lookup::take(answer->answer);
+	else
+		newfrom = my_hlr.getCLIDLocal(username);
 	if (!newfrom) {
 		/* ==================FIXME KLUDGE====================
 		 * Here is our fake table of IMSIs and phone numbers
@@ -1485,7 +1583,7 @@ SMq::lookup_from_address (short_msg_pending *qmsg)
 
 /* Change the Request-URI's address to a valid IMSI.  */
 enum sm_state
-SMq::lookup_uri_imsi (short_msg_pending *qmsg)
+SMq::lookup_uri_imsi (short_msg_pending *qmsg, sm_lookup *answer)
 {
 	qmsg->parse();
 
@@ -1509,8 +1607,11 @@ SMq::lookup_uri_imsi (short_msg_pending *qmsg)
 	if (username[0] == '+' || (   0 != strncmp("imsi", username, 4)
 				   && 0 != strncmp("IMSI", username, 4))) {
 		// We have a phone number.  It needs translation.
+		if (answer && answer->key != username)
+			answer = NULL;		// Not for this one; ask.
 
-		char *newdest = my_hlr.getIMSI(username);
+		char *newdest = answer? sm_lookup::take(answer->answer):
+					my_hlr.getIMSI(username);
 		if (!newdest) {
 			/* ==================FIXME KLUDGE====================
 			 * Here is our fake table of IMSIs and phone numbers
@@ -1540,7 +1641,8 @@ SMq::lookup_uri_imsi (short_msg_pending *qmsg)
 			 // cerr << "MSG = " << qmsg->text << endl;
 
 		    if (global_relay.c_str()[0] == '\0'
-			|| !my_hlr.useGateway(username)) {
+			|| !(answer? answer->gateway:
+				     my_hlr.useGateway(username))) {
 			// There's no global relay -- or the HLR says not to
 			// use the global relay for it -- so send a bounce.
 			return bounce_message (qmsg, gConfig.getStr("BounceMessage.NotRegistered"));
@@ -1553,12 +1655,18 @@ SMq::lookup_uri_imsi (short_msg_pending *qmsg)
 			// However, the From address is at this point the
 			// sender's local ph#.  Map it to the global ph#.
 			char *newfrom;
-			newfrom = my_hlr.mapCLIDGlobal(
+			if (answer && qmsg->parsed->from->url->username
+			    && answer->from ==
+					qmsg->parsed->from->url->username)
+				newfrom = sm_lookup::take(answer->global_from);
+			else
+				newfrom = my_hlr.mapCLIDGlobal(
 					qmsg->parsed->from->url->username);
 			if (newfrom) {
 				osip_free(qmsg->parsed->from->url->username);
 				qmsg->parsed->from->url->username = 
 					osip_strdup (newfrom);
+				free(newfrom);
 			}
 			return REQUEST_DESTINATION_SIPURL;
 		    }
@@ -1607,7 +1715,7 @@ SMq::lookup_uri_imsi (short_msg_pending *qmsg)
  * recipient's location again) will use a new one.
  */
 enum sm_state
-SMq::lookup_uri_hostport (short_msg_pending *qmsg)
+SMq::lookup_uri_hostport (short_msg_pending *qmsg, sm_lookup *answer)
 {
 
 	qmsg->parse();
@@ -1630,7 +1738,10 @@ SMq::lookup_uri_hostport (short_msg_pending *qmsg)
 		/* imsi is an IMSI at this point.  */
 
 		newport = NULL;
-		newhost = my_hlr.getRegistrationIP (imsi);
+		if (answer && answer->key == imsi)
+			newhost = sm_lookup::take(answer->answer);
+		else
+			newhost = my_hlr.getRegistrationIP (imsi);
 	}
 
 	if (newhost) {
@@ -1706,8 +1817,9 @@ SMq::lookup_uri_hostport (short_msg_pending *qmsg)
 		qmsg->parsed_was_changed();
 	}
 
-	// Now that we changed the Call-ID, we have to update the queue tag.
-	qmsg->set_qtag();
+	// Now that we changed the Call-ID, we have to update the queue tag
+	// (and the queue's index of it).
+	retag(qmsg);
 
 	// Both of these were dynamic storage; don't leak them.
 	// (They were allocated by malloc() so we free with free().
@@ -1720,6 +1832,158 @@ SMq::lookup_uri_hostport (short_msg_pending *qmsg)
 	return REQUEST_MSG_DELIVERY;
 }
 
+
+/*
+ * Lookup workers.  The lookups above may have to wait for the HLR,
+ * so when there are workers, process_timeout hands the HLR part of
+ * each lookup to them, and goes on with the rest of the queue.  When
+ * the answer comes back, finish_lookups runs the lookup itself with
+ * the worker's answers, here in the main loop -- only the main loop
+ * ever touches the queue or the messages in it.
+ */
+bool
+SMq::start_workers(unsigned count)
+{
+	if (!my_workers.start(&my_hlr, count))
+		return false;
+	my_network.add_wakeup(my_workers.wakeup_fd());
+	return true;
+}
+
+void
+SMq::stop_workers()
+{
+	my_network.remove_wakeup();
+	my_workers.stop();
+
+	time_t now = time(NULL);
+	while (!lookups.empty()) {
+		short_msg_p_list::iterator qmsg = lookups.begin()->second;
+		forget_lookup(&*qmsg);
+		set_state(qmsg, unasked_state(qmsg->state), now);
+	}
+}
+
+bool
+SMq::start_lookup(short_msg_p_list::iterator qmsg)
+{
+	sm_lookup::kind_t kind;
+	enum sm_state asked;
+	const char *user;
+
+	if (!my_workers.running())
+		return false;
+	if (!qmsg->parse())
+		return false;
+	osip_message_t *p = qmsg->parsed;
+	if (!p->req_uri || !p->req_uri->username
+	    || !p->from || !p->from->url)
+		return false;
+	const char *dest = p->req_uri->username;
+	bool dest_is_imsi = 0 == strncmp("imsi", dest, 4)
+			 || 0 == strncmp("IMSI", dest, 4);
+
+	// Only ask the workers when the lookup would ask the HLR.
+	switch (qmsg->state) {
+	case REQUEST_FROM_ADDRESS_LOOKUP:
+		// Short codes are done right here, and a sender that
+		// already has a phone number doesn't need the HLR.
+		user = p->from->url->username;
+		if (!p->sip_method || 0 != strcmp("MESSAGE", p->sip_method)
+		    || short_code_map.find(string(dest)) != short_code_map.end()
+		    || !user || user[0] == '+' || isdigit(user[0]))
+			return false;
+		kind = sm_lookup::CALLER_ID;
+		asked = ASKED_FOR_FROM_ADDRESS_LOOKUP;
+		break;
+
+	case REQUEST_DESTINATION_IMSI:
+		if (dest[0] != '+' && dest_is_imsi)
+			return false;		// Already an IMSI
+		user = dest;
+		kind = sm_lookup::IMSI;
+		asked = ASKED_FOR_DESTINATION_IMSI;
+		break;
+
+	case REQUEST_DESTINATION_SIPURL:
+		if (dest[0] == '+' || !dest_is_imsi)
+			return false;		// For the global relay
+		user = dest;
+		kind = sm_lookup::ROUTE;
+		asked = ASKED_FOR_DESTINATION_SIPURL;
+		break;
+
+	default:
+		return false;
+	}
+
+	// All the lookups of a message go to the same worker, picked by
+	// where it was first going, so messages to one destination are
+	// answered in the order they came in.
+	if (!qmsg->lookup_dest) {
+		qmsg->lookup_dest = short_msg_pending::taghash_of(dest);
+		if (!qmsg->lookup_dest)
+			qmsg->lookup_dest = 1;	// 0 is "not picked yet"
+	}
+
+	forget_lookup(&*qmsg);
+	if (++last_lookup_id == 0)
+		last_lookup_id = 1;
+	sm_lookup *job = new sm_lookup(last_lookup_id, kind,
+				       qmsg->lookup_dest, user);
+	if (kind == sm_lookup::IMSI) {
+		if (p->from->url->username)
+			job->from = p->from->url->username;
+		job->relay = global_relay.c_str()[0] != '\0';
+	}
+	qmsg->lookup_id = job->id;
+	lookups[job->id] = qmsg;
+	set_state(qmsg, asked);
+	my_workers.submit(job);
+	return true;
+}
+
+void
+SMq::finish_lookups()
+{
+	sm_lookup *job;
+	enum sm_state newstate;
+
+	while ((job = my_workers.answered()) != NULL) {
+		lookup_map_t::iterator l = lookups.find(job->id);
+		if (l == lookups.end()) {
+			// The message is gone, or timed out and was
+			// asked about again.
+			delete job;
+			continue;
+		}
+		short_msg_p_list::iterator qmsg = l->second;
+		forget_lookup(&*qmsg);
+		if (!qmsg->parse()) {
+			delete job;	// It'll time out and go round again.
+			continue;
+		}
+
+		switch (qmsg->state) {
+		case ASKED_FOR_FROM_ADDRESS_LOOKUP:
+			newstate = handle_sms_message(qmsg, job);
+			break;
+		case ASKED_FOR_DESTINATION_IMSI:
+			newstate = lookup_uri_imsi(&*qmsg, job);
+			break;
+		case ASKED_FOR_DESTINATION_SIPURL:
+			newstate = lookup_uri_hostport(&*qmsg, job);
+			break;
+		default:
+			// Something else has happened to it since.
+			delete job;
+			continue;
+		}
+		set_state(qmsg, newstate);
+		delete job;
+	}
+}
+
 /*
  * Helper function because C++ is fucked about types.
  * and the osip library doesn't keep its types straight.
@@ -1811,6 +2075,13 @@ SMq::respond_sip_ack(int errcode, short_msg_pending *smp,
 		cerr << "send_dgram had trouble sending the response." << endl;
 }
 
+// A datagram that has been received but not yet acknowledged.
+struct unacked_dgram {
+	short_msg_p_list *smpl;		// Holds it, unless it was queued
+	short_msg_pending *smp;
+	int errcode;
+};
+
 //
 // The main loop that listens for incoming datagrams, handles them
 // through the queue, and moves them toward transmission.
@@ -1827,20 +2098,25 @@ SMq::main_loop()
 	short_msg_p_list::iterator qmsg;
 	time_t now;
 	int errcode;
+	std::vector<unacked_dgram> unacked;
 
 	stop_main_loop = false;
 
    while (!stop_main_loop) {
 
 	now = time(NULL);		
-	qmsg = time_sorted_list.begin();
-	if (qmsg == time_sorted_list.end()) {
+	qmsg = next_message();
+	if (qmsg == message_list.end()) {
 		timeout = -1;			// Infinite timeout
 	} else {
 		timeout = qmsg->next_action_time - now;
 		if (timeout < 0) timeout = 0;  // Check for incoming anyway
 	}
 	mstimeout = 1000 * timeout;
+	// Come back in time to sync what the journal has written.
+	int synctimeout = my_journal.commit_timeout();
+	if (synctimeout >= 0 && (mstimeout < 0 || synctimeout < mstimeout))
+		mstimeout = synctimeout;
 
 #undef DEBUG_Q
 #ifdef DEBUG_Q
@@ -1853,7 +2129,9 @@ SMq::main_loop()
 	timebuf[19] = '\0';	// Leave out space, year and newline
 
 	cerr << "=== " << timebuf+4 << " "
-	     << time_sorted_list.size() << " queued; ";
+	     << message_list.size() << " queued; ";
+	if (!lookups.empty())
+		cerr << lookups.size() << " being looked up; ";
 	if (timeout < 0) {
 		cerr << "waiting." << endl;
 	} else {
@@ -1873,6 +2151,11 @@ SMq::main_loop()
 		// Timeout.  Just push things along.
 		// cerr << "Timeout..." << endl;
 	} else {
+		// Accept datagrams for as long as they keep coming (up to
+		// group_commit of them), make them safe in the journal with
+		// a single commit, and only then acknowledge them.  Without
+		// a journal, each one is acknowledged as it comes.
+	    while (true) {
 		// We got a datagram.  Dump it into the queue, copying it.
 		//
 		// Here we do a bit of tricky memory allocation.  Rather
@@ -1929,31 +2212,70 @@ SMq::main_loop()
 			     << " datagram:" << endl
 	                     << "BADMSG = " << smp->text << endl;
 		}
-		// It's OK to reference "smp" here, whether it's in the
-		// smpl list, or has been moved into the main time_sorted_list.
-		respond_sip_ack (errcode, smp, smp->srcaddr, smp->srcaddrlen);
+		unacked_dgram u = { smpl, smp, errcode };
+		unacked.push_back(u);
 
-		// We won't leak memory if we didn't queue it up, since
-		// the delete of smpl will delete anything still
-		// in ITS list.
-		delete smpl;
+		if (!my_journal.is_open() || unacked.size() >= group_commit)
+			break;
+		len = my_network.get_next_dgram(buffer, sizeof(buffer), 0);
+		if (len <= 0)
+			break;
+	    } /* while (true) */
+		my_journal.commit(true);
+
+		for (unsigned i = 0; i < unacked.size(); i++) {
+			// It's OK to reference "smp" here, whether it's in
+			// the smpl list, or has been moved into the main
+			// message_list.
+			smp = unacked[i].smp;
+			respond_sip_ack (unacked[i].errcode, smp,
+					 smp->srcaddr, smp->srcaddrlen);
+
+			// We won't leak memory if we didn't queue it up,
+			// since the delete of smpl will delete anything still
+			// in ITS list.
+			delete unacked[i].smpl;
+		}
+		unacked.clear();
 	}
 
+	// Carry on with what the lookup workers have answered, then
+	// with whatever's due.
+	finish_lookups();
 	process_timeout();
+
+	// Write out the state changes, and let the journal start new
+	// segments and compactions.
+	my_journal.commit(false);
+	my_journal.maintain();
     } /* while (!stop_main_loop) */
 }
 
 
 /* Debug dump of SMq and mainly the queue. */
 void SMq::debug_dump() {
-	short_msg_p_list::iterator x = time_sorted_list.begin();
+	short_msg_p_list::iterator x = message_list.begin();
 	time_t now = time(NULL);
-	for (; x != time_sorted_list.end(); ++x) {
+	unsigned depth[STATE_MAX_PLUS_ONE] = { 0 };
+	for (; x != message_list.end(); ++x) {
 		x->make_text_valid();
 		cout << "== State: " << sm_state_string (x->state) << "\t"
 		     << (x->next_action_time - now) << endl << "MSG = "
 		     << x->text << endl;
+		if (x->state < STATE_MAX_PLUS_ONE)
+			depth[x->state]++;
 	}
+	cout << "Queue: " << message_list.size() << " messages" << endl;
+	for (int i = 0; i < STATE_MAX_PLUS_ONE; i++)
+		if (depth[i])
+			cout << "  " << depth[i] << "\t"
+			     << sm_state_string ((enum sm_state)i) << endl;
+	my_workers.dump(cout);
+	my_limits.dump(cout);
+	cout << "Sends:" << endl;
+	send_latency.dump(cout, "first tries, from queueing");
+	my_hlr.dump(cout);
+	my_journal.dump(cout);
 }
 
 /* Print net addr in hex.  Returns a static buffer.  */
@@ -2001,21 +2323,18 @@ netaddr_parse(const char *str, char *addr, unsigned int *len)
 
 /*
  * Save queue to file.
- * 
- * We save in reverse timestamp order, to make it very fast to insert when
- * re-read.
  */
 bool
 SMq::save_queue_to_file(std::string qfile)
 {
-	short_msg_p_list::reverse_iterator x = time_sorted_list.rbegin();
+	short_msg_p_list::iterator x = message_list.begin();
 	ofstream ofile;
 	unsigned howmany = 0;
 
 	ofile.open(qfile.c_str(), ios::out | ios::binary | ios::trunc);
 	if (!ofile.is_open())
 		return false;
-	for (; x != time_sorted_list.rend(); ++x) {
+	for (; x != message_list.end(); ++x) {
 		x->make_text_valid();
 		ofile << "=== " << (int) x->state << " " 
 		      << x->next_action_time << " "
@@ -2116,6 +2435,72 @@ SMq::read_queue_from_file(std::string qfile)
 	return true;
 }
 
+/*
+ * Open the journal and put its messages back in the queue, in the
+ * states they were in.  They keep their journal_ids, so nothing needs
+ * to be written for them.  If "restore" is false, the journal's
+ * messages are dropped from it instead.
+ */
+bool
+SMq::recover_from_journal(std::string dir, bool restore)
+{
+	SMjournal::saved_msg_map saved;
+	unsigned howmanyerrs = 0;
+
+	if (!my_journal.open(dir))
+		return false;
+	if (!my_journal.recover(saved))
+		cerr << "Some of the journal in " << dir
+		     << " could not be read." << endl;
+
+	if (!restore) {
+		cerr << "=== Dropping " << saved.size()
+		     << " journaled messages in favor of the savefile." << endl;
+		for (SMjournal::saved_msg_map::iterator m = saved.begin();
+		     m != saved.end(); ++m)
+			my_journal.forget(m->first);
+		my_journal.commit(true);
+		return true;
+	}
+
+	for (SMjournal::saved_msg_map::iterator m = saved.begin();
+	     m != saved.end(); ++m) {
+		short_msg_p_list *smpl = new short_msg_p_list (1);
+		short_msg_pending *smp = &*smpl->begin();
+		smp->initialize (m->second.text.size(),
+				 (char *)m->second.text.data(), false);
+		if (m->second.srcaddr.size() <= sizeof(smp->srcaddr)) {
+			smp->srcaddrlen = m->second.srcaddr.size();
+			memcpy(smp->srcaddr, m->second.srcaddr.data(),
+			       smp->srcaddrlen);
+		}
+
+		int errcode = smp->validate_short_msg();
+		if (errcode == 0) {
+			short_msg_p_list::iterator sm =
+				link_new_message (*smpl);
+			sm->set_state ((SMqueue::sm_state)m->second.state,
+				       m->second.next_action_time);
+			timers.schedule (sm);
+			my_journal.adopt (*sm, m->first);
+		} else {
+			// Forget it, so it's not recovered again.
+			cerr << "Recovered bad " << errcode
+			     << " message:" << endl
+	                     << "BADMSG = " << smp->text << endl;
+			my_journal.forget (m->first);
+			howmanyerrs++;
+		}
+		delete smpl;
+		// Let go of the text as we go.
+		m->second.text.clear();
+	}
+	cerr << "=== Recovered " << saved.size() << " messages total, "
+	     << howmanyerrs << " bad ones." << endl;
+	my_journal.commit(true);
+	return true;
+}
+
 
 /*
  * Read in a message from a file.  Return malloc'd char block of the whole
@@ -2193,12 +2578,21 @@ main(int argc, char **argv)
   while (true) {
     SMq smq;			/* Our big state machine & msg queue */
 
-    gSetLogLevel(gConfig.getStr("LogLevel"));
+    gSetLogLevels(gConfig);
 
     // IP address:port of the Home Location Register that we send SIP
     // REGISTER messages to.
     smq.set_register_hostport(gConfig.getStr("Asterisk.address"));  
 
+    // The subscriber store, filled from the Asterisk config.
+    if (!smq.my_hlr.open(gConfig.defines("HLR.Path") ? gConfig.getStr("HLR.Path") : NULL)) {
+	cerr << "Cannot open the HLR store; keeping it in memory." << endl;
+	smq.my_hlr.open(NULL);
+    }
+    smq.my_hlr.importAsterisk(
+	gConfig.defines("HLR.SIPConf") ? gConfig.getStr("HLR.SIPConf") : "/etc/asterisk/sip.conf",
+	gConfig.defines("HLR.ExtensionsConf") ? gConfig.getStr("HLR.ExtensionsConf") : "/etc/asterisk/extensions.local.conf");
+
     // IP address:port of the global relay where we sent SIP messages
     // if we don't know where else to send them.
     smq.set_global_relay(gConfig.getStr("SIP.global_relay"));
@@ -2224,31 +2618,79 @@ main(int argc, char **argv)
 
     savefile = gConfig.getStr("savefile");
 
-    if (!smq.read_queue_from_file (savefile)) {
+    // With a journal, the queue is kept as it changes.  A savefile is
+    // only written when there's no working journal, so if there is one,
+    // it has the whole queue: it replaces what's in the journal, and
+    // is read into the journal once.
+    bool have_savefile = access(savefile.c_str(), R_OK) == 0;
+    if (gConfig.defines("Journal.Path")) {
+	if (gConfig.defines("Journal.SegmentBytes"))
+	    smq.my_journal.segment_bytes = gConfig.getNum("Journal.SegmentBytes");
+	if (gConfig.defines("Journal.SyncInterval"))
+	    smq.my_journal.sync_interval = gConfig.getNum("Journal.SyncInterval");
+	if (gConfig.defines("Journal.GroupCommit"))
+	    smq.group_commit = gConfig.getNum("Journal.GroupCommit");
+	if (!smq.recover_from_journal (gConfig.getStr("Journal.Path"),
+				       !have_savefile)) {
+	    cerr << "Cannot use the journal in " << gConfig.getStr("Journal.Path")
+	         << "; saving the queue to " << savefile << " instead." << endl;
+	}
+    }
+    if (!smq.my_journal.is_open() || have_savefile) {
+      if (smq.read_queue_from_file (savefile)) {
+	if (smq.my_journal.is_open()) {
+	  // Once it's safely in the journal, don't read it again next time.
+	  // If it isn't, the journal has shut itself off, and the savefile
+	  // is still the only copy of the queue on disk.
+	  if (smq.my_journal.commit(true))
+	    unlink(savefile.c_str());
+	  else
+	    cerr << "Cannot move " << savefile << " into the journal; keeping it." << endl;
+	}
+      } else {
 	cerr << "Failed to read queue from file " << savefile << endl;
+      }
     }
-    cerr << "Queue contains " << smq.time_sorted_list.size() 
+    cerr << "Queue contains " << smq.message_list.size() 
          << " msgs." << endl;
 
     // smq.debug_dump();
 
+    // Threads for the HLR lookups, so that a slow one doesn't hold up
+    // the rest of the queue, and limits on how fast we send.
+    unsigned workers = 4;
+    if (gConfig.defines("Lookup.Workers"))
+	workers = gConfig.getNum("Lookup.Workers");
+    if (workers && !smq.start_workers(workers))
+	cerr << "Cannot start the lookup workers; looking up in the main loop." << endl;
+    smq.my_limits.set_rates(
+	gConfig.defines("Delivery.RateLimit") ? gConfig.getNum("Delivery.RateLimit") : 0,
+	gConfig.defines("Delivery.RateLimit.PerDestination") ? gConfig.getNum("Delivery.RateLimit.PerDestination") : 0);
+
     smq.stop_main_loop = false;
     smq.reexec_smqueue = false;
 
     smq.main_loop();
 
+    // Whatever the workers hadn't answered gets asked again next time.
+    smq.stop_workers();
+
     // The rest of this code never gets run (unless main_loop exits
     // based upon getting a "reboot" sms or signal or something).
     if (smq.reexec_smqueue) {
       cerr << "====== Re-Execing! ======" << endl;
-      if (!smq.save_queue_to_file(savefile)) {
+      if (smq.my_journal.is_open()) {
+	smq.my_journal.close();
+      } else if (!smq.save_queue_to_file(savefile)) {
 	cerr << "OUCH!  Could not save queue to file " << savefile << endl;
       }
       please_re_exec = true;
       break;	// Get out of scope that contains smq, closing file descrs.
     } else {
       cerr << "====== Quitting! ======" << endl;
-      if (!smq.save_queue_to_file(savefile)) {
+      if (smq.my_journal.is_open()) {
+	smq.my_journal.close();
+      } else if (!smq.save_queue_to_file(savefile)) {
 	cerr << "OUCH!  Could not save queue to file " << savefile << endl;
       }
       // smq.debug_dump();
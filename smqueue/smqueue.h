@@ -33,6 +33,10 @@
 #include <iostream>
 
 #include "smnet.h"			// My network support
+#include "smheap.h"			// Timer heap of the queue
+#include "smjournal.h"			// Write-ahead journal of the queue
+#include "smworkers.h"			// HLR lookup workers
+#include "smrate.h"			// Send rate limits
 #include "HLR.h"			// My home location register
 
 namespace SMqueue {
@@ -320,6 +324,16 @@ class short_msg_pending: public short_msg {
 					// handset register messages, to find
 					// the original SMS message that
 					// prompted us to send the register.)
+	size_t heap_index;		// Position in the SMq's timer heap,
+					// or npos if not queued.
+	unsigned long heap_seq;		// Order of scheduling, for ties.
+	unsigned long long journal_id;	// Name in the journal, or 0.
+	unsigned journal_hash;		// Hash of the text last journaled.
+	unsigned long lookup_id;	// HLR lookup a worker is doing for
+					// us, or 0.
+	unsigned lookup_dest;		// Hash of our first destination,
+					// which picks the lookup worker; or 0.
+	double queued_at;		// When we came into the queue, or 0.
 
 	static const char *smp_my_ipaddress;	// Static copy of my IP address
 					// for validity checking of msgs.
@@ -337,7 +351,14 @@ class short_msg_pending: public short_msg {
 		srcaddrlen(0),
 		qtag (NULL),
 		qtaghash (0),
-		linktag (NULL)
+		linktag (NULL),
+		heap_index (timer_heap_base::npos),
+		heap_seq (0),
+		journal_id (0),
+		journal_hash (0),
+		lookup_id (0),
+		lookup_dest (0),
+		queued_at (0)
 	{ 
 	}
 
@@ -352,7 +373,14 @@ class short_msg_pending: public short_msg {
 		srcaddrlen(0),
 		qtag (NULL),
 		qtaghash (0),
-		linktag (NULL)
+		linktag (NULL),
+		heap_index (timer_heap_base::npos),
+		heap_seq (0),
+		journal_id (0),
+		journal_hash (0),
+		lookup_id (0),
+		lookup_dest (0),
+		queued_at (0)
 	{
 	}
 
@@ -400,7 +428,15 @@ class short_msg_pending: public short_msg {
 		srcaddrlen(smp.srcaddrlen),
 		qtag (NULL),
 		qtaghash (smp.qtaghash),
-		linktag (NULL)
+		linktag (NULL),
+		// A copy is not in the queue, even if the original is.
+		heap_index (timer_heap_base::npos),
+		heap_seq (0),
+		journal_id (0),
+		journal_hash (0),
+		lookup_id (0),
+		lookup_dest (0),
+		queued_at (0)
 	{
 		if (smp.srcaddrlen) {
 			if (smp.srcaddrlen > sizeof (srcaddr))
@@ -488,6 +524,13 @@ class short_msg_pending: public short_msg {
 		qtag = NULL;
 		qtaghash = 0;
 		linktag = NULL;
+		heap_index = timer_heap_base::npos;
+		heap_seq = 0;
+		journal_id = 0;
+		journal_hash = 0;
+		lookup_id = 0;
+		lookup_dest = 0;
+		queued_at = 0;
 	}
 	void
 	initialize ()
@@ -566,10 +609,11 @@ class short_msg_pending: public short_msg {
 	// components that, in combination, identify the message uniquely.
 	// FIXME!  The spec is unpleasantly unclear about this.
 	// Result is 0 for success, or 3-digit integer error code if error.
+	// For a message that's in the queue, use SMq::retag instead.
 	int set_qtag();
 
 	// Hash the tag to an int, for speedier searching.
-	int taghash_of(const char *tag);
+	static int taghash_of(const char *tag);
 
 	/* Check host and port for validity.  */
 	bool
@@ -645,20 +689,45 @@ void init_smcommands (short_code_map_t *scm);
 class SMq {
 	public:
 
-	/* A list of all messages we know about, sorted by time of next
-	   action (assuming nothing arrives to change our mind before that
-	   time). */
-	short_msg_p_list time_sorted_list;
+	/* A list of all messages we know about, in no particular order.
+	   The list only holds them; use the functions below to put them
+	   in and take them out, since those also keep the indexes.  */
+	short_msg_p_list message_list;
 
-	/* We may later want other accessors for faster access to various
-	   messages when things DO arrive.  For now, linear search!  */
+	/* The same messages, by time of next action (assuming nothing
+	   arrives to change our mind before that time).  */
+	timer_heap<short_msg_p_list::iterator> timers;
+
+	/* The same messages, by the hash of their qtag.  Several messages
+	   can share a tag (e.g. a response and the message it answers),
+	   and so can several hashes.  */
+	typedef std::multimap<int, short_msg_p_list::iterator> tag_index_t;
+	tag_index_t tag_index;
 
 	/* The network sockets that we're using for I/O */
 	SMnet my_network;
 
 	/* The interface to the Host Location Register for routing
 	   messages and looking up their return and destination addresses.  */
-	AsteriskHLR my_hlr;
+	NativeHLR my_hlr;
+
+	/* Where the queue is kept safe across crashes, if anywhere.  */
+	SMjournal my_journal;
+
+	/* Most datagrams to accept before a journal commit and their
+	   acknowledgements.  */
+	unsigned group_commit;
+
+	/* Threads that do the HLR lookups, if any, and the messages that
+	   are waiting for them, by lookup_id.  */
+	SMworkers my_workers;
+	typedef std::map<unsigned long, short_msg_p_list::iterator> lookup_map_t;
+	lookup_map_t lookups;
+	unsigned long last_lookup_id;
+
+	/* How fast we may send, and how long messages took to be sent.  */
+	send_limiter my_limits;
+	latency_stats send_latency;
 
 	/* Where to send SMS's that we can't route locally. */
 	std::string global_relay;
@@ -688,9 +757,18 @@ class SMq {
 
 	/* Constructor */
 	SMq () : 
-		time_sorted_list (),
+		message_list (),
+		timers (),
+		tag_index (),
 		my_network (),
 		my_hlr(),
+		my_journal(),
+		group_commit(32),
+		my_workers(),
+		lookups(),
+		last_lookup_id(0),
+		my_limits(),
+		send_latency(),
 		global_relay(""),
 		my_ipaddress(""),
 		my_2nd_ipaddress(""),
@@ -744,6 +822,13 @@ class SMq {
 		return my_network.listen_on_port (port);
 	}
 
+	/* Start count lookup workers, and have the main loop wake up
+	   when they answer.  Without them, it does its own lookups.  */
+	bool start_workers(unsigned count);
+	/* Stop them, and set the messages they were looking up to
+	   be looked up again at once.  */
+	void stop_workers();
+
 	// Main loop listening for dgrams and processing them.
 	void main_loop();
 
@@ -811,7 +896,30 @@ class SMq {
 
 	/* Initial handling of an incoming SMS message in the queue */
 	enum sm_state
-	handle_sms_message(short_msg_p_list::iterator qmsg);
+	handle_sms_message(short_msg_p_list::iterator qmsg,
+			   sm_lookup *answer = NULL);
+
+	/*
+	 * Give the HLR lookup that a message's state calls for to the
+	 * lookup workers, and put the message in the matching "asked for"
+	 * state until they answer.  Returns false, leaving the message
+	 * alone, if there are no workers or the state needs no lookup.
+	 */
+	bool
+	start_lookup(short_msg_p_list::iterator qmsg);
+
+	/* Carry on with the messages whose lookups have been answered.  */
+	void
+	finish_lookups();
+
+	/* Drop a message's outstanding lookup, if it has one.  */
+	void
+	forget_lookup(short_msg_pending *sm) {
+		if (sm->lookup_id) {
+			lookups.erase(sm->lookup_id);
+			sm->lookup_id = 0;
+		}
+	}
 
 	/* When a SIP response arrives, search the queue for its matching
 	   MESSAGE and handle both.  */
@@ -834,20 +942,26 @@ class SMq {
 	 * This is also where we assign a new Call-ID to the message, so that
 	 * re-sends will use the same Call-ID, but re-locate's (looking up the
 	 * recipient's location again) will use a new one.
+	 *
+	 * These lookups use the HLR's answers in "answer", if a worker
+	 * looked them up; otherwise they ask the HLR themselves.
 	 */
 	enum sm_state
-	lookup_uri_hostport (short_msg_pending *qmsg);
+	lookup_uri_hostport (short_msg_pending *qmsg,
+			     sm_lookup *answer = NULL);
 
 	/* 
 	 * Change the From address username to a valid phone number in format:
 	 *     +countrycodephonenum
 	 */
 	enum sm_state
-	lookup_from_address(short_msg_pending *qmsg);
+	lookup_from_address(short_msg_pending *qmsg,
+			    sm_lookup *answer = NULL);
 
 	/* Change the Request-URI's address to a valid IMSI.  */
 	enum sm_state
-	lookup_uri_imsi (short_msg_pending *qmsg);
+	lookup_uri_imsi (short_msg_pending *qmsg,
+			 sm_lookup *answer = NULL);
 
 #if 0
 	/* Insert a newly incoming message into the queue. */
@@ -873,30 +987,74 @@ class SMq {
 	// them to the real list.  Note that this moves the message's list
 	// entry itself off the original list (which can then be discarded).
 	void insert_new_message(short_msg_p_list &smp) {
-		time_sorted_list.splice (time_sorted_list.begin(), smp);
-		time_sorted_list.begin()->set_state (INITIAL_STATE);
-		// time_sorted_list.begin()->timeout = 0;  // it is already
+		insert_new_message (smp, INITIAL_STATE);
 		// Low timeout will cause this msg to be at front of queue.
 	}
 	// This version lets the initial state be set.
 	void insert_new_message(short_msg_p_list &smp, enum sm_state s) {
-		time_sorted_list.splice (time_sorted_list.begin(), smp);
-		time_sorted_list.begin()->set_state (s);
-		// time_sorted_list.begin()->timeout = 0;  // it is already
-		// Low timeout will cause this msg to be at front of queue.
+		short_msg_p_list::iterator sm = link_new_message (smp);
+		sm->set_state (s);
+		timers.schedule (sm);
+		my_journal.put (*sm);
 	}
 	// This version lets the state and timeout be set.
 	void insert_new_message(short_msg_p_list &smp, enum sm_state s, 
 			time_t t) {
-		time_sorted_list.splice (time_sorted_list.begin(), smp);
-		time_sorted_list.begin()->set_state (s, t);
+		short_msg_p_list::iterator sm = link_new_message (smp);
+		sm->set_state (s, t);
+		timers.schedule (sm);
+		my_journal.put (*sm);
 	}
+	// Move a new message into the list and the tag index.  The caller
+	// sets its state and puts it on the timer heap.
+	short_msg_p_list::iterator link_new_message(short_msg_p_list &smp) {
+		message_list.splice (message_list.begin(), smp);
+		short_msg_p_list::iterator sm = message_list.begin();
+		index_tag (sm);
+		if (!sm->queued_at)
+			sm->queued_at = sm_now();
+		return sm;
+	}
+
+	// Take a message out of the queue, moving its list entry to
+	// the front of "into".  Its iterator stays valid.
+	void unqueue_message(short_msg_p_list::iterator sm,
+			     short_msg_p_list &into) {
+		timers.remove (sm);
+		unindex_tag (&*sm);
+		forget_lookup (&*sm);
+		my_journal.remove (*sm);
+		into.splice (into.begin(), message_list, sm);
+	}
+	// Take a message out of the queue and delete it.
+	void delete_message(short_msg_p_list::iterator sm) {
+		short_msg_p_list temp;
+		unqueue_message (sm, temp);
+	}
+
+	// The message whose next action is soonest, or message_list.end()
+	// if the queue is empty.
+	short_msg_p_list::iterator next_message() {
+		if (timers.empty())
+			return message_list.end();
+		return timers.top();
+	}
+
+	// Add a queued message to the tag index, if it has a tag yet.
+	void index_tag(short_msg_p_list::iterator sm);
+	// Remove a message from the tag index.  If it was there, set
+	// "where" to its iterator and return true.
+	bool unindex_tag(short_msg_pending *sm,
+			 short_msg_p_list::iterator *where = NULL);
+	// Recalculate a message's qtag, keeping the tag index right if
+	// the message is queued.  Same result as set_qtag().
+	int retag(short_msg_pending *sm);
 #if 0
 	void insert_new_message(short_msg_pending &smp) {
 --!	FIXME!!  This seems to COPY the smp rather than INSERT it!
-		time_sorted_list.push_front (smp);
-		time_sorted_list.begin()->set_state (INITIAL_STATE);
-		// time_sorted_list.begin()->timeout = 0;  // it is already
+		message_list.push_front (smp);
+		message_list.begin()->set_state (INITIAL_STATE);
+		// message_list.begin()->timeout = 0;  // it is already
 		// Low timeout will cause this msg to be at front of queue.
 	}
 #endif
@@ -914,59 +1072,31 @@ class SMq {
 
 	/*
  	 * When we reset the state and timestamp of a message,
-	 * we need to reinsert it into the queue.  C++ doesn't seem
-	 * to have a standard container that lets one do this cleanly.
-	 * Even with lists it's a kludge -- we have to do our own search.
-	 * With multisets you can't splice an element out while keeping the
-	 * element... etc.
+	 * we need to move it within the timer heap.  Always change the
+	 * state of a queued message through these, rather than the
+	 * short_msg_pending's own set_state, or the heap won't know.
 	 */
 	void set_state(short_msg_p_list::iterator sm, enum sm_state newstate) {
-		short_msg_p_list temp;
-		/* Extract the current sm from the time_sorted_list */
-		temp.splice(temp.begin(), time_sorted_list, sm);
 		sm->set_state(newstate);
-		// Insert it according to the new timestamp.
-		// One would think that "multisets" could do this simply,
-		// but they don't appear to have this capability.
-		// Note: if list is empty, or all are too early, insert at end.
-		for (short_msg_p_list::iterator x = time_sorted_list.begin(); 
-		     true; x++) {
-			if (x == time_sorted_list.end() 
-			    || x->next_action_time >= sm->next_action_time) {
-				time_sorted_list.splice(x, temp);
-				break;
-			}
-		}
+		timers.schedule(sm);
+		my_journal.change_state(*sm);
 	};
 
-	/*
- 	 * When we reset the state and timestamp of a message,
-	 * we need to reinsert it into the queue.  C++ doesn't seem
-	 * to have a standard container that lets one do this cleanly.
-	 * Even with lists it's a kludge -- we have to do our own search.
-	 * With multisets you can't splice an element out while keeping the
-	 * element... etc.
-	 */
 	void set_state(short_msg_p_list::iterator sm, enum sm_state newstate,
 		time_t timestamp) {
-		short_msg_p_list temp;
-		/* Extract the current sm from the time_sorted_list */
-		temp.splice(temp.begin(), time_sorted_list, sm);
 		sm->set_state(newstate, timestamp);
-		// Insert it according to the new timestamp.
-		// One would think that "multisets" could do this simply,
-		// but they don't appear to have this capability.
-		// Note: if list is empty, or all are too early, insert at end.
-		for (short_msg_p_list::iterator x = time_sorted_list.begin(); 
-		     true; x++) {
-			if (x == time_sorted_list.end() 
-			    || x->next_action_time >= sm->next_action_time) {
-				time_sorted_list.splice(x, temp);
-				break;
-			}
-		}
+		timers.schedule(sm);
+		my_journal.change_state(*sm);
 	};
 
+	/* Put off a message's next action until "when", without changing
+	   its state.  This isn't journaled: after a restart, the message
+	   may as well go at once.  */
+	void hold_message(short_msg_p_list::iterator sm, time_t when) {
+		sm->next_action_time = when;
+		timers.schedule(sm);
+	}
+
 	/* Save the queue to a file; read it back from a file.
 	   Reading a queue file doesn't delete things that might already
  	   be in the queue; if you want a clean queue, delete anything
@@ -975,6 +1105,12 @@ class SMq {
 	save_queue_to_file(std::string qfile);
 	bool
 	read_queue_from_file(std::string qfile);
+
+	/* Open the journal and put back the messages it kept (or, if
+	   not restore, drop them).  Returns false if there's no usable
+	   journal in the directory.  */
+	bool
+	recover_from_journal(std::string dir, bool restore);
 };
 
 } // namespace SMqueue
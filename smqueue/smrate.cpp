@@ -0,0 +1,151 @@
+/*
+ * smrate.cpp - Send rate limits for the Short Message queue of OpenBTS.
+ *
+ * Copyright 2009 Free Software Foundation, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * See the COPYING file in the main directory for details.
+ */
+
+#include "smrate.h"
+
+using namespace std;
+using namespace SMqueue;
+
+/* Seconds between sweeps of the destination buckets.  */
+static const double sweep_interval = 60.0;
+
+send_limiter::send_limiter() :
+	total_rate(0),
+	dest_rate(0),
+	total(),
+	dests(),
+	next_sweep(0),
+	admitted(0),
+	held_total(0),
+	held_dest(0)
+{
+}
+
+void
+send_limiter::set_rates(unsigned total_per_minute, unsigned dest_per_minute)
+{
+	total_rate = total_per_minute / 60.0;
+	dest_rate = dest_per_minute / 60.0;
+	// Start out full.
+	total.tokens = burst(total_rate);
+	total.last = 0;
+	dests.clear();
+}
+
+double
+send_limiter::burst(double rate)
+{
+	return rate > 1.0? rate: 1.0;
+}
+
+void
+send_limiter::refill(bucket &b, double rate, double now)
+{
+	if (now > b.last) {
+		b.tokens += (now - b.last) * rate;
+		if (b.tokens > burst(rate))
+			b.tokens = burst(rate);
+	}
+	b.last = now;
+}
+
+/* Seconds until a bucket has a whole token.  */
+double
+send_limiter::wait(const bucket &b, double rate)
+{
+	return b.tokens < 1.0? (1.0 - b.tokens) / rate: 0.0;
+}
+
+double
+send_limiter::admit(const std::string &dest, double now)
+{
+	double total_wait = 0;
+	if (total_rate > 0) {
+		refill(total, total_rate, now);
+		total_wait = wait(total, total_rate);
+	}
+
+	if (dest_rate > 0) {
+		bucket_map::iterator b = dests.find(dest);
+		if (b == dests.end()) {
+			b = dests.insert(make_pair(dest, bucket())).first;
+			b->second.tokens = burst(dest_rate);
+			b->second.last = now;
+		} else {
+			refill(b->second, dest_rate, now);
+		}
+		double dest_wait = wait(b->second, dest_rate);
+		if (dest_wait > 0) {
+			held_dest++;
+			// Wait for whichever bucket fills last.
+			return dest_wait > total_wait? dest_wait: total_wait;
+		}
+		if (total_wait > 0) {
+			held_total++;
+			return total_wait;
+		}
+		b->second.tokens -= 1.0;
+	} else if (total_wait > 0) {
+		held_total++;
+		return total_wait;
+	}
+
+	if (total_rate > 0)
+		total.tokens -= 1.0;
+	admitted++;
+	if (now >= next_sweep)
+		sweep(now);
+	return 0;
+}
+
+/* Throw out the buckets that would be full by now; admit() makes
+   them again, full, if it needs them.  */
+void
+send_limiter::sweep(double now)
+{
+	bucket_map::iterator b = dests.begin();
+	while (b != dests.end()) {
+		bucket_map::iterator here = b++;
+		refill(here->second, dest_rate, now);
+		if (here->second.tokens >= burst(dest_rate))
+			dests.erase(here);
+	}
+	next_sweep = now + sweep_interval;
+}
+
+void
+send_limiter::dump(std::ostream &os)
+{
+	os << "Send limits: ";
+	if (!limited()) {
+		os << "none";
+	} else {
+		if (total_rate > 0)
+			os << total_rate * 60.0 << "/min in all";
+		else
+			os << "none in all";
+		if (dest_rate > 0)
+			os << ", " << dest_rate * 60.0 << "/min to each of "
+			   << dests.size() << " destinations";
+	}
+	os << "; " << admitted << " sent, " << held_total
+	   << " held for the total rate, " << held_dest
+	   << " held for their destination" << endl;
+}
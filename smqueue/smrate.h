@@ -0,0 +1,83 @@
+/*
+ * smrate.h - Send rate limits for the Short Message queue of OpenBTS.
+ *
+ * Copyright 2009 Free Software Foundation, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * See the COPYING file in the main directory for details.
+ */
+
+#ifndef SM_RATE_H
+#define SM_RATE_H
+
+#include <string>
+#include <map>
+#include <iostream>
+
+namespace SMqueue {
+
+/*
+ * Token buckets that limit how fast we send: one for everything we
+ * send, and one for each destination.  A bucket holds up to a second's
+ * worth of sends (at least one), and refills at its rate.  A send takes
+ * a token from both buckets, or waits if either is empty.
+ *
+ * A rate of 0 is no limit.  Buckets of destinations that have gone
+ * quiet are full, so they're thrown away from time to time.
+ */
+class send_limiter {
+	public:
+
+	send_limiter();
+
+	/* Set the rates, in messages per minute.  */
+	void set_rates(unsigned total, unsigned per_dest);
+	bool limited() const { return total_rate > 0 || dest_rate > 0; }
+
+	/* May we send to dest now?  If so, it counts as sent, and we
+	   return 0.  If not, return the seconds until we might.  */
+	double admit(const std::string &dest, double now);
+
+	void dump(std::ostream &os);
+
+	private:
+
+	struct bucket {
+		double tokens;
+		double last;		// When tokens was right
+
+		bucket() : tokens(0), last(0) { }
+	};
+	typedef std::map<std::string, bucket> bucket_map;
+
+	double total_rate;		// Per second, or 0
+	double dest_rate;
+	bucket total;
+	bucket_map dests;
+	double next_sweep;		// When to throw out full buckets
+
+	/* Statistics */
+	unsigned long admitted;
+	unsigned long held_total;	// Not admitted for the total rate
+	unsigned long held_dest;	// Not admitted for the destination
+
+	static double burst(double rate);
+	static void refill(bucket &b, double rate, double now);
+	static double wait(const bucket &b, double rate);
+	void sweep(double now);
+};
+
+} // namespace SMqueue
+
+#endif
@@ -0,0 +1,290 @@
+/*
+ * smworkers.cpp - HLR lookup workers for the Short Message queue of OpenBTS.
+ *
+ * Copyright 2009 Free Software Foundation, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * See the COPYING file in the main directory for details.
+ */
+
+#include "smworkers.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+using namespace std;
+using namespace SMqueue;
+
+double
+SMqueue::sm_now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+
+const double latency_stats::limits[latency_stats::nbuckets - 1] =
+	{ 0.01, 0.1, 1.0, 10.0, 60.0 };
+
+latency_stats::latency_stats() :
+	count(0),
+	total(0.0),
+	max(0.0)
+{
+	for (unsigned i = 0; i < nbuckets; i++)
+		buckets[i] = 0;
+}
+
+void
+latency_stats::add(double seconds)
+{
+	if (seconds < 0)
+		seconds = 0;		// The clock was set back.
+	count++;
+	total += seconds;
+	if (seconds > max)
+		max = seconds;
+	unsigned i = 0;
+	while (i < nbuckets - 1 && seconds >= limits[i])
+		i++;
+	buckets[i]++;
+}
+
+void
+latency_stats::dump(std::ostream &os, const char *what)
+{
+	os << "  " << what << ": " << count;
+	if (count == 0) {
+		os << endl;
+		return;
+	}
+	os << ", average " << total / count * 1000.0 << " ms, max "
+	   << max * 1000.0 << " ms" << endl << "   ";
+	for (unsigned i = 0; i < nbuckets; i++) {
+		if (i < nbuckets - 1)
+			os << " <" << limits[i] << "s:";
+		else
+			os << " more:";
+		os << buckets[i];
+	}
+	os << endl;
+}
+
+
+SMworkers::SMworkers() :
+	hlr(NULL),
+	workers(),
+	answers_lock(),
+	answers(),
+	latency(),
+	submitted(0),
+	collected(0)
+{
+	pipefd[0] = pipefd[1] = -1;
+}
+
+SMworkers::~SMworkers()
+{
+	stop();
+}
+
+bool
+SMworkers::start(NativeHLR *anhlr, unsigned count)
+{
+	if (running() || count == 0)
+		return running();
+	if (pipe(pipefd) < 0) {
+		cerr << "Cannot make a pipe for the lookup workers: "
+		     << strerror(errno) << endl;
+		pipefd[0] = pipefd[1] = -1;
+		return false;
+	}
+	for (int i = 0; i < 2; i++) {
+		fcntl(pipefd[i], F_SETFL, fcntl(pipefd[i], F_GETFL) | O_NONBLOCK);
+		fcntl(pipefd[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	hlr = anhlr;
+	for (unsigned i = 0; i < count; i++) {
+		worker *w = new worker(this);
+		workers.push_back(w);
+		w->thread.start(run, w);
+	}
+	return true;
+}
+
+void
+SMworkers::stop()
+{
+	for (unsigned i = 0; i < workers.size(); i++) {
+		worker *w = workers[i];
+		w->lock.lock();
+		w->stopping = true;
+		w->more.signal();
+		w->lock.unlock();
+	}
+	for (unsigned i = 0; i < workers.size(); i++) {
+		worker *w = workers[i];
+		w->thread.join();
+		while (!w->jobs.empty()) {
+			delete w->jobs.front();
+			w->jobs.pop_front();
+		}
+		delete w;
+	}
+	workers.clear();
+
+	while (!answers.empty()) {
+		delete answers.front();
+		answers.pop_front();
+	}
+	submitted = collected = 0;
+	for (int i = 0; i < 2; i++) {
+		if (pipefd[i] >= 0)
+			close(pipefd[i]);
+		pipefd[i] = -1;
+	}
+}
+
+void
+SMworkers::submit(sm_lookup *job)
+{
+	worker *w = workers[job->dest % workers.size()];
+	job->queued_at = sm_now();
+	submitted++;
+	w->lock.lock();
+	w->jobs.push_back(job);
+	if (w->jobs.size() > w->max_depth)
+		w->max_depth = w->jobs.size();
+	w->more.signal();
+	w->lock.unlock();
+}
+
+sm_lookup *
+SMworkers::answered()
+{
+	sm_lookup *job = NULL;
+	answers_lock.lock();
+	if (!answers.empty()) {
+		job = answers.front();
+		answers.pop_front();
+	}
+	answers_lock.unlock();
+	if (job)
+		collected++;
+	return job;
+}
+
+/* A worker: answer lookups in order until told to stop.  */
+void *
+SMworkers::run(void *arg)
+{
+	worker *w = (worker *)arg;
+
+	w->lock.lock();
+	while (true) {
+		while (w->jobs.empty() && !w->stopping)
+			w->more.wait(w->lock);
+		if (w->stopping)
+			break;
+		sm_lookup *job = w->jobs.front();
+		w->lock.unlock();
+
+		w->pool->ask(job);
+
+		w->lock.lock();
+		// Only take it off once it's answered, so the queue
+		// depth counts the lookup in progress too.
+		w->jobs.pop_front();
+		w->done++;
+		w->pool->finish(job);
+	}
+	w->lock.unlock();
+	return NULL;
+}
+
+/* Ask the HLR what the lookup wants to know.  This is all a worker
+   does that takes any time.  */
+void
+SMworkers::ask(sm_lookup *job)
+{
+	const char *key = job->key.c_str();
+
+	switch (job->kind) {
+	case sm_lookup::CALLER_ID:
+		job->answer = hlr->getCLIDLocal(key);
+		break;
+
+	case sm_lookup::IMSI:
+		job->answer = hlr->getIMSI(key);
+		// If it isn't ours, the main loop may want to send it to
+		// the global relay, with the sender's global number.
+		if (!job->answer && job->relay) {
+			job->gateway = hlr->useGateway(key);
+			if (job->gateway)
+				job->global_from =
+					hlr->mapCLIDGlobal(job->from.c_str());
+		}
+		break;
+
+	case sm_lookup::ROUTE:
+		job->answer = hlr->getRegistrationIP(key);
+		break;
+	}
+}
+
+/* Pass an answered lookup back, waking up the main loop if it might
+   be waiting.  */
+void
+SMworkers::finish(sm_lookup *job)
+{
+	answers_lock.lock();
+	bool was_empty = answers.empty();
+	answers.push_back(job);
+	latency.add(sm_now() - job->queued_at);
+	answers_lock.unlock();
+
+	if (was_empty) {
+		char c = 0;
+		// If the pipe is full, the main loop is already awake.
+		while (write(pipefd[1], &c, 1) < 0 && errno == EINTR)
+			;
+	}
+}
+
+void
+SMworkers::dump(std::ostream &os)
+{
+	os << "Lookup workers: ";
+	if (!running()) {
+		os << "none; looking up in the main loop." << endl;
+		return;
+	}
+	os << workers.size() << ", " << in_flight() << " lookups in flight"
+	   << endl;
+	for (unsigned i = 0; i < workers.size(); i++) {
+		worker *w = workers[i];
+		w->lock.lock();
+		os << "  worker " << i << ": " << w->jobs.size()
+		   << " queued (most " << w->max_depth << "), "
+		   << w->done << " done" << endl;
+		w->lock.unlock();
+	}
+	answers_lock.lock();
+	latency.dump(os, "lookups");
+	answers_lock.unlock();
+}
@@ -0,0 +1,179 @@
+/*
+ * smworkers.h - HLR lookup workers for the Short Message queue of OpenBTS.
+ *
+ * Copyright 2009 Free Software Foundation, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * See the COPYING file in the main directory for details.
+ */
+
+#ifndef SM_WORKERS_H
+#define SM_WORKERS_H
+
+#include <stdlib.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <iostream>
+
+#include <Threads.h>
+#include "HLR.h"
+
+namespace SMqueue {
+
+/* Seconds since the epoch, to the microsecond.  */
+double sm_now();
+
+/*
+ * Counts of how long something took, with a rough histogram.
+ */
+struct latency_stats {
+	static const unsigned nbuckets = 6;
+	static const double limits[nbuckets - 1];	// Upper bounds, seconds
+
+	unsigned long count;
+	double total;
+	double max;
+	unsigned long buckets[nbuckets];
+
+	latency_stats();
+	void add(double seconds);
+	void dump(std::ostream &os, const char *what);
+};
+
+/*
+ * The HLR questions that one step of a message needs, and the answers.
+ * The main loop fills in the questions from the message, a worker asks
+ * the HLR, and the main loop puts the answers into the message.  The
+ * workers never see the message itself, so only the main loop ever
+ * touches the queue.
+ */
+struct sm_lookup {
+	enum kind_t {
+		CALLER_ID,	// The From IMSI's phone number
+		IMSI,		// The destination phone number's IMSI
+		ROUTE		// The destination IMSI's cell, host:port
+	};
+
+	unsigned long id;	// lookup_id of the message it's for
+	kind_t kind;
+	unsigned dest;		// Hash of the destination; picks the worker
+	std::string key;	// Username or IMSI to look up
+	std::string from;	// For IMSI: the sender, in case of a relay
+	bool relay;		// For IMSI: is there a global relay?
+
+	char *answer;		// From the HLR (malloc'd), or NULL
+	bool gateway;		// For IMSI: the HLR says use the relay
+	char *global_from;	// For IMSI: sender's global number, or NULL
+	double queued_at;	// When it was handed to the workers
+
+	sm_lookup(unsigned long anid, kind_t akind, unsigned adest,
+		  const char *akey)
+		: id(anid), kind(akind), dest(adest), key(akey), from(),
+		  relay(false), answer(NULL), gateway(false),
+		  global_from(NULL), queued_at(0) { }
+	~sm_lookup() {
+		free(answer);
+		free(global_from);
+	}
+
+	/* Hand over an answer; the caller frees it.  */
+	static char *take(char *&what) {
+		char *p = what;
+		what = NULL;
+		return p;
+	}
+
+	private:
+	sm_lookup(const sm_lookup &);
+	sm_lookup & operator= (const sm_lookup &);
+};
+
+/*
+ * A pool of threads that ask the HLR questions for the main loop, so
+ * that a slow lookup (the HLR may run a program to answer) holds up
+ * only the messages behind it on its own worker.
+ *
+ * Each lookup goes to the worker picked by its dest hash, and each
+ * worker answers its lookups in order, so two messages for the same
+ * destination come back in the order they went in.  Answers are
+ * collected in one queue; wakeup_fd() becomes readable when there are
+ * answers, so the main loop can poll on it with its sockets.
+ */
+class SMworkers {
+	public:
+
+	SMworkers();
+	~SMworkers();
+
+	/* Start count workers asking hlr.  False if there are none.  */
+	bool start(NativeHLR *hlr, unsigned count);
+	/* Stop the workers, dropping what they haven't answered.  */
+	void stop();
+	bool running() const { return !workers.empty(); }
+
+	/* Read end of a pipe that is written when answers are waiting.
+	   The reader should empty it before calling answered().  */
+	int wakeup_fd() const { return pipefd[0]; }
+
+	/* Hand a lookup to its worker, which owns it until it's answered.  */
+	void submit(sm_lookup *job);
+	/* The next answered lookup, or NULL.  The caller deletes it.  */
+	sm_lookup *answered();
+
+	/* Lookups handed out and not yet collected.  */
+	size_t in_flight() const { return submitted - collected; }
+
+	void dump(std::ostream &os);
+
+	private:
+
+	struct worker {
+		SMworkers *pool;
+		Thread thread;
+		Mutex lock;
+		Signal more;
+		std::deque<sm_lookup *> jobs;
+		size_t max_depth;	// Deepest jobs has been
+		unsigned long done;
+		bool stopping;
+
+		worker(SMworkers *apool)
+			: pool(apool), thread(), lock(), more(), jobs(),
+			  max_depth(0), done(0), stopping(false) { }
+	};
+
+	NativeHLR *hlr;
+	std::vector<worker *> workers;
+	int pipefd[2];
+
+	Mutex answers_lock;
+	std::deque<sm_lookup *> answers;
+	latency_stats latency;		// Submit to answer, under answers_lock
+
+	unsigned long submitted;	// Main loop only
+	unsigned long collected;
+
+	static void *run(void *arg);
+	void ask(sm_lookup *job);
+	void finish(sm_lookup *job);
+
+	// Not copyable.
+	SMworkers(const SMworkers &);
+	SMworkers & operator= (const SMworkers &);
+};
+
+} // namespace SMqueue
+
+#endif